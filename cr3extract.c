@@ -1,95 +1,1576 @@
+#ifdef __linux__
+#define _GNU_SOURCE   // O_DIRECT, MAP_HUGETLB
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <stdatomic.h>
 
 #ifdef _WIN32
 #include <io.h>
 #include <fcntl.h>
+#include <windows.h>
+#endif
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <dirent.h>
 #endif
 
+#ifdef __linux__
+#include <poll.h>
+#include <signal.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#endif
+
+// Where a JpegInfo entry came from
+enum {
+    JPEG_FROM_SCAN = 0,  // FF D8 ... FF D9 byte scan
+    JPEG_FROM_THMB,      // THMB box in the moov Canon uuid
+    JPEG_FROM_PRVW,      // PRVW box in the top-level preview uuid
+    JPEG_FROM_TRAK,      // JPEG track sample located through stsz/co64
+    JPEG_FROM_IFD        // strip or JPEGInterchangeFormat of a TIFF IFD (CR2, DNG)
+};
+
 // Updated JpegInfo to use size_t instead of long
 typedef struct {
     size_t start;  // Changed from long to size_t
     size_t end;    // Changed from long to size_t
     size_t size;   // Changed from long to size_t
+    int source;    // JPEG_FROM_*
+    uint16_t width;   // from the container, 0 if unknown
+    uint16_t height;
 } JpegInfo;
 
+// Memory bound per file in flight: the reader cache ((RR_CACHE_BLOCKS + RR_MAX_RUN) *
+// RR_BLOCK_SIZE = 768 KB), the moov box and Canon uuid copies used for EXIF (sized by
+// the CR3 header, not the previews) and the read-ahead buffers (--read-buffers x
+// --read-buffer, 2 x 256 KB by default). Previews are streamed, never held in memory,
+// so the bound does not depend on preview size. --rotate is the exception: a preview
+// that is rotated is decoded to its DCT coefficients (2 bytes per sample, about 4
+// bytes per pixel for a 4:2:2 preview).
 #define STREAM_BUFFER_SIZE 4096
+#define MAX_JOB_OUTPUTS 8
+#define RR_BLOCK_SIZE (64 * 1024)
+#define RR_CACHE_BLOCKS 8
+#define RR_MAX_RUN 4
+
+// RangeReader: random access to an input (local file, memory buffer or HTTP URL).
+// A small block cache sits in front of the backend so the many tiny header reads of
+// the box parser cost one fetch, and adjacent missing blocks are fetched together.
+typedef struct RangeReader RangeReader;
+// What one input has used of the resource limits. The worker sets it up in
+// process_file; readers opened meanwhile keep a pointer to it, so read-ahead and
+// scan threads charge the same budget.
+typedef struct {
+    const char *path;
+    int64_t deadline_ms;        // 0: no time limit
+    _Atomic uint64_t boxes;
+    _Atomic uint64_t metadata;
+    _Atomic uint64_t read;
+    _Atomic int exceeded;       // set by the first limit hit
+} FileBudget;
+
+// process_file result for an input stopped by a resource limit, and the exit
+// status when every failed input was
+#define RESULT_OVER_LIMIT (-2)
+#define EXIT_OVER_LIMIT 3
+
+struct RangeReader {
+    // fetch: reads up to len bytes at offset; returns the count, which is at least
+    // min_len unless the data ends first, or -1 on error
+    long long (*fetch)(RangeReader *r, uint64_t offset, void *buf, size_t len, size_t min_len);
+    void (*close)(RangeReader *r);
+    void *source;           // backend state
+    uint64_t size;          // UINT64_MAX while unknown or while following a growing file
+    int remote;             // each fetch is a network round trip
+    int concurrent;         // fetch may be called from several threads at once
+    int verbose;
+    unsigned char *cache;   // RR_CACHE_BLOCKS blocks, then RR_MAX_RUN blocks of fetch scratch
+    uint64_t block_index[RR_CACHE_BLOCKS];
+    size_t block_len[RR_CACHE_BLOCKS];   // 0 marks an empty slot
+    uint64_t block_used[RR_CACHE_BLOCKS];
+    uint64_t clock;
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    uint64_t fetches;
+    uint64_t bytes_fetched;
+    FileBudget *budget;     // of the input being processed when opened, or NULL
+};
+
+// SHA-256 state; --store names each output by the digest of its bytes
+typedef struct {
+    uint32_t h[8];
+    uint64_t len;
+    unsigned char block[64];
+    size_t fill;
+} Sha256;
+
+// Output sink: every extracted file is written through one of these so batch
+// runs can record what was produced (path, size, CRC-32) in the journal.
+typedef struct {
+    FILE *fp;
+    int to_stdout;
+    const char *path;
+    size_t size;
+    uint32_t crc;
+    char *temp_path;        // --store: written here until the digest is known
+    Sha256 sha;
+} OutputSink;
+
+// Objects written and duplicates linked by --store, for the -v report
+typedef struct {
+    uint64_t written;
+    uint64_t written_bytes;
+    uint64_t linked;
+    uint64_t linked_bytes;
+} StoreStats;
+
+typedef struct {
+    char *path;
+    size_t size;
+    uint32_t crc;
+} OutputRecord;
+
+// Outputs completed for the input currently being processed
+typedef struct {
+    OutputRecord outputs[MAX_JOB_OUTPUTS];
+    int count;
+} JobOutputs;
+
+// One journal line: a source file (identified by size and mtime) and the outputs it produced
+typedef struct {
+    char *source;
+    uint64_t size;
+    int64_t mtime_ns;
+    JobOutputs done;
+} JournalEntry;
+
+// Bounded queue of input paths feeding the worker pool (batch and --watch)
+typedef struct {
+    char **items;
+    int capacity;
+    int head;
+    int count;
+    int closed;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} WorkQueue;
+
+// AIMD controller of --jobs auto: files in flight and the read buffer size, tuned
+// from the throughput and per-file latency of each epoch of finished files
+typedef struct {
+    int enabled;
+    int limit;              // files allowed in flight
+    int active;             // files in flight (workers past adapt_acquire)
+    int min, max;
+    size_t read_size;
+    size_t read_min, read_max;
+    int slow_start;         // double the limit until the first decrease
+    int raised_read;        // the last increase was to the read size
+    int hold;               // skip judging the epoch after a decrease
+    int epochs, increases, decreases, peak_limit;
+    int epoch_files;
+    uint64_t epoch_bytes;
+    double epoch_latency_ms;
+    int64_t epoch_start_ms;
+    double base_latency_ms; // lowest mean latency of an epoch so far
+    double last_rate;       // bytes per second of the last epoch
+    double last_latency_ms;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} Adaptive;
+
+// Which -j all previews a batch task writes: all, the thumbnail tier (the first) or
+// the background tier (the others), for --thumbs-first
+enum { TIER_ALL = 0, TIER_THUMB, TIER_BACKGROUND };
+
+// Per-input state flags of a --thumbs-first run
+#define TS_THUMB_CLAIMED 1
+#define TS_THUMB_DONE 2
+#define TS_BACKGROUND_CLAIMED 4
+#define TS_URGENT 8     // asked for on --priority
+
+// --thumbs-first work list: every input's thumbnail tier, then the background tiers;
+// inputs asked for on --priority run both tiers before anything else. lock guards
+// everything but inputs.
+typedef struct {
+    char **inputs;
+    int count;
+    unsigned char *state;       // TS_* flags per input
+    OutputRecord *thumbs;       // thumbnail tier output per input, for the journal
+    int next_thumb;
+    int next_background;        // inputs before it have their background tier claimed
+    int remaining;              // inputs whose background tier is not claimed yet
+    int thumbs_left;            // thumbnails not written (or failed) yet
+    int *urgent;                // --priority requests, newest last
+    int urgent_count;
+    int urgent_cap;
+    int requests;
+    int verbose;
+    int64_t start_ms;
+    int64_t thumbs_done_ms;
+    _Atomic int stop;           // ends the --priority reader
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} TierSchedule;
+
+// Shared state of a batch or watch run; lock guards the journal and the counters
+typedef struct {
+    JournalEntry *journal;
+    size_t journal_cap;
+    FILE *journal_out;
+    int to_stdout;
+    int verbose;
+    int multi;  // several inputs: name the failed ones
+    int done;
+    int skipped;
+    int failed;
+    int over_limit;     // failed inputs stopped by a resource limit
+    pthread_mutex_t lock;
+    WorkQueue queue;
+    Adaptive adapt;
+    TierSchedule *tiers;    // --thumbs-first, otherwise NULL
+} BatchState;
+
+// Per-chunk result of the parallel scan (see find_all_jpegs_parallel)
+#define SCAN_CHUNK_SIZE (4u << 20)
+typedef struct {
+    int64_t first_eoi;      // first EOI before the chunk's first SOI, -1 if none
+    int has_soi;
+    int64_t open_start;     // SOI still unmatched at the chunk end, -1 if none
+    JpegInfo *pairs;        // JPEGs that start and end after the first SOI
+    int count;
+    int capacity;
+    int failed;
+    int too_many;           // more pairs than --max-previews
+} ScanChunk;
+
+typedef struct {
+    RangeReader *rd;
+    uint64_t size;
+    ScanChunk *chunks;
+    int chunk_count;
+    int next;               // next chunk to claim, guarded by lock
+    pthread_mutex_t lock;
+} ParallelScan;
+
+// I/O counters of a --bulk run, summed over all workers for the -v report
+#define DIRECT_ALIGN 4096
+#define DIRECT_BOUNCE_SIZE (1u << 20)
+typedef struct {
+    uint64_t inputs;
+    uint64_t input_bytes;
+    uint64_t cached_read;
+    uint64_t direct_read;
+    uint64_t written;
+    uint64_t still_cached;
+} BulkStats;
+
+// ReadAhead: ring of read buffers for a sequential pass over [pos, end) of a reader
+typedef struct {
+    RangeReader *rd;
+    uint64_t pos;           // next offset to read
+    uint64_t end;
+    size_t size;            // bytes per buffer
+    unsigned char *block;   // count * size bytes
+    unsigned char **bufs;
+    size_t *lens;
+    int count;
+    int first;              // oldest buffer not yet released by the consumer
+    int held;               // the consumer is working on bufs[first]
+    int ready;              // filled buffers after the held one
+    int eof;
+    int error;
+    int stop;
+    int threaded;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} ReadAhead;
+
+// Arena: per-worker scratch memory for everything one input needs (reader cache, box
+// copies, EXIF, preview list, file names). It is reset after each input, so once it
+// has grown to the high-water mark a worker makes no heap allocations per file.
+#define ARENA_ALIGN 16          // also the size of the header holding each block's length
+#define ARENA_GROW_STEP (64u << 10)
+#define ARENA_HUGE_PAGE (2u << 20)
+#define ARENA_MAX_GROWTH (256u << 20)   // heap demand is cumulative, so one odd input cannot pin more
+typedef struct {
+    unsigned char *base;
+    size_t size;
+    size_t used;
+    size_t last;                // offset of the most recent block (SIZE_MAX if none)
+    size_t demand;              // bytes requested for the current input, heap fallbacks included
+    int mapped;                 // base came from mmap (--huge-pages)
+    uint64_t files;
+    uint64_t arena_allocs;
+    uint64_t heap_allocs;
+    uint64_t file_heap_allocs;
+    uint64_t last_heap_file;    // last input that needed the heap
+    unsigned grows;
+} Arena;
+
+// Allocation counters summed over all workers for the -v report
+typedef struct {
+    uint64_t files;
+    uint64_t arena_allocs;
+    uint64_t heap_allocs;
+    uint64_t last_heap_file;
+    size_t size;
+    unsigned grows;
+} ScratchStats;
 
 // Global flags
 int g_minimize_exif = 0;
 int g_extract_all = 0;
 int g_extract_index = -1;
 char *g_output_filename = NULL;
+const char *g_journal_path = NULL;
+int g_resume = 0;
+int g_skip_newer = 0;
+int g_box_index = 0;
+int g_follow = 0;
+int g_follow_timeout_ms = 30000;
+int g_jobs = 1;
+int g_adaptive = 0;           // --jobs auto
+int g_jobs_min = 1;
+int g_jobs_max = 0;           // 0: four per CPU, at most ADAPT_MAX_JOBS
+size_t g_read_buffer_min = 64 * 1024;
+size_t g_read_buffer_max = 4u << 20;
+int g_debounce_ms = 100;
+_Thread_local JobOutputs *g_job_outputs = NULL;
+_Thread_local int g_tier = TIER_ALL;
+int g_thumbs_first = 0;
+const char *g_priority_path = NULL;
+size_t g_arena_size = 2u << 20;
+int g_scan_threads = 1;
+int g_bulk = 0;
+int g_direct = 0;
+int g_layout_window = 0;
+BulkStats g_bulk_totals;
+pthread_mutex_t g_bulk_lock = PTHREAD_MUTEX_INITIALIZER;
+_Atomic size_t g_read_buffer_size = 256 * 1024;   // tuned by --jobs auto while workers read it
+int g_read_buffers = 2;
+int g_bench_scan = 0;
+int g_huge_pages = 0;
+int g_rotate = 0;
+int g_phash = 0;
+int g_dupes_distance = -1;   // --dupes: max Hamming distance, -1 if off
+int g_min_long_edge = 0;
+size_t g_max_bytes = 0;
+int g_render_raw = 0;
+int g_raw_fallback = 0;
+int g_bench_render = 0;
+int g_walk = 0;
+int g_verify = 0;
+int g_heif = 0;
+int g_max_boxes = 100000;              // resource limits per input, 0: none
+int g_max_depth = 32;
+size_t g_max_metadata = 64u << 20;
+int g_max_previews = 65536;
+uint64_t g_max_read = 0;
+int64_t g_time_limit_ms = 0;
+_Thread_local FileBudget *g_budget = NULL;
+const char *g_store_dir = NULL;
+FILE *g_store_manifest = NULL;
+StoreStats g_store_totals;
+pthread_mutex_t g_store_lock = PTHREAD_MUTEX_INITIALIZER;
+const char *g_trace_path = NULL;
+const char *g_metrics_path = NULL;
+int g_metrics_port = 0;
+int g_metrics_interval = 10;
+_Thread_local Arena *g_arena = NULL;
+ScratchStats g_scratch_totals;
+pthread_mutex_t g_scratch_lock = PTHREAD_MUTEX_INITIALIZER;
+uint32_t g_crc_table[256];
 
 // Function prototypes
-int find_all_jpegs(FILE *file, JpegInfo **jpegs, int *count);
+void arena_begin(void);
+void arena_reset(void);
+void arena_end(void);
+void report_scratch_stats(void);
+void report_bulk_stats(void);
+void bulk_release_output(int fd, size_t size);
+void *scratch_alloc(size_t n);
+void *scratch_calloc(size_t count, size_t size);
+void *scratch_realloc(void *p, size_t n);
+void scratch_free(void *p);
+char *scratch_strdup(const char *s);
+void budget_begin(FileBudget *b, const char *path);
+void budget_end(void);
+int budget_check(FileBudget *b);
+int budget_read(FileBudget *b, uint64_t len);
+int limit_boxes(void);
+int limit_depth(int depth);
+int limit_metadata(uint64_t size);
+int limit_previews(int count);
+void trace_thread_begin(const char *kind);
+void trace_thread_end(void);
+uint64_t trace_begin(void);
+void trace_end(const char *name, uint64_t start, const char *detail);
+void trace_counter(const char *name, uint64_t value);
+int trace_write(const char *path, int verbose);
+void metrics_thread_begin(void);
+void metrics_add(int counter, uint64_t value);
+void metrics_observe(const char *name, uint64_t ns);
+void metrics_queue_depth(int depth);
+int metrics_start(void);
+void metrics_stop(void);
+long long memory_fetch(RangeReader *r, uint64_t offset, void *buf, size_t len, size_t min_len);
+int find_all_jpegs(RangeReader *rd, JpegInfo **jpegs, int *count);
+int find_all_jpegs_serial(RangeReader *rd, JpegInfo **jpegs, int *count);
+int readahead_start(ReadAhead *ra, RangeReader *rd, uint64_t start, uint64_t end);
+long long readahead_next(ReadAhead *ra, const unsigned char **data);
+void readahead_stop(ReadAhead *ra);
+int find_all_jpegs_parallel(RangeReader *rd, JpegInfo **jpegs, int *count, int threads);
+int find_all_jpegs_walked(RangeReader *rd, JpegInfo **jpegs, int *count);
+int run_scan_benchmark(char **inputs, int input_count);
 uint16_t read16le(const unsigned char *data, size_t offset, size_t dataSize);
 uint32_t read32le(const unsigned char *data, size_t offset, size_t dataSize);
-int findBox_streaming(FILE *f, size_t start, size_t end, const char *target,
+uint16_t read16be(const unsigned char *data, size_t offset, size_t dataSize);
+uint32_t read32be(const unsigned char *data, size_t offset, size_t dataSize);
+uint64_t read64be(const unsigned char *data, size_t offset, size_t dataSize);
+int64_t monotonic_ms(void);
+void sleep_ms(int ms);
+int follow_wait(int fd, uint64_t end);
+RangeReader *reader_open(const char *path, int verbose);
+RangeReader *reader_open_memory(unsigned char *data, size_t size, int owned);
+long long reader_read(RangeReader *r, uint64_t offset, void *buf, size_t len);
+int reader_read_full(RangeReader *r, uint64_t offset, void *buf, size_t len);
+void reader_close(RangeReader *r);
+uint64_t box_header(const unsigned char *data, size_t pos, size_t end, char type[5], size_t *headerSize);
+int locate_previews_boxes(RangeReader *rd, JpegInfo **jpegs, int *count);
+void adapt_init(Adaptive *a);
+void adapt_destroy(Adaptive *a);
+void adapt_acquire(Adaptive *a);
+void adapt_release(Adaptive *a);
+void adapt_sample(Adaptive *a, uint64_t bytes, int64_t latency_ms);
+void report_adaptive_stats(const Adaptive *a);
+int layout_order(char **inputs, int count, int verbose);
+int tiff_byte_order(RangeReader *rd);
+int locate_previews_ifds(RangeReader *rd, int be, JpegInfo **jpegs, int *count, uint64_t *broken);
+int extract_tiff_exif(RangeReader *rd, int be, unsigned char **exifSegment, size_t *exifSize, int verbose);
+uint16_t tiff16(const unsigned char *data, size_t offset, size_t dataSize, int be);
+uint32_t tiff32(const unsigned char *data, size_t offset, size_t dataSize, int be);
+void tiff_put16(unsigned char *p, uint16_t v, int be);
+void tiff_put32(unsigned char *p, uint32_t v, int be);
+int locate_jpegs(RangeReader *rd, JpegInfo **jpegs, int *count);
+int findBox_streaming(RangeReader *rd, uint64_t start, uint64_t end, const char *target,
                       unsigned char **result, size_t *resultSize);
-int extractCr3Exif_streaming(FILE *f, size_t fileSize, unsigned char **exifSegment, size_t *exifSize, int verbose);
+int extractCr3Exif_streaming(RangeReader *rd, unsigned char **exifSegment, size_t *exifSize, int verbose);
 int minimizeExifData(unsigned char **exifSegment, size_t *exifSize);
-int insertExifIntoJpeg(const unsigned char *jpegData, size_t jpegSize,
-                       unsigned char *exifSegment, size_t exifSize,
-                       unsigned char **outputData, size_t *outputSize);
+int write_jpeg_head(OutputSink *sink, const unsigned char *exif, size_t exifSize, int *with_exif);
+int stream_jpeg(RangeReader *rd, uint64_t start, size_t size, const unsigned char *exif, size_t exifSize,
+                OutputSink *sink, int *with_exif);
+unsigned char *load_exif(RangeReader *rd, size_t *exifSize, int verbose);
+int rotate_jpeg(const unsigned char *in, size_t size, int orientation, unsigned char **out, size_t *out_size,
+                int *out_w, int *out_h);
+int exif_orientation(unsigned char *exif, size_t size, int reset);
+int emit_jpeg(RangeReader *rd, const JpegInfo *jpeg, const unsigned char *exif, size_t exifSize,
+              OutputSink *sink, int *with_exif, int verbose);
+int phash_file(const char *cr3_path, int verbose);
+int verify_file(const char *cr3_path, int verbose);
+int jpeg_dimensions(RangeReader *rd, const JpegInfo *jpeg, int *width, int *height);
+int select_preview(RangeReader *rd, JpegInfo *jpegs, int count, int verbose);
+size_t parse_byte_size(const char *text);
+void report_duplicates(void);
+int write_raw_render(RangeReader *rd, OutputSink *sink, int verbose);
+int run_render_benchmark(char **inputs, int input_count);
 int extract_largest_jpeg(const char *cr3_path, const char *output_path, int to_stdout, int verbose);
 int extract_all_jpegs(const char *cr3_path, int verbose);
 int extract_specific_jpeg(const char *cr3_path, int jpeg_index, int to_stdout, int verbose);
+int extract_heif_preview(const char *cr3_path, const char *output_path, int to_stdout, int verbose);
+size_t output_source_name(const char *source, const char **name);
 char* generate_output_filename(const char* source);
+char* generate_output_filename_ext(const char* source, const char *ext);
 char* generate_output_filename_all(const char* source, int index);
+void sha256_init(Sha256 *s);
+void sha256_update(Sha256 *s, const unsigned char *data, size_t len);
+void sha256_final(Sha256 *s, unsigned char digest[32]);
+int store_open(OutputSink *sink);
+int store_commit(OutputSink *sink, char **object, int *fresh);
+void report_store_stats(void);
+void crc32_init(void);
+uint32_t crc32_update(uint32_t crc, const unsigned char *data, size_t len);
+int sink_open(OutputSink *sink, const char *path, int to_stdout);
+size_t sink_write(OutputSink *sink, const void *data, size_t len);
+int sink_close(OutputSink *sink, int keep);
+int file_stat_info(const char *path, uint64_t *size, int64_t *mtime_ns);
+int journal_load(const char *path, JournalEntry **entries, size_t *count);
+int journal_append(FILE *journal, const char *source, uint64_t size, int64_t mtime_ns, const JobOutputs *job);
+int journal_entry_verified(const JournalEntry *entry, uint64_t size, int64_t mtime_ns);
+int outputs_up_to_date(const char *cr3_path, int64_t src_mtime_ns);
+int process_file(const char *cr3_path, int to_stdout, int verbose, uint64_t *bytes_read);
+int run_mode(const char *cr3_path, int to_stdout, int verbose);
+int queue_init(WorkQueue *q, int capacity);
+int queue_push(WorkQueue *q, char *path);
+char *queue_pop(WorkQueue *q);
+void queue_close(WorkQueue *q);
+void queue_destroy(WorkQueue *q);
+int batch_begin(BatchState *st, int to_stdout, int verbose);
+void batch_end(BatchState *st);
+int batch_process_input(BatchState *st, const char *cr3_path, int tier, OutputRecord *thumb);
+int tier_init(TierSchedule *ts, char **inputs, int count);
+void tier_destroy(TierSchedule *ts);
+int tier_next(TierSchedule *ts, int *tier);
+int tier_finish(TierSchedule *ts, int index, int tier, int result);
+int tier_request(TierSchedule *ts, const char *path, int verbose);
+void tier_run(BatchState *st);
+int run_batch(char **inputs, int input_count, int to_stdout, int verbose);
+int run_watch(const char *dir, int verbose);
+void report_peak_rss(void);
 void print_usage(const char *progname);
 
 // print_usage (unchanged)
 void print_usage(const char *progname) {
-    printf("Usage: %s <infile> [-] [-v] [-m] [-j all|1|2|3] [-o outfile] [-h]\n", progname);
+    printf("Usage: %s <infile>... [-] [-v] [-m] [-j all|auto|1|2|3] [-o outfile] [batch options] [-h]\n", progname);
     printf("Options:\n");
     printf("  (no -j) : Extract largest JPEG preview unaltered (no EXIF changes) to file or stdout\n");
     printf("  -       : Output to stdout (allowed in default mode and -j 1|2|3)\n");
     printf("  -v      : Verbose output\n");
-    printf("  -m      : Minimize EXIF data (applies only with -j options)\n");
+    printf("  -m      : Minimize EXIF data (applies only with -j options and --heif)\n");
     printf("  -j all  : Extract first 3 JPEG segments with full/minimized EXIF (stdout not allowed)\n");
     printf("  -j 1    : Extract 1st JPEG segment with full/minimized EXIF (stdout allowed)\n");
     printf("  -j 2    : Extract 2nd JPEG segment with full/minimized EXIF (stdout allowed)\n");
     printf("  -j 3    : Extract 3rd JPEG segment with full/minimized EXIF (stdout allowed)\n");
+    printf("  -j auto : Extract the preview chosen by --min-long-edge/--max-bytes with full/minimized EXIF\n");
     printf("  -o FILENAME : Specify output file name. In default mode or -j 1|2|3, FILENAME is used exactly.\n");
     printf("                In -j all mode, FILENAME is used as a base name with an index appended.\n");
     printf("  -h      : Print this help message and exit\n");
+    printf("  --min-long-edge PX : Choose the cheapest preview whose longer side is at least PX pixels\n");
+    printf("                (read from each JPEG's frame header) instead of the largest or -j index\n");
+    printf("  --max-bytes SIZE   : Choose the largest preview of at most SIZE bytes (300000, 300k, 2M);\n");
+    printf("                with --min-long-edge, only previews within SIZE are considered\n");
+    printf("  --rotate    : With -j, turn previews upright losslessly (DCT-domain transpose/flip) per the\n");
+    printf("                EXIF Orientation and set it to 1; partial edge MCUs may be trimmed\n");
+    printf("  --render-raw : Instead of a preview, write a JPEG rendered from the lowest wavelet subband\n");
+    printf("                of the CRX raw data (1/16 of the sensor size per axis; experimental)\n");
+    printf("  --raw-fallback : In the default mode, render the raw data like --render-raw when the file\n");
+    printf("                has no JPEG preview or its preview has no readable frame header\n");
+    printf("  --bench-render : Time reading the largest embedded preview against --render-raw for each\n");
+    printf("                input (nothing is extracted)\n");
+    printf("  --phash     : Print a perceptual hash and the mean color of each input, computed from the\n");
+    printf("                DC coefficients of its smallest preview of 256x256 or more (nothing is extracted)\n");
+    printf("  --dupes BITS : Hash every input like --phash and print groups whose hashes differ in at\n");
+    printf("                most BITS bits (e.g. 6) as \"group<TAB>hash<TAB>path\" lines\n");
+    printf("  --heif      : In the default mode, write the HEVC preview of HDR PQ files unaltered as a .HIF\n");
+    printf("                HEIF image with full/minimized EXIF; other files get their JPEG preview\n");
+    printf("  --verify    : Check each input's box structure and the marker segments and Huffman data of\n");
+    printf("                its previews; print \"OK<TAB>path\" or \"FAIL<TAB>path<TAB>reason\" (nothing is extracted)\n");
+    printf("  --box-index : Locate previews from the CR3 box structure (THMB, PRVW, JPEG track) instead of\n");
+    printf("                scanning every byte; -j 1|2|3 then select THMB, PRVW and the full-size JPEG\n");
+    printf("  --follow    : The input may still be growing (copy from card or network): parse the box index\n");
+    printf("                as bytes arrive and write each preview as soon as its byte range is complete\n");
+    printf("  --follow-timeout SECS : Give up when a followed file has not grown for SECS seconds (default 30)\n");
+    printf("  --walk      : Find JPEGs by walking their marker segments from each FF D8 FF: nested\n");
+    printf("                thumbnails and FF D9 bytes inside segments cannot split a preview, and only\n");
+    printf("                entropy-coded data is searched for markers (-v prints each SOF layout)\n");
+    printf("  --scan-threads N : Scan files of 8 MB or more for JPEG markers with N threads (default 1)\n");
+    printf("  --bench-scan     : Time the serial and the --scan-threads scan of each input and check\n");
+    printf("                    that both find the same JPEGs (nothing is extracted)\n");
+    printf("  --read-buffer KB : Size of each buffer for scanning and copying (default 256)\n");
+    printf("  --read-buffers N : Buffers kept in flight by a read-ahead thread (default 2; 1 reads\n");
+    printf("                    synchronously)\n");
+    printf("  <infile> may be an http:// URL: only the byte ranges holding the box index, EXIF and the\n");
+    printf("                selected previews are fetched (HTTP Range requests); outputs use the URL file name\n");
+    printf("Batch options (several inputs may be given, and directories are searched recursively for\n");
+    printf(".CR3, .CR2 and .DNG files; - and -o then are not allowed):\n");
+    printf("  --files-from LIST : Read more input paths from LIST, one per line ('-' reads stdin)\n");
+    printf("  --journal FILE    : Append a line per completed input (source size/mtime, outputs, CRC-32) to FILE\n");
+    printf("  --resume          : Skip inputs the journal lists as done, if the source is unchanged\n");
+    printf("                      and every recorded output still matches its size and CRC-32\n");
+    printf("  --newer           : Skip inputs whose outputs already exist and are newer than the source\n");
+    printf("  --jobs N          : Process up to N files in parallel (default 1)\n");
+    printf("  --jobs auto       : Tune the files in flight and the read buffer size while running (AIMD on\n");
+    printf("                      measured throughput and per-file latency); -v reports the settings reached\n");
+    printf("  --jobs-min N, --jobs-max N : Caps for --jobs auto (default 1 and 4 per CPU, at most 64)\n");
+    printf("  --read-buffer-min KB, --read-buffer-max KB : Read buffer caps for --jobs auto (default 64, 4096)\n");
+    printf("  --arena-size KB   : Initial per-worker scratch arena, reset after each file (default 2048;\n");
+    printf("                      0 uses malloc); it grows to the largest file's needs\n");
+    printf("  --huge-pages      : Back the arenas with huge pages where the OS allows it\n");
+    printf("  --bulk            : Archive-friendly I/O: read only the box-indexed ranges without kernel\n");
+    printf("                      read-ahead, drop inputs and outputs from the page cache when done\n");
+    printf("  --direct          : --bulk, reading inputs with O_DIRECT where the file system allows it\n");
+    printf("  --thumbs-first    : With -j all, write every input's first preview (the CR3 THMB thumbnail)\n");
+    printf("                      before any input's larger previews\n");
+    printf("  --priority FILE   : With --thumbs-first, read input paths from FILE (e.g. a FIFO), one per\n");
+    printf("                      line; each gets all its previews next, newest request first\n");
+    printf("  --layout-order N  : Process inputs in on-disk order (first extent from FIEMAP or FIBMAP, else\n");
+    printf("                      inode number), sorted in blocks of N that alternately sweep up and down,\n");
+    printf("                      so no input moves N or more places from the given order\n");
+    printf("  --watch DIR       : Watch DIR (Linux inotify) and extract every raw file written or moved\n");
+    printf("                      into it; runs until interrupted, using --jobs workers\n");
+    printf("  --debounce MS     : In --watch mode, wait until a file has been quiet and unchanged in size\n");
+    printf("                      for MS milliseconds before extracting (default 100)\n");
+    printf("  --trace FILE      : Record per-thread spans (open, parse, scan, EXIF, write, waits) and the\n");
+    printf("                      queue depth, written at exit as Chrome trace-event JSON for Perfetto\n");
+    printf("  --metrics FILE    : Keep FILE updated with Prometheus metrics (files done/failed, bytes,\n");
+    printf("                      phase latency histograms, cache hits, files in flight)\n");
+    printf("  --metrics-interval SECS : Rewrite the --metrics file every SECS seconds (default 10)\n");
+    printf("  --metrics-port PORT : Serve the same metrics over HTTP on 127.0.0.1:PORT\n");
+    printf("  --store DIR       : Write each output once into DIR/ab/cd/<sha256>.<ext> (hashed while it is\n");
+    printf("                      written) and hardlink the usual output path to it; content already in\n");
+    printf("                      the store is not stored again\n");
+    printf("  --store-manifest FILE : With --store, append \"sha256<TAB>size<TAB>path\" lines to FILE\n");
+    printf("                      instead of creating the output paths\n");
+    printf("Resource limits per input (for untrusted files; a file over a limit fails, and the exit\n");
+    printf("status is 3 if every failed input was stopped by a limit):\n");
+    printf("  --max-boxes N     : Parse at most N box headers (default 100000)\n");
+    printf("  --max-depth N     : Descend at most N levels of nested boxes (default 32)\n");
+    printf("  --max-metadata SIZE : Allocate at most SIZE for boxes and IFDs the file declares (default 64M)\n");
+    printf("  --max-previews N  : List at most N JPEG candidates (default 65536)\n");
+    printf("  --max-read SIZE   : Read at most SIZE bytes of the file, scanning included (default: no limit)\n");
+    printf("  --time-limit SECS : Give up on a file after SECS seconds of wall-clock time (default: none)\n");
+}
+
+// ----- Scratch memory -----
+
+// arena_map: backing store for an arena; with --huge-pages it tries explicit huge
+// pages, then transparent huge pages, before falling back to malloc
+unsigned char *arena_map(size_t size, int *mapped) {
+    *mapped = 0;
+#ifdef __linux__
+    if (g_huge_pages) {
+        void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p == MAP_FAILED) {
+            p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (p != MAP_FAILED) madvise(p, size, MADV_HUGEPAGE);
+        }
+        if (p != MAP_FAILED) {
+            *mapped = 1;
+            return p;
+        }
+    }
+#endif
+    return malloc(size);
+}
+
+void arena_unmap(unsigned char *base, size_t size, int mapped) {
+#ifdef __linux__
+    if (mapped) {
+        munmap(base, size);
+        return;
+    }
+#else
+    (void)size;
+    (void)mapped;
+#endif
+    free(base);
+}
+
+// arena_round: arena sizes are whole huge pages with --huge-pages
+size_t arena_round(size_t size) {
+    size_t step = g_huge_pages ? ARENA_HUGE_PAGE : ARENA_GROW_STEP;
+    return (size + step - 1) / step * step;
+}
+
+// arena_begin: gives the calling thread an arena (unless --arena-size 0)
+void arena_begin(void) {
+    if (g_arena_size == 0 || g_arena) return;
+    Arena *a = calloc(1, sizeof(Arena));
+    if (!a) return;
+    a->size = arena_round(g_arena_size);
+    a->base = arena_map(a->size, &a->mapped);
+    if (!a->base) {
+        free(a);
+        return;
+    }
+    a->last = SIZE_MAX;
+    g_arena = a;
+}
+
+// arena_reset: releases everything allocated for the finished input. If the input
+// needed more than the arena holds, the arena grows to that high-water mark so the
+// next input is served without touching the heap.
+void arena_reset(void) {
+    Arena *a = g_arena;
+    if (!a) return;
+    a->files++;
+    if (a->file_heap_allocs) a->last_heap_file = a->files;
+    if (a->demand > a->size && a->size < ARENA_MAX_GROWTH) {
+        size_t size = arena_round(a->demand + a->demand / 4);
+        if (size > ARENA_MAX_GROWTH) size = ARENA_MAX_GROWTH;
+        int mapped;
+        unsigned char *base = arena_map(size, &mapped);
+        if (base) {
+            arena_unmap(a->base, a->size, a->mapped);
+            a->base = base;
+            a->size = size;
+            a->mapped = mapped;
+            a->grows++;
+        }
+    }
+    a->used = 0;
+    a->demand = 0;
+    a->last = SIZE_MAX;
+    a->file_heap_allocs = 0;
+}
+
+// arena_end: folds the thread's counters into the run totals and frees its arena
+void arena_end(void) {
+    Arena *a = g_arena;
+    if (!a) return;
+    arena_reset();
+    a->files--;   // the reset above did not finish an input
+    pthread_mutex_lock(&g_scratch_lock);
+    g_scratch_totals.files += a->files;
+    g_scratch_totals.arena_allocs += a->arena_allocs;
+    g_scratch_totals.heap_allocs += a->heap_allocs;
+    g_scratch_totals.grows += a->grows;
+    if (a->last_heap_file > g_scratch_totals.last_heap_file)
+        g_scratch_totals.last_heap_file = a->last_heap_file;
+    if (a->size > g_scratch_totals.size)
+        g_scratch_totals.size = a->size;
+    pthread_mutex_unlock(&g_scratch_lock);
+    arena_unmap(a->base, a->size, a->mapped);
+    free(a);
+    g_arena = NULL;
+}
+
+void report_scratch_stats(void) {
+    ScratchStats *t = &g_scratch_totals;
+    if (t->files == 0) return;
+    fprintf(stderr, "Scratch memory: %llu files, %llu arena / %llu heap allocations (%.2f heap per file",
+            (unsigned long long)t->files, (unsigned long long)t->arena_allocs, (unsigned long long)t->heap_allocs,
+            (double)t->heap_allocs / t->files);
+    if (t->heap_allocs)
+        fprintf(stderr, ", none after file %llu of a worker", (unsigned long long)t->last_heap_file);
+    fprintf(stderr, "), arena %zu KB%s, grown %u times\n", t->size / 1024, g_huge_pages ? " (huge pages)" : "", t->grows);
+}
+
+// scratch_alloc: per-input allocation; from the thread's arena when it has room,
+// otherwise (or without an arena) from the heap. Release with scratch_free().
+void *scratch_alloc(size_t n) {
+    Arena *a = g_arena;
+    if (!a) return malloc(n);
+    size_t need = ARENA_ALIGN + (n + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+    a->demand += need;
+    if (need <= a->size - a->used) {
+        *(size_t *)(a->base + a->used) = n;
+        a->last = a->used;
+        a->used += need;
+        a->arena_allocs++;
+        return a->base + a->last + ARENA_ALIGN;
+    }
+    a->heap_allocs++;
+    a->file_heap_allocs++;
+    return malloc(n);
+}
+
+void *scratch_calloc(size_t count, size_t size) {
+    if (size && count > SIZE_MAX / size) return NULL;
+    void *p = scratch_alloc(count * size);
+    if (p) memset(p, 0, count * size);
+    return p;
+}
+
+int scratch_in_arena(const void *p) {
+    const Arena *a = g_arena;
+    return a && (const unsigned char *)p >= a->base && (const unsigned char *)p < a->base + a->size;
+}
+
+// scratch_free: heap blocks are freed; arena blocks are reclaimed only if they are the
+// most recent allocation, everything else goes at the next arena_reset()
+void scratch_free(void *p) {
+    if (!p) return;
+    if (!scratch_in_arena(p)) {
+        free(p);
+        return;
+    }
+    Arena *a = g_arena;
+    if ((unsigned char *)p - ARENA_ALIGN == a->base + a->last) {
+        a->used = a->last;
+        a->last = SIZE_MAX;
+    }
+}
+
+void *scratch_realloc(void *p, size_t n) {
+    if (!p) return scratch_alloc(n);
+    Arena *a = g_arena;
+    if (!scratch_in_arena(p)) {
+        if (a) {
+            a->heap_allocs++;
+            a->file_heap_allocs++;
+            a->demand += n;
+        }
+        return realloc(p, n);
+    }
+    unsigned char *block = (unsigned char *)p - ARENA_ALIGN;
+    size_t old = *(size_t *)block;
+    size_t need = ARENA_ALIGN + (n + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+    if (block == a->base + a->last && need <= a->size - a->last) {
+        // Most recent block: grow or shrink in place
+        a->demand += need > a->used - a->last ? need - (a->used - a->last) : 0;
+        a->used = a->last + need;
+        *(size_t *)block = n;
+        return p;
+    }
+    void *q = scratch_alloc(n);
+    if (q) memcpy(q, p, old < n ? old : n);
+    return q;
+}
+
+char *scratch_strdup(const char *s) {
+    size_t n = strlen(s) + 1;
+    char *p = scratch_alloc(n);
+    if (p) memcpy(p, s, n);
+    return p;
+}
+
+// ----- Resource limits -----
+// Inputs may be hostile uploads, so the work one file can cause is bounded: box
+// headers parsed, box nesting, memory allocated for metadata the file declares,
+// previews listed, bytes read and wall-clock time. The first limit hit stops the
+// file with one message; every later check fails fast, and process_file reports
+// RESULT_OVER_LIMIT whatever error the mode itself returned.
+
+void budget_begin(FileBudget *b, const char *path) {
+    memset(b, 0, sizeof(*b));
+    b->path = path;
+    if (g_time_limit_ms)
+        b->deadline_ms = monotonic_ms() + g_time_limit_ms;
+    g_budget = b;
+}
+
+void budget_end(void) {
+    g_budget = NULL;
+}
+
+// budget_fail: marks b exceeded, printing what was hit the first time. Returns -1.
+int budget_fail(FileBudget *b, const char *what, unsigned long long limit) {
+    if (atomic_exchange(&b->exceeded, 1) == 0)
+        fprintf(stderr, "%s: %s limit (%llu) exceeded, giving up on this file\n", b->path, what, limit);
+    return -1;
+}
+
+// budget_check: -1 once b is exceeded or past its deadline; always 0 without a budget
+int budget_check(FileBudget *b) {
+    if (!b) return 0;
+    if (atomic_load_explicit(&b->exceeded, memory_order_relaxed)) return -1;
+    if (b->deadline_ms && monotonic_ms() > b->deadline_ms)
+        return budget_fail(b, "time (ms)", (unsigned long long)g_time_limit_ms);
+    return 0;
+}
+
+// budget_read: charges a read of len bytes from the input, from any thread; the total
+// is kept without --max-read too, for --jobs auto
+int budget_read(FileBudget *b, uint64_t len) {
+    if (budget_check(b) != 0) return -1;
+    if (b && atomic_fetch_add(&b->read, len) + len > g_max_read && g_max_read)
+        return budget_fail(b, "read (bytes)", (unsigned long long)g_max_read);
+    return 0;
+}
+
+// limit_boxes: charges one box header parsed by the current worker
+int limit_boxes(void) {
+    if (budget_check(g_budget) != 0) return -1;
+    if (g_budget && g_max_boxes && atomic_fetch_add(&g_budget->boxes, 1) >= (uint64_t)g_max_boxes)
+        return budget_fail(g_budget, "box count", (unsigned long long)g_max_boxes);
+    return 0;
+}
+
+int limit_depth(int depth) {
+    if (g_budget && g_max_depth && depth > g_max_depth)
+        return budget_fail(g_budget, "box nesting", (unsigned long long)g_max_depth);
+    return budget_check(g_budget);
+}
+
+// limit_metadata: charges an allocation whose size the file declares (moov, IFDs)
+int limit_metadata(uint64_t size) {
+    if (budget_check(g_budget) != 0) return -1;
+    if (g_budget && g_max_metadata && atomic_fetch_add(&g_budget->metadata, size) + size > g_max_metadata)
+        return budget_fail(g_budget, "metadata memory (bytes)", (unsigned long long)g_max_metadata);
+    return 0;
+}
+
+// limit_previews: -1 if a preview list may not hold count entries
+int limit_previews(int count) {
+    if (g_budget && g_max_previews && count > g_max_previews)
+        return budget_fail(g_budget, "preview count", (unsigned long long)g_max_previews);
+    return budget_check(g_budget);
+}
+
+// ----- Trace -----
+// --trace FILE records a timeline of the run for chrome://tracing or ui.perfetto.dev:
+// complete spans per input and per stage (open, container parse, scan, EXIF, write,
+// ...), consumer waits for read-ahead buffers and work, and the work queue depth.
+// Every traced thread appends to its own ring of TRACE_RING_EVENTS events without
+// locking, overwriting its oldest events when full. Rings are handed out under
+// g_trace_lock when a thread starts and are reused by later threads of the same
+// kind, so short-lived read-ahead threads share a few lanes. At exit all rings are
+// merged into one Chrome trace-event JSON file.
+
+#define TRACE_RING_EVENTS (1u << 16)
+
+typedef struct {
+    const char *name;           // string literal
+    char *detail;               // heap copy (the input of a "file" span), or NULL
+    uint64_t ts;                // monotonic ns
+    uint64_t dur;               // ns; the value for a counter
+    int counter;
+} TraceEvent;
+
+typedef struct TraceRing TraceRing;
+struct TraceRing {
+    TraceEvent *events;         // TRACE_RING_EVENTS slots
+    uint64_t written;           // events recorded; the ring keeps the last TRACE_RING_EVENTS
+    const char *kind;           // thread name, a string literal
+    int tid;
+    int busy;                   // a running thread owns it
+    TraceRing *next;
+};
+
+TraceRing *g_trace_rings = NULL;
+int g_trace_threads = 0;
+uint64_t g_trace_epoch = 0;
+pthread_mutex_t g_trace_lock = PTHREAD_MUTEX_INITIALIZER;
+_Thread_local TraceRing *g_trace_ring = NULL;
+typedef struct ThreadMetrics ThreadMetrics;     // see Metrics; spans also feed its histograms
+_Thread_local ThreadMetrics *g_metrics = NULL;
+
+uint64_t trace_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+// trace_thread_begin: gives the calling thread a ring, reusing an idle one of the
+// same kind; a no-op without --trace
+void trace_thread_begin(const char *kind) {
+    if (!g_trace_path) return;
+    pthread_mutex_lock(&g_trace_lock);
+    if (!g_trace_epoch) g_trace_epoch = trace_clock();
+    TraceRing *ring = g_trace_rings;
+    while (ring && (ring->busy || ring->kind != kind))
+        ring = ring->next;
+    if (!ring && (ring = calloc(1, sizeof(TraceRing))) != NULL) {
+        ring->events = calloc(TRACE_RING_EVENTS, sizeof(TraceEvent));
+        if (!ring->events) {
+            free(ring);
+            ring = NULL;
+        } else {
+            ring->kind = kind;
+            ring->tid = ++g_trace_threads;
+            ring->next = g_trace_rings;
+            g_trace_rings = ring;
+        }
+    }
+    if (ring) ring->busy = 1;
+    pthread_mutex_unlock(&g_trace_lock);
+    g_trace_ring = ring;
+}
+
+void trace_thread_end(void) {
+    if (!g_trace_ring) return;
+    pthread_mutex_lock(&g_trace_lock);
+    g_trace_ring->busy = 0;
+    pthread_mutex_unlock(&g_trace_lock);
+    g_trace_ring = NULL;
+}
+
+void trace_record(const char *name, const char *detail, uint64_t ts, uint64_t dur, int counter) {
+    TraceRing *ring = g_trace_ring;
+    TraceEvent *e = &ring->events[ring->written % TRACE_RING_EVENTS];
+    free(e->detail);
+    e->name = name;
+    e->detail = detail ? strdup(detail) : NULL;
+    e->ts = ts;
+    e->dur = dur;
+    e->counter = counter;
+    ring->written++;
+}
+
+// trace_begin: start time of a span, 0 if this thread has neither a trace ring nor
+// metrics
+uint64_t trace_begin(void) {
+    return g_trace_ring || g_metrics ? trace_clock() : 0;
+}
+
+// trace_end: records the span `name` that began at start for --trace (detail is
+// copied) and its latency for the metrics
+void trace_end(const char *name, uint64_t start, const char *detail) {
+    if (!start) return;
+    uint64_t now = trace_clock();
+    if (g_trace_ring) trace_record(name, detail, start, now - start, 0);
+    if (g_metrics) metrics_observe(name, now - start);
+}
+
+void trace_counter(const char *name, uint64_t value) {
+    if (g_trace_ring) trace_record(name, NULL, trace_clock(), value, 1);
+}
+
+// trace_json_string: writes s as a JSON string
+void trace_json_string(FILE *f, const char *s) {
+    fputc('"', f);
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') fprintf(f, "\\%c", c);
+        else if (c < 0x20) fprintf(f, "\\u%04x", c);
+        else fputc(c, f);
+    }
+    fputc('"', f);
+}
+
+// trace_write: merges all rings into a Chrome trace-event JSON file and frees them.
+// Must run after every traced thread has finished. Returns 0 on success.
+int trace_write(const char *path, int verbose) {
+    FILE *f = fopen(path, "w");
+    uint64_t events = 0, dropped = 0;
+    if (!f) perror("Failed to open trace file");
+    else fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+                    "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"cr3extract\"}}");
+    while (g_trace_rings) {
+        TraceRing *ring = g_trace_rings;
+        uint64_t kept = ring->written < TRACE_RING_EVENTS ? ring->written : TRACE_RING_EVENTS;
+        if (f) {
+            fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s %d\"}}",
+                    ring->tid, ring->kind, ring->tid);
+        }
+        for (uint64_t i = ring->written - kept; i < ring->written; i++) {
+            TraceEvent *e = &ring->events[i % TRACE_RING_EVENTS];
+            double ts = (double)(e->ts - g_trace_epoch) / 1000.0;
+            if (f && e->counter) {
+                fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"C\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"args\":{\"value\":%llu}}",
+                        e->name, ring->tid, ts, (unsigned long long)e->dur);
+            } else if (f) {
+                fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f", e->name,
+                        ring->tid, ts, (double)e->dur / 1000.0);
+                if (e->detail) {
+                    fprintf(f, ",\"args\":{\"file\":");
+                    trace_json_string(f, e->detail);
+                    fputc('}', f);
+                }
+                fputc('}', f);
+            }
+        }
+        for (uint64_t i = 0; i < kept; i++)
+            free(ring->events[i].detail);
+        events += kept;
+        dropped += ring->written - kept;
+        g_trace_rings = ring->next;
+        free(ring->events);
+        free(ring);
+    }
+    g_trace_ring = NULL;
+    if (!f) return -1;
+    fprintf(f, "\n]}\n");
+    if (fclose(f) != 0) {
+        fprintf(stderr, "Failed to write trace file %s\n", path);
+        return -1;
+    }
+    if (dropped)
+        fprintf(stderr, "Trace: the oldest %llu events were overwritten (ring of %u events per thread).\n",
+                (unsigned long long)dropped, TRACE_RING_EVENTS);
+    if (verbose)
+        fprintf(stderr, "Trace: %llu events written to %s\n", (unsigned long long)events, path);
+    return 0;
+}
+
+// ----- Metrics -----
+// --metrics FILE / --metrics-port PORT expose live progress of batch and --watch runs
+// in the Prometheus text format: a textfile rewritten every --metrics-interval
+// seconds (and at exit, for node_exporter's textfile collector) and/or a plain HTTP
+// endpoint on 127.0.0.1. Each worker owns a ThreadMetrics block and is its only
+// writer, so updates are relaxed atomic stores of plain adds, with no lock or
+// locked instruction on the hot path; the exporter sums all blocks when it renders.
+// Phase latencies come from the same points that --trace records spans at.
+
+enum {
+    METRIC_FILES_STARTED,
+    METRIC_FILES_DONE,
+    METRIC_FILES_FAILED,
+    METRIC_FILES_SKIPPED,
+    METRIC_BYTES_READ,          // backend bytes, folded in when a reader is closed
+    METRIC_BACKEND_READS,
+    METRIC_CACHE_HITS,
+    METRIC_CACHE_MISSES,
+    METRIC_BYTES_WRITTEN,
+    METRIC_FILES_OVER_LIMIT,
+    METRIC_COUNT
+};
+
+#define METRICS_PHASES 6
+#define METRICS_BUCKETS 17      // 16 bounds and +Inf
+const char *const METRICS_PHASE_NAMES[METRICS_PHASES] = { "file", "open", "parse container", "scan", "exif", "write" };
+const uint64_t METRICS_BUCKET_NS[METRICS_BUCKETS - 1] = {
+    100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000, 25000000, 50000000, 100000000,
+    250000000, 500000000, 1000000000, 2500000000u, 5000000000u, 10000000000u
+};
+const char *const METRICS_BUCKET_LABELS[METRICS_BUCKETS] = {
+    "0.0001", "0.00025", "0.0005", "0.001", "0.0025", "0.005", "0.01", "0.025", "0.05", "0.1", "0.25", "0.5", "1", "2.5", "5", "10", "+Inf"
+};
+
+struct ThreadMetrics {
+    _Atomic uint64_t counters[METRIC_COUNT];
+    _Atomic uint64_t buckets[METRICS_PHASES][METRICS_BUCKETS];   // not cumulative
+    _Atomic uint64_t sum_ns[METRICS_PHASES];
+    ThreadMetrics *next;
+};
+
+ThreadMetrics *g_metrics_threads = NULL;
+pthread_mutex_t g_metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t g_metrics_cond = PTHREAD_COND_INITIALIZER;
+_Atomic uint64_t g_metrics_queue_depth = 0;
+int g_metrics_stop = 0;
+uint64_t g_metrics_started_ns = 0;
+pthread_t g_metrics_writer;
+int g_metrics_writer_running = 0;
+#ifndef _WIN32
+pthread_t g_metrics_server;
+int g_metrics_listen_fd = -1;
+#endif
+
+// metrics_add: the calling thread is the only writer of its block
+void metrics_add(int counter, uint64_t value) {
+    ThreadMetrics *m = g_metrics;
+    if (!m) return;
+    atomic_store_explicit(&m->counters[counter],
+                          atomic_load_explicit(&m->counters[counter], memory_order_relaxed) + value,
+                          memory_order_relaxed);
+}
+
+// metrics_observe: records the latency of a span if its name is a tracked phase
+void metrics_observe(const char *name, uint64_t ns) {
+    ThreadMetrics *m = g_metrics;
+    int phase = 0, bucket = 0;
+    while (phase < METRICS_PHASES && strcmp(name, METRICS_PHASE_NAMES[phase]) != 0)
+        phase++;
+    if (!m || phase == METRICS_PHASES) return;
+    while (bucket < METRICS_BUCKETS - 1 && ns > METRICS_BUCKET_NS[bucket])
+        bucket++;
+    _Atomic uint64_t *b = &m->buckets[phase][bucket], *s = &m->sum_ns[phase];
+    atomic_store_explicit(b, atomic_load_explicit(b, memory_order_relaxed) + 1, memory_order_relaxed);
+    atomic_store_explicit(s, atomic_load_explicit(s, memory_order_relaxed) + ns, memory_order_relaxed);
+}
+
+// metrics_thread_begin: gives the calling thread its counter block; a no-op without
+// --metrics or --metrics-port. Blocks live until metrics_stop.
+void metrics_thread_begin(void) {
+    if (!g_metrics_path && !g_metrics_port) return;
+    ThreadMetrics *m = calloc(1, sizeof(ThreadMetrics));
+    if (!m) return;
+    pthread_mutex_lock(&g_metrics_lock);
+    m->next = g_metrics_threads;
+    g_metrics_threads = m;
+    pthread_mutex_unlock(&g_metrics_lock);
+    g_metrics = m;
+}
+
+void metrics_queue_depth(int depth) {
+    atomic_store_explicit(&g_metrics_queue_depth, (uint64_t)depth, memory_order_relaxed);
+}
+
+// metrics_render: writes the Prometheus text exposition of all counters to f
+void metrics_render(FILE *f) {
+    uint64_t c[METRIC_COUNT] = { 0 }, buckets[METRICS_PHASES][METRICS_BUCKETS], sum_ns[METRICS_PHASES];
+    memset(buckets, 0, sizeof(buckets));
+    memset(sum_ns, 0, sizeof(sum_ns));
+    pthread_mutex_lock(&g_metrics_lock);
+    for (ThreadMetrics *m = g_metrics_threads; m; m = m->next) {
+        for (int i = 0; i < METRIC_COUNT; i++)
+            c[i] += atomic_load_explicit(&m->counters[i], memory_order_relaxed);
+        for (int p = 0; p < METRICS_PHASES; p++) {
+            for (int b = 0; b < METRICS_BUCKETS; b++)
+                buckets[p][b] += atomic_load_explicit(&m->buckets[p][b], memory_order_relaxed);
+            sum_ns[p] += atomic_load_explicit(&m->sum_ns[p], memory_order_relaxed);
+        }
+    }
+    pthread_mutex_unlock(&g_metrics_lock);
+
+    uint64_t finished = c[METRIC_FILES_DONE] + c[METRIC_FILES_FAILED];
+    uint64_t lookups = c[METRIC_CACHE_HITS] + c[METRIC_CACHE_MISSES];
+    fprintf(f, "# HELP cr3extract_files_total Inputs finished, by result.\n# TYPE cr3extract_files_total counter\n");
+    fprintf(f, "cr3extract_files_total{result=\"done\"} %llu\n", (unsigned long long)c[METRIC_FILES_DONE]);
+    fprintf(f, "cr3extract_files_total{result=\"failed\"} %llu\n", (unsigned long long)c[METRIC_FILES_FAILED]);
+    fprintf(f, "cr3extract_files_total{result=\"skipped\"} %llu\n", (unsigned long long)c[METRIC_FILES_SKIPPED]);
+    fprintf(f, "# HELP cr3extract_files_over_limit_total Failed inputs stopped by a resource limit.\n"
+               "# TYPE cr3extract_files_over_limit_total counter\n");
+    fprintf(f, "cr3extract_files_over_limit_total %llu\n", (unsigned long long)c[METRIC_FILES_OVER_LIMIT]);
+    fprintf(f, "# HELP cr3extract_files_in_flight Inputs being processed.\n# TYPE cr3extract_files_in_flight gauge\n");
+    fprintf(f, "cr3extract_files_in_flight %llu\n",
+            (unsigned long long)(c[METRIC_FILES_STARTED] > finished ? c[METRIC_FILES_STARTED] - finished : 0));
+    fprintf(f, "# HELP cr3extract_queue_depth Inputs waiting for a worker.\n# TYPE cr3extract_queue_depth gauge\n");
+    fprintf(f, "cr3extract_queue_depth %llu\n",
+            (unsigned long long)atomic_load_explicit(&g_metrics_queue_depth, memory_order_relaxed));
+    fprintf(f, "# HELP cr3extract_read_bytes_total Bytes read from inputs (closed readers).\n"
+               "# TYPE cr3extract_read_bytes_total counter\n");
+    fprintf(f, "cr3extract_read_bytes_total %llu\n", (unsigned long long)c[METRIC_BYTES_READ]);
+    fprintf(f, "# HELP cr3extract_backend_reads_total Read calls on inputs (closed readers).\n"
+               "# TYPE cr3extract_backend_reads_total counter\n");
+    fprintf(f, "cr3extract_backend_reads_total %llu\n", (unsigned long long)c[METRIC_BACKEND_READS]);
+    fprintf(f, "# HELP cr3extract_written_bytes_total Bytes written to outputs.\n"
+               "# TYPE cr3extract_written_bytes_total counter\n");
+    fprintf(f, "cr3extract_written_bytes_total %llu\n", (unsigned long long)c[METRIC_BYTES_WRITTEN]);
+    fprintf(f, "# HELP cr3extract_cache_lookups_total Reader block cache lookups, by result.\n"
+               "# TYPE cr3extract_cache_lookups_total counter\n");
+    fprintf(f, "cr3extract_cache_lookups_total{result=\"hit\"} %llu\n", (unsigned long long)c[METRIC_CACHE_HITS]);
+    fprintf(f, "cr3extract_cache_lookups_total{result=\"miss\"} %llu\n", (unsigned long long)c[METRIC_CACHE_MISSES]);
+    fprintf(f, "# HELP cr3extract_cache_hit_ratio Share of reader block cache lookups that hit.\n"
+               "# TYPE cr3extract_cache_hit_ratio gauge\n");
+    fprintf(f, "cr3extract_cache_hit_ratio %.4f\n", lookups ? (double)c[METRIC_CACHE_HITS] / lookups : 0.0);
+    fprintf(f, "# HELP cr3extract_phase_duration_seconds Time spent per input in each phase.\n"
+               "# TYPE cr3extract_phase_duration_seconds histogram\n");
+    for (int p = 0; p < METRICS_PHASES; p++) {
+        uint64_t cumulative = 0;
+        for (int b = 0; b < METRICS_BUCKETS; b++) {
+            cumulative += buckets[p][b];
+            fprintf(f, "cr3extract_phase_duration_seconds_bucket{phase=\"%s\",le=\"%s\"} %llu\n",
+                    METRICS_PHASE_NAMES[p], METRICS_BUCKET_LABELS[b], (unsigned long long)cumulative);
+        }
+        fprintf(f, "cr3extract_phase_duration_seconds_sum{phase=\"%s\"} %.6f\n", METRICS_PHASE_NAMES[p],
+                (double)sum_ns[p] / 1e9);
+        fprintf(f, "cr3extract_phase_duration_seconds_count{phase=\"%s\"} %llu\n", METRICS_PHASE_NAMES[p],
+                (unsigned long long)cumulative);
+    }
+    fprintf(f, "# HELP cr3extract_uptime_seconds Seconds since the run started.\n# TYPE cr3extract_uptime_seconds gauge\n");
+    fprintf(f, "cr3extract_uptime_seconds %.3f\n", (double)(trace_clock() - g_metrics_started_ns) / 1e9);
+}
+
+// metrics_write_file: replaces the textfile atomically (write a temporary file, rename)
+int metrics_write_file(const char *path) {
+    size_t len = strlen(path) + 5;
+    char *tmp = malloc(len);
+    if (!tmp) return -1;
+    snprintf(tmp, len, "%s.tmp", path);
+    FILE *f = fopen(tmp, "w");
+    int rc = -1;
+    if (f) {
+        metrics_render(f);
+        if (fclose(f) == 0 && rename(tmp, path) == 0) rc = 0;
+    }
+    if (rc != 0) {
+        fprintf(stderr, "Failed to write metrics file %s: %s\n", path, strerror(errno));
+        remove(tmp);
+    }
+    free(tmp);
+    return rc;
+}
+
+void *metrics_writer(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&g_metrics_lock);
+    while (!g_metrics_stop) {
+        struct timespec due;
+        clock_gettime(CLOCK_REALTIME, &due);
+        due.tv_sec += g_metrics_interval;
+        while (!g_metrics_stop && pthread_cond_timedwait(&g_metrics_cond, &g_metrics_lock, &due) != ETIMEDOUT)
+            ;
+        if (g_metrics_stop) break;
+        pthread_mutex_unlock(&g_metrics_lock);
+        metrics_write_file(g_metrics_path);
+        pthread_mutex_lock(&g_metrics_lock);
+    }
+    pthread_mutex_unlock(&g_metrics_lock);
+    return NULL;
+}
+
+#ifndef _WIN32
+// metrics_server: answers every connection on the metrics port with the current
+// exposition (HTTP/1.0, whatever was requested); accept times out so stop is seen
+void *metrics_server(void *arg) {
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&g_metrics_lock);
+        int stop = g_metrics_stop;
+        pthread_mutex_unlock(&g_metrics_lock);
+        if (stop) break;
+        int fd = accept(g_metrics_listen_fd, NULL, NULL);
+        if (fd < 0) continue;
+        char request[1024];
+        struct timeval tv = { 1, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        if (recv(fd, request, sizeof(request), 0) >= 0) {
+            char *body = NULL;
+            size_t len = 0;
+            FILE *f = open_memstream(&body, &len);
+            if (f) {
+                metrics_render(f);
+                fclose(f);
+                char head[128];
+                int hlen = snprintf(head, sizeof(head),
+                                    "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                                    "Content-Length: %zu\r\n\r\n", len);
+                if (send(fd, head, (size_t)hlen, MSG_NOSIGNAL) == hlen)
+                    send(fd, body, len, MSG_NOSIGNAL);
+            }
+            free(body);
+        }
+        close(fd);
+    }
+    return NULL;
+}
+#endif
+
+// metrics_start: opens the metrics port and starts the textfile writer. Returns 0 on success.
+int metrics_start(void) {
+    g_metrics_started_ns = trace_clock();
+#ifndef _WIN32
+    if (g_metrics_port) {
+        struct addrinfo hints, *res = NULL;
+        char port[8];
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        snprintf(port, sizeof(port), "%d", g_metrics_port);
+        int fd = getaddrinfo("127.0.0.1", port, &hints, &res) == 0 ?
+                 socket(res->ai_family, res->ai_socktype, res->ai_protocol) : -1;
+        int one = 1;
+        struct timeval tv = { 0, 200000 };
+        if (fd >= 0) {
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        }
+        if (fd < 0 || bind(fd, res->ai_addr, res->ai_addrlen) != 0 || listen(fd, 16) != 0) {
+            fprintf(stderr, "Cannot serve metrics on 127.0.0.1:%d: %s\n", g_metrics_port, strerror(errno));
+            if (fd >= 0) close(fd);
+            if (res) freeaddrinfo(res);
+            return -1;
+        }
+        freeaddrinfo(res);
+        g_metrics_listen_fd = fd;
+        if (pthread_create(&g_metrics_server, NULL, metrics_server, NULL) != 0) {
+            fprintf(stderr, "Failed to start the metrics server thread\n");
+            close(fd);
+            g_metrics_listen_fd = -1;
+            return -1;
+        }
+    }
+#else
+    if (g_metrics_port) {
+        fprintf(stderr, "'--metrics-port' is not supported on this platform.\n");
+        return -1;
+    }
+#endif
+    if (g_metrics_path) {
+        if (metrics_write_file(g_metrics_path) != 0)
+            return -1;
+        g_metrics_writer_running = pthread_create(&g_metrics_writer, NULL, metrics_writer, NULL) == 0;
+    }
+    return 0;
+}
+
+// metrics_stop: stops the exporter threads, writes the final textfile and frees
+// the counter blocks. Every worker must have finished.
+void metrics_stop(void) {
+    pthread_mutex_lock(&g_metrics_lock);
+    g_metrics_stop = 1;
+    pthread_cond_broadcast(&g_metrics_cond);
+    pthread_mutex_unlock(&g_metrics_lock);
+    int final_write = g_metrics_writer_running;
+    if (g_metrics_writer_running) {
+        pthread_join(g_metrics_writer, NULL);
+        g_metrics_writer_running = 0;
+    }
+#ifndef _WIN32
+    if (g_metrics_listen_fd >= 0) {
+        pthread_join(g_metrics_server, NULL);
+        close(g_metrics_listen_fd);
+        g_metrics_listen_fd = -1;
+    }
+#endif
+    if (final_write)
+        metrics_write_file(g_metrics_path);
+    g_metrics = NULL;
+    while (g_metrics_threads) {
+        ThreadMetrics *m = g_metrics_threads;
+        g_metrics_threads = m->next;
+        free(m);
+    }
+}
+
+// ----- Read-ahead -----
+// A producer thread keeps up to --read-buffers buffers of --read-buffer bytes filled
+// with the data following the one being scanned or written, so the disk and the
+// consumer work at the same time. A range that fits in one buffer, or
+// --read-buffers 1, is read on the caller's thread instead.
+
+void *readahead_producer(void *arg) {
+    ReadAhead *ra = (ReadAhead *)arg;
+    trace_thread_begin("read-ahead");
+    pthread_mutex_lock(&ra->lock);
+    while (!ra->stop && !ra->eof && !ra->error) {
+        if (ra->held + ra->ready >= ra->count) {
+            pthread_cond_wait(&ra->cond, &ra->lock);
+            continue;
+        }
+        int slot = (ra->first + ra->held + ra->ready) % ra->count;
+        uint64_t pos = ra->pos;
+        size_t want = ra->end - pos < ra->size ? (size_t)(ra->end - pos) : ra->size;
+        pthread_mutex_unlock(&ra->lock);
+        long long got = want ? reader_read(ra->rd, pos, ra->bufs[slot], want) : 0;
+        pthread_mutex_lock(&ra->lock);
+        if (got < 0) {
+            ra->error = 1;
+        } else if (got == 0) {
+            ra->eof = 1;
+        } else {
+            ra->lens[slot] = (size_t)got;
+            ra->pos += (uint64_t)got;
+            ra->ready++;
+        }
+        pthread_cond_broadcast(&ra->cond);
+    }
+    pthread_mutex_unlock(&ra->lock);
+    trace_thread_end();
+    return NULL;
+}
+
+// readahead_start: prepares reading [start, end) of rd; end may be UINT64_MAX for
+// "to the end of the input". Returns 0 on success.
+int readahead_start(ReadAhead *ra, RangeReader *rd, uint64_t start, uint64_t end) {
+    memset(ra, 0, sizeof(*ra));
+    ra->rd = rd;
+    ra->pos = start;
+    ra->end = end;
+    ra->size = g_read_buffer_size;
+    uint64_t span = end - start;
+    if (end > rd->size && rd->size != UINT64_MAX)
+        span = rd->size > start ? rd->size - start : 0;
+    ra->count = (g_read_buffers > 1 && span > ra->size) ? g_read_buffers : 1;
+    if (ra->count == 1 && span < ra->size)
+        ra->size = span ? (size_t)span : 1;
+    ra->bufs = scratch_alloc(ra->count * sizeof(unsigned char *));
+    ra->lens = scratch_alloc(ra->count * sizeof(size_t));
+    ra->block = scratch_alloc(ra->count * ra->size);
+    if (!ra->bufs || !ra->lens || !ra->block) {
+        fprintf(stderr, "Memory allocation failed for read buffers\n");
+        readahead_stop(ra);
+        return -1;
+    }
+    for (int i = 0; i < ra->count; i++)
+        ra->bufs[i] = ra->block + (size_t)i * ra->size;
+    if (ra->count > 1) {
+        pthread_mutex_init(&ra->lock, NULL);
+        pthread_cond_init(&ra->cond, NULL);
+        if (pthread_create(&ra->thread, NULL, readahead_producer, ra) == 0) {
+            ra->threaded = 1;
+        } else {
+            pthread_mutex_destroy(&ra->lock);
+            pthread_cond_destroy(&ra->cond);
+            ra->count = 1;   // read synchronously
+        }
+    }
+    return 0;
+}
+
+// readahead_next: the next piece of the range in *data, valid until the following
+// call. Returns its length, 0 at the end of the range or -1 on a read error.
+long long readahead_next(ReadAhead *ra, const unsigned char **data) {
+    if (!ra->threaded) {
+        size_t want = ra->end - ra->pos < ra->size ? (size_t)(ra->end - ra->pos) : ra->size;
+        long long got = want ? reader_read(ra->rd, ra->pos, ra->bufs[0], want) : 0;
+        if (got > 0) ra->pos += (uint64_t)got;
+        *data = ra->bufs[0];
+        return got;
+    }
+    pthread_mutex_lock(&ra->lock);
+    if (ra->held) {
+        ra->first = (ra->first + 1) % ra->count;
+        ra->held = 0;
+        pthread_cond_broadcast(&ra->cond);
+    }
+    if (!ra->ready && !ra->eof && !ra->error) {
+        uint64_t t = trace_begin();
+        while (!ra->ready && !ra->eof && !ra->error)
+            pthread_cond_wait(&ra->cond, &ra->lock);
+        trace_end("wait read-ahead", t, NULL);
+    }
+    long long got = 0;
+    if (ra->ready) {
+        ra->ready--;
+        ra->held = 1;
+        *data = ra->bufs[ra->first];
+        got = (long long)ra->lens[ra->first];
+    } else if (ra->error) {
+        got = -1;
+    }
+    pthread_mutex_unlock(&ra->lock);
+    return got;
+}
+
+void readahead_stop(ReadAhead *ra) {
+    if (ra->threaded) {
+        pthread_mutex_lock(&ra->lock);
+        ra->stop = 1;
+        pthread_cond_broadcast(&ra->cond);
+        pthread_mutex_unlock(&ra->lock);
+        pthread_join(ra->thread, NULL);
+        pthread_mutex_destroy(&ra->lock);
+        pthread_cond_destroy(&ra->cond);
+        ra->threaded = 0;
+    }
+    scratch_free(ra->block);
+    scratch_free(ra->lens);
+    scratch_free(ra->bufs);
+    ra->block = NULL;
+    ra->lens = NULL;
+    ra->bufs = NULL;
 }
 
 // Updated find_all_jpegs with size_t
-int find_all_jpegs(FILE *file, JpegInfo **jpegs, int *count) {
-    const size_t BUFFER_SIZE = 4096;
-    unsigned char buffer[BUFFER_SIZE];
+int find_all_jpegs_serial(RangeReader *rd, JpegInfo **jpegs, int *count) {
+    const unsigned char *buffer;
     size_t bytes_read;
+    long long got;
     size_t file_pos = 0;
     int capacity = 10;
     *count = 0;
-    *jpegs = malloc(capacity * sizeof(JpegInfo));
+    *jpegs = scratch_alloc(capacity * sizeof(JpegInfo));
     if (!*jpegs) {
         perror("Failed to allocate memory for JPEG array");
         return -1;
     }
+    ReadAhead ra;
+    if (readahead_start(&ra, rd, 0, UINT64_MAX) != 0) {
+        scratch_free(*jpegs);
+        *jpegs = NULL;
+        return -1;
+    }
     size_t start = (size_t)-1;
     unsigned char last_byte = 0;
     int has_last_byte = 0;
-    rewind(file);
-    while ((bytes_read = fread(buffer, 1, BUFFER_SIZE, file)) > 0) {
+    while ((got = readahead_next(&ra, &buffer)) > 0) {
+        bytes_read = (size_t)got;
         if (has_last_byte && bytes_read > 0) {
             if (last_byte == 0xFF && buffer[0] == 0xD8)
                 start = file_pos - 1;
             if (start != (size_t)-1 && last_byte == 0xFF && buffer[0] == 0xD9) {
+                if (limit_previews(*count + 1) != 0) {
+                    readahead_stop(&ra);
+                    scratch_free(*jpegs);
+                    *jpegs = NULL;
+                    *count = 0;
+                    return -1;
+                }
                 if (*count >= capacity) {
                     capacity *= 2;
-                    JpegInfo *temp = realloc(*jpegs, capacity * sizeof(JpegInfo));
+                    JpegInfo *temp = scratch_realloc(*jpegs, capacity * sizeof(JpegInfo));
                     if (!temp) {
                         perror("Failed to realloc JPEG array");
-                        free(*jpegs);
+                        readahead_stop(&ra);
+                        scratch_free(*jpegs);
                         return -1;
                     }
                     *jpegs = temp;
                 }
+                memset(&(*jpegs)[*count], 0, sizeof(JpegInfo));
                 (*jpegs)[*count].start = start;
                 (*jpegs)[*count].end = file_pos + 1;
                 (*jpegs)[*count].size = (*jpegs)[*count].end - (*jpegs)[*count].start;
@@ -101,16 +1582,25 @@ int find_all_jpegs(FILE *file, JpegInfo **jpegs, int *count) {
             if (buffer[i] == 0xFF && buffer[i + 1] == 0xD8)
                 start = file_pos + i;
             if (start != (size_t)-1 && buffer[i] == 0xFF && buffer[i + 1] == 0xD9) {
+                if (limit_previews(*count + 1) != 0) {
+                    readahead_stop(&ra);
+                    scratch_free(*jpegs);
+                    *jpegs = NULL;
+                    *count = 0;
+                    return -1;
+                }
                 if (*count >= capacity) {
                     capacity *= 2;
-                    JpegInfo *temp = realloc(*jpegs, capacity * sizeof(JpegInfo));
+                    JpegInfo *temp = scratch_realloc(*jpegs, capacity * sizeof(JpegInfo));
                     if (!temp) {
                         perror("Failed to realloc JPEG array");
-                        free(*jpegs);
+                        readahead_stop(&ra);
+                        scratch_free(*jpegs);
                         return -1;
                     }
                     *jpegs = temp;
                 }
+                memset(&(*jpegs)[*count], 0, sizeof(JpegInfo));
                 (*jpegs)[*count].start = start;
                 (*jpegs)[*count].end = file_pos + i + 2;
                 (*jpegs)[*count].size = (*jpegs)[*count].end - (*jpegs)[*count].start;
@@ -126,76 +1616,958 @@ int find_all_jpegs(FILE *file, JpegInfo **jpegs, int *count) {
         }
         file_pos += bytes_read;
     }
-    if (ferror(file)) {
-        perror("Error reading input file during JPEG search");
-        free(*jpegs);
+    readahead_stop(&ra);
+    if (got < 0) {
+        if (budget_check(rd->budget) == 0)
+            fprintf(stderr, "Error reading input file during JPEG search\n");
+        scratch_free(*jpegs);
         *jpegs = NULL;
         *count = 0;
         return -1;
     }
-    rewind(file);
     return 0;
 }
 
-// Endian Helpers (unchanged)
-uint16_t read16le(const unsigned char *data, size_t offset, size_t dataSize) {
-    if (offset + 1 >= dataSize) return 0;
-    return (uint16_t)data[offset] | ((uint16_t)data[offset + 1] << 8);
-}
+// ----- Parallel scan -----
+// The file is cut into SCAN_CHUNK_SIZE chunks that --scan-threads workers claim in
+// turn. Each chunk is summarized so the chunks can be merged in file order into
+// exactly the list find_all_jpegs_serial() builds: an EOI before the chunk's first
+// SOI may close a JPEG opened in an earlier chunk, and everything from the first SOI
+// on pairs up locally. One byte past the chunk end is read so a marker split across
+// the boundary is seen by the chunk holding its 0xFF.
 
-uint32_t read32le(const unsigned char *data, size_t offset, size_t dataSize) {
-    if (offset + 3 >= dataSize) return 0;
-    return ((uint32_t)data[offset]) | ((uint32_t)data[offset + 1] << 8) |
-           ((uint32_t)data[offset + 2] << 16) | ((uint32_t)data[offset + 3] << 24);
+int scan_chunk_push(ScanChunk *c, uint64_t start, uint64_t end) {
+    if (g_max_previews && c->count >= g_max_previews) {
+        c->too_many = 1;
+        return -1;
+    }
+    if (c->count >= c->capacity) {
+        int new_cap = c->capacity ? c->capacity * 2 : 16;
+        JpegInfo *temp = realloc(c->pairs, new_cap * sizeof(JpegInfo));
+        if (!temp) return -1;
+        c->pairs = temp;
+        c->capacity = new_cap;
+    }
+    JpegInfo *j = &c->pairs[c->count++];
+    memset(j, 0, sizeof(*j));
+    j->start = start;
+    j->end = end;
+    j->size = end - start;
+    return 0;
 }
 
-// findBox_streaming (unchanged)
-int findBox_streaming(FILE *f, size_t start, size_t end, const char *target,
-                      unsigned char **result, size_t *resultSize) {
-    size_t pos = start;
-    while (pos + 8 <= end) {
-        if (fseek(f, pos, SEEK_SET) != 0) {
-            fprintf(stderr, "fseek failed at pos %zu\n", pos);
-            return 0;
+// scan_chunk: SOI/EOI events of the chunk at base, whose bytes are buf[0, len) plus
+// an optional look-ahead byte at buf[len] when avail > len
+int scan_chunk(ScanChunk *c, const unsigned char *buf, size_t len, size_t avail, uint64_t base) {
+    int64_t open = -1;
+    c->first_eoi = -1;
+    c->has_soi = 0;
+    const unsigned char *p = buf, *end = buf + len;
+    while ((p = memchr(p, 0xFF, end - p)) != NULL) {
+        size_t off = p - buf;
+        p++;
+        if (off + 1 >= avail) break;
+        if (buf[off + 1] == 0xD8) {
+            c->has_soi = 1;
+            open = base + off;
+        } else if (buf[off + 1] == 0xD9) {
+            if (!c->has_soi) {
+                if (c->first_eoi < 0) c->first_eoi = base + off;
+            } else if (open != -1) {
+                if (scan_chunk_push(c, open, base + off + 2) != 0) return -1;
+                open = -1;
+            }
         }
-        unsigned char header[16];
-        if (fread(header, 1, 8, f) != 8) break;
-        uint32_t size32 = (header[0] << 24) | (header[1] << 16) | (header[2] << 8) | header[3];
-        char boxType[5];
-        memcpy(boxType, header + 4, 4);
-        boxType[4] = '\0';
-        uint64_t boxSize = size32;
-        size_t headerSize = 8;
-        if (size32 == 1) {
-            if (fread(header + 8, 1, 8, f) != 8) break;
-            headerSize = 16;
+    }
+    c->open_start = open;
+    return 0;
+}
+
+void *scan_worker(void *arg) {
+    ParallelScan *ps = (ParallelScan *)arg;
+    unsigned char *buf = malloc(SCAN_CHUNK_SIZE + 1);
+    trace_thread_begin("scan");
+    for (;;) {
+        pthread_mutex_lock(&ps->lock);
+        int idx = ps->next++;
+        pthread_mutex_unlock(&ps->lock);
+        if (idx >= ps->chunk_count) break;
+        ScanChunk *c = &ps->chunks[idx];
+        uint64_t base = (uint64_t)idx * SCAN_CHUNK_SIZE;
+        size_t len = ps->size - base < SCAN_CHUNK_SIZE ? (size_t)(ps->size - base) : SCAN_CHUNK_SIZE;
+        size_t want = base + len < ps->size ? len + 1 : len;
+        uint64_t t = trace_begin();
+        long long got = buf && budget_check(ps->rd->budget) == 0 ? ps->rd->fetch(ps->rd, base, buf, want, want) : -1;
+        trace_end("read", t, NULL);
+        if (got > 0 && budget_read(ps->rd->budget, (uint64_t)got) != 0)
+            got = -1;
+        t = trace_begin();
+        if (got < (long long)len || scan_chunk(c, buf, len, (size_t)got, base) != 0)
+            c->failed = 1;
+        trace_end("scan chunk", t, NULL);
+    }
+    trace_thread_end();
+    free(buf);
+    return NULL;
+}
+
+// find_all_jpegs_parallel: same result as find_all_jpegs_serial() using `threads` workers
+int find_all_jpegs_parallel(RangeReader *rd, JpegInfo **jpegs, int *count, int threads) {
+    ParallelScan ps;
+    memset(&ps, 0, sizeof(ps));
+    ps.rd = rd;
+    ps.size = rd->size;
+    ps.chunk_count = (int)((ps.size + SCAN_CHUNK_SIZE - 1) / SCAN_CHUNK_SIZE);
+    ps.chunks = scratch_calloc(ps.chunk_count, sizeof(ScanChunk));
+    pthread_t *tids = scratch_alloc(threads * sizeof(pthread_t));
+    *jpegs = NULL;
+    *count = 0;
+    if (!ps.chunks || !tids) {
+        fprintf(stderr, "Memory allocation failed for parallel scan\n");
+        scratch_free(tids);
+        scratch_free(ps.chunks);
+        return -1;
+    }
+    pthread_mutex_init(&ps.lock, NULL);
+    int started = 0;
+    while (started < threads && started < ps.chunk_count &&
+           pthread_create(&tids[started], NULL, scan_worker, &ps) == 0)
+        started++;
+    if (started == 0)
+        scan_worker(&ps);   // no threads available: scan on the caller's thread
+    for (int i = 0; i < started; i++)
+        pthread_join(tids[i], NULL);
+    pthread_mutex_destroy(&ps.lock);
+
+    int total = 0, failed = 0, too_many = 0;
+    for (int i = 0; i < ps.chunk_count; i++) {
+        total += ps.chunks[i].count + 1;
+        failed |= ps.chunks[i].failed;
+        too_many |= ps.chunks[i].too_many;
+    }
+    if (too_many) {
+        limit_previews(g_max_previews + 1);
+    } else if (failed && budget_check(rd->budget) == 0) {
+        fprintf(stderr, "Error reading input file during JPEG search\n");
+    }
+    *jpegs = failed ? NULL : scratch_alloc((total ? total : 1) * sizeof(JpegInfo));
+    if (!failed && !*jpegs)
+        fprintf(stderr, "Failed to allocate memory for JPEG array\n");
+    int64_t carry = -1;
+    for (int i = 0; i < ps.chunk_count && *jpegs; i++) {
+        ScanChunk *c = &ps.chunks[i];
+        if (carry != -1 && c->first_eoi >= 0) {
+            JpegInfo *j = &(*jpegs)[(*count)++];
+            memset(j, 0, sizeof(*j));
+            j->start = carry;
+            j->end = c->first_eoi + 2;
+            j->size = j->end - j->start;
+            carry = -1;
+        }
+        if (c->has_soi) {
+            memcpy(*jpegs + *count, c->pairs, c->count * sizeof(JpegInfo));
+            *count += c->count;
+            carry = c->open_start;
+        }
+    }
+    for (int i = 0; i < ps.chunk_count; i++)
+        free(ps.chunks[i].pairs);
+    scratch_free(tids);
+    scratch_free(ps.chunks);
+    if (*jpegs && limit_previews(*count) != 0) {
+        scratch_free(*jpegs);
+        *jpegs = NULL;
+        *count = 0;
+    }
+    return *jpegs ? 0 : -1;
+}
+
+// find_all_jpegs: parallel scan for large local inputs with --scan-threads, otherwise serial
+int find_all_jpegs(RangeReader *rd, JpegInfo **jpegs, int *count) {
+    if (g_walk)
+        return find_all_jpegs_walked(rd, jpegs, count);
+    if (g_scan_threads > 1 && rd->concurrent && rd->size != UINT64_MAX && rd->size >= 2 * (uint64_t)SCAN_CHUNK_SIZE)
+        return find_all_jpegs_parallel(rd, jpegs, count, g_scan_threads);
+    return find_all_jpegs_serial(rd, jpegs, count);
+}
+
+double monotonic_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// run_scan_benchmark: --bench-scan; times the serial and the parallel scan of each
+// input (best of three, after a warm-up pass) and checks that they agree
+int run_scan_benchmark(char **inputs, int input_count) {
+    int threads = g_scan_threads > 1 ? g_scan_threads : 4, mismatches = 0;
+    for (int f = 0; f < input_count; f++) {
+        RangeReader *rd = reader_open(inputs[f], 0);
+        if (!rd) return 1;
+        if (!rd->concurrent || rd->size == UINT64_MAX) {
+            fprintf(stderr, "%s: parallel scan needs a local, complete file\n", inputs[f]);
+            reader_close(rd);
+            return 1;
+        }
+        double best[2] = { 1e30, 1e30 };
+        JpegInfo *result[2] = { NULL, NULL };
+        int counts[2] = { 0, 0 };
+        for (int round = 0; round < 4; round++) {
+            for (int k = 0; k < 2; k++) {
+                JpegInfo *jpegs = NULL;
+                int count = 0;
+                double t0 = monotonic_seconds();
+                int rc = k == 0 ? find_all_jpegs_serial(rd, &jpegs, &count)
+                                : find_all_jpegs_parallel(rd, &jpegs, &count, threads);
+                double t = monotonic_seconds() - t0;
+                if (rc != 0) {
+                    reader_close(rd);
+                    return 1;
+                }
+                if (round > 0 && t < best[k]) best[k] = t;   // round 0 warms the page cache
+                scratch_free(result[k]);
+                result[k] = jpegs;
+                counts[k] = count;
+            }
+        }
+        int same = counts[0] == counts[1] &&
+                   (counts[0] == 0 || memcmp(result[0], result[1], counts[0] * sizeof(JpegInfo)) == 0);
+        double mb = rd->size / 1e6;
+        printf("%s: %.1f MB, %d JPEGs; serial %.1f ms (%.0f MB/s), %d threads %.1f ms (%.0f MB/s, %.2fx); %s\n",
+               inputs[f], mb, counts[0], best[0] * 1e3, mb / best[0], threads, best[1] * 1e3, mb / best[1],
+               best[0] / best[1], same ? "identical" : "RESULTS DIFFER");
+        mismatches += !same;
+        scratch_free(result[0]);
+        scratch_free(result[1]);
+        reader_close(rd);
+    }
+    return mismatches ? 1 : 0;
+}
+
+// Endian Helpers (unchanged)
+uint16_t read16le(const unsigned char *data, size_t offset, size_t dataSize) {
+    if (offset + 1 >= dataSize) return 0;
+    return (uint16_t)data[offset] | ((uint16_t)data[offset + 1] << 8);
+}
+
+uint32_t read32le(const unsigned char *data, size_t offset, size_t dataSize) {
+    if (offset + 3 >= dataSize) return 0;
+    return ((uint32_t)data[offset]) | ((uint32_t)data[offset + 1] << 8) |
+           ((uint32_t)data[offset + 2] << 16) | ((uint32_t)data[offset + 3] << 24);
+}
+
+uint16_t read16be(const unsigned char *data, size_t offset, size_t dataSize) {
+    if (offset + 1 >= dataSize) return 0;
+    return (uint16_t)((data[offset] << 8) | data[offset + 1]);
+}
+
+uint32_t read32be(const unsigned char *data, size_t offset, size_t dataSize) {
+    if (offset + 3 >= dataSize) return 0;
+    return ((uint32_t)data[offset] << 24) | ((uint32_t)data[offset + 1] << 16) |
+           ((uint32_t)data[offset + 2] << 8) | (uint32_t)data[offset + 3];
+}
+
+uint64_t read64be(const unsigned char *data, size_t offset, size_t dataSize) {
+    if (offset + 7 >= dataSize) return 0;
+    return ((uint64_t)read32be(data, offset, dataSize) << 32) | read32be(data, offset + 4, dataSize);
+}
+
+int64_t monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void sleep_ms(int ms) {
+#ifdef _WIN32
+    Sleep(ms);
+#else
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+    nanosleep(&ts, NULL);
+#endif
+}
+
+// follow_wait: in --follow mode, blocks until the file holds at least `end` bytes.
+// Returns 0 if it stops growing for --follow-timeout first. Always 1 without --follow.
+int follow_wait(int fd, uint64_t end) {
+    if (!g_follow) return 1;
+    uint64_t last_size = 0;
+    int64_t idle_since = monotonic_ms();
+    for (;;) {
+        struct stat st;
+        if (fstat(fd, &st) != 0) return 0;
+        if ((uint64_t)st.st_size >= end) return 1;
+        int64_t now = monotonic_ms();
+        if ((uint64_t)st.st_size != last_size) {
+            last_size = (uint64_t)st.st_size;
+            idle_since = now;
+        } else if (now - idle_since >= g_follow_timeout_ms) {
+            fprintf(stderr, "Timed out waiting for the file to reach %llu bytes (stuck at %llu).\n",
+                    (unsigned long long)end, (unsigned long long)last_size);
+            return 0;
+        }
+        sleep_ms(10);
+    }
+}
+
+// ----- Range readers -----
+
+long long reader_fetch(RangeReader *r, uint64_t offset, void *buf, size_t len, size_t min_len) {
+    if (budget_check(r->budget) != 0)
+        return -1;
+    uint64_t t = trace_begin();
+    long long got = r->fetch(r, offset, buf, len, min_len);
+    trace_end("read", t, NULL);
+    r->fetches++;
+    if (got > 0) r->bytes_fetched += (uint64_t)got;
+    if (got > 0 && budget_read(r->budget, (uint64_t)got) != 0)
+        return -1;
+    return got;
+}
+
+int cache_find(RangeReader *r, uint64_t block) {
+    for (int i = 0; i < RR_CACHE_BLOCKS; i++) {
+        if (r->block_len[i] && r->block_index[i] == block)
+            return i;
+    }
+    return -1;
+}
+
+// cache_fill: fetches blocks [first, first + count) with one backend call. Only the
+// first `need` bytes have to be present, so a followed file is not waited on for
+// bytes beyond the request.
+int cache_fill(RangeReader *r, uint64_t first, int count, size_t need) {
+    unsigned char *scratch = r->cache + RR_CACHE_BLOCKS * RR_BLOCK_SIZE;
+    size_t len = (size_t)count * RR_BLOCK_SIZE;
+    long long got = reader_fetch(r, first * RR_BLOCK_SIZE, scratch, len, need < len ? need : len);
+    if (got < 0) return -1;
+    for (int k = 0; k < count && (size_t)got > (size_t)k * RR_BLOCK_SIZE; k++) {
+        size_t off = (size_t)k * RR_BLOCK_SIZE;
+        size_t n = (size_t)got - off < RR_BLOCK_SIZE ? (size_t)got - off : RR_BLOCK_SIZE;
+        int slot = cache_find(r, first + k);
+        if (slot < 0) {
+            slot = 0;
+            for (int i = 1; i < RR_CACHE_BLOCKS; i++) {
+                if (r->block_used[i] < r->block_used[slot]) slot = i;
+            }
+        }
+        memcpy(r->cache + (size_t)slot * RR_BLOCK_SIZE, scratch + off, n);
+        r->block_index[slot] = first + k;
+        r->block_len[slot] = n;
+        r->block_used[slot] = ++r->clock;
+    }
+    return 0;
+}
+
+// reader_read: reads up to len bytes at offset; returns the count (short only at the
+// end of the data) or -1 on error. Reads of RR_MAX_RUN blocks or more bypass the cache.
+long long reader_read(RangeReader *r, uint64_t offset, void *buf, size_t len) {
+    if (offset >= r->size || len == 0) return 0;
+    if (len > r->size - offset) len = (size_t)(r->size - offset);
+    if (len >= (size_t)RR_MAX_RUN * RR_BLOCK_SIZE)
+        return reader_fetch(r, offset, buf, len, len);
+    unsigned char *out = (unsigned char *)buf;
+    size_t done = 0;
+    while (done < len) {
+        uint64_t pos = offset + done, block = pos / RR_BLOCK_SIZE;
+        size_t in_block = (size_t)(pos % RR_BLOCK_SIZE);
+        size_t want = len - done < RR_BLOCK_SIZE - in_block ? len - done : RR_BLOCK_SIZE - in_block;
+        int slot = cache_find(r, block);
+        if (slot < 0 || r->block_len[slot] < in_block + want) {
+            // Miss, or a short block that may have grown: fetch it together with the
+            // following blocks this request needs that are not cached either
+            uint64_t last = (offset + len - 1) / RR_BLOCK_SIZE;
+            int count = 1;
+            while (block + count <= last && count < RR_MAX_RUN && cache_find(r, block + count) < 0)
+                count++;
+            r->cache_misses++;
+            if (cache_fill(r, block, count, (size_t)(offset + len - block * RR_BLOCK_SIZE)) != 0)
+                return done ? (long long)done : -1;
+            slot = cache_find(r, block);
+            if (slot < 0 || r->block_len[slot] <= in_block) break;
+            if (r->block_len[slot] < in_block + want) {
+                memcpy(out + done, r->cache + (size_t)slot * RR_BLOCK_SIZE + in_block, r->block_len[slot] - in_block);
+                done += r->block_len[slot] - in_block;
+                break;   // end of the data
+            }
+        } else {
+            r->cache_hits++;
+        }
+        memcpy(out + done, r->cache + (size_t)slot * RR_BLOCK_SIZE + in_block, want);
+        r->block_used[slot] = ++r->clock;
+        done += want;
+    }
+    return (long long)done;
+}
+
+int reader_read_full(RangeReader *r, uint64_t offset, void *buf, size_t len) {
+    return reader_read(r, offset, buf, len) == (long long)len;
+}
+
+RangeReader *reader_new(void) {
+    RangeReader *r = scratch_calloc(1, sizeof(RangeReader));
+    if (!r) return NULL;
+    r->cache = scratch_alloc((size_t)(RR_CACHE_BLOCKS + RR_MAX_RUN) * RR_BLOCK_SIZE);
+    if (!r->cache) {
+        scratch_free(r);
+        return NULL;
+    }
+    r->size = UINT64_MAX;
+    r->budget = g_budget;
+    return r;
+}
+
+void reader_close(RangeReader *r) {
+    if (!r) return;
+    if (r->verbose && r->remote)
+        fprintf(stderr, "Fetched %llu of %llu bytes in %llu requests (cache: %llu hits, %llu misses)\n",
+                (unsigned long long)r->bytes_fetched, (unsigned long long)r->size,
+                (unsigned long long)r->fetches, (unsigned long long)r->cache_hits,
+                (unsigned long long)r->cache_misses);
+    if (r->fetch != memory_fetch) {     // in-memory previews were counted when read
+        metrics_add(METRIC_BYTES_READ, r->bytes_fetched);
+        metrics_add(METRIC_BACKEND_READS, r->fetches);
+    }
+    metrics_add(METRIC_CACHE_HITS, r->cache_hits);
+    metrics_add(METRIC_CACHE_MISSES, r->cache_misses);
+    if (r->close) r->close(r);
+    scratch_free(r->cache);
+    scratch_free(r);
+}
+
+// Local file backend: positioned reads, waiting for a growing file in --follow mode.
+// After one --follow timeout the file is treated as complete.
+typedef struct {
+    int fd;
+    int stopped_growing;
+    unsigned char *bounce;      // DIRECT_ALIGN-aligned buffer when opened with O_DIRECT
+    unsigned char *bounce_mem;
+    uint64_t size;              // file size at open, for the --bulk residency check
+    uint64_t cached_bytes;      // read through the page cache
+    uint64_t direct_bytes;      // read with O_DIRECT
+} FileSource;
+
+// ----- Bulk mode -----
+// --bulk keeps archive-wide runs from evicting other services' page cache: only the
+// box-indexed ranges are read, kernel read-ahead is disabled, and inputs and outputs
+// are dropped from the cache (POSIX_FADV_DONTNEED) when done. --direct additionally
+// reads inputs with O_DIRECT where the file system supports it.
+
+// bulk_prepare_input: switches a freshly opened file to O_DIRECT (--direct) and tells
+// the kernel not to read ahead of the requested ranges
+void bulk_prepare_input(RangeReader *r, FileSource *fs, const char *path) {
+#if defined(O_DIRECT) && !defined(_WIN32)
+    if (g_direct) {
+        int dfd = open(path, O_RDONLY | O_DIRECT);
+        fs->bounce_mem = dfd >= 0 ? scratch_alloc(DIRECT_BOUNCE_SIZE + DIRECT_ALIGN) : NULL;
+        if (fs->bounce_mem) {
+            close(fs->fd);
+            fs->fd = dfd;
+            fs->bounce = (unsigned char *)(((uintptr_t)fs->bounce_mem + DIRECT_ALIGN - 1) & ~(uintptr_t)(DIRECT_ALIGN - 1));
+            r->concurrent = 0;   // one bounce buffer per reader
+        } else {
+            if (dfd >= 0) close(dfd);
+            if (r->verbose) fprintf(stderr, "O_DIRECT not available for %s, using buffered reads\n", path);
+        }
+    }
+#else
+    (void)path;
+    (void)r;
+#endif
+#ifdef POSIX_FADV_RANDOM
+    posix_fadvise(fs->fd, 0, 0, POSIX_FADV_RANDOM);
+#else
+    (void)fs;
+#endif
+}
+
+// resident_bytes: how much of the file is in the page cache (Linux), or 0 if unknown
+uint64_t resident_bytes(int fd, uint64_t size) {
+    uint64_t resident = 0;
+#ifdef __linux__
+    if (size == 0 || size > SIZE_MAX) return 0;
+    void *map = mmap(NULL, (size_t)size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) return 0;
+    long page = sysconf(_SC_PAGESIZE);
+    size_t pages = (size_t)((size + page - 1) / page);
+    unsigned char vec[4096];
+    for (size_t first = 0; first < pages; first += sizeof(vec)) {
+        size_t n = pages - first < sizeof(vec) ? pages - first : sizeof(vec);
+        size_t bytes = n * page;
+        if ((uint64_t)first * page + bytes > size) bytes = (size_t)(size - (uint64_t)first * page);
+        if (mincore((unsigned char *)map + first * page, bytes, vec) != 0) break;
+        for (size_t i = 0; i < n; i++)
+            resident += (vec[i] & 1) ? (uint64_t)page : 0;
+    }
+    munmap(map, (size_t)size);
+#else
+    (void)fd;
+    (void)size;
+#endif
+    return resident;
+}
+
+// bulk_release_input: drops a finished input from the page cache and folds its
+// I/O counters into the run totals
+void bulk_release_input(int fd, uint64_t size, uint64_t cached_bytes, uint64_t direct_bytes) {
+#ifdef POSIX_FADV_DONTNEED
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+    uint64_t left = resident_bytes(fd, size);
+    pthread_mutex_lock(&g_bulk_lock);
+    g_bulk_totals.inputs++;
+    g_bulk_totals.cached_read += cached_bytes;
+    g_bulk_totals.direct_read += direct_bytes;
+    g_bulk_totals.input_bytes += size;
+    g_bulk_totals.still_cached += left;
+    pthread_mutex_unlock(&g_bulk_lock);
+}
+
+// bulk_release_output: writes a finished output (already flushed to fd) back and
+// drops it from the page cache (dirty pages cannot be dropped, hence the fdatasync)
+void bulk_release_output(int fd, size_t size) {
+#ifndef _WIN32
+    if (fdatasync(fd) == 0) {
+#ifdef POSIX_FADV_DONTNEED
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+    }
+#else
+    (void)fd;
+#endif
+    pthread_mutex_lock(&g_bulk_lock);
+    g_bulk_totals.written += size;
+    pthread_mutex_unlock(&g_bulk_lock);
+}
+
+void report_bulk_stats(void) {
+    BulkStats *t = &g_bulk_totals;
+    if (!g_bulk || t->inputs == 0) return;
+    fprintf(stderr, "Bulk I/O: %llu inputs (%.1f MB), read %.1f MB through the page cache and %.1f MB with O_DIRECT, "
+            "wrote %.1f MB; %.1f MB of the inputs still cached after DONTNEED\n",
+            (unsigned long long)t->inputs, t->input_bytes / 1e6, t->cached_read / 1e6, t->direct_read / 1e6,
+            t->written / 1e6, t->still_cached / 1e6);
+}
+
+// direct_fetch: O_DIRECT needs aligned offsets, lengths and buffers, so whole aligned
+// blocks are read into the bounce buffer and the requested bytes copied out
+long long direct_fetch(FileSource *fs, uint64_t offset, unsigned char *buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        uint64_t pos = offset + done, aligned = pos & ~(uint64_t)(DIRECT_ALIGN - 1);
+        size_t skip = (size_t)(pos - aligned);
+        size_t want = (skip + len - done + DIRECT_ALIGN - 1) & ~(size_t)(DIRECT_ALIGN - 1);
+        if (want > DIRECT_BOUNCE_SIZE) want = DIRECT_BOUNCE_SIZE;
+        ssize_t n = pread(fs->fd, fs->bounce, want, (off_t)aligned);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if ((size_t)n <= skip) break;
+        size_t take = (size_t)n - skip < len - done ? (size_t)n - skip : len - done;
+        memcpy(buf + done, fs->bounce + skip, take);
+        done += take;
+        fs->direct_bytes += (size_t)n;
+        if ((size_t)n < want) break;   // end of file
+    }
+    return (long long)done;
+}
+
+long long file_fetch(RangeReader *r, uint64_t offset, void *buf, size_t len, size_t min_len) {
+    FileSource *fs = (FileSource *)r->source;
+    int fd = fs->fd;
+    if (!fs->stopped_growing && !follow_wait(fd, offset + min_len))
+        fs->stopped_growing = 1;   // return whatever is there
+#ifndef _WIN32
+    if (fs->bounce)
+        return direct_fetch(fs, offset, (unsigned char *)buf, len);
+#endif
+    size_t done = 0;
+    while (done < len) {
+#ifdef _WIN32
+        if (_lseeki64(fd, (long long)(offset + done), SEEK_SET) < 0) return -1;
+        int n = _read(fd, (char *)buf + done, (unsigned)(len - done > 0x40000000 ? 0x40000000 : len - done));
+#else
+        ssize_t n = pread(fd, (char *)buf + done, len - done, (off_t)(offset + done));
+#endif
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0) break;
+        done += (size_t)n;
+    }
+    fs->cached_bytes += done;
+    return (long long)done;
+}
+
+void file_close(RangeReader *r) {
+    FileSource *fs = (FileSource *)r->source;
+    if (g_bulk)
+        bulk_release_input(fs->fd, fs->size, fs->cached_bytes, fs->direct_bytes);
+    close(fs->fd);
+    scratch_free(fs->bounce_mem);
+    scratch_free(fs);
+}
+
+// Memory backend: also used for inputs that cannot seek, such as pipes
+typedef struct {
+    unsigned char *data;
+    int owned;
+} MemorySource;
+
+long long memory_fetch(RangeReader *r, uint64_t offset, void *buf, size_t len, size_t min_len) {
+    (void)min_len;
+    MemorySource *m = (MemorySource *)r->source;
+    if (offset >= r->size) return 0;
+    if (len > r->size - offset) len = (size_t)(r->size - offset);
+    memcpy(buf, m->data + offset, len);
+    return (long long)len;
+}
+
+void memory_close(RangeReader *r) {
+    MemorySource *m = (MemorySource *)r->source;
+    if (m->owned) free(m->data);   // slurped inputs live on the heap
+    scratch_free(m);
+}
+
+RangeReader *reader_open_memory(unsigned char *data, size_t size, int owned) {
+    RangeReader *r = reader_new();
+    MemorySource *m = scratch_alloc(sizeof(MemorySource));
+    if (!r || !m) {
+        scratch_free(m);
+        if (r) reader_close(r);
+        fprintf(stderr, "Memory allocation failed for memory reader\n");
+        return NULL;
+    }
+    m->data = data;
+    m->owned = owned;
+    r->source = m;
+    r->size = size;
+    r->fetch = memory_fetch;
+    r->close = memory_close;
+    r->concurrent = 1;
+    return r;
+}
+
+#ifndef _WIN32
+// HTTP backend: one Range GET per fetch over a kept-alive connection. Only plain
+// http:// is supported; put a local TLS-terminating proxy in front of https stores.
+typedef struct {
+    char host[256];
+    char port[8];
+    char *path;
+    int fd;
+} HttpSource;
+
+int http_connect(HttpSource *h) {
+    struct addrinfo hints, *res, *ai;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int rc = getaddrinfo(h->host, h->port, &hints, &res);
+    if (rc != 0) {
+        fprintf(stderr, "Cannot resolve %s: %s\n", h->host, gai_strerror(rc));
+        return -1;
+    }
+    h->fd = -1;
+    for (ai = res; ai && h->fd < 0; ai = ai->ai_next) {
+        int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0) continue;
+        struct timeval tv = { 30, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) h->fd = fd;
+        else close(fd);
+    }
+    freeaddrinfo(res);
+    if (h->fd < 0) fprintf(stderr, "Cannot connect to %s:%s\n", h->host, h->port);
+    return h->fd < 0 ? -1 : 0;
+}
+
+void http_disconnect(HttpSource *h) {
+    if (h->fd >= 0) close(h->fd);
+    h->fd = -1;
+}
+
+// http_header_value: value of a response header (case-insensitive name), or NULL
+const char *http_header_value(const char *head, const char *name) {
+    size_t n = strlen(name);
+    for (const char *line = strstr(head, "\r\n"); line; line = strstr(line + 2, "\r\n")) {
+        const char *p = line + 2, *q = name;
+        size_t k = 0;
+        while (k < n && p[k] && (p[k] | 0x20) == (q[k] | 0x20)) k++;
+        if (k == n && p[n] == ':') {
+            p += n + 1;
+            while (*p == ' ') p++;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+long long http_fetch(RangeReader *r, uint64_t offset, void *buf, size_t len, size_t min_len) {
+    (void)min_len;
+    HttpSource *h = (HttpSource *)r->source;
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (h->fd < 0 && http_connect(h) != 0) return -1;
+        char request[2048];
+        int rlen = snprintf(request, sizeof(request),
+                            "GET %s HTTP/1.1\r\nHost: %s:%s\r\nRange: bytes=%llu-%llu\r\n"
+                            "User-Agent: cr3extract\r\nConnection: keep-alive\r\n\r\n",
+                            h->path, h->host, h->port, (unsigned long long)offset,
+                            (unsigned long long)(offset + len - 1));
+        if (rlen <= 0 || (size_t)rlen >= sizeof(request)) {
+            fprintf(stderr, "URL path too long\n");
+            return -1;
+        }
+        if (send(h->fd, request, rlen, MSG_NOSIGNAL) != rlen) {
+            http_disconnect(h);   // stale keep-alive connection: reconnect once
+            continue;
+        }
+        char head[8192];
+        size_t hlen = 0;
+        char *body = NULL;
+        while (!body) {
+            ssize_t n = recv(h->fd, head + hlen, sizeof(head) - 1 - hlen, 0);
+            if (n <= 0) break;
+            hlen += (size_t)n;
+            head[hlen] = '\0';
+            body = strstr(head, "\r\n\r\n");
+            if (!body && hlen == sizeof(head) - 1) break;
+        }
+        if (!body) {
+            http_disconnect(h);
+            if (hlen == 0 && attempt == 0) continue;
+            fprintf(stderr, "Malformed or missing HTTP response from %s\n", h->host);
+            return -1;
+        }
+        body[2] = '\0';   // terminate the header block after its last line
+        body += 4;
+        size_t have = hlen - (size_t)(body - head);
+        int status = 0;
+        sscanf(head, "HTTP/%*d.%*d %d", &status);
+        const char *v;
+        long long content_length = (v = http_header_value(head, "Content-Length")) ? atoll(v) : -1;
+        int must_close = (v = http_header_value(head, "Connection")) && (v[0] | 0x20) == 'c';
+        if ((v = http_header_value(head, "Content-Range")) && (v = strchr(v, '/')) && v[1] != '*')
+            r->size = strtoull(v + 1, NULL, 10);
+        if (status == 416) {
+            http_disconnect(h);
+            return 0;
+        }
+        if (status == 200 && offset == 0 && content_length >= 0) {
+            r->size = (uint64_t)content_length;   // server ignores Range: take the head of the body
+        } else if (status != 206) {
+            fprintf(stderr, "HTTP request for %s failed (status %d%s)\n", h->path, status,
+                    status == 200 ? ", server does not support range requests" : "");
+            http_disconnect(h);
+            return -1;
+        }
+        if (content_length < 0) {
+            fprintf(stderr, "HTTP response without Content-Length is not supported\n");
+            http_disconnect(h);
+            return -1;
+        }
+        size_t want = (uint64_t)content_length < len ? (size_t)content_length : len;
+        size_t done = have < want ? have : want;
+        memcpy(buf, body, done);
+        while (done < want) {
+            ssize_t n = recv(h->fd, (char *)buf + done, want - done, 0);
+            if (n <= 0) {
+                http_disconnect(h);
+                fprintf(stderr, "HTTP connection to %s closed early\n", h->host);
+                return -1;
+            }
+            done += (size_t)n;
+        }
+        if (must_close || (uint64_t)content_length > want)
+            http_disconnect(h);   // do not drain a body larger than what was asked for
+        return (long long)done;
+    }
+    return -1;
+}
+
+void http_close(RangeReader *r) {
+    HttpSource *h = (HttpSource *)r->source;
+    http_disconnect(h);
+    scratch_free(h->path);
+    scratch_free(h);
+}
+
+RangeReader *http_reader_open(const char *url, int verbose) {
+    const char *p = url + 7;
+    size_t hostlen = strcspn(p, ":/?#");
+    HttpSource *h = scratch_calloc(1, sizeof(HttpSource));
+    RangeReader *r = reader_new();
+    int valid = hostlen > 0 && h && hostlen < sizeof(h->host);
+    if (valid) {
+        memcpy(h->host, p, hostlen);
+        p += hostlen;
+        snprintf(h->port, sizeof(h->port), "80");
+    }
+    if (valid && *p == ':') {
+        // An empty, non-numeric or out-of-range port is an error, not port 80
+        size_t portlen = strcspn(p + 1, "/?#");
+        valid = portlen > 0 && portlen < sizeof(h->port) && strspn(p + 1, "0123456789") >= portlen;
+        if (valid) {
+            memcpy(h->port, p + 1, portlen);
+            h->port[portlen] = '\0';
+            valid = atoi(h->port) >= 1 && atoi(h->port) <= 65535;
+        }
+        p += 1 + portlen;
+    }
+    if (!h || !r || !valid) {
+        fprintf(stderr, "Invalid URL or out of memory: %s\n", url);
+        scratch_free(h);
+        if (r) reader_close(r);
+        return NULL;
+    }
+    // The request target: the path and query, never the fragment
+    size_t pathlen = strcspn(p, "#");
+    h->path = scratch_alloc(pathlen + 2);
+    if (h->path) {
+        size_t slash = *p != '/';
+        h->path[0] = '/';
+        memcpy(h->path + slash, p, pathlen);
+        h->path[slash + pathlen] = '\0';
+    }
+    h->fd = -1;
+    r->source = h;
+    r->fetch = http_fetch;
+    r->close = http_close;
+    r->remote = 1;
+    r->verbose = verbose;
+    unsigned char probe;
+    if (!h->path || reader_read(r, 0, &probe, 1) != 1) {   // learns the size from Content-Range
+        fprintf(stderr, "Failed to open CR3 file: %s\n", url);
+        reader_close(r);
+        return NULL;
+    }
+    return r;
+}
+#endif
+
+// reader_open_backend: http:// URLs use the HTTP backend; regular files are read in
+// place; anything else (pipes, character devices) is read into memory first.
+RangeReader *reader_open_backend(const char *path, int verbose) {
+    if (strncmp(path, "http://", 7) == 0) {
+#ifndef _WIN32
+        return http_reader_open(path, verbose);
+#else
+        fprintf(stderr, "HTTP inputs are not supported on this platform.\n");
+        return NULL;
+#endif
+    }
+#ifdef _WIN32
+    int fd = open(path, O_RDONLY | O_BINARY);
+#else
+    int fd = open(path, O_RDONLY);
+#endif
+    if (fd < 0) {
+        perror("Failed to open CR3 file");
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && !S_ISREG(st.st_mode)) {
+        size_t cap = 1 << 20, len = 0;
+        unsigned char *data = malloc(cap);
+        for (;;) {
+            if (data && len == cap) {
+                unsigned char *temp = realloc(data, cap * 2);
+                if (!temp) {
+                    free(data);
+                    data = NULL;
+                } else {
+                    data = temp;
+                    cap *= 2;
+                }
+            }
+            if (!data) break;
+            ssize_t n = read(fd, data + len, cap - len);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            len += (size_t)n;
+        }
+        close(fd);
+        if (!data) {
+            fprintf(stderr, "Memory allocation failed while reading %s\n", path);
+            return NULL;
+        }
+        RangeReader *r = reader_open_memory(data, len, 1);
+        if (!r) free(data);
+        return r;
+    }
+    RangeReader *r = reader_new();
+    FileSource *source = scratch_calloc(1, sizeof(FileSource));
+    if (!r || !source) {
+        fprintf(stderr, "Memory allocation failed for file reader\n");
+        scratch_free(source);
+        if (r) reader_close(r);
+        close(fd);
+        return NULL;
+    }
+    source->fd = fd;
+    source->size = (uint64_t)st.st_size;
+    r->source = source;
+    r->fetch = file_fetch;
+    r->close = file_close;
+    r->verbose = verbose;
+    r->size = g_follow ? UINT64_MAX : (uint64_t)st.st_size;
+    r->concurrent = !g_follow;
+    if (g_bulk)
+        bulk_prepare_input(r, source, path);
+    return r;
+}
+
+RangeReader *reader_open(const char *path, int verbose) {
+    uint64_t t = trace_begin();
+    RangeReader *r = reader_open_backend(path, verbose);
+    trace_end("open", t, NULL);
+    return r;
+}
+
+// findBox_streaming (unchanged)
+int findBox_streaming(RangeReader *rd, uint64_t start, uint64_t end, const char *target,
+                      unsigned char **result, size_t *resultSize) {
+    uint64_t pos = start;
+    while (pos + 8 <= end && limit_boxes() == 0) {
+        unsigned char header[16];
+        if (!reader_read_full(rd, pos, header, 8)) break;
+        uint32_t size32 = (header[0] << 24) | (header[1] << 16) | (header[2] << 8) | header[3];
+        char boxType[5];
+        memcpy(boxType, header + 4, 4);
+        boxType[4] = '\0';
+        uint64_t boxSize = size32;
+        size_t headerSize = 8;
+        if (size32 == 1) {
+            if (!reader_read_full(rd, pos + 8, header + 8, 8)) break;
+            headerSize = 16;
             boxSize = ((uint64_t)header[8] << 56) | ((uint64_t)header[9] << 48) |
                       ((uint64_t)header[10] << 40) | ((uint64_t)header[11] << 32) |
                       ((uint64_t)header[12] << 24) | ((uint64_t)header[13] << 16) |
                       ((uint64_t)header[14] << 8) | (uint64_t)header[15];
         }
         if (boxSize < headerSize) {
-            fprintf(stderr, "Invalid box size at position %zu\n", pos);
+            fprintf(stderr, "Invalid box size at position %llu\n", (unsigned long long)pos);
             return 0;
         }
-        size_t boxEnd = pos + boxSize;
-        if (boxEnd > end) {
-            fprintf(stderr, "Box at position %zu extends beyond file bounds.\n", pos);
+        if (boxSize > end - pos) {
+            fprintf(stderr, "Box at position %llu extends beyond file bounds.\n", (unsigned long long)pos);
             return 0;
         }
+        uint64_t boxEnd = pos + boxSize;
         if (strcmp(boxType, target) == 0) {
             size_t contentSize = boxSize - headerSize;
-            *result = (unsigned char *)malloc(contentSize);
+            if (limit_metadata(contentSize) != 0)
+                return 0;
+            *result = (unsigned char *)scratch_alloc(contentSize);
             if (!*result) {
                 fprintf(stderr, "Memory allocation failed in findBox_streaming\n");
                 return 0;
             }
-            if (fseek(f, pos + headerSize, SEEK_SET) != 0) {
-                free(*result);
-                return 0;
-            }
-            if (fread(*result, 1, contentSize, f) != contentSize) {
-                free(*result);
+            if (!reader_read_full(rd, pos + headerSize, *result, contentSize)) {
+                scratch_free(*result);
                 return 0;
             }
             *resultSize = contentSize;
@@ -207,10 +2579,10 @@ int findBox_streaming(FILE *f, size_t start, size_t end, const char *target,
 }
 
 // extractCr3Exif_streaming (unchanged)
-int extractCr3Exif_streaming(FILE *f, size_t fileSize, unsigned char **exifSegment, size_t *exifSize, int verbose) {
+int extractCr3Exif_streaming(RangeReader *rd, unsigned char **exifSegment, size_t *exifSize, int verbose) {
     unsigned char *moovBox = NULL;
     size_t moovSize = 0;
-    if (!findBox_streaming(f, 0, fileSize, "moov", &moovBox, &moovSize)) {
+    if (!findBox_streaming(rd, 0, rd->size, "moov", &moovBox, &moovSize)) {
         if (verbose) fprintf(stderr, "No 'moov' box found in CR3 file.\n");
         return 0;
     }
@@ -237,10 +2609,10 @@ int extractCr3Exif_streaming(FILE *f, size_t fileSize, unsigned char **exifSegme
         if (pos + boxSize > moovSize) break;
         if (strcmp(type, "uuid") == 0) {
             uuidSize = boxSize - headerSize;
-            uuidBox = (unsigned char *)malloc(uuidSize);
+            uuidBox = (unsigned char *)scratch_alloc(uuidSize);
             if (!uuidBox) {
                 fprintf(stderr, "Memory allocation failed for uuidBox\n");
-                free(moovBox);
+                scratch_free(moovBox);
                 return 0;
             }
             memcpy(uuidBox, moovBox + pos + headerSize, uuidSize);
@@ -248,14 +2620,14 @@ int extractCr3Exif_streaming(FILE *f, size_t fileSize, unsigned char **exifSegme
         }
         pos += boxSize;
     }
-    free(moovBox);
+    scratch_free(moovBox);
     if (!uuidBox) {
         if (verbose) fprintf(stderr, "No 'uuid' box found in 'moov' box.\n");
         return 0;
     }
     pos = 0;
     int found = 0;
-    while (pos < uuidSize - 4) {
+    while (uuidSize >= 4 && pos + 4 <= uuidSize) {
         if (memcmp(uuidBox + pos, "II", 2) == 0) {
             uint16_t marker = read16le(uuidBox, pos + 2, uuidSize);
             if (marker == 42) {
@@ -267,64 +2639,647 @@ int extractCr3Exif_streaming(FILE *f, size_t fileSize, unsigned char **exifSegme
     }
     if (!found) {
         if (verbose) fprintf(stderr, "No valid TIFF header found in 'uuid' box.\n");
-        free(uuidBox);
+        scratch_free(uuidBox);
         return 0;
     }
     size_t tiffDataSize = uuidSize - pos;
-    unsigned char *tiffData = (unsigned char *)malloc(tiffDataSize);
+    unsigned char *tiffData = (unsigned char *)scratch_alloc(tiffDataSize);
     if (!tiffData) {
         fprintf(stderr, "Memory allocation failed for TIFF data\n");
-        free(uuidBox);
+        scratch_free(uuidBox);
         return 0;
     }
     memcpy(tiffData, uuidBox + pos, tiffDataSize);
-    free(uuidBox);
+    scratch_free(uuidBox);
     const char exifHeader[6] = {'E','x','i','f',0,0};
     *exifSize = 6 + tiffDataSize;
-    *exifSegment = (unsigned char *)malloc(*exifSize);
+    *exifSegment = (unsigned char *)scratch_alloc(*exifSize);
     if (!*exifSegment) {
         fprintf(stderr, "Memory allocation failed for EXIF segment\n");
-        free(tiffData);
+        scratch_free(tiffData);
         return 0;
     }
     memcpy(*exifSegment, exifHeader, 6);
     memcpy(*exifSegment + 6, tiffData, tiffDataSize);
-    free(tiffData);
+    scratch_free(tiffData);
     return 1;
 }
 
-// minimizeExifData (unchanged)
-int minimizeExifData(unsigned char **exifSegment, size_t *exifSize) {
-    const char *exifHeader = "Exif\0\0";
-    if (*exifSize < 10 || memcmp(*exifSegment, exifHeader, 6) != 0) {
-        fprintf(stderr, "Not a valid EXIF segment.\n");
-        return 0;
+// ----- Adaptive concurrency -----
+// --jobs auto starts --jobs-max workers but lets only `limit` of them work on a file at
+// a time. Each epoch of finished files (at least two per allowed file, and 250 ms)
+// yields the bytes read per second and the mean time per file. The controller is
+// AIMD: while throughput holds, it raises one setting additively, alternating
+// between files in flight (+1) and the read buffer (+64 KB); in the slow start the
+// file limit doubles instead. When the mean latency exceeds twice the best seen
+// without a throughput gain to show for it, or throughput falls by a fifth, the
+// setting raised last is halved. The caps are --jobs-min/-max and
+// --read-buffer-min/-max.
+
+#define ADAPT_EPOCH_MS 250
+#define ADAPT_READ_STEP (64u << 10)
+#define ADAPT_MAX_JOBS 64
+
+void adapt_init(Adaptive *a) {
+    memset(a, 0, sizeof(*a));
+    if (!g_adaptive) return;
+    a->enabled = 1;
+    a->max = g_jobs_max;
+    if (a->max == 0) {
+#ifndef _WIN32
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+#else
+        long cpus = 2;
+#endif
+        a->max = cpus > 0 && cpus * 4 < ADAPT_MAX_JOBS ? (int)cpus * 4 : ADAPT_MAX_JOBS;
+        if (a->max < g_jobs_min) a->max = g_jobs_min;
     }
-    size_t tiffStart = 6;
-    if (tiffStart + 8 > *exifSize) return 0;
-    uint32_t ifd0RelOffset = read32le(*exifSegment, tiffStart + 4, *exifSize);
-    size_t ifd0Offset = tiffStart + ifd0RelOffset;
-    if (ifd0Offset + 2 > *exifSize) return 0;
-    uint16_t count = read16le(*exifSegment, ifd0Offset, *exifSize);
-    size_t ifd0EntriesStart = ifd0Offset + 2;
-    size_t ifd0EntriesSize = count * 12;
-    if (ifd0EntriesStart + ifd0EntriesSize + 4 > *exifSize) return 0;
+    a->min = g_jobs_min;
+    a->limit = a->peak_limit = a->min;
+    a->read_min = g_read_buffer_min;
+    a->read_max = g_read_buffer_max;
+    a->read_size = g_read_buffer_size;
+    if (a->read_size < a->read_min) a->read_size = a->read_min;
+    if (a->read_size > a->read_max) a->read_size = a->read_max;
+    g_read_buffer_size = a->read_size;
+    a->slow_start = 1;
+    a->epoch_start_ms = monotonic_ms();
+    pthread_mutex_init(&a->lock, NULL);
+    pthread_cond_init(&a->cond, NULL);
+}
 
-    uint16_t allowed[] = { 0x010F, 0x0110, 0x0132, 0x829A, 0x829D, 0x8827, 0x920A, 0x0112 };
-    size_t allowedCount = sizeof(allowed) / sizeof(allowed[0]);
+void adapt_destroy(Adaptive *a) {
+    if (!a->enabled) return;
+    pthread_mutex_destroy(&a->lock);
+    pthread_cond_destroy(&a->cond);
+}
 
-    unsigned char *filteredEntries = (unsigned char *)malloc(ifd0EntriesSize);
-    if (!filteredEntries) {
-        fprintf(stderr, "Memory allocation failed in minimizeExifData\n");
-        return 0;
+// adapt_acquire: waits until the worker may start another file
+void adapt_acquire(Adaptive *a) {
+    if (!a->enabled) return;
+    pthread_mutex_lock(&a->lock);
+    while (a->active >= a->limit)
+        pthread_cond_wait(&a->cond, &a->lock);
+    a->active++;
+    pthread_mutex_unlock(&a->lock);
+}
+
+void adapt_release(Adaptive *a) {
+    if (!a->enabled) return;
+    pthread_mutex_lock(&a->lock);
+    a->active--;
+    pthread_cond_signal(&a->cond);
+    pthread_mutex_unlock(&a->lock);
+}
+
+// adapt_epoch: one AIMD step from the files finished since the last (lock held)
+void adapt_epoch(Adaptive *a, int64_t now) {
+    double rate = a->epoch_bytes * 1000.0 / (double)(now - a->epoch_start_ms);
+    double latency = a->epoch_latency_ms / a->epoch_files;
+    if (a->base_latency_ms == 0 || latency < a->base_latency_ms)
+        a->base_latency_ms = latency;
+    int congested = a->last_rate > 0 &&
+                    ((latency > 2 * a->base_latency_ms && rate < a->last_rate * 1.1) || rate < a->last_rate * 0.8);
+    int old_limit = a->limit;
+    if (a->hold) {
+        a->hold = 0;
+    } else if (congested) {
+        if (a->raised_read && a->read_size > a->read_min) {
+            a->read_size = a->read_size / 2 > a->read_min ? a->read_size / 2 : a->read_min;
+        } else {
+            a->limit = a->limit / 2 > a->min ? a->limit / 2 : a->min;
+        }
+        a->slow_start = 0;
+        a->hold = 1;
+        a->decreases++;
+    } else if (a->last_rate == 0 || rate >= a->last_rate * 0.95) {
+        int raise_read = a->read_size < a->read_max &&
+                         (a->limit >= a->max || (!a->slow_start && !a->raised_read));
+        if (raise_read) {
+            a->read_size = a->read_size + ADAPT_READ_STEP < a->read_max ? a->read_size + ADAPT_READ_STEP : a->read_max;
+            a->increases++;
+        } else if (a->limit < a->max) {
+            a->limit = a->slow_start ? a->limit * 2 : a->limit + 1;
+            if (a->limit > a->max) a->limit = a->max;
+            a->increases++;
+        }
+        a->raised_read = raise_read;
     }
-    size_t newEntryCount = 0;
-    for (size_t i = 0; i < count; i++) {
-        size_t entryOffset = ifd0EntriesStart + i * 12;
-        if (entryOffset + 12 > *exifSize) break;
-        uint16_t tag = read16le(*exifSegment, entryOffset, *exifSize);
-        int keep = 0;
-        for (size_t j = 0; j < allowedCount; j++) {
+    g_read_buffer_size = a->read_size;
+    if (a->limit > a->peak_limit) a->peak_limit = a->limit;
+    if (a->limit > old_limit)
+        pthread_cond_broadcast(&a->cond);
+    a->last_rate = rate;
+    a->last_latency_ms = latency;
+    a->epochs++;
+    a->epoch_files = 0;
+    a->epoch_bytes = 0;
+    a->epoch_latency_ms = 0;
+    a->epoch_start_ms = now;
+}
+
+// adapt_sample: records one finished file, closing the epoch when it is long enough
+void adapt_sample(Adaptive *a, uint64_t bytes, int64_t latency_ms) {
+    if (!a->enabled) return;
+    pthread_mutex_lock(&a->lock);
+    a->epoch_files++;
+    a->epoch_bytes += bytes;
+    a->epoch_latency_ms += (double)latency_ms;
+    int64_t now = monotonic_ms();
+    if (a->epoch_files >= 2 * a->limit && now - a->epoch_start_ms >= ADAPT_EPOCH_MS)
+        adapt_epoch(a, now);
+    pthread_mutex_unlock(&a->lock);
+}
+
+// report_adaptive_stats: the settings --jobs auto ended with (-v)
+void report_adaptive_stats(const Adaptive *a) {
+    if (!a->enabled) return;
+    fprintf(stderr, "Adaptive jobs: settled at %d files in flight (peak %d, range %d-%d) and %zu KB reads "
+            "(range %zu-%zu KB); %d increases, %d decreases in %d epochs",
+            a->limit, a->peak_limit, a->min, a->max, a->read_size / 1024, a->read_min / 1024, a->read_max / 1024,
+            a->increases, a->decreases, a->epochs);
+    if (a->epochs)
+        fprintf(stderr, "; last epoch %.1f MB/s, %.1f ms per file", a->last_rate / 1048576.0, a->last_latency_ms);
+    fprintf(stderr, "\n");
+}
+
+// ----- Physical layout order -----
+// --layout-order keeps spinning disks from seeking back and forth between inputs given
+// in argv or readdir order: inputs are sorted by where their first bytes (the box index
+// and, in CR3 files, the previews) lie on disk. Sorting is done in blocks of N inputs,
+// alternately ascending and descending so the heads sweep without returning to the
+// start, which bounds how far any input is moved and so how long it waits.
+
+enum { LAYOUT_UNKNOWN = 0, LAYOUT_EXTENT, LAYOUT_INODE };
+
+// Where an input starts on disk: device, then byte offset (LAYOUT_EXTENT) or inode number
+typedef struct {
+    char *path;
+    int index;
+    int kind;
+    uint64_t dev;
+    uint64_t pos;
+} LayoutKey;
+
+// layout_key: physical offset of the file's first byte from FIEMAP, else FIBMAP (needs
+// CAP_SYS_RAWIO), else the inode number, which most file systems allocate near the data
+void layout_key(const char *path, LayoutKey *key) {
+    key->kind = LAYOUT_UNKNOWN;
+    key->dev = UINT64_MAX;
+    key->pos = 0;
+#ifndef _WIN32
+    struct stat st;
+    if (strncmp(path, "http://", 7) == 0 || stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+        return;
+    key->kind = LAYOUT_INODE;
+    key->dev = (uint64_t)st.st_dev;
+    key->pos = (uint64_t)st.st_ino;
+#ifdef __linux__
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    uint64_t buf[(sizeof(struct fiemap) + sizeof(struct fiemap_extent)) / sizeof(uint64_t) + 1];
+    struct fiemap *fm = (struct fiemap *)buf;
+    memset(buf, 0, sizeof(buf));
+    fm->fm_start = 0;
+    fm->fm_length = 1;
+    fm->fm_extent_count = 1;
+    int block = 0, block_size = 0;
+    if (ioctl(fd, FS_IOC_FIEMAP, fm) == 0 && fm->fm_mapped_extents == 1 &&
+        !(fm->fm_extents[0].fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DATA_INLINE))) {
+        key->kind = LAYOUT_EXTENT;
+        key->pos = fm->fm_extents[0].fe_physical;
+    } else if (ioctl(fd, FIGETBSZ, &block_size) == 0 && ioctl(fd, FIBMAP, &block) == 0 && block > 0) {
+        key->kind = LAYOUT_EXTENT;
+        key->pos = (uint64_t)block * (uint64_t)block_size;
+    }
+    close(fd);
+#endif
+#else
+    (void)path;
+#endif
+}
+
+int layout_compare(const void *a, const void *b) {
+    const LayoutKey *x = (const LayoutKey *)a, *y = (const LayoutKey *)b;
+    if (x->dev != y->dev) return x->dev < y->dev ? -1 : 1;
+    if (x->kind != y->kind) return x->kind < y->kind ? -1 : 1;
+    if (x->pos != y->pos) return x->pos < y->pos ? -1 : 1;
+    return x->index - y->index;
+}
+
+// layout_travel: bytes the heads move between consecutive inputs located by extent
+uint64_t layout_travel(const LayoutKey *keys, int count) {
+    uint64_t travel = 0;
+    for (int i = 1; i < count; i++) {
+        const LayoutKey *a = &keys[i - 1], *b = &keys[i];
+        if (a->kind == LAYOUT_EXTENT && b->kind == LAYOUT_EXTENT && a->dev == b->dev)
+            travel += a->pos > b->pos ? a->pos - b->pos : b->pos - a->pos;
+    }
+    return travel;
+}
+
+// layout_order: reorders inputs for --layout-order. Returns -1 (order unchanged) if
+// the keys cannot be allocated.
+int layout_order(char **inputs, int count, int verbose) {
+    if (count <= 0) return 0;
+    LayoutKey *keys = malloc((size_t)count * sizeof(LayoutKey));
+    if (!keys) {
+        fprintf(stderr, "Memory allocation failed for --layout-order, keeping the given order\n");
+        return -1;
+    }
+    int by_kind[3] = { 0, 0, 0 };
+    for (int i = 0; i < count; i++) {
+        keys[i].path = inputs[i];
+        keys[i].index = i;
+        layout_key(inputs[i], &keys[i]);
+        by_kind[keys[i].kind]++;
+    }
+    uint64_t before = layout_travel(keys, count);
+    int window = g_layout_window;
+    for (int start = 0, block = 0; start < count; start += window, block++) {
+        int n = count - start < window ? count - start : window;
+        qsort(keys + start, n, sizeof(LayoutKey), layout_compare);
+        if (block & 1) {
+            for (int lo = start, hi = start + n - 1; lo < hi; lo++, hi--) {
+                LayoutKey t = keys[lo];
+                keys[lo] = keys[hi];
+                keys[hi] = t;
+            }
+        }
+    }
+    for (int i = 0; i < count; i++)
+        inputs[i] = keys[i].path;
+    if (verbose)
+        fprintf(stderr, "Layout order: %d inputs in blocks of %d (%d by extent, %d by inode number, %d unknown); "
+                "head travel between extents %.1f MB -> %.1f MB\n", count, window, by_kind[LAYOUT_EXTENT],
+                by_kind[LAYOUT_INODE], by_kind[LAYOUT_UNKNOWN], before / 1048576.0,
+                layout_travel(keys, count) / 1048576.0);
+    free(keys);
+    return 0;
+}
+
+// ----- CR3 box index -----
+// Canon stores three JPEG previews at places the container describes exactly:
+// THMB inside the moov Canon uuid, PRVW inside a top-level uuid right after moov,
+// and the full-size preview as the sample of the track whose CRAW entry has a
+// JPEG child. Reading only these boxes avoids touching the raw data at all.
+
+const unsigned char CANON_MOOV_UUID[16] = { 0x85, 0xc0, 0xb6, 0x87, 0x82, 0x0f, 0x11, 0xe0,
+                                            0x81, 0x11, 0xf4, 0xce, 0x46, 0x2b, 0x6a, 0x48 };
+const unsigned char CANON_PRVW_UUID[16] = { 0xea, 0xf4, 0x2b, 0x5e, 0x1c, 0x98, 0x4b, 0x88,
+                                            0xb9, 0xfb, 0xb7, 0xdc, 0x40, 0x6e, 0x4d, 0x16 };
+
+// Sample entry and first sample of a trak, from its stsd, stsz and co64/stco
+typedef struct {
+    size_t entry;               // stsd sample entry: size, type, fields, child boxes
+    size_t entryEnd;
+    uint16_t width, height;     // CRAW entry fields
+    uint64_t offset, size;
+} TrakSample;
+
+// Full-size HEVC preview of an HDR PQ CR3: its track sample and the hvcC box
+// (decoder configuration with the VPS/SPS/PPS) of its CRAW entry
+typedef struct {
+    uint64_t offset, size;
+    uint16_t width, height;
+    unsigned char *hvcc;        // whole hvcC box, scratch memory
+    size_t hvccSize;
+} HevcPreview;
+
+// box_header: parses the ISO-BMFF box header at data[pos], which must fit in [pos, end).
+// Returns the total box size (0 if invalid) and sets type and *headerSize.
+uint64_t box_header(const unsigned char *data, size_t pos, size_t end, char type[5], size_t *headerSize) {
+    if (pos + 8 > end || limit_boxes() != 0) return 0;
+    uint64_t boxSize = read32be(data, pos, end);
+    memcpy(type, data + pos + 4, 4);
+    type[4] = '\0';
+    *headerSize = 8;
+    if (boxSize == 1) {
+        if (pos + 16 > end) return 0;
+        boxSize = read64be(data, pos + 8, end);
+        *headerSize = 16;
+    } else if (boxSize == 0) {
+        boxSize = end - pos;
+    }
+    if (boxSize < *headerSize || boxSize > end - pos) return 0;
+    return boxSize;
+}
+
+// find_child_box: finds the first child box of the given type in [start, end).
+// Returns 1 and the child's content range.
+int find_child_box(const unsigned char *data, size_t start, size_t end, const char *target,
+                   size_t *contentStart, size_t *contentEnd) {
+    size_t pos = start, headerSize;
+    char type[5];
+    uint64_t boxSize;
+    while ((boxSize = box_header(data, pos, end, type, &headerSize)) != 0) {
+        if (strcmp(type, target) == 0) {
+            *contentStart = pos + headerSize;
+            *contentEnd = pos + boxSize;
+            return 1;
+        }
+        pos += boxSize;
+    }
+    return 0;
+}
+
+// find_fourcc_box: locates a box by type anywhere in [start, end), for sample entries
+// whose fixed header length varies. Returns the box offset or (size_t)-1.
+size_t find_fourcc_box(const unsigned char *data, size_t start, size_t end, const char *fourcc) {
+    for (size_t p = start + 4; p + 4 <= end; p++) {
+        if (memcmp(data + p, fourcc, 4) != 0) continue;
+        uint32_t size = read32be(data, p - 4, end);
+        if (size >= 8 && p - 4 + size <= end) return p - 4;
+    }
+    return (size_t)-1;
+}
+
+int add_preview(JpegInfo **jpegs, int *count, int *capacity, size_t start, size_t size,
+                int source, uint16_t width, uint16_t height) {
+    if (limit_previews(*count + 1) != 0)
+        return -1;
+    if (*count >= *capacity) {
+        int new_cap = *capacity ? *capacity * 2 : 4;
+        JpegInfo *temp = scratch_realloc(*jpegs, new_cap * sizeof(JpegInfo));
+        if (!temp) {
+            fprintf(stderr, "Memory allocation failed for preview list\n");
+            return -1;
+        }
+        *jpegs = temp;
+        *capacity = new_cap;
+    }
+    JpegInfo *j = &(*jpegs)[(*count)++];
+    j->start = start;
+    j->size = size;
+    j->end = start + size;
+    j->source = source;
+    j->width = width;
+    j->height = height;
+    return 0;
+}
+
+// parse_trak_sample: sample entry and first sample of the trak box whose content is
+// [content, end) in an in-memory moov. Returns 1 if the trak has an stsd entry.
+int parse_trak_sample(const unsigned char *moov, size_t content, size_t end, TrakSample *t) {
+    size_t ms, me, ns, ne, ss, se, cs, ce, zs, ze;
+    if (!find_child_box(moov, content, end, "mdia", &ms, &me) ||
+        !find_child_box(moov, ms, me, "minf", &ns, &ne) ||
+        !find_child_box(moov, ns, ne, "stbl", &ss, &se) ||
+        !find_child_box(moov, ss, se, "stsd", &cs, &ce) || cs + 16 > ce)
+        return 0;
+    // stsd: version/flags(4) entry count(4), then the CRAW sample entry
+    t->entry = cs + 8;
+    uint32_t entrySize = read32be(moov, t->entry, ce);
+    t->entryEnd = (entrySize >= 8 && t->entry + entrySize <= ce) ? t->entry + entrySize : ce;
+    t->width = read16be(moov, t->entry + 32, t->entryEnd);
+    t->height = read16be(moov, t->entry + 34, t->entryEnd);
+    t->offset = 0;
+    t->size = 0;
+    if (find_child_box(moov, ss, se, "stsz", &zs, &ze) && zs + 12 <= ze) {
+        t->size = read32be(moov, zs + 4, ze);
+        if (t->size == 0) t->size = read32be(moov, zs + 12, ze);
+    }
+    if (find_child_box(moov, ss, se, "co64", &zs, &ze))
+        t->offset = read64be(moov, zs + 8, ze);
+    else if (find_child_box(moov, ss, se, "stco", &zs, &ze))
+        t->offset = read32be(moov, zs + 8, ze);
+    return 1;
+}
+
+// parse_moov_previews: THMB and JPEG-track previews described by an in-memory moov
+// box whose content starts at file offset moovOffset.
+int parse_moov_previews(const unsigned char *moov, size_t moovSize, size_t moovOffset,
+                        JpegInfo **jpegs, int *count, int *capacity) {
+    size_t pos = 0, headerSize, cs, ce;
+    char type[5];
+    uint64_t boxSize;
+    while ((boxSize = box_header(moov, pos, moovSize, type, &headerSize)) != 0) {
+        size_t content = pos + headerSize, end = pos + boxSize;
+        if (strcmp(type, "uuid") == 0 && content + 16 <= end &&
+            memcmp(moov + content, CANON_MOOV_UUID, 16) == 0 &&
+            find_child_box(moov, content + 16, end, "THMB", &cs, &ce) && cs + 16 <= ce) {
+            // THMB: version/flags(4) width(2) height(2) jpeg size(4) ... jpeg data
+            uint16_t w = read16be(moov, cs + 4, ce), h = read16be(moov, cs + 6, ce);
+            uint32_t jsize = read32be(moov, cs + 8, ce);
+            size_t jstart = (size_t)-1;
+            for (size_t off = cs + 12; off <= cs + 24 && off + 2 <= ce; off += 4) {
+                if (moov[off] == 0xFF && moov[off + 1] == 0xD8) {
+                    jstart = off;
+                    break;
+                }
+            }
+            if (jstart != (size_t)-1) {
+                if (jsize == 0 || jstart + jsize > ce) jsize = ce - jstart;
+                if (add_preview(jpegs, count, capacity, moovOffset + jstart, jsize, JPEG_FROM_THMB, w, h) != 0)
+                    return -1;
+            }
+        } else if (strcmp(type, "trak") == 0) {
+            TrakSample t;
+            if (parse_trak_sample(moov, content, end, &t) && memcmp(moov + t.entry + 4, "CRAW", 4) == 0 &&
+                find_fourcc_box(moov, t.entry + 8, t.entryEnd, "JPEG") != (size_t)-1 && t.offset && t.size) {
+                if (add_preview(jpegs, count, capacity, (size_t)t.offset, (size_t)t.size, JPEG_FROM_TRAK,
+                                t.width, t.height) != 0)
+                    return -1;
+            }
+        }
+        pos += boxSize;
+    }
+    return 0;
+}
+
+int compare_jpeg_start(const void *a, const void *b) {
+    size_t sa = ((const JpegInfo *)a)->start, sb = ((const JpegInfo *)b)->start;
+    return (sa > sb) - (sa < sb);
+}
+
+// locate_previews_boxes: builds the preview list from the box structure, reading
+// only top-level headers, the moov box and the head of the PRVW uuid. Stops before
+// mdat, so in --follow mode it returns as soon as those few hundred KB have arrived.
+// Returns 0 with *count == 0 if the file does not look like a CR3.
+int locate_previews_boxes(RangeReader *rd, JpegInfo **jpegs, int *count) {
+    int capacity = 0, have_moov = 0, have_prvw = 0;
+    uint64_t pos = 0;
+    *jpegs = NULL;
+    *count = 0;
+    while (pos + 8 <= rd->size && !(have_moov && have_prvw) && limit_boxes() == 0) {
+        unsigned char header[16 + 64];
+        if (!reader_read_full(rd, pos, header, 16))
+            break;
+        char type[5];
+        memcpy(type, header + 4, 4);
+        type[4] = '\0';
+        size_t headerSize = 8;
+        uint64_t boxSize = read32be(header, 0, 16);
+        if (boxSize == 1) {
+            boxSize = read64be(header, 8, 16);
+            headerSize = 16;
+        }
+        if (pos == 0 && strcmp(type, "ftyp") != 0) break;
+        if (boxSize < headerSize || strcmp(type, "mdat") == 0) break;
+        if (strcmp(type, "moov") == 0) {
+            // A growing --follow input has no size yet; otherwise moov must fit in the file
+            if (!g_follow && boxSize > rd->size - pos)
+                break;
+            size_t moovSize = (size_t)boxSize - headerSize;
+            unsigned char *moov = limit_metadata(moovSize) == 0 ? scratch_alloc(moovSize) : NULL;
+            if (!moov) {
+                if (budget_check(g_budget) == 0)
+                    fprintf(stderr, "Memory allocation failed for moov box\n");
+                scratch_free(*jpegs);
+                *jpegs = NULL;
+                *count = 0;
+                return -1;
+            }
+            if (!reader_read_full(rd, pos + headerSize, moov, moovSize)) {
+                scratch_free(moov);
+                break;
+            }
+            int rc = parse_moov_previews(moov, moovSize, pos + headerSize, jpegs, count, &capacity);
+            scratch_free(moov);
+            if (rc != 0) {
+                scratch_free(*jpegs);
+                *jpegs = NULL;
+                *count = 0;
+                return -1;
+            }
+            have_moov = 1;
+        } else if (strcmp(type, "uuid") == 0 && boxSize >= headerSize + 16 + 8 + 24) {
+            // uuid(16) + 8 bytes, then PRVW: unknown(4) unknown(2) width(2) height(2) unknown(2) size(4) jpeg
+            size_t avail = boxSize - headerSize < 16 + 64 ? (size_t)boxSize - headerSize : 16 + 64;
+            if (!reader_read_full(rd, pos + headerSize, header, avail))
+                break;
+            size_t prvw = 16;
+            while (prvw + 8 <= avail && memcmp(header + prvw + 4, "PRVW", 4) != 0)
+                prvw++;
+            if (memcmp(header, CANON_PRVW_UUID, 16) == 0 && prvw + 8 + 16 <= avail) {
+                size_t c = prvw + 8;
+                uint32_t jsize = read32be(header, c + 12, avail);
+                size_t jstart = pos + headerSize + c + 16;
+                if (jsize > 0 && jstart + jsize <= pos + boxSize &&
+                    add_preview(jpegs, count, &capacity, jstart, jsize, JPEG_FROM_PRVW,
+                                read16be(header, c + 6, avail), read16be(header, c + 8, avail)) != 0) {
+                    scratch_free(*jpegs);
+                    *jpegs = NULL;
+                    *count = 0;
+                    return -1;
+                }
+                have_prvw = 1;
+            }
+        }
+        pos += boxSize;
+    }
+    if (*count > 1)
+        qsort(*jpegs, *count, sizeof(JpegInfo), compare_jpeg_start);
+    return 0;
+}
+
+// locate_hevc_preview: finds the track whose CRAW entry carries an hvcC box, as HDR
+// PQ files store their full-size preview as an HEVC image instead of a JPEG. Returns
+// 1 and fills hp (the caller frees hp->hvcc), 0 if there is none, -1 on OOM.
+int locate_hevc_preview(RangeReader *rd, HevcPreview *hp) {
+    unsigned char *moov = NULL;
+    size_t moovSize = 0;
+    int found = 0;
+    memset(hp, 0, sizeof(*hp));
+    if (!findBox_streaming(rd, 0, rd->size, "moov", &moov, &moovSize))
+        return 0;
+    size_t pos = 0, headerSize;
+    char type[5];
+    uint64_t boxSize;
+    while (!found && (boxSize = box_header(moov, pos, moovSize, type, &headerSize)) != 0) {
+        TrakSample t;
+        size_t hvcc;
+        if (strcmp(type, "trak") == 0 && parse_trak_sample(moov, pos + headerSize, pos + boxSize, &t) &&
+            memcmp(moov + t.entry + 4, "CRAW", 4) == 0 && t.offset && t.size && t.width && t.height &&
+            (hvcc = find_fourcc_box(moov, t.entry + 8, t.entryEnd, "hvcC")) != (size_t)-1) {
+            hp->hvccSize = read32be(moov, hvcc, t.entryEnd);
+            hp->hvcc = scratch_alloc(hp->hvccSize);
+            if (!hp->hvcc) {
+                fprintf(stderr, "Memory allocation failed for HEVC decoder configuration\n");
+                scratch_free(moov);
+                return -1;
+            }
+            memcpy(hp->hvcc, moov + hvcc, hp->hvccSize);
+            hp->offset = t.offset;
+            hp->size = t.size;
+            hp->width = t.width;
+            hp->height = t.height;
+            found = 1;
+        }
+        pos += boxSize;
+    }
+    scratch_free(moov);
+    return found;
+}
+
+// locate_jpegs: preview list for the extraction modes. TIFF-based files are always
+// located through their IFDs. With --box-index, --follow, --bulk or a remote input the
+// CR3 container index is used when the file has one; otherwise (or as a fallback) the
+// whole file is scanned for SOI/EOI pairs.
+int locate_jpegs(RangeReader *rd, JpegInfo **jpegs, int *count) {
+    int be = tiff_byte_order(rd);
+    if (be >= 0) {
+        uint64_t t = trace_begin();
+        int rc = locate_previews_ifds(rd, be, jpegs, count, NULL);
+        trace_end("parse container", t, NULL);
+        if (rc != 0)
+            return -1;
+        if (*count > 0)
+            return 0;
+        scratch_free(*jpegs);
+        *jpegs = NULL;
+    } else if (g_box_index || g_follow || g_bulk || rd->remote) {
+        uint64_t t = trace_begin();
+        int rc = locate_previews_boxes(rd, jpegs, count);
+        trace_end("parse container", t, NULL);
+        if (rc != 0)
+            return -1;
+        if (*count > 0)
+            return 0;
+        scratch_free(*jpegs);
+        *jpegs = NULL;
+        if (g_follow)
+            fprintf(stderr, "No CR3 preview index found, scanning the data present so far.\n");
+    }
+    uint64_t t = trace_begin();
+    int rc = find_all_jpegs(rd, jpegs, count);
+    trace_end("scan", t, NULL);
+    return rc;
+}
+
+// minimizeExifData (unchanged)
+int minimizeExifData(unsigned char **exifSegment, size_t *exifSize) {
+    const char *exifHeader = "Exif\0\0";
+    if (*exifSize < 10 || memcmp(*exifSegment, exifHeader, 6) != 0) {
+        fprintf(stderr, "Not a valid EXIF segment.\n");
+        return 0;
+    }
+    size_t tiffStart = 6;
+    if (tiffStart + 8 > *exifSize) return 0;
+    int be = (*exifSegment)[tiffStart] == 'M';  // big-endian EXIF comes from MM TIFF files
+    uint32_t ifd0RelOffset = tiff32(*exifSegment, tiffStart + 4, *exifSize, be);
+    size_t ifd0Offset = tiffStart + ifd0RelOffset;
+    if (ifd0Offset + 2 > *exifSize) return 0;
+    uint16_t count = tiff16(*exifSegment, ifd0Offset, *exifSize, be);
+    size_t ifd0EntriesStart = ifd0Offset + 2;
+    size_t ifd0EntriesSize = count * 12;
+    if (ifd0EntriesStart + ifd0EntriesSize + 4 > *exifSize) return 0;
+
+    uint16_t allowed[] = { 0x010F, 0x0110, 0x0132, 0x829A, 0x829D, 0x8827, 0x920A, 0x0112 };
+    size_t allowedCount = sizeof(allowed) / sizeof(allowed[0]);
+
+    unsigned char *filteredEntries = (unsigned char *)scratch_alloc(ifd0EntriesSize);
+    if (!filteredEntries) {
+        fprintf(stderr, "Memory allocation failed in minimizeExifData\n");
+        return 0;
+    }
+    size_t newEntryCount = 0;
+    for (size_t i = 0; i < count; i++) {
+        size_t entryOffset = ifd0EntriesStart + i * 12;
+        if (entryOffset + 12 > *exifSize) break;
+        uint16_t tag = tiff16(*exifSegment, entryOffset, *exifSize, be);
+        int keep = 0;
+        for (size_t j = 0; j < allowedCount; j++) {
             if (tag == allowed[j]) {
                 keep = 1;
                 break;
@@ -336,468 +3291,4860 @@ int minimizeExifData(unsigned char **exifSegment, size_t *exifSize) {
         }
     }
     size_t newIFD0Size = 2 + newEntryCount * 12 + 4;
-    unsigned char *newIFD0 = (unsigned char *)malloc(newIFD0Size);
+    unsigned char *newIFD0 = (unsigned char *)scratch_alloc(newIFD0Size);
     if (!newIFD0) {
         fprintf(stderr, "Memory allocation failed for new IFD0 block.\n");
-        free(filteredEntries);
+        scratch_free(filteredEntries);
         return 0;
     }
-    newIFD0[0] = newEntryCount & 0xFF;
-    newIFD0[1] = (newEntryCount >> 8) & 0xFF;
+    tiff_put16(newIFD0, (uint16_t)newEntryCount, be);
     memcpy(newIFD0 + 2, filteredEntries, newEntryCount * 12);
     memset(newIFD0 + 2 + newEntryCount * 12, 0, 4);
-    free(filteredEntries);
+    scratch_free(filteredEntries);
     size_t newExifSize = ifd0Offset + newIFD0Size;
-    unsigned char *newExif = (unsigned char *)malloc(newExifSize);
+    unsigned char *newExif = (unsigned char *)scratch_alloc(newExifSize);
     if (!newExif) {
         fprintf(stderr, "Memory allocation failed for new EXIF segment\n");
-        free(newIFD0);
+        scratch_free(newIFD0);
         return 0;
     }
     memcpy(newExif, *exifSegment, ifd0Offset);
     memcpy(newExif + ifd0Offset, newIFD0, newIFD0Size);
-    free(newIFD0);
-    free(*exifSegment);
+    scratch_free(newIFD0);
+    scratch_free(*exifSegment);
     *exifSegment = newExif;
     *exifSize = newExifSize;
     return 1;
 }
 
-// insertExifIntoJpeg (corrected from previous fix)
-int insertExifIntoJpeg(const unsigned char *jpegData, size_t jpegSize,
-                       unsigned char *exifSegment, size_t exifSize,
-                       unsigned char **outputData, size_t *outputSize) {
-    if (jpegSize < 2 || jpegData[0] != 0xFF || jpegData[1] != 0xD8) {
-        fprintf(stderr, "Extracted data is not a valid JPEG.\n");
-        return 0;
+// ----- Content-addressed store -----
+// --store DIR writes every output once under DIR/ab/cd/<sha256>.<ext>, named by
+// the digest of its bytes. The digest is computed while the output is streamed to
+// a temporary file in DIR. If an object with that digest already exists, the
+// temporary file is dropped; it is usually still only in the page cache then, so
+// a re-import costs reads but almost no writes. The usual output path then
+// becomes a hardlink to the object, or with --store-manifest a line in the
+// manifest naming the digest, size and path.
+
+const uint32_t SHA256_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+void sha256_init(Sha256 *s) {
+    static const uint32_t h0[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+    memcpy(s->h, h0, sizeof(h0));
+    s->len = 0;
+    s->fill = 0;
+}
+
+void sha256_block(Sha256 *s, const unsigned char *p) {
+    uint32_t w[64], v[8];
+    for (int i = 0; i < 16; i++)
+        w[i] = read32be(p, i * 4, 64);
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ROTR32(w[i - 15], 7) ^ ROTR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROTR32(w[i - 2], 17) ^ ROTR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
     }
-    *outputSize = 2 + 4 + exifSize + (jpegSize - 2);
-    *outputData = (unsigned char *)malloc(*outputSize);
-    if (!*outputData) {
-        fprintf(stderr, "Memory allocation failed for output JPEG.\n");
-        return 0;
+    memcpy(v, s->h, sizeof(v));
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = v[7] + (ROTR32(v[4], 6) ^ ROTR32(v[4], 11) ^ ROTR32(v[4], 25)) +
+                      ((v[4] & v[5]) ^ (~v[4] & v[6])) + SHA256_K[i] + w[i];
+        uint32_t t2 = (ROTR32(v[0], 2) ^ ROTR32(v[0], 13) ^ ROTR32(v[0], 22)) +
+                      ((v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]));
+        memmove(v + 1, v, 7 * sizeof(uint32_t));
+        v[4] += t1;
+        v[0] = t1 + t2;
     }
-    size_t pos = 0;
-    memcpy(*outputData, jpegData, 2);
-    pos += 2;
-    (*outputData)[pos++] = 0xFF;
-    (*outputData)[pos++] = 0xE1;
-    uint16_t segLength = exifSize + 2;
-    (*outputData)[pos++] = (segLength >> 8) & 0xFF;
-    (*outputData)[pos++] = segLength & 0xFF;
-    memcpy(*outputData + pos, exifSegment, exifSize);
-    pos += exifSize;
-    memcpy(*outputData + pos, jpegData + 2, jpegSize - 2);
-    return 1;
+    for (int i = 0; i < 8; i++)
+        s->h[i] += v[i];
 }
 
-// Updated extract_largest_jpeg with size_t (unchanged in terms of JPEG selection)
-int extract_largest_jpeg(const char *cr3_path, const char *output_path, int to_stdout, int verbose) {
-    FILE *cr3_file = fopen(cr3_path, "rb");
-    if (!cr3_file) {
-        perror("Failed to open CR3 file");
-        return -1;
+void sha256_update(Sha256 *s, const unsigned char *data, size_t len) {
+    s->len += len;
+    if (s->fill) {
+        size_t n = 64 - s->fill < len ? 64 - s->fill : len;
+        memcpy(s->block + s->fill, data, n);
+        s->fill += n;
+        data += n;
+        len -= n;
+        if (s->fill < 64) return;
+        sha256_block(s, s->block);
+        s->fill = 0;
     }
+    for (; len >= 64; data += 64, len -= 64)
+        sha256_block(s, data);
+    memcpy(s->block, data, len);
+    s->fill = len;
+}
 
-    JpegInfo *jpegs = NULL;
-    int jpeg_count = 0;
-    if (find_all_jpegs(cr3_file, &jpegs, &jpeg_count) != 0) {
-        fprintf(stderr, "Failed to scan for JPEG previews in CR3 file.\n");
-        fclose(cr3_file);
-        if (jpegs) free(jpegs);
+void sha256_final(Sha256 *s, unsigned char digest[32]) {
+    uint64_t bits = s->len * 8;
+    unsigned char pad[72] = { 0x80 };
+    size_t n = (s->fill < 56 ? 56 : 120) - s->fill;
+    for (int i = 0; i < 8; i++)
+        pad[n + i] = (unsigned char)(bits >> (56 - 8 * i));
+    sha256_update(s, pad, n + 8);
+    for (int i = 0; i < 8; i++)
+        tiff_put32(digest + 4 * i, s->h[i], 1);
+}
+
+#ifndef _WIN32
+// store_open: opens a temporary file in the store for sink. Returns 0, or -1 with errno set.
+int store_open(OutputSink *sink) {
+    static _Atomic unsigned long long serial = 0;
+    size_t n = strlen(g_store_dir) + 64;
+    sink->temp_path = scratch_alloc(n);
+    if (!sink->temp_path) {
+        errno = ENOMEM;
+        return -1;
+    }
+    snprintf(sink->temp_path, n, "%s/.tmp-%ld-%llu", g_store_dir, (long)getpid(), atomic_fetch_add(&serial, 1));
+    sink->fp = fopen(sink->temp_path, "wb");
+    if (!sink->fp) {
+        scratch_free(sink->temp_path);
+        sink->temp_path = NULL;
         return -1;
     }
+    sha256_init(&sink->sha);
+    return 0;
+}
 
-    if (jpeg_count == 0) {
-        fprintf(stderr, "No JPEG previews found in CR3 file: %s\n", cr3_path);
-        fclose(cr3_file);
-        if (jpegs) free(jpegs);
+// store_commit: moves the closed temporary file of sink to its object (or drops it if
+// the object exists) and links or lists sink->path. *object receives the object
+// path (scratch memory), *fresh whether the object is new. Returns 0 on success.
+int store_commit(OutputSink *sink, char **object, int *fresh_object) {
+    static const char hex[] = "0123456789abcdef";
+    unsigned char digest[32];
+    char name[65];
+    sha256_final(&sink->sha, digest);
+    for (int i = 0; i < 32; i++) {
+        name[2 * i] = hex[digest[i] >> 4];
+        name[2 * i + 1] = hex[digest[i] & 15];
+    }
+    name[64] = '\0';
+    const char *slash = strrchr(sink->path, '/');
+    const char *ext = strrchr(slash ? slash + 1 : sink->path, '.');
+    if (!ext) ext = "";
+    size_t n = strlen(g_store_dir) + 8 + 64 + strlen(ext) + 1;
+    char *path = scratch_alloc(n);
+    if (!path) {
+        fprintf(stderr, "Memory allocation failed for store path\n");
+        unlink(sink->temp_path);
         return -1;
     }
+    // Shard directories DIR/ab and DIR/ab/cd
+    snprintf(path, n, "%s/%.2s", g_store_dir, name);
+    mkdir(path, 0777);
+    snprintf(path, n, "%s/%.2s/%.2s", g_store_dir, name, name + 2);
+    mkdir(path, 0777);
+    snprintf(path, n, "%s/%.2s/%.2s/%s%s", g_store_dir, name, name + 2, name, ext);
+    int fresh = link(sink->temp_path, path) == 0;
+    int rc = fresh || errno == EEXIST ? 0 : -1;
+    *fresh_object = fresh;
+    if (rc != 0)
+        fprintf(stderr, "Failed to add %s to the store: %s\n", path, strerror(errno));
+    unlink(sink->temp_path);
 
-    int largest_idx = 0;
-    for (int i = 1; i < jpeg_count; i++) {
-        if (jpegs[i].size > jpegs[largest_idx].size)
-            largest_idx = i;
+    struct stat a, b;
+    if (rc == 0 && g_store_manifest) {
+        pthread_mutex_lock(&g_store_lock);
+        fprintf(g_store_manifest, "%s\t%zu\t%s\n", name, sink->size, sink->path);
+        fflush(g_store_manifest);
+        pthread_mutex_unlock(&g_store_lock);
+    } else if (rc == 0 && !(stat(sink->path, &a) == 0 && stat(path, &b) == 0 && a.st_dev == b.st_dev &&
+                            a.st_ino == b.st_ino)) {
+        unlink(sink->path);
+        if (link(path, sink->path) != 0) {
+            fprintf(stderr, "Failed to link %s to %s: %s\n", sink->path, path, strerror(errno));
+            rc = -1;
+        }
+    }
+    if (rc == 0) {
+        pthread_mutex_lock(&g_store_lock);
+        if (fresh) {
+            g_store_totals.written++;
+            g_store_totals.written_bytes += sink->size;
+        } else {
+            g_store_totals.linked++;
+            g_store_totals.linked_bytes += sink->size;
+        }
+        pthread_mutex_unlock(&g_store_lock);
+        *object = path;
+    } else {
+        scratch_free(path);
     }
+    return rc;
+}
+#else
+int store_open(OutputSink *sink) {
+    (void)sink;
+    errno = ENOSYS;
+    return -1;
+}
+
+int store_commit(OutputSink *sink, char **object, int *fresh_object) {
+    (void)sink;
+    (void)object;
+    (void)fresh_object;
+    return -1;
+}
+#endif
 
-    size_t jpeg_start_offset = jpegs[largest_idx].start;
-    size_t jpeg_size = jpegs[largest_idx].size;
+void report_store_stats(void) {
+    StoreStats *t = &g_store_totals;
+    if (!g_store_dir || t->written + t->linked == 0) return;
+    fprintf(stderr, "Store: %llu new objects (%.1f MB written), %llu duplicates linked (%.1f MB not stored again)\n",
+            (unsigned long long)t->written, t->written_bytes / 1e6, (unsigned long long)t->linked,
+            t->linked_bytes / 1e6);
+}
 
-    if (fseek(cr3_file, jpeg_start_offset, SEEK_SET) != 0) {
-        perror("Failed to seek to JPEG start position in CR3 file");
-        fclose(cr3_file);
-        free(jpegs);
-        return -1;
+// CRC-32 (IEEE 802.3, reflected) used to fingerprint outputs in the journal
+void crc32_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+            c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        g_crc_table[i] = c;
     }
+}
+
+uint32_t crc32_update(uint32_t crc, const unsigned char *data, size_t len) {
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++)
+        crc = g_crc_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
 
-    FILE *output_stream = NULL;
+// sink_open: returns 0 on success, -1 with errno set if the file cannot be created
+int sink_open(OutputSink *sink, const char *path, int to_stdout) {
+    memset(sink, 0, sizeof(*sink));
     if (to_stdout) {
-        output_stream = stdout;
+        sink->fp = stdout;
+        sink->to_stdout = 1;
 #ifdef _WIN32
         _setmode(_fileno(stdout), _O_BINARY);
 #endif
-        if (verbose)
-            fprintf(stderr, "Largest JPEG preview found (size: %zu bytes), streaming to stdout...\n", jpeg_size);
-    } else {
-        output_stream = fopen(output_path, "wb");
-        if (!output_stream) {
-            perror("Failed to open output JPEG file");
-            fclose(cr3_file);
-            free(jpegs);
-            return -1;
+        return 0;
+    }
+    sink->path = path;
+    if (g_store_dir)
+        return store_open(sink);
+    sink->fp = fopen(path, "wb");
+    return sink->fp ? 0 : -1;
+}
+
+size_t sink_write(OutputSink *sink, const void *data, size_t len) {
+    size_t written = fwrite(data, 1, len, sink->fp);
+    sink->crc = crc32_update(sink->crc, (const unsigned char *)data, written);
+    if (sink->temp_path)
+        sha256_update(&sink->sha, (const unsigned char *)data, written);
+    sink->size += written;
+    metrics_add(METRIC_BYTES_WRITTEN, written);
+    return written;
+}
+
+// sink_close: closes the file and, if keep is set and a batch job is active,
+// records the finished output for the journal. With --store, a kept output goes
+// into the store and anything else is removed. Returns 0 on success.
+int sink_close(OutputSink *sink, int keep) {
+    int rc = 0, fresh = 0, release_fd = -1;
+    char *object = NULL;
+    uint64_t t = trace_begin();
+    if (sink->to_stdout) {
+        if (fflush(stdout) != 0) rc = -1;
+    } else if (sink->fp) {
+        // --bulk: a store output is released only once it turns out to be a new
+        // object; duplicates are unlinked before their pages are ever written back
+        if (g_bulk && fflush(sink->fp) == 0) {
+            if (sink->temp_path)
+                release_fd = dup(fileno(sink->fp));
+            else
+                bulk_release_output(fileno(sink->fp), sink->size);
         }
-        if (verbose)
-            printf("Largest JPEG preview extracted to %s (size: %zu bytes)\n", output_path, jpeg_size);
+        if (fclose(sink->fp) != 0) {
+            fprintf(stderr, "Failed to finish writing %s\n", sink->path);
+            rc = -1;
+        }
+    }
+    sink->fp = NULL;
+    if (sink->temp_path) {
+        if (rc == 0 && keep)
+            rc = store_commit(sink, &object, &fresh);
+        else
+            remove(sink->temp_path);
+        scratch_free(sink->temp_path);
+        sink->temp_path = NULL;
     }
+    if (release_fd >= 0) {
+        if (rc == 0 && fresh)
+            bulk_release_output(release_fd, sink->size);
+        close(release_fd);
+    }
+    trace_end("close", t, NULL);
+    if (rc == 0 && keep && sink->path && g_job_outputs && g_job_outputs->count < MAX_JOB_OUTPUTS) {
+        OutputRecord *rec = &g_job_outputs->outputs[g_job_outputs->count];
+        rec->path = scratch_strdup(g_store_manifest ? object : sink->path);
+        if (rec->path) {
+            rec->size = sink->size;
+            rec->crc = sink->crc;
+            g_job_outputs->count++;
+        }
+    }
+    scratch_free(object);
+    return rc;
+}
 
-    size_t remaining = jpeg_size;
-    unsigned char buffer[STREAM_BUFFER_SIZE];
+// write_jpeg_head: writes SOI and, if it fits, an APP1 segment holding exif;
+// *with_exif reports whether it did. Returns 0 on success.
+int write_jpeg_head(OutputSink *sink, const unsigned char *exif, size_t exifSize, int *with_exif) {
+    size_t head = 2;
+    unsigned char app1[6] = { 0xFF, 0xD8, 0xFF, 0xE1,
+                              (unsigned char)((exifSize + 2) >> 8), (unsigned char)((exifSize + 2) & 0xFF) };
+    *with_exif = 0;
+    if (exifSize + 2 > 0xFFFF) {
+        // APP1 length is 16 bits: larger EXIF would corrupt the file
+        fprintf(stderr, "EXIF data (%zu bytes) exceeds the 65533-byte APP1 limit (writing JPEG without EXIF).\n",
+                exifSize);
+    } else {
+        head = sizeof(app1);
+    }
+    uint64_t t = trace_begin();
+    int failed = sink_write(sink, app1, head) != head || (head > 2 && sink_write(sink, exif, exifSize) != exifSize);
+    trace_end("inject", t, NULL);
+    if (failed) {
+        fprintf(stderr, "Failed to write EXIF segment to %s.\n", sink->to_stdout ? "stdout" : sink->path);
+        return -1;
+    }
+    *with_exif = head > 2;
+    return 0;
+}
+
+// stream_jpeg: copies the JPEG at [start, start + size) to the sink through the
+// read-ahead buffers. If exif is given, an APP1 segment holding it is written
+// right after SOI, so the preview is never held in memory. *with_exif reports whether
+// the EXIF was inserted. Returns 0 on success.
+int stream_jpeg(RangeReader *rd, uint64_t start, size_t size, const unsigned char *exif, size_t exifSize,
+                OutputSink *sink, int *with_exif) {
+    const unsigned char *buffer;
+    size_t remaining = size;
+    int first = 1, rc = -1;
+    *with_exif = 0;
+    ReadAhead ra;
+    if (readahead_start(&ra, rd, start, start + size) != 0)
+        return -1;
+    uint64_t t = trace_begin();
     while (remaining > 0) {
-        size_t to_read = remaining < STREAM_BUFFER_SIZE ? remaining : STREAM_BUFFER_SIZE;
-        size_t bytes_read = fread(buffer, 1, to_read, cr3_file);
-        if (bytes_read == 0) {
-            if (ferror(cr3_file)) {
-                perror("Error reading JPEG data from CR3 file");
-            } else {
+        long long got = readahead_next(&ra, &buffer);
+        if (got <= 0) {
+            if (got < 0)
+                fprintf(stderr, "Error reading JPEG data from CR3 file\n");
+            else
                 fprintf(stderr, "Unexpected end-of-file while streaming JPEG data.\n");
+            goto out;
+        }
+        size_t bytes_read = (size_t)got, skip = 0;
+        if (first && exif) {
+            if (bytes_read < 2 || buffer[0] != 0xFF || buffer[1] != 0xD8) {
+                fprintf(stderr, "Extracted data is not a valid JPEG (writing it without EXIF).\n");
+            } else {
+                if (write_jpeg_head(sink, exif, exifSize, with_exif) != 0)
+                    goto out;
+                skip = 2;
             }
-            fclose(cr3_file);
-            if (!to_stdout && output_stream) fclose(output_stream);
-            free(jpegs);
-            return -1;
         }
-        size_t bytes_written = fwrite(buffer, 1, bytes_read, output_stream);
-        if (bytes_written != bytes_read) {
-            if (to_stdout) {
+        first = 0;
+        size_t bytes_written = sink_write(sink, buffer + skip, bytes_read - skip);
+        if (bytes_written != bytes_read - skip) {
+            if (sink->to_stdout) {
                 if (ferror(stdout)) perror("Error writing JPEG data to stdout");
                 else fprintf(stderr, "Failed to write complete JPEG data to stdout (expected %zu, wrote %zu bytes).\n",
-                             bytes_read, bytes_written);
+                             bytes_read - skip, bytes_written);
             } else {
                 fprintf(stderr, "Failed to write complete JPEG data to file %s (expected %zu, wrote %zu bytes).\n",
-                        output_path, bytes_read, bytes_written);
+                        sink->path, bytes_read - skip, bytes_written);
             }
-            fclose(cr3_file);
-            if (!to_stdout && output_stream) fclose(output_stream);
-            free(jpegs);
-            return -1;
+            goto out;
         }
         remaining -= bytes_read;
     }
-
-    fclose(cr3_file);
-    if (!to_stdout && output_stream) fclose(output_stream);
-    free(jpegs);
-    return 0;
+    rc = 0;
+out:
+    trace_end("write", t, NULL);
+    readahead_stop(&ra);
+    return rc;
 }
 
-// Updated extract_all_jpegs with size_t and our new heuristic
-int extract_all_jpegs(const char *cr3_path, int verbose) {
-    FILE *cr3_file = fopen(cr3_path, "rb");
-    if (!cr3_file) {
-        perror("Failed to open CR3 file");
-        return -1;
-    }
-    fseek(cr3_file, 0, SEEK_END);
-    size_t fileSize = ftell(cr3_file);
-    rewind(cr3_file);
-    JpegInfo *jpegs = NULL;
-    int jpeg_count = 0;
-    if (find_all_jpegs(cr3_file, &jpegs, &jpeg_count) != 0) {
-        fprintf(stderr, "Failed to scan for JPEG previews in CR3 file.\n");
-        fclose(cr3_file);
-        free(jpegs);
-        return -1;
-    }
-    if (jpeg_count == 0) {
-        fprintf(stderr, "No JPEG previews found in CR3 file: %s\n", cr3_path);
-        fclose(cr3_file);
-        free(jpegs);
-        return -1;
-    }
-
+// load_exif: EXIF segment for the -j modes (minimized with -m), or NULL if there is none
+unsigned char *load_exif(RangeReader *rd, size_t *exifSize, int verbose) {
     unsigned char *exifSegment = NULL;
-    size_t exifSize = 0;
-    if (!extractCr3Exif_streaming(cr3_file, fileSize, &exifSegment, &exifSize, verbose)) {
+    uint64_t t = trace_begin();
+    int be = tiff_byte_order(rd);
+    int found = be >= 0 ? extract_tiff_exif(rd, be, &exifSegment, exifSize, verbose)
+                        : extractCr3Exif_streaming(rd, &exifSegment, exifSize, verbose);
+    trace_end("exif", t, NULL);
+    if (!found) {
         if (verbose)
             fprintf(stderr, "Failed to extract EXIF from CR3 file (continuing without EXIF).\n");
-    } else if (g_minimize_exif) {
-        if (!minimizeExifData(&exifSegment, &exifSize)) {
-            fprintf(stderr, "Failed to minimize EXIF data (continuing without EXIF).\n");
-            free(exifSegment);
-            exifSegment = NULL;
+        return NULL;
+    }
+    t = trace_begin();
+    int minimized = !g_minimize_exif || minimizeExifData(&exifSegment, exifSize);
+    if (g_minimize_exif) trace_end("minimize", t, NULL);
+    if (!minimized) {
+        fprintf(stderr, "Failed to minimize EXIF data (continuing without EXIF).\n");
+        scratch_free(exifSegment);
+        return NULL;
+    }
+    return exifSegment;
+}
+
+// ----- Lossless rotation -----
+// --rotate turns -j previews upright in the DCT domain, as jpegtran does: the
+// baseline Huffman data is decoded to quantized coefficients, whole blocks are
+// moved (transposing and/or negating odd-frequency coefficients) and the result is
+// re-encoded with optimized Huffman tables. No pixel is decoded, so nothing is lost.
+// Partial MCUs at an edge that would end up on the leading side are trimmed. The
+// coefficient planes take 2 bytes per sample (about 4 bytes per pixel for a 4:2:2
+// preview, 3 for 4:2:0), so they come from the heap and never grow the per-worker
+// arena.
+
+#define HUFF_LOOKAHEAD 9
+typedef struct {
+    uint8_t bits[17];           // codes per length (DHT layout, index 1..16)
+    uint8_t vals[256];
+    int count;
+    int defined;
+    int mincode[17];
+    int maxcode[17];            // -1 if no code has this length
+    int valptr[17];
+    uint8_t lookup_len[1 << HUFF_LOOKAHEAD];   // codes up to HUFF_LOOKAHEAD bits
+    uint8_t lookup_val[1 << HUFF_LOOKAHEAD];
+    uint16_t ehufco[256];       // encoder: code and length per symbol
+    uint8_t ehufsi[256];
+} HuffTable;
+
+typedef struct {
+    int id, h, v, tq;           // from SOF
+    int td, ta;                 // from SOS
+    int scanned;
+    int bw, bh;                 // block grid padded to whole MCUs
+    int16_t *coef;              // bw * bh blocks of 64 coefficients, natural order
+} JpegComponent;
+
+const uint8_t JPEG_NATURAL_ORDER[64] = {
+     0,  1,  8, 16,  9,  2,  3, 10, 17, 24, 32, 25, 18, 11,  4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13,  6,  7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63
+};
+
+// huff_build: canonical codes for a DHT bits/vals pair, for both decoding and encoding
+int huff_build(HuffTable *t) {
+    int code = 0, k = 0;
+    memset(t->lookup_len, 0, sizeof(t->lookup_len));
+    for (int len = 1; len <= 16; len++) {
+        t->valptr[len] = k;
+        t->mincode[len] = code;
+        for (int n = 0; n < t->bits[len]; n++, k++, code++) {
+            if (k >= 256 || code >= (1 << len)) return -1;   // too many symbols, over-subscribed table
+            t->ehufco[t->vals[k]] = (uint16_t)code;
+            t->ehufsi[t->vals[k]] = (uint8_t)len;
+            if (len <= HUFF_LOOKAHEAD) {
+                int shift = HUFF_LOOKAHEAD - len;
+                for (int fill = 0; fill < (1 << shift); fill++) {
+                    t->lookup_len[(code << shift) | fill] = (uint8_t)len;
+                    t->lookup_val[(code << shift) | fill] = t->vals[k];
+                }
+            }
         }
+        t->maxcode[len] = t->bits[len] ? code - 1 : -1;
+        code <<= 1;
     }
+    t->count = k;
+    return 0;
+}
 
-    // New heuristic: if the first JPEG segment is below 8KB and there are at least 4 segments,
-    // skip the first segment by setting starting_index to 1.
-    int starting_index = 0;
-    if (jpeg_count >= 4 && jpegs[0].size < 8 * 1024) {
-        if (verbose)
-            fprintf(stderr, "First JPEG segment size %zu is below 8KB, skipping it.\n", jpegs[0].size);
-        starting_index = 1;
+// huff_optimal: optimal code lengths (at most 16 bits) for the given symbol
+// frequencies, following JPEG Annex K.2 (the procedure libjpeg uses)
+int huff_optimal(const long *freq_in, HuffTable *t) {
+    long freq[257];
+    int codesize[257], others[257], count[33];
+    memcpy(freq, freq_in, 256 * sizeof(long));
+    freq[256] = 1;   // reserves one code so no real code is all ones
+    for (int i = 0; i < 257; i++) {
+        codesize[i] = 0;
+        others[i] = -1;
     }
-    int max_extract = ((jpeg_count - starting_index) < 3) ? (jpeg_count - starting_index) : 3;
-    int result = 0;
-    for (int i = starting_index; i < starting_index + max_extract; i++) {
-        size_t start_offset = jpegs[i].start;
-        size_t size_jpeg = jpegs[i].size;
-        if (fseek(cr3_file, start_offset, SEEK_SET) != 0) {
-            perror("Failed to seek to JPEG segment");
-            result = -1;
-            break;
+    for (;;) {
+        int c1 = -1, c2 = -1;
+        long v = LONG_MAX;
+        for (int i = 0; i <= 256; i++) {
+            if (freq[i] && freq[i] <= v) {
+                v = freq[i];
+                c1 = i;
+            }
         }
-        unsigned char *jpeg_data = (unsigned char *)malloc(size_jpeg);
-        if (!jpeg_data) {
-            perror("Failed to allocate memory for JPEG data");
+        v = LONG_MAX;
+        for (int i = 0; i <= 256; i++) {
+            if (freq[i] && freq[i] <= v && i != c1) {
+                v = freq[i];
+                c2 = i;
+            }
+        }
+        if (c2 < 0) break;
+        freq[c1] += freq[c2];
+        freq[c2] = 0;
+        codesize[c1]++;
+        while (others[c1] >= 0) {
+            c1 = others[c1];
+            codesize[c1]++;
+        }
+        others[c1] = c2;
+        codesize[c2]++;
+        while (others[c2] >= 0) {
+            c2 = others[c2];
+            codesize[c2]++;
+        }
+    }
+    memset(count, 0, sizeof(count));
+    for (int i = 0; i <= 256; i++) {
+        if (codesize[i] > 32) return -1;
+        if (codesize[i]) count[codesize[i]]++;
+    }
+    int i;
+    for (i = 32; i > 16; i--) {
+        while (count[i] > 0) {
+            int j = i - 2;
+            while (count[j] == 0) j--;
+            count[i] -= 2;
+            count[i - 1]++;
+            count[j + 1] += 2;
+            count[j]--;
+        }
+    }
+    while (count[i] == 0) i--;
+    count[i]--;   // drop the reserved symbol 256
+    memset(t, 0, sizeof(*t));
+    for (i = 1; i <= 16; i++) t->bits[i] = (uint8_t)count[i];
+    int p = 0;
+    for (i = 1; i <= 32; i++) {
+        for (int j = 0; j <= 255; j++) {
+            if (codesize[j] == i) t->vals[p++] = (uint8_t)j;
+        }
+    }
+    return huff_build(t);
+}
+
+// Bit reader over entropy-coded data: undoes 0xFF00 stuffing and stops at markers
+typedef struct {
+    const unsigned char *data;
+    size_t pos;
+    size_t end;
+    uint64_t acc;
+    int bits;
+    int marker;     // a marker was reached; zeros are fed from here on
+    int padding;    // zero bytes fed so far, all at the low end of acc
+} BitReader;
+
+void br_fill(BitReader *b) {
+    while (b->bits <= 56) {
+        unsigned c = 0;
+        if (!b->marker && b->pos < b->end) {
+            c = b->data[b->pos];
+            if (c == 0xFF) {
+                unsigned next = b->pos + 1 < b->end ? b->data[b->pos + 1] : 0xD9;
+                if (next == 0x00) {
+                    b->pos += 2;
+                } else {
+                    b->marker = 1;
+                    c = 0;
+                    b->padding++;
+                }
+            } else {
+                b->pos++;
+            }
+        } else {
+            b->padding++;
+        }
+        b->acc |= (uint64_t)c << (56 - b->bits);
+        b->bits += 8;
+    }
+}
+
+unsigned br_get(BitReader *b, int n) {
+    if (n == 0) return 0;
+    if (b->bits < n) br_fill(b);
+    unsigned v = (unsigned)(b->acc >> (64 - n));
+    b->acc <<= n;
+    b->bits -= n;
+    return v;
+}
+
+int br_decode(BitReader *b, const HuffTable *t) {
+    if (b->bits < 16) br_fill(b);
+    unsigned peek = (unsigned)(b->acc >> (64 - HUFF_LOOKAHEAD));
+    int len = t->lookup_len[peek];
+    if (len) {
+        b->acc <<= len;
+        b->bits -= len;
+        return t->lookup_val[peek];
+    }
+    int code = (int)br_get(b, HUFF_LOOKAHEAD);
+    for (len = HUFF_LOOKAHEAD + 1; len <= 16; len++) {
+        code = (code << 1) | (int)br_get(b, 1);
+        if (t->maxcode[len] >= 0 && code <= t->maxcode[len] && code >= t->mincode[len])
+            return t->vals[t->valptr[len] + code - t->mincode[len]];
+    }
+    return -1;   // corrupt data
+}
+
+// br_leftover: entropy-coded bits not yet consumed before the next marker, or -1 if
+// decoding has run into the zeros fed past it (the data was cut short)
+long br_leftover(const BitReader *b) {
+    if (b->padding * 8 > b->bits) return -1;
+    long left = b->bits - b->padding * 8;
+    for (size_t pos = b->pos; !b->marker && pos < b->end; left += 8) {
+        if (b->data[pos] == 0xFF) {
+            if (pos + 1 < b->end && b->data[pos + 1] != 0x00) break;
+            pos += 2;
+        } else {
+            pos++;
+        }
+    }
+    return left;
+}
+
+// br_restart: skips the RSTn marker at the end of a restart interval
+int br_restart(BitReader *b) {
+    b->acc = 0;
+    b->bits = 0;
+    b->marker = 0;
+    b->padding = 0;
+    while (b->pos + 1 < b->end && !(b->data[b->pos] == 0xFF && b->data[b->pos + 1] >= 0xD0 && b->data[b->pos + 1] <= 0xD7))
+        b->pos++;
+    if (b->pos + 1 >= b->end) return -1;
+    b->pos += 2;
+    return 0;
+}
+
+int extend_value(unsigned v, int s) {
+    return (s && v < (1u << (s - 1))) ? (int)v - (1 << s) + 1 : (int)v;
+}
+
+// decode_block: one block in natural order; with dc_only the AC values are skipped
+// and only blk[0] is written
+int decode_block(BitReader *b, const HuffTable *dc, const HuffTable *ac, int *pred, int16_t *blk, int dc_only) {
+    int s = br_decode(b, dc);
+    if (s < 0 || s > 11) return -1;
+    *pred += extend_value(br_get(b, s), s);
+    blk[0] = (int16_t)*pred;
+    for (int k = 1; k < 64; k++) {
+        int rs = br_decode(b, ac);
+        if (rs < 0) return -1;
+        int r = rs >> 4;
+        s = rs & 15;
+        if (s == 0) {
+            if (r != 15) break;   // EOB
+            k += 15;
+            continue;
+        }
+        k += r;
+        if (k > 63 || s > 10) return -1;
+        if (dc_only) br_get(b, s);
+        else blk[JPEG_NATURAL_ORDER[k]] = (int16_t)extend_value(br_get(b, s), s);
+    }
+    return 0;
+}
+
+// Growable output buffer for the re-encoded JPEG
+typedef struct {
+    unsigned char *data;
+    size_t len;
+    size_t cap;
+    int failed;
+    uint64_t acc;   // entropy coder bit accumulator
+    int bits;
+} ByteBuf;
+
+void bb_put(ByteBuf *o, const void *p, size_t n) {
+    if (o->failed) return;
+    if (o->len + n > o->cap) {
+        size_t cap = o->cap ? o->cap : 65536;
+        while (cap < o->len + n) cap *= 2;
+        unsigned char *temp = realloc(o->data, cap);
+        if (!temp) {
+            o->failed = 1;
+            return;
+        }
+        o->data = temp;
+        o->cap = cap;
+    }
+    memcpy(o->data + o->len, p, n);
+    o->len += n;
+}
+
+void bb_marker(ByteBuf *o, int marker, size_t payload) {
+    unsigned char h[4] = { 0xFF, (unsigned char)marker, (unsigned char)((payload + 2) >> 8), (unsigned char)((payload + 2) & 0xFF) };
+    bb_put(o, h, 4);
+}
+
+void bb_bits(ByteBuf *o, unsigned v, int n) {
+    if (n == 0) return;
+    o->acc = (o->acc << n) | (v & ((1u << n) - 1));
+    o->bits += n;
+    while (o->bits >= 8) {
+        unsigned char c = (unsigned char)(o->acc >> (o->bits - 8));
+        bb_put(o, &c, 1);
+        if (c == 0xFF) {
+            unsigned char zero = 0;
+            bb_put(o, &zero, 1);
+        }
+        o->bits -= 8;
+    }
+}
+
+int bit_length(int v) {
+    int n = 0;
+    if (v < 0) v = -v;
+    while (v) {
+        n++;
+        v >>= 1;
+    }
+    return n;
+}
+
+// encode_block: writes one block, or with `freq` set only counts its symbols
+void encode_block(ByteBuf *o, const int16_t *blk, int *pred, const HuffTable *dc, const HuffTable *ac,
+                  long *dc_freq, long *ac_freq) {
+    int diff = blk[0] - *pred;
+    *pred = blk[0];
+    int n = bit_length(diff);
+    if (dc_freq) dc_freq[n]++;
+    else {
+        bb_bits(o, dc->ehufco[n], dc->ehufsi[n]);
+        bb_bits(o, (unsigned)(diff < 0 ? diff - 1 : diff), n);
+    }
+    int run = 0;
+    for (int k = 1; k < 64; k++) {
+        int v = blk[JPEG_NATURAL_ORDER[k]];
+        if (v == 0) {
+            run++;
+            continue;
+        }
+        while (run > 15) {
+            if (ac_freq) ac_freq[0xF0]++;
+            else bb_bits(o, ac->ehufco[0xF0], ac->ehufsi[0xF0]);
+            run -= 16;
+        }
+        n = bit_length(v);
+        int rs = (run << 4) | n;
+        if (ac_freq) ac_freq[rs]++;
+        else {
+            bb_bits(o, ac->ehufco[rs], ac->ehufsi[rs]);
+            bb_bits(o, (unsigned)(v < 0 ? v - 1 : v), n);
+        }
+        run = 0;
+    }
+    if (run) {
+        if (ac_freq) ac_freq[0]++;
+        else bb_bits(o, ac->ehufco[0], ac->ehufsi[0]);
+    }
+}
+
+// transform_block: output block from input block for the orientation's DCT-domain
+// operation: an optional transpose, then negation of odd horizontal (flip_u) and/or
+// odd vertical (flip_v) frequencies
+void transform_block(const int16_t *in, int16_t *out, int transpose, int flip_u, int flip_v) {
+    for (int v = 0; v < 8; v++) {
+        for (int u = 0; u < 8; u++) {
+            int c = transpose ? in[u * 8 + v] : in[v * 8 + u];
+            if ((flip_u && (u & 1)) ^ (flip_v && (v & 1))) c = -c;
+            out[v * 8 + u] = (int16_t)c;
+        }
+    }
+}
+
+// decode_jpeg_coefficients flags
+enum {
+    JPEG_DC_ONLY = 1,           // keep one DC value per block
+    JPEG_VERIFY = 2             // each scan must end at its marker, with RSTn in sequence
+};
+
+// Coefficients of a decoded baseline JPEG
+typedef struct {
+    int width, height, ncomp, hmax, vmax;
+    int dc_only;                // planes hold one DC value per block instead of 64
+    int verify;                 // JPEG_VERIFY was given
+    const char *error;          // why decoding failed
+    JpegComponent comp[4];
+    uint8_t qt[4][64];          // zigzag order
+    int qt_present[4];
+} JpegCoefficients;
+
+void jpeg_coefficients_free(JpegCoefficients *jc) {
+    for (int c = 0; c < 4; c++) {
+        free(jc->comp[c].coef);
+        jc->comp[c].coef = NULL;
+    }
+}
+
+// decode_scan: entropy-decodes one scan starting at `pos` into the component
+// planes. Returns the offset of the first byte after the scan data, or 0 on error.
+size_t decode_scan(const unsigned char *in, size_t size, size_t pos, JpegCoefficients *jc, const int *idx, int ns,
+                   const HuffTable *dc_tables, const HuffTable *ac_tables, int restart) {
+    BitReader b;
+    int preds[4] = { 0, 0, 0, 0 };
+    int units_x, units_y;
+    memset(&b, 0, sizeof(b));
+    b.data = in;
+    b.pos = pos;
+    b.end = size;
+    if (ns == 1) {
+        // A single-component scan is not interleaved: blocks in raster order,
+        // covering only the component's own (unpadded) size
+        JpegComponent *c = &jc->comp[idx[0]];
+        units_x = ((jc->width * c->h + jc->hmax - 1) / jc->hmax + 7) / 8;
+        units_y = ((jc->height * c->v + jc->vmax - 1) / jc->vmax + 7) / 8;
+    } else {
+        units_x = jc->comp[0].bw / jc->comp[0].h;
+        units_y = jc->comp[0].bh / jc->comp[0].v;
+    }
+    long unit = 0;
+    for (int uy = 0; uy < units_y; uy++) {
+        for (int ux = 0; ux < units_x; ux++, unit++) {
+            if (restart && unit && unit % restart == 0) {
+                if (jc->verify) {
+                    long left = br_leftover(&b);
+                    if (left < 0 || left >= 8) {
+                        jc->error = left < 0 ? "entropy-coded data cut short" : "extraneous bytes before a restart marker";
+                        return 0;
+                    }
+                    if (b.pos + 1 >= size || in[b.pos] != 0xFF || in[b.pos + 1] != 0xD0 + (unit / restart - 1) % 8) {
+                        jc->error = "restart marker missing or out of sequence";
+                        return 0;
+                    }
+                }
+                if (br_restart(&b) != 0) {
+                    jc->error = "restart marker missing";
+                    return 0;
+                }
+                memset(preds, 0, sizeof(preds));
+            }
+            for (int i = 0; i < ns; i++) {
+                JpegComponent *c = &jc->comp[idx[i]];
+                int nh = ns == 1 ? 1 : c->h, nv = ns == 1 ? 1 : c->v;
+                for (int by = 0; by < nv; by++) {
+                    for (int bx = 0; bx < nh; bx++) {
+                        size_t block = (size_t)(uy * nv + by) * c->bw + ux * nh + bx;
+                        int16_t *blk = c->coef + (jc->dc_only ? block : block * 64);
+                        if (decode_block(&b, &dc_tables[c->td], &ac_tables[c->ta], &preds[i], blk, jc->dc_only) != 0) {
+                            jc->error = "invalid Huffman code";
+                            return 0;
+                        }
+                        // A DC value is 8 times the block mean of level-shifted 8-bit samples
+                        int q = jc->qt[c->tq][0];
+                        if (jc->verify && abs(preds[i]) * q > 1024 + q) {
+                            jc->error = "DC value out of range";
+                            return 0;
+                        }
+                    }
+                }
+            }
+        }
+    }
+    if (jc->verify) {
+        long left = br_leftover(&b);
+        if (left < 0 || left >= 8) {
+            jc->error = left < 0 ? "entropy-coded data cut short" : "extraneous bytes after the last block";
+            return 0;
+        }
+    }
+    // The scan ends at the first marker that is not RSTn
+    pos = b.pos;
+    while (pos + 1 < size && !(in[pos] == 0xFF && in[pos + 1] != 0 && (in[pos + 1] < 0xD0 || in[pos + 1] > 0xD7)))
+        pos++;
+    return pos;
+}
+
+// decode_jpeg_coefficients: parses a baseline (SOF0/SOF1, 8-bit, Huffman) JPEG and
+// decodes all of its scans. APPn and COM segments, except an old EXIF, are appended
+// to `keep` if given. Returns 0 on success, -1 for other codings or corrupt data
+// (jc->error says which).
+int decode_jpeg_coefficients(const unsigned char *in, size_t size, JpegCoefficients *jc, ByteBuf *keep,
+                             int flags) {
+    HuffTable *dc_tables = calloc(4, sizeof(HuffTable));
+    HuffTable *ac_tables = calloc(4, sizeof(HuffTable));
+    int restart = 0, scanned = 0, rc = -1;
+    size_t pos = 2;
+    memset(jc, 0, sizeof(*jc));
+    jc->hmax = jc->vmax = 1;
+    jc->dc_only = (flags & JPEG_DC_ONLY) != 0;
+    jc->verify = (flags & JPEG_VERIFY) != 0;
+    if (!dc_tables || !ac_tables || size < 4 || in[0] != 0xFF || in[1] != 0xD8) goto out;
+
+    while (pos + 4 <= size) {
+        if (in[pos] != 0xFF) goto out;
+        int marker = in[pos + 1];
+        if (marker == 0xFF) {   // fill byte
+            pos++;
+            continue;
+        }
+        if (marker == 0xD9) break;
+        size_t len = ((size_t)in[pos + 2] << 8) | in[pos + 3];
+        if (len < 2 || pos + 2 + len > size) goto out;
+        const unsigned char *seg = in + pos + 4;
+        size_t seglen = len - 2;
+        if ((marker >= 0xE0 && marker <= 0xEF) || marker == 0xFE) {
+            if (keep && !(marker == 0xE1 && seglen >= 6 && memcmp(seg, "Exif\0\0", 6) == 0))
+                bb_put(keep, in + pos, 2 + len);
+        } else if (marker == 0xDB) {
+            size_t p = 0;
+            while (p < seglen) {
+                int pq = seg[p] >> 4, tq = seg[p] & 15;
+                if (tq > 3 || p + 1 + (pq ? 128 : 64) > seglen) goto out;
+                for (int i = 0; i < 64; i++) {
+                    // 16-bit tables are written back as 8-bit, so larger steps are not handled
+                    if (pq && seg[p + 1 + 2 * i]) goto out;
+                    jc->qt[tq][i] = pq ? seg[p + 2 + 2 * i] : seg[p + 1 + i];
+                }
+                jc->qt_present[tq] = 1;
+                p += 1 + (pq ? 128 : 64);
+            }
+        } else if (marker == 0xC4) {
+            size_t p = 0;
+            while (p < seglen) {
+                int tc = seg[p] >> 4, th = seg[p] & 15, total = 0;
+                if (tc > 1 || th > 3 || p + 17 > seglen) goto out;
+                HuffTable *t = tc ? &ac_tables[th] : &dc_tables[th];
+                memset(t, 0, sizeof(*t));
+                for (int i = 1; i <= 16; i++) total += t->bits[i] = seg[p + i];
+                if (total > 256 || p + 17 + total > seglen) goto out;
+                memcpy(t->vals, seg + p + 17, total);
+                if (huff_build(t) != 0) goto out;
+                t->defined = 1;
+                p += 17 + total;
+            }
+        } else if (marker == 0xDD) {
+            if (seglen < 2) goto out;
+            restart = (seg[0] << 8) | seg[1];
+        } else if (marker == 0xC0 || marker == 0xC1) {
+            if (jc->ncomp || seglen < 6 || seg[0] != 8) goto out;
+            jc->height = (seg[1] << 8) | seg[2];
+            jc->width = (seg[3] << 8) | seg[4];
+            jc->ncomp = seg[5];
+            if (jc->ncomp < 1 || jc->ncomp > 4 || seglen < 6 + 3 * (size_t)jc->ncomp || !jc->width || !jc->height)
+                goto out;
+            for (int c = 0; c < jc->ncomp; c++) {
+                JpegComponent *comp = &jc->comp[c];
+                comp->id = seg[6 + 3 * c];
+                comp->h = seg[7 + 3 * c] >> 4;
+                comp->v = seg[7 + 3 * c] & 15;
+                comp->tq = seg[8 + 3 * c];
+                if (comp->h < 1 || comp->h > 4 || comp->v < 1 || comp->v > 4 || comp->tq > 3) goto out;
+                if (comp->h > jc->hmax) jc->hmax = comp->h;
+                if (comp->v > jc->vmax) jc->vmax = comp->v;
+            }
+            int mcux = (jc->width + 8 * jc->hmax - 1) / (8 * jc->hmax);
+            int mcuy = (jc->height + 8 * jc->vmax - 1) / (8 * jc->vmax);
+            for (int c = 0; c < jc->ncomp; c++) {
+                JpegComponent *comp = &jc->comp[c];
+                comp->bw = mcux * comp->h;
+                comp->bh = mcuy * comp->v;
+                comp->coef = calloc((size_t)comp->bw * comp->bh, (jc->dc_only ? 1 : 64) * sizeof(int16_t));
+                if (!comp->coef) {
+                    perror("Failed to allocate memory for JPEG coefficients");
+                    goto out;
+                }
+            }
+        } else if (marker >= 0xC2 && marker <= 0xCF && marker != 0xC8 && marker != 0xCC) {
+            jc->error = "not a baseline JPEG";
+            goto out;   // progressive, lossless, hierarchical or arithmetic coding
+        } else if (marker == 0xDA) {
+            int ns = seglen ? seg[0] : 0, idx[4];
+            if (!jc->ncomp || ns < 1 || ns > jc->ncomp || seglen < 4 + 2 * (size_t)ns) goto out;
+            for (int i = 0; i < ns; i++) {
+                idx[i] = -1;
+                for (int c = 0; c < jc->ncomp; c++) {
+                    if (jc->comp[c].id == seg[1 + 2 * i]) idx[i] = c;
+                }
+                if (idx[i] < 0) goto out;
+                JpegComponent *comp = &jc->comp[idx[i]];
+                comp->td = seg[2 + 2 * i] >> 4;
+                comp->ta = seg[2 + 2 * i] & 15;
+                if (comp->td > 3 || comp->ta > 3 || !dc_tables[comp->td].defined || !ac_tables[comp->ta].defined)
+                    goto out;
+            }
+            pos = decode_scan(in, size, pos + 2 + len, jc, idx, ns, dc_tables, ac_tables, restart);
+            if (!pos) goto out;
+            for (int i = 0; i < ns; i++) {
+                if (!jc->comp[idx[i]].scanned) scanned++;
+                jc->comp[idx[i]].scanned = 1;
+            }
+            continue;
+        }
+        pos += 2 + len;
+    }
+    if (!jc->ncomp || scanned != jc->ncomp) {
+        jc->error = jc->ncomp ? "a component has no scan" : "no frame header";
+        goto out;
+    }
+    for (int c = 0; c < jc->ncomp; c++) {
+        if (!jc->qt_present[jc->comp[c].tq]) {
+            jc->error = "missing quantization table";
+            goto out;
+        }
+    }
+    rc = 0;
+out:
+    if (rc != 0 && !jc->error) jc->error = "malformed marker segment";
+    if (rc != 0) jpeg_coefficients_free(jc);
+    free(dc_tables);
+    free(ac_tables);
+    return rc;
+}
+
+// BlockSource: supplies block (bx, by) of component c of the frame being encoded,
+// coefficients quantized and in natural order
+typedef void (*BlockSource)(void *ctx, int c, int bx, int by, int16_t *blk);
+
+// encode_jpeg: appends DQT, SOF0, optimized DHT, one interleaved baseline scan and EOI
+// for the frame described by `frame` (size, components, sampling factors, zigzag
+// quantization tables; its coefficient planes are not used). Two passes over the
+// blocks: count symbols, then encode with Huffman tables built from the counts.
+int encode_jpeg(ByteBuf *o, const JpegCoefficients *frame, BlockSource source, void *ctx) {
+    HuffTable *enc = NULL;      // DC luminance, AC luminance, DC chroma, AC chroma
+    long (*freq)[256] = NULL;
+    int ncomp = frame->ncomp, rc = -1;
+    for (int t = 0; t < 4; t++) {
+        if (!frame->qt_present[t]) continue;
+        unsigned char q[65];
+        q[0] = (unsigned char)t;
+        memcpy(q + 1, frame->qt[t], 64);
+        bb_marker(o, 0xDB, sizeof(q));
+        bb_put(o, q, sizeof(q));
+    }
+    unsigned char sof[6 + 3 * 4] = { 8, (unsigned char)(frame->height >> 8), (unsigned char)frame->height,
+                                     (unsigned char)(frame->width >> 8), (unsigned char)frame->width,
+                                     (unsigned char)ncomp };
+    for (int c = 0; c < ncomp; c++) {
+        sof[6 + 3 * c] = (unsigned char)frame->comp[c].id;
+        sof[7 + 3 * c] = (unsigned char)((frame->comp[c].h << 4) | frame->comp[c].v);
+        sof[8 + 3 * c] = (unsigned char)frame->comp[c].tq;
+    }
+    bb_marker(o, 0xC0, 6 + 3 * ncomp);
+    bb_put(o, sof, 6 + 3 * ncomp);
+
+    freq = calloc(4, sizeof(*freq));
+    enc = calloc(4, sizeof(HuffTable));
+    if (!freq || !enc) goto out;
+    int mcux = (frame->width + 8 * frame->hmax - 1) / (8 * frame->hmax);
+    int mcuy = (frame->height + 8 * frame->vmax - 1) / (8 * frame->vmax);
+    for (int pass = 0; pass < 2; pass++) {
+        int preds[4] = { 0, 0, 0, 0 };
+        int units_x = ncomp == 1 ? (frame->width + 7) / 8 : mcux, units_y = ncomp == 1 ? (frame->height + 7) / 8 : mcuy;
+        for (int uy = 0; uy < units_y; uy++) {
+            for (int ux = 0; ux < units_x; ux++) {
+                for (int c = 0; c < ncomp; c++) {
+                    int nh = ncomp == 1 ? 1 : frame->comp[c].h, nv = ncomp == 1 ? 1 : frame->comp[c].v;
+                    int tbl = c == 0 ? 0 : 2;
+                    for (int by = 0; by < nv; by++) {
+                        for (int bx = 0; bx < nh; bx++) {
+                            int16_t blk[64];
+                            source(ctx, c, ux * nh + bx, uy * nv + by, blk);
+                            if (pass == 0)
+                                encode_block(o, blk, &preds[c], NULL, NULL, freq[tbl], freq[tbl + 1]);
+                            else
+                                encode_block(o, blk, &preds[c], &enc[tbl], &enc[tbl + 1], NULL, NULL);
+                        }
+                    }
+                }
+            }
+        }
+        if (pass == 1) break;
+        unsigned char dht[17 + 256];
+        for (int t = 0; t < (ncomp > 1 ? 4 : 2); t++) {
+            if (huff_optimal(freq[t], &enc[t]) != 0) goto out;
+            dht[0] = (unsigned char)(((t & 1) << 4) | (t >> 1));
+            memcpy(dht + 1, enc[t].bits + 1, 16);
+            memcpy(dht + 17, enc[t].vals, enc[t].count);
+            bb_marker(o, 0xC4, 17 + enc[t].count);
+            bb_put(o, dht, 17 + enc[t].count);
+        }
+        unsigned char sos[1 + 2 * 4 + 3];
+        sos[0] = (unsigned char)ncomp;
+        for (int c = 0; c < ncomp; c++) {
+            sos[1 + 2 * c] = (unsigned char)frame->comp[c].id;
+            sos[2 + 2 * c] = c == 0 ? 0x00 : 0x11;
+        }
+        sos[1 + 2 * ncomp] = 0;     // Ss, Se, Ah/Al of a sequential scan
+        sos[2 + 2 * ncomp] = 63;
+        sos[3 + 2 * ncomp] = 0;
+        bb_marker(o, 0xDA, 4 + 2 * ncomp);
+        bb_put(o, sos, 4 + 2 * ncomp);
+    }
+    bb_bits(o, 0x7F, 7);   // pad the last byte with 1-bits
+    bb_put(o, "\xFF\xD9", 2);
+    rc = o->failed ? -1 : 0;
+out:
+    free(enc);
+    free(freq);
+    return rc;
+}
+
+// Block mapping of a rotation: output block -> transformed input block
+typedef struct {
+    const JpegCoefficients *jc;
+    int transpose, flip_x, flip_y;
+    int mcux, mcuy;             // input MCU grid after trimming
+} RotateSource;
+
+void rotate_source_block(void *ctx, int c, int ox, int oy, int16_t *blk) {
+    const RotateSource *r = ctx;
+    const JpegComponent *comp = &r->jc->comp[c];
+    // Block grid of the transposed (not yet flipped) component
+    int gw = r->transpose ? r->mcuy * comp->v : r->mcux * comp->h;
+    int gh = r->transpose ? r->mcux * comp->h : r->mcuy * comp->v;
+    int gx = r->flip_x ? gw - 1 - ox : ox, gy = r->flip_y ? gh - 1 - oy : oy;
+    int ix = r->transpose ? gy : gx, iy = r->transpose ? gx : gy;
+    transform_block(comp->coef + ((size_t)iy * comp->bw + ix) * 64, blk, r->transpose, r->flip_x, r->flip_y);
+}
+
+// rotate_jpeg: rewrites a baseline JPEG so that it displays upright for EXIF
+// orientation 2-8. Returns 0 with a malloc'd JPEG and its new size in *out_w x *out_h,
+// or -1 if the preview uses a coding this does not handle.
+int rotate_jpeg(const unsigned char *in, size_t size, int orientation, unsigned char **out, size_t *out_size,
+                int *out_w, int *out_h) {
+    // Per orientation: transpose, then reverse the output x and/or y axis
+    static const int TRANSPOSE[9] = { 0, 0, 0, 0, 0, 1, 1, 1, 1 };
+    static const int FLIP_X[9] =    { 0, 0, 1, 1, 0, 0, 1, 1, 0 };
+    static const int FLIP_Y[9] =    { 0, 0, 0, 1, 1, 0, 0, 1, 1 };
+    JpegCoefficients jc, frame;
+    RotateSource src;
+    ByteBuf o;
+    int rc = -1;
+    memset(&o, 0, sizeof(o));
+    *out = NULL;
+    if (orientation < 2 || orientation > 8) return -1;
+    bb_put(&o, "\xFF\xD8", 2);
+    if (decode_jpeg_coefficients(in, size, &jc, &o, 0) != 0) {
+        free(o.data);
+        return -1;
+    }
+    int transpose = TRANSPOSE[orientation], flip_x = FLIP_X[orientation], flip_y = FLIP_Y[orientation];
+
+    // Trim the partial MCU row/column on each input axis that gets reversed: its
+    // padding would otherwise land on the leading edge
+    int rev_in_x = transpose ? flip_y : flip_x, rev_in_y = transpose ? flip_x : flip_y;
+    int tw = rev_in_x ? jc.width / (8 * jc.hmax) * (8 * jc.hmax) : jc.width;
+    int th = rev_in_y ? jc.height / (8 * jc.vmax) * (8 * jc.vmax) : jc.height;
+    if (tw == 0 || th == 0) goto out;   // smaller than one MCU
+
+    // Output frame: swapped size and sampling factors, quantization tables transposed
+    // along with the blocks
+    memset(&frame, 0, sizeof(frame));
+    frame.width = transpose ? th : tw;
+    frame.height = transpose ? tw : th;
+    frame.ncomp = jc.ncomp;
+    frame.hmax = transpose ? jc.vmax : jc.hmax;
+    frame.vmax = transpose ? jc.hmax : jc.vmax;
+    for (int c = 0; c < jc.ncomp; c++) {
+        frame.comp[c].id = jc.comp[c].id;
+        frame.comp[c].tq = jc.comp[c].tq;
+        frame.comp[c].h = transpose ? jc.comp[c].v : jc.comp[c].h;
+        frame.comp[c].v = transpose ? jc.comp[c].h : jc.comp[c].v;
+    }
+    for (int t = 0; t < 4; t++) {
+        if (!(frame.qt_present[t] = jc.qt_present[t])) continue;
+        uint8_t natural[64];
+        for (int i = 0; i < 64; i++) natural[JPEG_NATURAL_ORDER[i]] = jc.qt[t][i];
+        for (int i = 0; i < 64; i++) {
+            int n = JPEG_NATURAL_ORDER[i];
+            frame.qt[t][i] = transpose ? natural[(n % 8) * 8 + n / 8] : natural[n];
+        }
+    }
+    src.jc = &jc;
+    src.transpose = transpose;
+    src.flip_x = flip_x;
+    src.flip_y = flip_y;
+    src.mcux = (tw + 8 * jc.hmax - 1) / (8 * jc.hmax);
+    src.mcuy = (th + 8 * jc.vmax - 1) / (8 * jc.vmax);
+    if (encode_jpeg(&o, &frame, rotate_source_block, &src) != 0) {
+        fprintf(stderr, "Failed to allocate memory for the rotated JPEG\n");
+        goto out;
+    }
+    *out = o.data;
+    *out_size = o.len;
+    *out_w = frame.width;
+    *out_h = frame.height;
+    o.data = NULL;
+    rc = 0;
+out:
+    free(o.data);
+    jpeg_coefficients_free(&jc);
+    return rc;
+}
+
+// exif_orientation: Orientation (0x0112) from IFD0 of an "Exif\0\0" segment, 0 if
+// there is none. With reset set, the tag is rewritten to 1 (top-left) in place.
+int exif_orientation(unsigned char *exif, size_t size, int reset) {
+    if (!exif || size < 14 || memcmp(exif, "Exif\0\0", 6) != 0) return 0;
+    const unsigned char *tiff = exif + 6;
+    size_t tiffSize = size - 6;
+    int be = tiff[0] == 'M';
+    uint32_t ifd = be ? read32be(tiff, 4, tiffSize) : read32le(tiff, 4, tiffSize);
+    if (ifd + 2 > tiffSize) return 0;
+    uint16_t entries = be ? read16be(tiff, ifd, tiffSize) : read16le(tiff, ifd, tiffSize);
+    for (uint16_t i = 0; i < entries; i++) {
+        size_t entry = ifd + 2 + (size_t)i * 12;
+        if (entry + 12 > tiffSize) break;
+        uint16_t tag = be ? read16be(tiff, entry, tiffSize) : read16le(tiff, entry, tiffSize);
+        uint16_t type = be ? read16be(tiff, entry + 2, tiffSize) : read16le(tiff, entry + 2, tiffSize);
+        if (tag != 0x0112 || type != 3) continue;
+        int value = be ? read16be(tiff, entry + 8, tiffSize) : read16le(tiff, entry + 8, tiffSize);
+        if (reset) {
+            exif[6 + entry + 8] = be ? 0 : 1;
+            exif[6 + entry + 9] = be ? 1 : 0;
+        }
+        return value;
+    }
+    return 0;
+}
+
+// emit_jpeg: writes one -j output. With --rotate and an EXIF orientation other than
+// 1 the preview is first turned upright losslessly and written with Orientation = 1;
+// a preview that cannot be rotated is written as stored.
+int emit_jpeg(RangeReader *rd, const JpegInfo *jpeg, const unsigned char *exif, size_t exifSize,
+              OutputSink *sink, int *with_exif, int verbose) {
+    int orientation = g_rotate && exif ? exif_orientation((unsigned char *)exif, exifSize, 0) : 0;
+    if (orientation < 2 || orientation > 8)
+        return stream_jpeg(rd, jpeg->start, jpeg->size, exif, exifSize, sink, with_exif);
+
+    unsigned char *data = malloc(jpeg->size), *rotated = NULL, *patched = NULL;
+    size_t rotatedSize = 0;
+    int width = 0, height = 0, rc;
+    uint64_t t = trace_begin();
+    if (!data) {
+        perror("Failed to allocate memory for the preview to rotate");
+    } else if (!reader_read_full(rd, jpeg->start, data, jpeg->size)) {
+        fprintf(stderr, "Error reading JPEG data from CR3 file\n");
+    } else if (rotate_jpeg(data, jpeg->size, orientation, &rotated, &rotatedSize, &width, &height) != 0) {
+        fprintf(stderr, "Cannot rotate this preview losslessly (orientation %d), writing it as stored.\n", orientation);
+    } else {
+        patched = scratch_alloc(exifSize);
+    }
+    free(data);
+    trace_end("rotate", t, NULL);
+    if (!rotated || !patched) {
+        free(rotated);
+        return stream_jpeg(rd, jpeg->start, jpeg->size, exif, exifSize, sink, with_exif);
+    }
+    memcpy(patched, exif, exifSize);
+    exif_orientation(patched, exifSize, 1);
+    if (verbose)
+        fprintf(stderr, "Rotated preview losslessly for orientation %d (%dx%d)\n", orientation, width, height);
+    rc = write_jpeg_head(sink, patched, exifSize, with_exif);
+    if (rc == 0 && sink_write(sink, rotated + 2, rotatedSize - 2) != rotatedSize - 2) {
+        fprintf(stderr, "Failed to write rotated JPEG data to %s.\n", sink->to_stdout ? "stdout" : sink->path);
+        rc = -1;
+    }
+    free(rotated);
+    scratch_free(patched);
+    return rc;
+}
+
+// ----- Perceptual hash -----
+// --phash and --dupes: a 64-bit DCT hash computed from the DC coefficients of a
+// preview. Each DC value is the mean of an 8x8 block, so Huffman decoding alone
+// yields an image downscaled 8x, without any IDCT. The hash is the usual pHash:
+// the DC image is resampled to 32x32, its 8x8 lowest DCT frequencies are compared
+// against their median, one bit each.
+#define PHASH_SIZE 32
+#define PHASH_MIN_EDGE (PHASH_SIZE * 8)   // smallest preview that fills the 32x32 grid
+
+typedef struct {
+    char *path;
+    uint64_t hash;
+} PhashEntry;
+
+PhashEntry *g_phash_entries = NULL;
+size_t g_phash_count = 0;
+size_t g_phash_cap = 0;
+pthread_mutex_t g_phash_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// phash_dc_image: hash and mean color of a decoded DC-only JPEG
+void phash_dc_image(const JpegCoefficients *jc, uint64_t *hash, unsigned char rgb[3]) {
+    double mean[3] = { 0, 128, 128 };
+    double grid[PHASH_SIZE][PHASH_SIZE], rows[PHASH_SIZE][8], low[64], sorted[64];
+    double cos_table[128];   // cos(n * pi / 64), by recurrence so libm is not needed
+    int cw[4], ch[4];
+    for (int c = 0; c < jc->ncomp && c < 3; c++) {
+        const JpegComponent *comp = &jc->comp[c];
+        double q = jc->qt[comp->tq][0], sum = 0;
+        cw[c] = ((jc->width * comp->h + jc->hmax - 1) / jc->hmax + 7) / 8;
+        ch[c] = ((jc->height * comp->v + jc->vmax - 1) / jc->vmax + 7) / 8;
+        for (int y = 0; y < ch[c]; y++) {
+            for (int x = 0; x < cw[c]; x++) sum += comp->coef[(size_t)y * comp->bw + x];
+        }
+        mean[c] = sum * q / 8 / ((double)cw[c] * ch[c]) + 128;
+    }
+    // JFIF YCbCr to RGB
+    double r = mean[0] + 1.402 * (mean[2] - 128);
+    double g = mean[0] - 0.344136 * (mean[1] - 128) - 0.714136 * (mean[2] - 128);
+    double b = mean[0] + 1.772 * (mean[1] - 128);
+    rgb[0] = (unsigned char)(r < 0 ? 0 : r > 255 ? 255 : r + 0.5);
+    rgb[1] = (unsigned char)(g < 0 ? 0 : g > 255 ? 255 : g + 0.5);
+    rgb[2] = (unsigned char)(b < 0 ? 0 : b > 255 ? 255 : b + 0.5);
+
+    // Area-average the luma DC grid down (or up, for small previews) to 32x32
+    const JpegComponent *y = &jc->comp[0];
+    for (int ty = 0; ty < PHASH_SIZE; ty++) {
+        int y0 = ty * ch[0] / PHASH_SIZE, y1 = ((ty + 1) * ch[0] + PHASH_SIZE - 1) / PHASH_SIZE;
+        if (y1 <= y0) y1 = y0 + 1;
+        for (int tx = 0; tx < PHASH_SIZE; tx++) {
+            int x0 = tx * cw[0] / PHASH_SIZE, x1 = ((tx + 1) * cw[0] + PHASH_SIZE - 1) / PHASH_SIZE;
+            if (x1 <= x0) x1 = x0 + 1;
+            double sum = 0;
+            for (int sy = y0; sy < y1; sy++) {
+                for (int sx = x0; sx < x1; sx++) sum += y->coef[(size_t)sy * y->bw + sx];
+            }
+            grid[ty][tx] = sum / ((double)(y1 - y0) * (x1 - x0));
+        }
+    }
+    cos_table[0] = 1;
+    cos_table[1] = 0.99879545620517239;   // cos(pi / 64)
+    for (int n = 2; n < 128; n++) cos_table[n] = 2 * cos_table[1] * cos_table[n - 1] - cos_table[n - 2];
+    // Separable DCT-II, keeping only the 8 lowest frequencies in each direction
+    for (int ty = 0; ty < PHASH_SIZE; ty++) {
+        for (int k = 0; k < 8; k++) {
+            double sum = 0;
+            for (int x = 0; x < PHASH_SIZE; x++) sum += grid[ty][x] * cos_table[((2 * x + 1) * k) % 128];
+            rows[ty][k] = sum;
+        }
+    }
+    for (int k = 0; k < 8; k++) {
+        for (int u = 0; u < 8; u++) {
+            double sum = 0;
+            for (int yy = 0; yy < PHASH_SIZE; yy++) sum += rows[yy][u] * cos_table[((2 * yy + 1) * k) % 128];
+            low[k * 8 + u] = sum;
+        }
+    }
+    memcpy(sorted, low, sizeof(sorted));
+    qsort(sorted, 64, sizeof(double), compare_doubles);
+    double median = (sorted[31] + sorted[32]) / 2;
+    *hash = 0;
+    for (int i = 0; i < 64; i++) *hash = (*hash << 1) | (low[i] > median);
+}
+
+// phash_file: --phash / --dupes for one input. The smallest preview of at least
+// PHASH_MIN_EDGE pixels on both edges is used (THMB is too small), falling back to
+// the largest one that decodes.
+int phash_file(const char *cr3_path, int verbose) {
+    RangeReader *rd = reader_open(cr3_path, verbose);
+    if (!rd)
+        return -1;
+    JpegInfo *jpegs = NULL;
+    int count = 0, rc = -1;
+    if (locate_jpegs(rd, &jpegs, &count) != 0 || count == 0) {
+        fprintf(stderr, "No JPEG previews found in CR3 file: %s\n", cr3_path);
+        reader_close(rd);
+        scratch_free(jpegs);
+        return -1;
+    }
+    // Try previews from the smallest up
+    int *order = scratch_alloc(count * sizeof(int));
+    if (!order) {
+        reader_close(rd);
+        scratch_free(jpegs);
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        int j = i;
+        while (j > 0 && jpegs[order[j - 1]].size > jpegs[i].size) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = i;
+    }
+    uint64_t hash = 0;
+    unsigned char rgb[3];
+    for (int n = 0; n < count; n++) {
+        const JpegInfo *jpeg = &jpegs[order[n]];
+        int last = n == count - 1;
+        if (!last && jpeg->width && jpeg->height && (jpeg->width < PHASH_MIN_EDGE || jpeg->height < PHASH_MIN_EDGE))
+            continue;   // the container already says it is too small
+        unsigned char *data = malloc(jpeg->size);
+        JpegCoefficients jc;
+        if (!data)
+            break;
+        if (!reader_read_full(rd, jpeg->start, data, jpeg->size) ||
+            decode_jpeg_coefficients(data, jpeg->size, &jc, NULL, JPEG_DC_ONLY) != 0) {
+            free(data);
+            continue;
+        }
+        free(data);
+        if (!last && (jc.width < PHASH_MIN_EDGE || jc.height < PHASH_MIN_EDGE)) {
+            jpeg_coefficients_free(&jc);
+            continue;
+        }
+        phash_dc_image(&jc, &hash, rgb);
+        if (verbose)
+            fprintf(stderr, "%s: hashed JPEG at %zu (%dx%d)\n", cr3_path, jpeg->start, jc.width, jc.height);
+        jpeg_coefficients_free(&jc);
+        rc = 0;
+        break;
+    }
+    scratch_free(order);
+    scratch_free(jpegs);
+    reader_close(rd);
+    if (rc != 0) {
+        fprintf(stderr, "%s: no preview could be decoded for hashing\n", cr3_path);
+        return -1;
+    }
+    if (g_phash)
+        printf("%016llx\t#%02x%02x%02x\t%s\n", (unsigned long long)hash, rgb[0], rgb[1], rgb[2], cr3_path);
+    if (g_dupes_distance >= 0) {
+        pthread_mutex_lock(&g_phash_lock);
+        if (g_phash_count == g_phash_cap) {
+            size_t cap = g_phash_cap ? g_phash_cap * 2 : 256;
+            PhashEntry *temp = realloc(g_phash_entries, cap * sizeof(PhashEntry));
+            if (temp) {
+                g_phash_entries = temp;
+                g_phash_cap = cap;
+            }
+        }
+        char *path = strdup(cr3_path);
+        if (path && g_phash_count < g_phash_cap) {
+            g_phash_entries[g_phash_count].path = path;
+            g_phash_entries[g_phash_count].hash = hash;
+            g_phash_count++;
+        } else {
+            free(path);
+            rc = -1;
+        }
+        pthread_mutex_unlock(&g_phash_lock);
+    }
+    return rc;
+}
+
+int compare_phash_paths(const void *a, const void *b) {
+    return strcmp(((const PhashEntry *)a)->path, ((const PhashEntry *)b)->path);
+}
+
+int phash_root(int *parent, int i) {
+    while (parent[i] != i) {
+        parent[i] = parent[parent[i]];
+        i = parent[i];
+    }
+    return i;
+}
+
+// report_duplicates: --dupes; groups inputs whose hashes differ in at most
+// g_dupes_distance bits (transitively) and prints each group of two or more as
+// "group<TAB>hash<TAB>path" lines
+void report_duplicates(void) {
+    size_t n = g_phash_count, groups = 0;
+    int *parent = malloc((n ? n : 1) * sizeof(int));
+    if (!parent) {
+        perror("Failed to allocate memory for duplicate grouping");
+        return;
+    }
+    // Workers finish in any order; sorting by path keeps the report stable
+    qsort(g_phash_entries, n, sizeof(PhashEntry), compare_phash_paths);
+    for (size_t i = 0; i < n; i++) parent[i] = (int)i;
+    for (size_t i = 0; i < n; i++) {
+        for (size_t j = i + 1; j < n; j++) {
+            if (__builtin_popcountll(g_phash_entries[i].hash ^ g_phash_entries[j].hash) <= g_dupes_distance) {
+                int a = phash_root(parent, (int)i), b = phash_root(parent, (int)j);
+                if (a != b) parent[b < a ? a : b] = b < a ? b : a;
+            }
+        }
+    }
+    // Groups are numbered by the path order of their first member
+    for (size_t i = 0; i < n; i++) {
+        if (phash_root(parent, (int)i) != (int)i) continue;
+        size_t members = 0;
+        for (size_t j = i; j < n; j++) members += phash_root(parent, (int)j) == (int)i;
+        if (members < 2) continue;
+        groups++;
+        for (size_t j = i; j < n; j++) {
+            if (phash_root(parent, (int)j) == (int)i)
+                printf("%zu\t%016llx\t%s\n", groups, (unsigned long long)g_phash_entries[j].hash, g_phash_entries[j].path);
+        }
+    }
+    fprintf(stderr, "Duplicates: %zu group%s among %zu hashed input%s (distance <= %d)\n", groups, groups == 1 ? "" : "s",
+            n, n == 1 ? "" : "s", g_dupes_distance);
+    free(parent);
+    for (size_t i = 0; i < n; i++) free(g_phash_entries[i].path);
+    free(g_phash_entries);
+    g_phash_entries = NULL;
+    g_phash_count = g_phash_cap = 0;
+}
+
+// ----- Marker walker -----
+// --walk replaces SOI/EOI byte pairing with a walk of each JPEG's structure: from
+// an FF D8 FF candidate, marker segments (APPn, DQT, DHT, SOFn, ...) are skipped by
+// their length fields, and only entropy-coded data is searched, for the marker that
+// ends it (stuffed FF 00 and RSTn are part of the scan). An EXIF thumbnail nested
+// in APP1, or FF D9 bytes inside a segment, therefore cannot split or end a
+// preview, and a candidate whose segments do not chain up is discarded. The SOF
+// gives each preview's size and component layout on the way.
+
+// Structure of one JPEG as seen by jpeg_walk
+typedef struct {
+    uint64_t end;               // offset after EOI
+    int sof;                    // SOFn marker, 0 if none seen
+    int width, height;
+    int ncomp;
+    uint8_t sampling[4];        // per component: h << 4 | v
+    int scans;
+} JpegLayout;
+
+// Bytes of the previous buffer a WalkReader keeps, so that a marker split across
+// two buffers can be read back without restarting the stream
+#define WALK_TAIL 16
+
+// One read-ahead stream for a whole walk. It follows the walk forward from the
+// first entropy-coded scan and restarts only when the walk goes back further than
+// WALK_TAIL bytes or jumps far ahead. Until it starts, headers are read through the
+// RangeReader directly, so a header-only walk never starts a producer thread; once
+// it has, every read goes through the stream, whose producer owns the RangeReader.
+typedef struct {
+    RangeReader *rd;
+    ReadAhead ra;
+    int started;
+    uint64_t base;              // file offset of buf[0]
+    const unsigned char *buf;
+    size_t len;
+    unsigned char tail[WALK_TAIL];  // the bytes just before base
+    size_t tail_len;
+} WalkReader;
+
+void walk_reader_init(WalkReader *w, RangeReader *rd) {
+    memset(w, 0, sizeof(*w));
+    w->rd = rd;
+}
+
+void walk_reader_close(WalkReader *w) {
+    if (w->started) readahead_stop(&w->ra);
+    w->started = 0;
+}
+
+// walk_reader_at: moves the stream so that pos lies in the current buffer. Returns
+// 1, 0 at the end of the input or -1 on a read error.
+int walk_reader_at(WalkReader *w, uint64_t pos) {
+    if (!w->started || pos < w->base || pos - w->base > w->len + 4 * (uint64_t)w->ra.size) {
+        walk_reader_close(w);
+        if (readahead_start(&w->ra, w->rd, pos, UINT64_MAX) != 0)
+            return -1;
+        w->started = 1;
+        w->base = pos;
+        w->len = 0;
+        w->tail_len = 0;
+    }
+    while (pos >= w->base + w->len) {
+        size_t keep = w->len < WALK_TAIL ? w->len : WALK_TAIL;
+        size_t old = w->tail_len < WALK_TAIL - keep ? w->tail_len : WALK_TAIL - keep;
+        memmove(w->tail, w->tail + w->tail_len - old, old);
+        if (keep) memcpy(w->tail + old, w->buf + w->len - keep, keep);
+        w->tail_len = old + keep;
+        w->base += w->len;
+        w->len = 0;
+        long long got = readahead_next(&w->ra, &w->buf);
+        if (got <= 0)
+            return got < 0 ? -1 : 0;
+        w->len = (size_t)got;
+    }
+    return 1;
+}
+
+// walk_read: copies len bytes at pos. Returns 1, 0 if the input ends first or -1 on
+// a read error.
+int walk_read(WalkReader *w, uint64_t pos, unsigned char *out, size_t len) {
+    if (!w->started) {
+        long long got = reader_read(w->rd, pos, out, len);
+        return got == (long long)len ? 1 : got < 0 ? -1 : 0;
+    }
+    if (pos < w->base && w->base - pos <= w->tail_len) {
+        size_t back = (size_t)(w->base - pos), n = back < len ? back : len;
+        memcpy(out, w->tail + w->tail_len - back, n);
+        out += n;
+        pos += n;
+        len -= n;
+    }
+    while (len) {
+        int r = walk_reader_at(w, pos);
+        if (r != 1)
+            return r;
+        size_t off = (size_t)(pos - w->base), n = w->len - off < len ? w->len - off : len;
+        memcpy(out, w->buf + off, n);
+        out += n;
+        pos += n;
+        len -= n;
+    }
+    return 1;
+}
+
+// jpeg_scan_end: offset of the first marker after the entropy-coded data at pos,
+// or UINT64_MAX if none before limit
+uint64_t jpeg_scan_end(WalkReader *w, uint64_t pos, uint64_t limit) {
+    while (pos < limit) {
+        if (walk_reader_at(w, pos) != 1)
+            return UINT64_MAX;
+        size_t off = (size_t)(pos - w->base), n = w->len;
+        if (limit - w->base < n) n = (size_t)(limit - w->base);
+        const unsigned char *p = memchr(w->buf + off, 0xFF, n - off);
+        if (!p) {
+            pos = w->base + n;
+            continue;
+        }
+        // Fill bytes: FF FF ... continue the marker, which may start the next buffer
+        unsigned char c = 0xFF;
+        pos = w->base + (size_t)(p - w->buf) + 1;
+        while (c == 0xFF && pos < limit) {
+            if (walk_read(w, pos, &c, 1) != 1)
+                return UINT64_MAX;
+            pos++;
+        }
+        if (c == 0xFF)
+            break;
+        if (c != 0x00 && (c < 0xD0 || c > 0xD7))
+            return pos - 2;
+    }
+    return UINT64_MAX;
+}
+
+// jpeg_walk_stream: jpeg_walk on a walk's stream
+int jpeg_walk_stream(WalkReader *w, uint64_t start, uint64_t limit, int header_only, JpegLayout *layout) {
+    unsigned char h[4 + 6 + 3 * 4];
+    uint64_t pos = start + 2;
+    memset(layout, 0, sizeof(*layout));
+    if (limit > w->rd->size) limit = w->rd->size;
+    if (start + 4 > limit || walk_read(w, start, h, 2) != 1 || h[0] != 0xFF || h[1] != 0xD8)
+        return -1;
+    while (pos + 2 <= limit) {
+        if (walk_read(w, pos, h, 2) != 1 || h[0] != 0xFF)
+            return -1;
+        int marker = h[1];
+        if (marker == 0xFF) {   // fill byte
+            pos++;
+            continue;
+        }
+        if (marker == 0xD9) {
+            if (!layout->scans) return -1;
+            layout->end = pos + 2;
+            return 0;
+        }
+        if (marker < 0xC0 || marker == 0xD8 || (marker >= 0xD0 && marker <= 0xD7))
+            return -1;
+        if (pos + 4 > limit || walk_read(w, pos + 2, h + 2, 2) != 1)
+            return -1;
+        size_t len = ((size_t)h[2] << 8) | h[3];
+        if (len < 2 || pos + 2 + len > limit)
+            return -1;
+        if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+            if (layout->sof || len < 8 || walk_read(w, pos + 4, h + 4, 6) != 1)
+                return -1;
+            layout->sof = marker;
+            layout->height = (h[5] << 8) | h[6];
+            layout->width = (h[7] << 8) | h[8];
+            layout->ncomp = h[9];
+            if (layout->ncomp < 1 || len != 8 + 3 * (size_t)layout->ncomp)
+                return -1;
+            if (layout->ncomp <= 4 && walk_read(w, pos + 10, h + 10, 3 * layout->ncomp) == 1) {
+                for (int c = 0; c < layout->ncomp; c++)
+                    layout->sampling[c] = h[11 + 3 * c];
+            }
+            if (header_only)
+                return layout->width ? 0 : -1;
+        } else if (marker == 0xDA) {
+            if (!layout->sof)
+                return -1;
+            layout->scans++;
+            uint64_t next = jpeg_scan_end(w, pos + 2 + len, limit);
+            if (next == UINT64_MAX)
+                return -1;
+            pos = next;
+            continue;
+        }
+        pos += 2 + len;
+    }
+    return -1;
+}
+
+// jpeg_walk: follows the JPEG at `start` segment by segment, up to limit. With
+// header_only it stops at the SOF. Returns 0 with the layout, or -1 if the bytes are
+// not a well-formed JPEG (no SOF before the first scan, a bad length, a marker where
+// none is allowed, or no EOI before limit).
+int jpeg_walk(RangeReader *rd, uint64_t start, uint64_t limit, int header_only, JpegLayout *layout) {
+    WalkReader w;
+    walk_reader_init(&w, rd);
+    int rc = jpeg_walk_stream(&w, start, limit, header_only, layout);
+    walk_reader_close(&w);
+    return rc;
+}
+
+// find_next_soi: offset of the next FF D8 FF at or after pos, UINT64_MAX if there is
+// none, or UINT64_MAX - 1 on a read error
+uint64_t find_next_soi(WalkReader *w, uint64_t pos) {
+    for (;;) {
+        int r;
+        if (!w->started || pos >= w->base) {
+            if ((r = walk_reader_at(w, pos)) != 1)
+                return r < 0 ? UINT64_MAX - 1 : UINT64_MAX;
+            size_t off = (size_t)(pos - w->base);
+            const unsigned char *p = memchr(w->buf + off, 0xFF, w->len - off);
+            if (!p) {
+                pos = w->base + w->len;
+                continue;
+            }
+            size_t i = (size_t)(p - w->buf);
+            if (i + 3 <= w->len) {
+                if (p[1] == 0xD8 && p[2] == 0xFF)
+                    return w->base + i;
+                pos = w->base + i + 1;
+                continue;
+            }
+            pos = w->base + i;
+        }
+        // A candidate that runs into the next buffer, or one that starts in the bytes
+        // kept from the previous one after reading it
+        unsigned char m[3];
+        if ((r = walk_read(w, pos, m, 3)) != 1)
+            return r < 0 ? UINT64_MAX - 1 : UINT64_MAX;
+        if (m[0] == 0xFF && m[1] == 0xD8 && m[2] == 0xFF)
+            return pos;
+        pos++;
+    }
+}
+
+// find_all_jpegs_walked: --walk; every SOI candidate is walked, a valid JPEG is
+// recorded with its SOF size and the search resumes after its EOI
+int find_all_jpegs_walked(RangeReader *rd, JpegInfo **jpegs, int *count) {
+    int capacity = 0, candidates = 0, rc = 0;
+    uint64_t pos = 0;
+    WalkReader w;
+    walk_reader_init(&w, rd);
+    *jpegs = NULL;
+    *count = 0;
+    for (;;) {
+        uint64_t soi = find_next_soi(&w, pos);
+        if (soi == UINT64_MAX)
+            break;
+        // Every walked FF D8 counts against --max-previews, well-formed or not
+        if (soi == UINT64_MAX - 1 || limit_previews(++candidates) != 0) {
+            if (budget_check(rd->budget) == 0)
+                fprintf(stderr, "Error reading input file during JPEG search\n");
+            rc = -1;
+            break;
+        }
+        JpegLayout layout;
+        if (jpeg_walk_stream(&w, soi, UINT64_MAX, 0, &layout) != 0) {
+            if (rd->verbose)
+                fprintf(stderr, "Skipping FF D8 at %llu: not a well-formed JPEG\n", (unsigned long long)soi);
+            pos = soi + 2;
+            continue;
+        }
+        if (rd->verbose) {
+            fprintf(stderr, "JPEG at %llu: %llu bytes, %dx%d, SOF%d, %d scan%s, sampling",
+                    (unsigned long long)soi, (unsigned long long)(layout.end - soi), layout.width, layout.height,
+                    layout.sof - 0xC0, layout.scans, layout.scans == 1 ? "" : "s");
+            for (int c = 0; c < layout.ncomp && c < 4; c++)
+                fprintf(stderr, "%s%dx%d", c ? "," : " ", layout.sampling[c] >> 4, layout.sampling[c] & 15);
+            fprintf(stderr, "\n");
+        }
+        if (add_preview(jpegs, count, &capacity, (size_t)soi, (size_t)(layout.end - soi), JPEG_FROM_SCAN,
+                        (uint16_t)layout.width, (uint16_t)layout.height) != 0) {
+            rc = -1;
+            break;
+        }
+        pos = layout.end;
+    }
+    walk_reader_close(&w);
+    if (rc != 0) {
+        scratch_free(*jpegs);
+        *jpegs = NULL;
+        *count = 0;
+    }
+    return rc;
+}
+
+// ----- TIFF container (CR2, DNG) -----
+// CR2, DNG and most other TIFF-based raw files say where their JPEGs are: an IFD
+// with Compression 6 or 7 has its image in a single strip (StripOffsets and
+// StripByteCounts), and the EXIF-style JPEGInterchangeFormat tags point at
+// thumbnails. The IFD chain and the SubIFDs (where DNG keeps its previews) are
+// followed from the header. The raw image itself is lossless JPEG in CR2 and many
+// DNGs, so each candidate's SOF is read and lossless frames are skipped. Only the
+// IFDs and the first bytes of each preview are read. Files are told apart by their
+// first bytes: "II*\0" or "MM\0*" is TIFF, anything else is handled as CR3.
+
+#define TIFF_MAX_IFDS 32
+#define TIFF_MAX_ENTRIES 1024
+#define TIFF_EXIF_VALUE_MAX 4096    // larger values (maker notes, XMP, ICC) are not copied
+
+uint16_t tiff16(const unsigned char *data, size_t offset, size_t dataSize, int be) {
+    return be ? read16be(data, offset, dataSize) : read16le(data, offset, dataSize);
+}
+
+uint32_t tiff32(const unsigned char *data, size_t offset, size_t dataSize, int be) {
+    return be ? read32be(data, offset, dataSize) : read32le(data, offset, dataSize);
+}
+
+void tiff_put16(unsigned char *p, uint16_t v, int be) {
+    p[be ? 0 : 1] = (unsigned char)(v >> 8);
+    p[be ? 1 : 0] = (unsigned char)v;
+}
+
+void tiff_put32(unsigned char *p, uint32_t v, int be) {
+    for (int i = 0; i < 4; i++)
+        p[be ? 3 - i : i] = (unsigned char)(v >> (8 * i));
+}
+
+// tiff_byte_order: 0 for a little-endian TIFF file, 1 for big-endian, -1 if the
+// file does not start with a TIFF header
+int tiff_byte_order(RangeReader *rd) {
+    unsigned char h[4];
+    if (rd->size < 8 || !reader_read_full(rd, 0, h, 4)) return -1;
+    if (memcmp(h, "II*\0", 4) == 0) return 0;
+    if (memcmp(h, "MM\0*", 4) == 0) return 1;
+    return -1;
+}
+
+// tiff_type_size: bytes per value of a TIFF field type, 0 if unknown
+size_t tiff_type_size(uint16_t type) {
+    static const unsigned char sizes[] = { 0, 1, 1, 2, 4, 8, 1, 1, 2, 4, 8, 4, 8, 4 };
+    return type < sizeof(sizes) ? sizes[type] : 0;
+}
+
+// tiff_read_ifd: reads the entry count, entries and next-IFD offset of the IFD at
+// offset into scratch memory. Returns the entry count, or -1 if the IFD is out of
+// bounds or implausible.
+int tiff_read_ifd(RangeReader *rd, uint64_t offset, int be, unsigned char **ifd) {
+    unsigned char n[2];
+    *ifd = NULL;
+    if (offset < 8 || offset + 2 > rd->size || !reader_read_full(rd, offset, n, 2)) return -1;
+    uint16_t count = tiff16(n, 0, 2, be);
+    size_t size = 2 + (size_t)count * 12 + 4;
+    if (count == 0 || count > TIFF_MAX_ENTRIES || offset + size > rd->size || limit_metadata(size) != 0) return -1;
+    *ifd = scratch_alloc(size);
+    if (!*ifd) return -1;
+    if (!reader_read_full(rd, offset, *ifd, size)) {
+        scratch_free(*ifd);
+        *ifd = NULL;
+        return -1;
+    }
+    return count;
+}
+
+// tiff_add_candidate: adds the JPEG at [start, start + size) unless it is already
+// listed, lies outside the file or is not a lossy JPEG frame (the raw data itself)
+int tiff_add_candidate(RangeReader *rd, uint64_t start, uint64_t size, JpegInfo **jpegs, int *count,
+                       int *capacity) {
+    JpegLayout layout;
+    if (size < 4 || start > rd->size || size > rd->size - start) return 0;
+    for (int i = 0; i < *count; i++)
+        if ((*jpegs)[i].start == start) return 0;
+    if (jpeg_walk(rd, start, start + size, 1, &layout) != 0) return 0;
+    if (layout.sof == 0xC3 || layout.sof == 0xC7 || layout.sof == 0xCB || layout.sof == 0xCF) return 0;
+    return add_preview(jpegs, count, capacity, (size_t)start, (size_t)size, JPEG_FROM_IFD,
+                       (uint16_t)layout.width, (uint16_t)layout.height);
+}
+
+int compare_jpeg_size(const void *a, const void *b) {
+    size_t sa = ((const JpegInfo *)a)->size, sb = ((const JpegInfo *)b)->size;
+    return (sa > sb) - (sa < sb);
+}
+
+// locate_previews_ifds: builds the preview list of a TIFF-based raw file from its
+// IFDs, smallest first (so -j 1|2|3 go from thumbnail to full-size like in a CR3).
+// A broken IFD ends the walk; if broken is given (--verify) it is an error instead.
+// Returns 0, -1 on allocation failure, or -2 with *broken set to the bad IFD offset.
+int locate_previews_ifds(RangeReader *rd, int be, JpegInfo **jpegs, int *count, uint64_t *broken) {
+    uint64_t queue[TIFF_MAX_IFDS];
+    unsigned char h[8];
+    int queued = 0, capacity = 0, rc = 0;
+    *jpegs = NULL;
+    *count = 0;
+    queue[queued++] = reader_read_full(rd, 0, h, 8) ? tiff32(h, 4, 8, be) : 0;
+    for (int next = 0; next < queued && rc == 0; next++) {
+        unsigned char *ifd;
+        int n = tiff_read_ifd(rd, queue[next], be, &ifd);
+        if (n < 0) {
+            if (broken) {
+                *broken = queue[next];
+                rc = -2;
+            }
+            break;
+        }
+        size_t size = 2 + (size_t)n * 12 + 4;
+        uint32_t compression = 0, strip = 0, strip_bytes = 0, strips = 0, jif = 0, jif_bytes = 0;
+        uint32_t sub_count = 0, sub_value = 0;
+        for (int i = 0; i < n; i++) {
+            size_t e = 2 + (size_t)i * 12;
+            uint16_t tag = tiff16(ifd, e, size, be), type = tiff16(ifd, e + 2, size, be);
+            uint32_t cnt = tiff32(ifd, e + 4, size, be);
+            uint32_t value = type == 3 ? tiff16(ifd, e + 8, size, be) : tiff32(ifd, e + 8, size, be);
+            switch (tag) {
+            case 0x0103: compression = value; break;
+            case 0x0111: strip = value; strips = cnt; break;
+            case 0x0117: strip_bytes = value; break;
+            case 0x0201: jif = value; break;
+            case 0x0202: jif_bytes = value; break;
+            case 0x014A: sub_count = cnt; sub_value = value; break;
+            }
+        }
+        uint32_t next_ifd = tiff32(ifd, size - 4, size, be);
+        scratch_free(ifd);
+        // Compression 6 (old JPEG), 7 (JPEG) and 34892 (DNG lossy JPEG)
+        if ((compression == 6 || compression == 7 || compression == 34892) && strips == 1)
+            rc = tiff_add_candidate(rd, strip, strip_bytes, jpegs, count, &capacity);
+        if (rc == 0 && jif && jif_bytes)
+            rc = tiff_add_candidate(rd, jif, jif_bytes, jpegs, count, &capacity);
+        // Offsets of SubIFDs: inline if there is one, otherwise an array of LONGs
+        for (uint32_t i = 0; rc == 0 && i < sub_count && queued < TIFF_MAX_IFDS; i++) {
+            uint64_t sub = sub_value;
+            if (sub_count > 1) {
+                unsigned char v[4];
+                if (!reader_read_full(rd, (uint64_t)sub_value + 4 * i, v, 4)) break;
+                sub = tiff32(v, 0, 4, be);
+            }
+            int seen = 0;
+            for (int j = 0; j < queued; j++) seen |= queue[j] == sub;
+            if (!seen) queue[queued++] = sub;
+        }
+        if (next_ifd && queued < TIFF_MAX_IFDS) {
+            int seen = 0;
+            for (int j = 0; j < queued; j++) seen |= queue[j] == next_ifd;
+            if (!seen) queue[queued++] = next_ifd;
+        }
+    }
+    if (rc != 0) {
+        scratch_free(*jpegs);
+        *jpegs = NULL;
+        *count = 0;
+        return rc;
+    }
+    if (*count > 1)
+        qsort(*jpegs, *count, sizeof(JpegInfo), compare_jpeg_size);
+    return 0;
+}
+
+// tiff_exif_tag_skipped: tags not copied into the EXIF of a preview: the layout of
+// the raw image (size, compression, strips, tiles, SubIFDs), the thumbnail pointers,
+// XMP, the DNG tags, and in sub-IFDs the maker note and the Interoperability pointer,
+// whose offsets would no longer hold
+int tiff_exif_tag_skipped(uint16_t tag, int depth) {
+    static const uint16_t layout[] = { 0x00FE, 0x00FF, 0x0100, 0x0101, 0x0102, 0x0103, 0x0106, 0x0111, 0x0115,
+                                       0x0116, 0x0117, 0x011C, 0x0142, 0x0143, 0x0144, 0x0145, 0x014A, 0x0201,
+                                       0x0202, 0x02BC };
+    for (size_t i = 0; i < sizeof(layout) / sizeof(layout[0]); i++)
+        if (tag == layout[i]) return 1;
+    if (tag >= 0xC612) return 1;
+    if (depth > 0) return tag == 0x927C || tag == 0xA005 || tag == 0x8769 || tag == 0x8825;
+    return 0;
+}
+
+// tiff_copy_ifd: appends a copy of the IFD at file offset `offset` to the TIFF being
+// built in out[0, cap): first its out-of-line values, then the IFD itself, then (for
+// IFD0) the Exif and GPS IFDs it points to. Values stay in the source byte order.
+// Returns the new IFD offset, or 0 on error.
+uint32_t tiff_copy_ifd(RangeReader *rd, uint64_t offset, int be, int depth, unsigned char *out, size_t *len,
+                       size_t cap) {
+    unsigned char *ifd;
+    int n = tiff_read_ifd(rd, offset, be, &ifd);
+    if (n < 0) return 0;
+    int kept = 0, ok = 1;
+    // Pass 1: keep entries and place their out-of-line values
+    for (int i = 0; i < n && ok; i++) {
+        unsigned char *e = ifd + 2 + (size_t)i * 12;
+        uint16_t tag = tiff16(e, 0, 12, be);
+        uint64_t bytes = (uint64_t)tiff_type_size(tiff16(e, 2, 12, be)) * tiff32(e, 4, 12, be);
+        if (tiff_exif_tag_skipped(tag, depth) || bytes == 0 || bytes > TIFF_EXIF_VALUE_MAX) continue;
+        if (bytes > 4) {
+            uint32_t from = tiff32(e, 8, 12, be);
+            *len += *len & 1;
+            if (*len + bytes > cap || !reader_read_full(rd, from, out + *len, (size_t)bytes)) {
+                ok = 0;
+                break;
+            }
+            tiff_put32(e + 8, (uint32_t)*len, be);
+            *len += (size_t)bytes;
+        }
+        memmove(ifd + 2 + (size_t)kept * 12, e, 12);
+        kept++;
+    }
+    *len += *len & 1;
+    uint32_t at = (uint32_t)*len;
+    if (!ok || *len + 2 + (size_t)kept * 12 + 4 > cap) {
+        scratch_free(ifd);
+        return 0;
+    }
+    *len += 2 + (size_t)kept * 12 + 4;
+    int reserved = kept;
+    // Pass 2: Exif and GPS IFDs follow IFD0, so minimizing IFD0 can cut them off
+    for (int i = 0; i < kept; i++) {
+        unsigned char *e = ifd + 2 + (size_t)i * 12;
+        uint16_t tag = tiff16(e, 0, 12, be);
+        if (depth == 0 && (tag == 0x8769 || tag == 0x8825)) {
+            uint32_t sub = tiff_copy_ifd(rd, tiff32(e, 8, 12, be), be, depth + 1, out, len, cap);
+            if (sub) {
+                tiff_put32(e + 8, sub, be);
+            } else {        // leave out a pointer to an unreadable or oversized IFD
+                memmove(e, e + 12, (size_t)(kept - i - 1) * 12);
+                kept--;
+                i--;
+            }
+        }
+    }
+    tiff_put16(ifd, (uint16_t)kept, be);
+    memcpy(out + at, ifd, 2 + (size_t)kept * 12);
+    memset(out + at + 2 + (size_t)kept * 12, 0, 4 + (size_t)(reserved - kept) * 12);
+    scratch_free(ifd);
+    return at;
+}
+
+// extract_tiff_exif: EXIF segment ("Exif\0\0" + a new TIFF) built from IFD0 of a
+// TIFF-based raw file and its Exif and GPS IFDs. Returns 1 on success, like
+// extractCr3Exif_streaming.
+int extract_tiff_exif(RangeReader *rd, int be, unsigned char **exifSegment, size_t *exifSize, int verbose) {
+    unsigned char h[8];
+    size_t cap = 65533 - 6, len = 8;
+    unsigned char *segment = scratch_alloc(6 + cap);
+    if (!segment) {
+        fprintf(stderr, "Memory allocation failed for EXIF segment\n");
+        return 0;
+    }
+    unsigned char *tiff = segment + 6;
+    memcpy(segment, "Exif\0\0", 6);
+    uint32_t ifd0 = 0;
+    if (reader_read_full(rd, 0, h, 8)) {
+        memcpy(tiff, h, 4);
+        ifd0 = tiff_copy_ifd(rd, tiff32(h, 4, 8, be), be, 0, tiff, &len, cap);
+    }
+    if (!ifd0) {
+        if (verbose) fprintf(stderr, "No usable IFD0 for EXIF in TIFF file.\n");
+        scratch_free(segment);
+        return 0;
+    }
+    tiff_put32(tiff + 4, ifd0, be);
+    *exifSegment = scratch_realloc(segment, 6 + len);
+    if (!*exifSegment) *exifSegment = segment;
+    *exifSize = 6 + len;
+    return 1;
+}
+
+// ----- Preview selection -----
+// --min-long-edge / --max-bytes: choose a preview by its pixel size or byte cost
+// rather than by position, which differs between camera bodies. Only the marker
+// headers of each candidate are read to reach its SOF; payloads are skipped.
+
+// jpeg_dimensions: width and height from the SOFn of the JPEG at jpeg->start.
+// Returns 0 on success, -1 if no frame header precedes the first scan.
+int jpeg_dimensions(RangeReader *rd, const JpegInfo *jpeg, int *width, int *height) {
+    JpegLayout layout;
+    if (jpeg_walk(rd, jpeg->start, jpeg->start + jpeg->size, 1, &layout) != 0 || !layout.height)
+        return -1;
+    *width = layout.width;
+    *height = layout.height;
+    return 0;
+}
+
+// select_preview: index of the preview the selectors ask for: with --min-long-edge
+// the cheapest one whose long edge is large enough, otherwise the largest one, in
+// both cases within --max-bytes. If nothing qualifies, the largest preview within
+// the budget (or, failing that, the smallest one) is taken with a warning. Records
+// the SOF dimensions in jpegs[]. Returns -1 if no candidate is a readable JPEG.
+int select_preview(RangeReader *rd, JpegInfo *jpegs, int count, int verbose) {
+    int best = -1, within = -1, smallest = -1;
+    for (int i = 0; i < count; i++) {
+        int width, height;
+        if (jpeg_dimensions(rd, &jpegs[i], &width, &height) != 0) {
+            if (verbose)
+                fprintf(stderr, "Ignoring JPEG at %zu: no frame header\n", jpegs[i].start);
+            continue;
+        }
+        jpegs[i].width = (uint16_t)width;
+        jpegs[i].height = (uint16_t)height;
+        int edge = width > height ? width : height;
+        if (verbose)
+            fprintf(stderr, "Candidate JPEG %d: %dx%d, %zu bytes\n", i + 1, width, height, jpegs[i].size);
+        if (smallest < 0 || jpegs[i].size < jpegs[smallest].size)
+            smallest = i;
+        if (g_max_bytes && jpegs[i].size > g_max_bytes)
+            continue;
+        int best_edge = 0, within_edge = 0;
+        if (within >= 0)
+            within_edge = jpegs[within].width > jpegs[within].height ? jpegs[within].width : jpegs[within].height;
+        if (within < 0 || edge > within_edge || (edge == within_edge && jpegs[i].size < jpegs[within].size))
+            within = i;
+        if (!g_min_long_edge || edge < g_min_long_edge)
+            continue;
+        if (best >= 0)
+            best_edge = jpegs[best].width > jpegs[best].height ? jpegs[best].width : jpegs[best].height;
+        if (best < 0 || jpegs[i].size < jpegs[best].size || (jpegs[i].size == jpegs[best].size && edge > best_edge))
+            best = i;
+    }
+    if (best < 0 && !g_min_long_edge)
+        best = within;   // --max-bytes alone: the largest preview that fits
+    if (best < 0 && within >= 0) {
+        fprintf(stderr, "No preview has a long edge of %d pixels%s; using the largest (%dx%d).\n", g_min_long_edge,
+                g_max_bytes ? " within the byte budget" : "", jpegs[within].width, jpegs[within].height);
+        best = within;
+    } else if (best < 0 && smallest >= 0) {
+        fprintf(stderr, "No preview fits in %zu bytes; using the smallest (%zu bytes).\n", g_max_bytes,
+                jpegs[smallest].size);
+        best = smallest;
+    }
+    if (best >= 0 && verbose)
+        fprintf(stderr, "Selected JPEG %d (%dx%d, %zu bytes)\n", best + 1, jpegs[best].width, jpegs[best].height,
+                jpegs[best].size);
+    return best;
+}
+
+// parse_byte_size: "300k", "2M", "1G" or plain bytes; returns 0 if malformed
+size_t parse_byte_size(const char *text) {
+    char *end;
+    unsigned long long value = strtoull(text, &end, 10);
+    if (end == text) return 0;
+    if (*end == 'k' || *end == 'K') {
+        value *= 1024;
+        end++;
+    } else if (*end == 'm' || *end == 'M') {
+        value *= 1024 * 1024;
+        end++;
+    } else if (*end == 'g' || *end == 'G') {
+        value *= 1024 * 1024 * 1024;
+        end++;
+    }
+    return *end ? 0 : (size_t)value;
+}
+
+// ----- Verification -----
+// --verify audits archived CR3 files without extracting anything. The top-level
+// boxes must exactly fill the file, the moov tree must nest cleanly and every track
+// sample must lie inside mdat. Each preview in the box index must be a well-formed
+// JPEG; for baseline frames the Huffman data is decoded (DC values only, no IDCT)
+// and must end exactly at its marker, with restart markers in sequence, which is
+// where a flipped bit almost always shows. Only headers and previews are read, not
+// the raw data. One line is printed per input: OK<TAB>path or FAIL<TAB>path<TAB>reason.
+// For TIFF-based files (CR2, DNG) every IFD must lie inside the file and each JPEG
+// they point at is checked the same way.
+
+#define VERIFY_REASON_SIZE 160
+
+// Boxes inside moov whose content is a list of child boxes
+const char *const VERIFY_CONTAINERS[] = { "trak", "mdia", "minf", "stbl", "dinf", "edts", NULL };
+const char *const PREVIEW_NAMES[] = { "scanned", "THMB", "PRVW", "full-size", "IFD" };
+
+// verify_box_tree: checks that the boxes in [start, end) of an in-memory moov fill it
+// exactly, descending into containers and the Canon uuid. base is the file offset
+// of moov[0]. Returns 0, or -1 with a reason.
+int verify_box_tree(const unsigned char *moov, size_t start, size_t end, uint64_t base, int depth, char *reason) {
+    size_t pos = start, headerSize;
+    char type[5];
+    if (limit_depth(depth) != 0) {
+        snprintf(reason, VERIFY_REASON_SIZE, "moov: resource limit exceeded at %llu", (unsigned long long)(base + start));
+        return -1;
+    }
+    while (pos < end) {
+        uint64_t boxSize = box_header(moov, pos, end, type, &headerSize);
+        if (!boxSize) {
+            snprintf(reason, VERIFY_REASON_SIZE, budget_check(g_budget) != 0 ? "moov: resource limit exceeded at %llu"
+                     : "moov: box at %llu overruns its parent", (unsigned long long)(base + pos));
+            return -1;
+        }
+        size_t content = pos + headerSize, boxEnd = pos + (size_t)boxSize;
+        int container = strcmp(type, "uuid") == 0 && content + 16 <= boxEnd &&
+                        memcmp(moov + content, CANON_MOOV_UUID, 16) == 0;
+        if (container) content += 16;
+        for (int i = 0; !container && VERIFY_CONTAINERS[i]; i++)
+            container = strcmp(type, VERIFY_CONTAINERS[i]) == 0;
+        if (container && verify_box_tree(moov, content, boxEnd, base, depth + 1, reason) != 0)
+            return -1;
+        pos = boxEnd;
+    }
+    return 0;
+}
+
+// verify_track_samples: checks that every sample of the stbl box [stbl, stblEnd) lies
+// inside mdat. Chunks come from stco/co64 and their sample counts from stsc (one per
+// chunk without it); the samples of a chunk follow each other from its offset.
+// Returns 0, or -1 with a reason.
+int verify_track_samples(const unsigned char *moov, size_t stbl, size_t stblEnd, int track,
+                         uint64_t mdat_start, uint64_t mdat_end, char *reason) {
+    size_t zs, ze, cs, ce, ss = 0, se = 0;
+    if (!find_child_box(moov, stbl, stblEnd, "stsz", &zs, &ze) || zs + 12 > ze) {
+        snprintf(reason, VERIFY_REASON_SIZE, "track %d has no sample size table", track);
+        return -1;
+    }
+    int wide = find_child_box(moov, stbl, stblEnd, "co64", &cs, &ce);
+    if (!wide && !find_child_box(moov, stbl, stblEnd, "stco", &cs, &ce)) {
+        snprintf(reason, VERIFY_REASON_SIZE, "track %d has no chunk offset table", track);
+        return -1;
+    }
+    int have_stsc = find_child_box(moov, stbl, stblEnd, "stsc", &ss, &se) && ss + 8 <= se;
+    uint32_t uniform = read32be(moov, zs + 4, ze), samples = read32be(moov, zs + 8, ze);
+    uint32_t chunks = cs + 8 <= ce ? read32be(moov, cs + 4, ce) : 0;
+    uint32_t runs = have_stsc ? read32be(moov, ss + 4, se) : 0;
+    if ((uniform == 0 && samples > (ze - zs - 12) / 4) || chunks > (ce - cs - 8) / (wide ? 8 : 4) ||
+        runs > (se - ss - 8) / 12) {
+        snprintf(reason, VERIFY_REASON_SIZE, "track %d: sample table overruns its box", track);
+        return -1;
+    }
+    uint32_t sample = 0, run = 0;
+    for (uint32_t chunk = 0; chunk < chunks && sample < samples; chunk++) {
+        // stsc: first chunk (1-based), samples per chunk, description index
+        while (run + 1 < runs && read32be(moov, ss + 8 + (size_t)(run + 1) * 12, se) <= chunk + 1)
+            run++;
+        uint32_t per_chunk = runs ? read32be(moov, ss + 8 + (size_t)run * 12 + 4, se) : 1;
+        uint64_t offset = wide ? read64be(moov, cs + 8 + (size_t)chunk * 8, ce)
+                               : read32be(moov, cs + 8 + (size_t)chunk * 4, ce);
+        for (uint32_t i = 0; i < per_chunk && sample < samples; i++, sample++) {
+            uint64_t size = uniform ? uniform : read32be(moov, zs + 12 + (size_t)sample * 4, ze);
+            if (offset < mdat_start || offset > mdat_end || size > mdat_end - offset) {
+                snprintf(reason, VERIFY_REASON_SIZE, "track %d sample %u at %llu (%llu bytes) lies outside mdat",
+                         track, sample + 1, (unsigned long long)offset, (unsigned long long)size);
+                return -1;
+            }
+            offset += size;
+        }
+    }
+    if (sample < samples) {
+        snprintf(reason, VERIFY_REASON_SIZE, "track %d: %u of %u samples have no chunk", track,
+                 samples - sample, samples);
+        return -1;
+    }
+    return 0;
+}
+
+// verify_container: checks the top-level boxes, the moov tree and the ranges of all
+// track samples. Returns 0, or -1 with a reason.
+int verify_container(RangeReader *rd, char *reason) {
+    uint64_t pos = 0, moov_pos = 0, moov_size = 0, mdat_start = 0, mdat_end = 0;
+    int have_moov = 0, have_mdat = 0;
+    while (pos < rd->size) {
+        unsigned char header[16];
+        uint64_t left = rd->size - pos;
+        if (limit_boxes() != 0) {
+            snprintf(reason, VERIFY_REASON_SIZE, "resource limit exceeded at %llu", (unsigned long long)pos);
+            return -1;
+        }
+        if (left < 8) {
+            snprintf(reason, VERIFY_REASON_SIZE, "%llu stray bytes after the last box", (unsigned long long)left);
+            return -1;
+        }
+        if (!reader_read_full(rd, pos, header, left < 16 ? 8 : 16)) {
+            snprintf(reason, VERIFY_REASON_SIZE, "read error at %llu", (unsigned long long)pos);
+            return -1;
+        }
+        size_t headerSize = 8;
+        uint64_t boxSize = read32be(header, 0, 16);
+        if (boxSize == 1) {
+            boxSize = left < 16 ? 0 : read64be(header, 8, 16);
+            headerSize = 16;
+        } else if (boxSize == 0) {
+            boxSize = left;   // the last box extends to the end of the file
+        }
+        if (pos == 0 && (memcmp(header + 4, "ftyp", 4) != 0 || boxSize < 12 || memcmp(header + 8, "crx ", 4) != 0)) {
+            snprintf(reason, VERIFY_REASON_SIZE, "not a CR3 (no 'crx ' ftyp box)");
+            return -1;
+        }
+        if (boxSize < headerSize) {
+            snprintf(reason, VERIFY_REASON_SIZE, "invalid size of the box at %llu", (unsigned long long)pos);
+            return -1;
+        }
+        if (boxSize > left) {
+            snprintf(reason, VERIFY_REASON_SIZE, "box at %llu runs %llu bytes past the end of the file",
+                     (unsigned long long)pos, (unsigned long long)(boxSize - left));
+            return -1;
+        }
+        if (memcmp(header + 4, "moov", 4) == 0 && !have_moov) {
+            moov_pos = pos + headerSize;
+            moov_size = boxSize - headerSize;
+            have_moov = 1;
+        } else if (memcmp(header + 4, "mdat", 4) == 0 && !have_mdat) {
+            mdat_start = pos + headerSize;
+            mdat_end = pos + boxSize;
+            have_mdat = 1;
+        }
+        pos += boxSize;
+    }
+    if (!have_moov || !have_mdat) {
+        snprintf(reason, VERIFY_REASON_SIZE, "no %s box", have_moov ? "mdat" : "moov");
+        return -1;
+    }
+
+    unsigned char *moov = limit_metadata(moov_size) == 0 ? scratch_alloc((size_t)moov_size) : NULL;
+    if (!moov || !reader_read_full(rd, moov_pos, moov, (size_t)moov_size)) {
+        snprintf(reason, VERIFY_REASON_SIZE, budget_check(g_budget) != 0 ? "resource limit exceeded"
+                                             : moov ? "read error in moov" : "out of memory for moov");
+        scratch_free(moov);
+        return -1;
+    }
+    int rc = verify_box_tree(moov, 0, (size_t)moov_size, moov_pos, 1, reason);
+    size_t bpos = 0, headerSize;
+    char type[5];
+    uint64_t boxSize;
+    for (int track = 1; rc == 0 && (boxSize = box_header(moov, bpos, (size_t)moov_size, type, &headerSize)) != 0;
+         bpos += (size_t)boxSize) {
+        if (strcmp(type, "trak") != 0) continue;
+        TrakSample t;
+        size_t ms, me, ns, ne, ss, se;
+        if (!parse_trak_sample(moov, bpos + headerSize, bpos + (size_t)boxSize, &t)) {
+            snprintf(reason, VERIFY_REASON_SIZE, "track %d has no sample description", track);
+            rc = -1;
+        } else if (find_child_box(moov, bpos + headerSize, bpos + (size_t)boxSize, "mdia", &ms, &me) &&
+                   find_child_box(moov, ms, me, "minf", &ns, &ne) && find_child_box(moov, ns, ne, "stbl", &ss, &se)) {
+            rc = verify_track_samples(moov, ss, se, track, mdat_start, mdat_end, reason);
+        }
+        track++;
+    }
+    scratch_free(moov);
+    return rc;
+}
+
+// verify_preview: checks the marker structure of one preview and, for a baseline
+// frame, its entropy-coded data. Returns 0, or -1 with a reason.
+int verify_preview(RangeReader *rd, const JpegInfo *jpeg, const char *cr3_path, int verbose, char *reason) {
+    const char *name = PREVIEW_NAMES[jpeg->source];
+    if (jpeg->end > rd->size) {
+        snprintf(reason, VERIFY_REASON_SIZE, "%s preview runs past the end of the file", name);
+        return -1;
+    }
+    unsigned char *data = malloc(jpeg->size);
+    if (!data || !reader_read_full(rd, jpeg->start, data, jpeg->size)) {
+        snprintf(reason, VERIFY_REASON_SIZE, data ? "read error in %s preview" : "out of memory for %s preview", name);
+        free(data);
+        return -1;
+    }
+    JpegLayout layout;
+    RangeReader *mem = reader_open_memory(data, jpeg->size, 0);
+    int rc = mem ? jpeg_walk(mem, 0, jpeg->size, 0, &layout) : -1;
+    if (mem) reader_close(mem);
+    if (rc != 0) {
+        snprintf(reason, VERIFY_REASON_SIZE, "%s preview: broken marker structure", name);
+        free(data);
+        return -1;
+    }
+    int baseline = layout.sof == 0xC0 || layout.sof == 0xC1;
+    if (baseline) {
+        JpegCoefficients jc;
+        if (decode_jpeg_coefficients(data, (size_t)layout.end, &jc, NULL, JPEG_DC_ONLY | JPEG_VERIFY) != 0) {
+            snprintf(reason, VERIFY_REASON_SIZE, "%s preview: %s", name, jc.error);
+            rc = -1;
+        } else {
+            jpeg_coefficients_free(&jc);
+        }
+    }
+    free(data);
+    if (rc == 0 && verbose)
+        fprintf(stderr, "%s: %s preview %dx%d, %zu bytes, SOF%d, %s\n", cr3_path, name, layout.width, layout.height,
+                jpeg->size, layout.sof - 0xC0, baseline ? "Huffman data decoded" : "entropy data not decoded");
+    return rc;
+}
+
+// verify_file: --verify for one input; prints its OK or FAIL line. Returns 0 if it passed.
+int verify_file(const char *cr3_path, int verbose) {
+    char reason[VERIFY_REASON_SIZE];
+    RangeReader *rd = reader_open(cr3_path, verbose);
+    if (!rd) {
+        printf("FAIL\t%s\tcannot be opened\n", cr3_path);
+        return -1;
+    }
+    int be = tiff_byte_order(rd);
+    int rc = be >= 0 ? 0 : verify_container(rd, reason);
+    if (rc == 0) {
+        JpegInfo *jpegs = NULL;
+        int count = 0, seen = 0;
+        uint64_t broken = 0;
+        int located = be >= 0 ? locate_previews_ifds(rd, be, &jpegs, &count, &broken)
+                              : locate_previews_boxes(rd, &jpegs, &count);
+        if (located != 0) {
+            if (located == -2)
+                snprintf(reason, VERIFY_REASON_SIZE, "IFD at %llu is empty or runs past the end of the file",
+                         (unsigned long long)broken);
+            else
+                snprintf(reason, VERIFY_REASON_SIZE, "out of memory for the preview list");
+            rc = -1;
+        } else if (be >= 0 && count == 0) {
+            snprintf(reason, VERIFY_REASON_SIZE, "no JPEG preview in the IFDs");
+            rc = -1;
+        }
+        for (int i = 0; rc == 0 && i < count; i++) {
+            seen |= 1 << jpegs[i].source;
+            rc = verify_preview(rd, &jpegs[i], cr3_path, verbose, reason);
+        }
+        for (int source = JPEG_FROM_THMB; rc == 0 && be < 0 && source <= JPEG_FROM_TRAK; source++) {
+            if (!(seen & (1 << source))) {
+                snprintf(reason, VERIFY_REASON_SIZE, "no %s preview in the box index", PREVIEW_NAMES[source]);
+                rc = -1;
+            }
+        }
+        scratch_free(jpegs);
+    }
+    reader_close(rd);
+    if (rc == 0)
+        printf("OK\t%s\n", cr3_path);
+    else
+        printf("FAIL\t%s\t%s\n", cr3_path, reason);
+    return rc;
+}
+
+// ----- Raw render -----
+// --render-raw and --raw-fallback build a small JPEG from the CRX raw track, for
+// files whose embedded previews are missing or broken. CRX codes each of the four
+// Bayer planes (half the sensor size per axis) with an integer 5/3 wavelet. The
+// coarsest low-pass subband is the first thing in each plane's data and is a
+// low-pass copy of the plane, 2^levels times smaller per axis. Only that subband is
+// read and entropy-decoded: for a 24 MP raw coded with 3 levels, that is a 375x250
+// image from a few hundred KB of the file. Each 2x2 Bayer cell becomes one pixel.
+// Black point, gray-world white balance and white point are estimated from the
+// image itself, then a square-root tone curve is applied and the result is encoded
+// with the rotation encoder.
+//
+// Supported is the CRX variant with version 1 mdat headers, one tile, four planes,
+// encoding type 0 or 1 and a lowest subband using the line-prediction coder.
+// Anything else is reported as unsupported.
+
+#define RAW_RENDER_SHIFT 3      // output is the Bayer plane scaled down 2^3 per axis
+#define RAW_RENDER_QUALITY 90
+#define CRX_SAMPLE_LIMIT (1 << 24)
+
+typedef struct {
+    uint64_t sample_offset;     // the raw track's mdat sample
+    uint64_t sample_size;
+    int width, height;          // sensor size from CMP1
+    int tile_width, tile_height;
+    int bits, planes, cfa, enc_type, levels;
+    uint32_t header_size;       // mdat header in front of the tile data
+} CrxImage;
+
+// Lowest subband of one plane
+typedef struct {
+    uint64_t offset;            // file offset of the coded data
+    uint32_t size;
+    int q_param;
+    int q_update;               // a quantizer update precedes each line
+} CrxBand;
+
+// MSB-first bit reader over one subband; reads past the end return zeros and are
+// caught by crx_overrun
+typedef struct {
+    const unsigned char *data;
+    size_t size;
+    size_t pos;                 // next byte to load, counting the zero padding
+    uint64_t acc;
+    int bits;
+} CrxBits;
+
+// Line decoder of the lowest subband
+typedef struct {
+    CrxBits in;
+    int width;
+    int k;                      // Rice parameter of the residuals
+    int s;                      // index into the run-length tables
+    int32_t *prev, *cur;        // width + 2 samples, one of padding on either side
+    int line;
+} CrxDecoder;
+
+void crx_fill(CrxBits *b) {
+    while (b->bits <= 56) {
+        uint64_t c = b->pos < b->size ? b->data[b->pos] : 0;
+        b->acc |= c << (56 - b->bits);
+        b->bits += 8;
+        b->pos++;
+    }
+}
+
+int crx_overrun(const CrxBits *b) {
+    return b->pos * 8 - b->bits > b->size * 8;
+}
+
+uint32_t crx_get(CrxBits *b, int n) {
+    if (n == 0) return 0;
+    crx_fill(b);
+    uint32_t v = (uint32_t)(b->acc >> (64 - n));
+    b->acc <<= n;
+    b->bits -= n;
+    return v;
+}
+
+// crx_zeros: counts and consumes 0-bits up to and including the next 1-bit;
+// -1 if the data ends first
+int crx_zeros(CrxBits *b) {
+    int n = 0;
+    for (;;) {
+        crx_fill(b);
+        if (b->acc >> 56 == 0) {
+            n += 8;
+            b->acc <<= 8;
+            b->bits -= 8;
+            if (crx_overrun(b)) return -1;
+            continue;
+        }
+        while (!(b->acc >> 63)) {
+            n++;
+            b->acc <<= 1;
+            b->bits--;
+        }
+        b->acc <<= 1;
+        b->bits--;
+        return crx_overrun(b) ? -1 : n;
+    }
+}
+
+// crx_code: Rice code with parameter k; a prefix of `escape` or more zeros is
+// followed by the value in `escape_bits` bits
+int crx_code(CrxBits *b, int k, int escape, int escape_bits, uint32_t *code) {
+    int zeros = crx_zeros(b);
+    if (zeros < 0) return -1;
+    if (zeros >= escape) *code = crx_get(b, escape_bits);
+    else *code = k ? crx_get(b, k) | ((uint32_t)zeros << k) : (uint32_t)zeros;
+    return 0;
+}
+
+int crx_predict_k(int k, uint32_t code, int max) {
+    int next = k - (code < (1u << k >> 1)) + ((code >> k) > 2) + ((code >> k) > 5);
+    return max && next > max ? max : next;
+}
+
+int32_t crx_signed(uint32_t code) {
+    return -(int32_t)(code & 1) ^ (int32_t)(code >> 1);
+}
+
+// crx_run: length of a run of repeated samples, after its leading 1-bit; at most `length`
+int crx_run(CrxDecoder *d, int length) {
+    static const int RUN_STEP[32] = { 1, 1, 1, 1, 2, 2, 2, 2, 4, 4, 4, 4, 8, 8, 8, 8, 16, 16, 32, 32,
+                                      64, 64, 128, 128, 256, 512, 1024, 2048, 4096, 8192, 16384, 32768 };
+    static const int RUN_BITS[32] = { 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 5, 5,
+                                      6, 6, 7, 7, 8, 9, 10, 11, 12, 13, 14, 15 };
+    int n = 1;
+    while (crx_get(&d->in, 1)) {
+        n += RUN_STEP[d->s];
+        if (n > length) {
+            n = length;
+            break;
+        }
+        if (d->s < 31) d->s++;
+        if (n == length) break;
+    }
+    if (n < length) {
+        n += (int)crx_get(&d->in, RUN_BITS[d->s]);
+        if (d->s > 0) d->s--;
+        if (n > length) return -1;
+    }
+    return n;
+}
+
+// crx_residual: adds the next residual to `pred`; `next_delta` (the gradient one
+// sample ahead on the line above, or -1 at the line end) steers the Rice parameter
+int crx_residual(CrxDecoder *d, int32_t pred, int32_t next_delta, int32_t *out) {
+    uint32_t code;
+    if (crx_code(&d->in, d->k, 41, 21, &code) != 0) return -1;
+    // Valid data stays far inside this; it keeps corrupt data from overflowing
+    int32_t v = pred + crx_signed(code);
+    *out = v > CRX_SAMPLE_LIMIT ? CRX_SAMPLE_LIMIT : v < -CRX_SAMPLE_LIMIT ? -CRX_SAMPLE_LIMIT : v;
+    if (next_delta >= 0) code = (code + (uint32_t)next_delta) >> 1;
+    d->k = crx_predict_k(d->k, code, 15);
+    return 0;
+}
+
+// crx_ahead: gradient one sample ahead on the line above, -1 at the end of the line
+int32_t crx_ahead(const int32_t *prev, int x, int w) {
+    if (x >= w) return -1;
+    int32_t d = 2 * (prev[x + 1] - prev[x]);
+    return d < 0 ? -d : d;
+}
+
+// crx_decode_line: next line of the subband into d->cur[1..width]. Samples are
+// predicted from the left neighbour on the first line and by the median edge
+// detector below it; runs code stretches equal to the neighbours.
+int crx_decode_line(CrxDecoder *d) {
+    int32_t *t = d->prev;
+    d->prev = d->cur;
+    d->cur = t;
+    int32_t *cur = d->cur, *prev = d->prev;
+    int w = d->width, x = 1;
+    if (d->line++ == 0) {
+        cur[0] = 0;
+        while (x <= w) {
+            int32_t pred = cur[x - 1];
+            if (x < w && pred == 0 && crx_get(&d->in, 1)) {
+                int n = crx_run(d, w - x + 1);
+                if (n < 0) return -1;
+                for (int i = 0; i < n; i++, x++)
+                    cur[x] = 0;
+                if (x > w) break;
+            }
+            if (crx_residual(d, pred, -1, &cur[x]) != 0) return -1;
+            x++;
+        }
+    } else {
+        cur[0] = prev[1];
+        while (x <= w) {
+            int32_t a = cur[x - 1], b = prev[x], c = prev[x - 1];
+            if (x < w && a == b && a == prev[x + 1]) {
+                if (crx_get(&d->in, 1)) {
+                    int n = crx_run(d, w - x + 1);
+                    if (n < 0) return -1;
+                    for (int i = 0; i < n; i++, x++)
+                        cur[x] = a;
+                    if (x > w) break;
+                }
+                if (crx_residual(d, prev[x], crx_ahead(prev, x, w), &cur[x]) != 0) return -1;
+            } else {
+                int32_t delta = b - c;
+                int32_t med[4] = { a + delta, a + delta, a, b };
+                int32_t pred = med[(((c < a) ^ (delta < 0)) << 1) + ((a < b) ^ (delta < 0))];
+                if (crx_residual(d, pred, crx_ahead(prev, x, w), &cur[x]) != 0) return -1;
+            }
+            x++;
+        }
+    }
+    cur[w + 1] = cur[w] + 1;
+    return crx_overrun(&d->in) ? -1 : 0;
+}
+
+// locate_crx_image: the largest trak whose CRAW entry has a CMP1 header, with the
+// CMP1 fields. Returns -1 with a message if there is none or it is not supported.
+int locate_crx_image(RangeReader *rd, CrxImage *img) {
+    uint64_t pos = 0;
+    int found = 0;
+    memset(img, 0, sizeof(*img));
+    while (pos + 8 <= rd->size && !found) {
+        unsigned char header[16];
+        if (!reader_read_full(rd, pos, header, 16))
+            break;
+        size_t headerSize = 8;
+        uint64_t boxSize = read32be(header, 0, 16);
+        if (boxSize == 1) {
+            boxSize = read64be(header, 8, 16);
+            headerSize = 16;
+        }
+        if (boxSize < headerSize || memcmp(header + 4, "mdat", 4) == 0) break;
+        if (memcmp(header + 4, "moov", 4) == 0) {
+            if (boxSize > rd->size - pos || limit_metadata(boxSize - headerSize) != 0)
+                break;
+            size_t moovSize = (size_t)boxSize - headerSize, p = 0, hs;
+            unsigned char *moov = scratch_alloc(moovSize);
+            char type[5];
+            uint64_t size;
+            if (!moov || !reader_read_full(rd, pos + headerSize, moov, moovSize)) {
+                scratch_free(moov);
+                break;
+            }
+            while ((size = box_header(moov, p, moovSize, type, &hs)) != 0) {
+                TrakSample t;
+                size_t cmp;
+                if (strcmp(type, "trak") == 0 && parse_trak_sample(moov, p + hs, p + size, &t) &&
+                    memcmp(moov + t.entry + 4, "CRAW", 4) == 0 && t.offset && t.size &&
+                    (cmp = find_fourcc_box(moov, t.entry + 8, t.entryEnd, "CMP1")) != (size_t)-1 &&
+                    cmp + 8 + 32 <= t.entryEnd) {
+                    const unsigned char *c = moov + cmp + 8;
+                    int w = (int)read32be(c, 8, 32), h = (int)read32be(c, 12, 32);
+                    if (w > 0 && h > 0 && (!found || (uint64_t)w * h > (uint64_t)img->width * img->height)) {
+                        img->sample_offset = t.offset;
+                        img->sample_size = t.size;
+                        img->width = w;
+                        img->height = h;
+                        img->tile_width = (int)read32be(c, 16, 32);
+                        img->tile_height = (int)read32be(c, 20, 32);
+                        img->bits = c[24];
+                        img->planes = c[25] >> 4;
+                        img->cfa = c[25] & 0xF;
+                        img->enc_type = c[26] >> 4;
+                        img->levels = c[26] & 0xF;
+                        img->header_size = read32be(c, 28, 32);
+                        found = 1;
+                    }
+                }
+                p += size;
+            }
+            scratch_free(moov);
+            break;
+        }
+        pos += boxSize;
+    }
+    if (!found) {
+        fprintf(stderr, "No CRX raw track found\n");
+        return -1;
+    }
+    if (img->planes != 4 || img->enc_type > 1 || img->cfa > 3 || img->levels > 3 || img->bits < 8 ||
+        img->bits > 16 || img->width < 2 || img->height < 2 || img->tile_width < img->width ||
+        img->tile_height < img->height || img->header_size < 12 || img->header_size >= img->sample_size) {
+        fprintf(stderr, "Unsupported CRX raw data (%d planes, encoding %d, %d levels, %dx%d in %dx%d tiles)\n",
+                img->planes, img->enc_type, img->levels, img->width, img->height, img->tile_width, img->tile_height);
+        return -1;
+    }
+    return 0;
+}
+
+// read_crx_bands: the lowest subband of each plane, from the tile, plane and subband
+// headers at the start of the mdat sample. Each plane's data is its subbands in order;
+// the planes follow each other in the tile.
+int read_crx_bands(RangeReader *rd, const CrxImage *img, CrxBand bands[4]) {
+    unsigned char *hdr = malloc(img->header_size);
+    size_t n = img->header_size, p = 0;
+    uint64_t plane_start = 0, plane_next = 0;
+    int tiles = 0, planes = 0, band = 0, rc = -1;
+    if (!hdr) {
+        fprintf(stderr, "Memory allocation failed for the CRX header\n");
+        return -1;
+    }
+    if (!reader_read_full(rd, img->sample_offset, hdr, n)) {
+        fprintf(stderr, "Failed to read the CRX header\n");
+        goto out;
+    }
+    while (p + 12 <= n) {
+        uint16_t sig = read16be(hdr, p, n), len = read16be(hdr, p + 2, n);
+        uint32_t size = read32be(hdr, p + 4, n);
+        if (sig == 0xFF01 && len == 8) {
+            if (++tiles > 1) break;
+        } else if (sig == 0xFF02 && len == 8 && tiles == 1 && planes < 4) {
+            int flags = hdr[p + 8];
+            if (!(flags & 8) || (flags >> 1) & 3) {
+                fprintf(stderr, "Unsupported CRX plane coding (flags 0x%02x)\n", flags);
+                goto out;
+            }
+            plane_start = plane_next;
+            plane_next += size;
+            band = 0;
+            planes++;
+        } else if (sig == 0xFF03 && len == 8 && planes > 0) {
+            if (band++ == 0) {
+                uint32_t bits = read32be(hdr, p + 8, n);
+                CrxBand *b = &bands[planes - 1];
+                b->offset = img->sample_offset + img->header_size + plane_start;
+                b->size = size - (bits & 0x7FFFF);
+                b->q_param = (bits >> 19) & 0xFF;
+                b->q_update = (bits & 0x8000000) != 0;
+                if ((bits & 0x7FFFF) > size || b->offset + b->size > img->sample_offset + img->sample_size) {
+                    fprintf(stderr, "Corrupt CRX subband header\n");
+                    goto out;
+                }
+            }
+        } else if (sig == 0xFF11 || sig == 0xFF12 || sig == 0xFF13) {
+            fprintf(stderr, "Unsupported CRX header version\n");
+            goto out;
+        } else {
+            break;
+        }
+        p += 4 + len;
+    }
+    if (planes != 4 || tiles != 1) {
+        fprintf(stderr, "Unsupported CRX layout (%d tiles, %d planes)\n", tiles, planes);
+        goto out;
+    }
+    rc = 0;
+out:
+    free(hdr);
+    return rc;
+}
+
+// decode_crx_band: the lowest subband of one plane, lw x lh samples around the
+// plane's mid-level. With wavelet levels each line is dequantized, after an update
+// of the quantizer if the subband carries one per line.
+int decode_crx_band(RangeReader *rd, const CrxImage *img, const CrxBand *band, int lw, int lh, int32_t *out) {
+    static const int Q_STEP[6] = { 0x28, 0x2D, 0x33, 0x39, 0x40, 0x48 };
+    unsigned char *data = malloc(band->size ? band->size : 1);
+    int32_t *lines = calloc(2 * ((size_t)lw + 2), sizeof(int32_t));
+    CrxDecoder d;
+    int q = band->q_param, qk = 0, rc = -1;
+    if (!data || !lines) {
+        fprintf(stderr, "Memory allocation failed for the CRX subband\n");
+        goto out;
+    }
+    if (!reader_read_full(rd, band->offset, data, band->size)) {
+        fprintf(stderr, "Failed to read the CRX subband data\n");
+        goto out;
+    }
+    memset(&d, 0, sizeof(d));
+    d.in.data = data;
+    d.in.size = band->size;
+    d.width = lw;
+    d.prev = lines;
+    d.cur = lines + lw + 2;
+    for (int y = 0; y < lh; y++) {
+        if (img->levels > 0 && band->q_update) {
+            uint32_t code;
+            if (crx_code(&d.in, qk, 23, 8, &code) != 0) goto corrupt;
+            q += crx_signed(code);
+            qk = crx_predict_k(qk, code, 0);
+            if (qk > 7) goto corrupt;
+        }
+        if (crx_decode_line(&d) != 0) goto corrupt;
+        int32_t scale = 1;
+        if (img->levels > 0) {
+            if (q < 0 || q / 6 > 26) goto corrupt;
+            scale = q / 6 >= 6 ? Q_STEP[q % 6] << (q / 6 - 6) : Q_STEP[q % 6] >> (6 - q / 6);
+        }
+        for (int x = 0; x < lw; x++) {
+            int64_t v = (int64_t)d.cur[1 + x] * scale;
+            out[(size_t)y * lw + x] = (int32_t)(v > CRX_SAMPLE_LIMIT ? CRX_SAMPLE_LIMIT : v < -CRX_SAMPLE_LIMIT ? -CRX_SAMPLE_LIMIT : v);
+        }
+    }
+    rc = 0;
+    goto out;
+corrupt:
+    fprintf(stderr, "Corrupt CRX subband data\n");
+out:
+    free(lines);
+    free(data);
+    return rc;
+}
+
+// 8-bit RGB image, its quantized DCT blocks and the tables for the baseline encoder
+typedef struct {
+    const unsigned char *rgb;
+    int width, height;
+    int bw, bh;                 // blocks per row and column
+    int16_t *coef;              // 3 planes of bw * bh blocks, natural order
+    uint16_t qt[2][64];         // natural order
+    double cosine[8][8];        // cos((2x + 1) u pi / 16)
+} RawSource;
+
+// raw_fdct_block: Y, Cb or Cr of an 8x8 block (edges replicated), forward DCT and
+// quantization
+void raw_fdct_block(const RawSource *r, int c, int bx, int by, int16_t *blk) {
+    double px[64], tmp[64];
+    for (int y = 0; y < 8; y++) {
+        int sy = by * 8 + y < r->height ? by * 8 + y : r->height - 1;
+        for (int x = 0; x < 8; x++) {
+            int sx = bx * 8 + x < r->width ? bx * 8 + x : r->width - 1;
+            const unsigned char *p = r->rgb + ((size_t)sy * r->width + sx) * 3;
+            double v;
+            if (c == 0) v = 0.299 * p[0] + 0.587 * p[1] + 0.114 * p[2];
+            else if (c == 1) v = -0.168736 * p[0] - 0.331264 * p[1] + 0.5 * p[2] + 128;
+            else v = 0.5 * p[0] - 0.418688 * p[1] - 0.081312 * p[2] + 128;
+            px[y * 8 + x] = v - 128;
+        }
+    }
+    for (int y = 0; y < 8; y++) {
+        for (int u = 0; u < 8; u++) {
+            double s = 0;
+            for (int x = 0; x < 8; x++) s += px[y * 8 + x] * r->cosine[u][x];
+            tmp[y * 8 + u] = s;
+        }
+    }
+    for (int v = 0; v < 8; v++) {
+        for (int u = 0; u < 8; u++) {
+            double s = 0;
+            for (int y = 0; y < 8; y++) s += tmp[y * 8 + u] * r->cosine[v][y];
+            s *= (u ? 1 : 0.70710678118654752) * (v ? 1 : 0.70710678118654752) / 4;
+            double q = s / r->qt[c ? 1 : 0][v * 8 + u];
+            int n = (int)(q < 0 ? q - 0.5 : q + 0.5);
+            blk[v * 8 + u] = (int16_t)(n > 1023 ? 1023 : n < -1023 ? -1023 : n);
+        }
+    }
+}
+
+void raw_source_block(void *ctx, int c, int bx, int by, int16_t *blk) {
+    const RawSource *r = ctx;
+    memcpy(blk, r->coef + (((size_t)c * r->bh + by) * r->bw + bx) * 64, 64 * sizeof(int16_t));
+}
+
+// encode_rgb_jpeg: baseline 4:4:4 JPEG of an 8-bit RGB image, JFIF header included
+int encode_rgb_jpeg(ByteBuf *o, const unsigned char *rgb, int width, int height, int quality) {
+    static const uint8_t LUMA_QT[64] = {
+        16, 11, 10, 16, 24, 40, 51, 61,      12, 12, 14, 19, 26, 58, 60, 55,
+        14, 13, 16, 24, 40, 57, 69, 56,      14, 17, 22, 29, 51, 87, 80, 62,
+        18, 22, 37, 56, 68, 109, 103, 77,    24, 35, 55, 64, 81, 104, 113, 92,
+        49, 64, 78, 87, 103, 121, 120, 101,  72, 92, 95, 98, 112, 100, 103, 99
+    };
+    static const uint8_t CHROMA_QT[64] = {
+        17, 18, 24, 47, 99, 99, 99, 99,  18, 21, 26, 66, 99, 99, 99, 99,
+        24, 26, 56, 99, 99, 99, 99, 99,  47, 66, 99, 99, 99, 99, 99, 99,
+        99, 99, 99, 99, 99, 99, 99, 99,  99, 99, 99, 99, 99, 99, 99, 99,
+        99, 99, 99, 99, 99, 99, 99, 99,  99, 99, 99, 99, 99, 99, 99, 99
+    };
+    static const unsigned char JFIF[14] = { 'J', 'F', 'I', 'F', 0, 1, 1, 0, 0, 1, 0, 1, 0, 0 };
+    RawSource src;
+    JpegCoefficients frame;
+    // Quality scaling as in the IJG library
+    int scale = quality < 50 ? 5000 / quality : 200 - 2 * quality;
+    memset(&frame, 0, sizeof(frame));
+    for (int i = 0; i < 64; i++) {
+        int l = (LUMA_QT[i] * scale + 50) / 100, c = (CHROMA_QT[i] * scale + 50) / 100;
+        src.qt[0][i] = (uint16_t)(l < 1 ? 1 : l > 255 ? 255 : l);
+        src.qt[1][i] = (uint16_t)(c < 1 ? 1 : c > 255 ? 255 : c);
+    }
+    for (int i = 0; i < 64; i++) {
+        frame.qt[0][i] = (uint8_t)src.qt[0][JPEG_NATURAL_ORDER[i]];
+        frame.qt[1][i] = (uint8_t)src.qt[1][JPEG_NATURAL_ORDER[i]];
+    }
+    frame.qt_present[0] = frame.qt_present[1] = 1;
+    // cos(k pi / 16) by the Chebyshev recurrence, no libm needed
+    double ck[32];
+    ck[0] = 1;
+    ck[1] = 0.98078528040323044913;
+    for (int k = 2; k < 32; k++) ck[k] = 2 * ck[1] * ck[k - 1] - ck[k - 2];
+    for (int u = 0; u < 8; u++)
+        for (int x = 0; x < 8; x++) src.cosine[u][x] = ck[((2 * x + 1) * u) % 32];
+    src.rgb = rgb;
+    src.width = width;
+    src.height = height;
+    frame.width = width;
+    frame.height = height;
+    frame.ncomp = 3;
+    frame.hmax = frame.vmax = 1;
+    for (int c = 0; c < 3; c++) {
+        frame.comp[c].id = c + 1;
+        frame.comp[c].h = frame.comp[c].v = 1;
+        frame.comp[c].tq = c ? 1 : 0;
+    }
+    // Transform once; the encoder visits every block twice
+    src.bw = (width + 7) / 8;
+    src.bh = (height + 7) / 8;
+    src.coef = malloc((size_t)3 * src.bw * src.bh * 64 * sizeof(int16_t));
+    if (!src.coef) return -1;
+    for (int c = 0; c < 3; c++)
+        for (int by = 0; by < src.bh; by++)
+            for (int bx = 0; bx < src.bw; bx++)
+                raw_fdct_block(&src, c, bx, by, src.coef + (((size_t)c * src.bh + by) * src.bw + bx) * 64);
+    bb_put(o, "\xFF\xD8", 2);
+    bb_marker(o, 0xE0, sizeof(JFIF));
+    bb_put(o, JFIF, sizeof(JFIF));
+    int rc = encode_jpeg(o, &frame, raw_source_block, &src);
+    free(src.coef);
+    return rc;
+}
+
+// histogram_percentile: value below which `fraction` of v[0..n) lies, to 1/65536 of
+// the range [0, hi]
+double histogram_percentile(const double *v, size_t n, double hi, double fraction, uint32_t *bins) {
+    memset(bins, 0, 65536 * sizeof(uint32_t));
+    if (hi <= 0) return 0;
+    for (size_t i = 0; i < n; i++) {
+        double b = v[i] / hi * 65535;
+        bins[b <= 0 ? 0 : b >= 65535 ? 65535 : (int)b]++;
+    }
+    size_t target = (size_t)(fraction * n), seen = 0;
+    for (int b = 0; b < 65536; b++) {
+        seen += bins[b];
+        if (seen > target) return b * hi / 65535;
+    }
+    return hi;
+}
+
+int isqrt(int v) {
+    int r = 0;
+    while ((r + 1) * (r + 1) <= v) r++;
+    return r;
+}
+
+// render_raw_jpeg: renders the CRX raw track of `rd` into a JPEG in `o`
+int render_raw_jpeg(RangeReader *rd, ByteBuf *o, int *out_w, int *out_h, int verbose) {
+    static const int RED_PLANE[4] = { 0, 1, 2, 3 }, BLUE_PLANE[4] = { 3, 2, 1, 0 };
+    CrxImage img;
+    CrxBand bands[4];
+    int rc = -1;
+    if (locate_crx_image(rd, &img) != 0 || read_crx_bands(rd, &img, bands) != 0)
+        return -1;
+    int lw = img.width / 2, lh = img.height / 2;
+    for (int l = 0; l < img.levels; l++) {
+        lw = (lw + 1) >> 1;
+        lh = (lh + 1) >> 1;
+    }
+    // Without enough wavelet levels, box-filter the subband down to the same scale
+    int f = 1 << (RAW_RENDER_SHIFT - img.levels);
+    while (f > 1 && (lw < f || lh < f)) f >>= 1;
+    int w = lw / f, h = lh / f;
+    if (w < 1 || h < 1) {
+        fprintf(stderr, "CRX raw data too small to render (%dx%d)\n", img.width, img.height);
+        return -1;
+    }
+    size_t n = (size_t)lw * lh, pixels = (size_t)w * h;
+    int32_t *planes = malloc(4 * n * sizeof(int32_t));
+    double *rgb = malloc(3 * pixels * sizeof(double)), *level = malloc(pixels * sizeof(double));
+    uint32_t *bins = malloc(65536 * sizeof(uint32_t));
+    unsigned char *out = malloc(3 * pixels);
+    if (!planes || !rgb || !level || !bins || !out) {
+        fprintf(stderr, "Memory allocation failed for the raw render\n");
+        goto out;
+    }
+    for (int p = 0; p < 4; p++) {
+        if (decode_crx_band(rd, &img, &bands[p], lw, lh, planes + p * n) != 0)
+            goto out;
+    }
+
+    // Bayer cell to RGB at the output scale
+    int32_t mid = 1 << (img.bits - 1), max = (1 << img.bits) - 1;
+    int red = RED_PLANE[img.cfa], blue = BLUE_PLANE[img.cfa];
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            double sum[4] = { 0, 0, 0, 0 };
+            for (int p = 0; p < 4; p++) {
+                for (int dy = 0; dy < f; dy++) {
+                    for (int dx = 0; dx < f; dx++) {
+                        int32_t v = mid + planes[p * n + (size_t)(y * f + dy) * lw + x * f + dx];
+                        sum[p] += v < 0 ? 0 : v > max ? max : v;
+                    }
+                }
+            }
+            double *px = rgb + ((size_t)y * w + x) * 3;
+            double g = 0;
+            for (int p = 0; p < 4; p++)
+                if (p != red && p != blue) g += sum[p];
+            px[0] = sum[red] / (f * f);
+            px[1] = g / (2 * f * f);
+            px[2] = sum[blue] / (f * f);
+        }
+    }
+
+    // Black point: low percentile of the darkest channel; gray-world gains; white
+    // point: high percentile of the brightest balanced channel
+    for (size_t i = 0; i < pixels; i++) {
+        double *px = rgb + i * 3, lo = px[0];
+        if (px[1] < lo) lo = px[1];
+        if (px[2] < lo) lo = px[2];
+        level[i] = lo;
+    }
+    double black = histogram_percentile(level, pixels, max, 0.001, bins), mean[3] = { 0, 0, 0 }, gain[3];
+    for (size_t i = 0; i < pixels; i++)
+        for (int c = 0; c < 3; c++) mean[c] += rgb[i * 3 + c] > black ? rgb[i * 3 + c] - black : 0;
+    for (int c = 0; c < 3; c++) {
+        gain[c] = mean[c] > 0 ? mean[1] / mean[c] : 1;
+        if (gain[c] < 0.25) gain[c] = 0.25;
+        if (gain[c] > 4) gain[c] = 4;
+    }
+    for (size_t i = 0; i < pixels; i++) {
+        double hi = 0;
+        for (int c = 0; c < 3; c++) {
+            double v = (rgb[i * 3 + c] - black) * gain[c];
+            if (v > hi) hi = v;
+        }
+        level[i] = hi;
+    }
+    double white = histogram_percentile(level, pixels, 4.0 * max, 0.995, bins);
+    if (white <= 0) white = 1;
+    unsigned char curve[4096];
+    for (int i = 0; i < 4096; i++) curve[i] = (unsigned char)isqrt(i * 65025 / 4095);
+    for (size_t i = 0; i < pixels * 3; i++) {
+        double v = (rgb[i] - black) * gain[i % 3] / white * 4095;
+        out[i] = curve[v <= 0 ? 0 : v >= 4095 ? 4095 : (int)v];
+    }
+    if (encode_rgb_jpeg(o, out, w, h, RAW_RENDER_QUALITY) != 0) {
+        fprintf(stderr, "Failed to allocate memory for the rendered JPEG\n");
+        goto out;
+    }
+    if (verbose) {
+        uint64_t coded = 0;
+        for (int p = 0; p < 4; p++) coded += bands[p].size;
+        fprintf(stderr, "Rendered %dx%d from the %d-level CRX raw (%dx%d, %llu coded bytes read); "
+                "black %.0f, gains %.2f/%.2f/%.2f\n", w, h, img.levels, img.width, img.height,
+                (unsigned long long)coded, black, gain[0], gain[1], gain[2]);
+    }
+    *out_w = w;
+    *out_h = h;
+    rc = 0;
+out:
+    free(out);
+    free(bins);
+    free(level);
+    free(rgb);
+    free(planes);
+    return rc;
+}
+
+// write_raw_render: renders the raw track and writes the JPEG to the sink
+int write_raw_render(RangeReader *rd, OutputSink *sink, int verbose) {
+    ByteBuf o;
+    int w, h;
+    memset(&o, 0, sizeof(o));
+    if (render_raw_jpeg(rd, &o, &w, &h, verbose) != 0) {
+        free(o.data);
+        return -1;
+    }
+    int rc = sink_write(sink, o.data, o.len) == o.len ? 0 : -1;
+    if (rc != 0)
+        perror("Failed to write the rendered JPEG");
+    free(o.data);
+    return rc;
+}
+
+// run_render_benchmark: --bench-render; times, per input, locating and reading the
+// largest embedded preview against rendering the raw track (best of three after a
+// warm-up pass)
+int run_render_benchmark(char **inputs, int input_count) {
+    int failures = 0;
+    for (int f = 0; f < input_count; f++) {
+        RangeReader *rd = reader_open(inputs[f], 0);
+        if (!rd) return 1;
+        double best[2] = { 1e30, 1e30 };
+        size_t preview_size = 0, render_size = 0;
+        int w = 0, h = 0, ok[2] = { 1, 1 };
+        for (int round = 0; round < 4; round++) {
+            // Embedded preview, as the default mode finds and reads it
+            double t0 = monotonic_seconds();
+            JpegInfo *jpegs = NULL;
+            int count = 0, largest = 0;
+            if (ok[0] && locate_jpegs(rd, &jpegs, &count) == 0 && count > 0) {
+                for (int i = 1; i < count; i++)
+                    if (jpegs[i].size > jpegs[largest].size) largest = i;
+                unsigned char *data = malloc(jpegs[largest].size);
+                if (!data || !reader_read_full(rd, jpegs[largest].start, data, jpegs[largest].size))
+                    ok[0] = 0;
+                preview_size = jpegs[largest].size;
+                free(data);
+            } else {
+                ok[0] = 0;
+            }
+            scratch_free(jpegs);
+            double t = monotonic_seconds() - t0;
+            if (round > 0 && t < best[0]) best[0] = t;
+
+            t0 = monotonic_seconds();
+            ByteBuf o;
+            memset(&o, 0, sizeof(o));
+            if (ok[1] && render_raw_jpeg(rd, &o, &w, &h, 0) != 0)
+                ok[1] = 0;
+            render_size = o.len;
+            free(o.data);
+            t = monotonic_seconds() - t0;
+            if (round > 0 && t < best[1]) best[1] = t;
+        }
+        if (!ok[0] || !ok[1]) {
+            printf("%s: %s\n", inputs[f], !ok[1] ? "raw render failed" : "no readable JPEG preview");
+            failures++;
+        } else {
+            printf("%s: largest preview %zu bytes in %.2f ms; raw render %dx%d (%zu bytes) in %.2f ms (%.2fx)\n",
+                   inputs[f], preview_size, best[0] * 1e3, w, h, render_size, best[1] * 1e3, best[1] / best[0]);
+        }
+        reader_close(rd);
+    }
+    return failures ? 1 : 0;
+}
+
+// ----- HEIF pass-through -----
+// HDR PQ files carry their full-size preview as an HEVC image. --heif wraps that
+// sample, without transcoding, in a minimal HEIF file: ftyp, a meta box describing
+// the hvc1 image item (hvcC copied from the CRAW entry, ispe, irot/imir from the EXIF
+// Orientation) and an Exif item, then an mdat holding the sample and the EXIF. Only
+// the box header is built in memory; the sample is streamed like a JPEG preview.
+
+void heif_put16(ByteBuf *o, uint16_t v) {
+    unsigned char b[2];
+    tiff_put16(b, v, 1);
+    bb_put(o, b, 2);
+}
+
+void heif_put32(ByteBuf *o, uint32_t v) {
+    unsigned char b[4];
+    tiff_put32(b, v, 1);
+    bb_put(o, b, 4);
+}
+
+// heif_box_begin: writes a box header with a placeholder size; returns its offset
+size_t heif_box_begin(ByteBuf *o, const char *type) {
+    size_t start = o->len;
+    heif_put32(o, 0);
+    bb_put(o, type, 4);
+    return start;
+}
+
+void heif_box_end(ByteBuf *o, size_t start) {
+    if (!o->failed)
+        tiff_put32(o->data + start, (uint32_t)(o->len - start), 1);
+}
+
+// write_heif: writes hp's sample as an HEIF image to the sink, with exif (an
+// "Exif\0\0" segment, may be NULL) as a linked Exif item. orientation is the EXIF
+// value the image is displayed with (0 or 1: as stored). Returns 0 on success.
+int write_heif(RangeReader *rd, const HevcPreview *hp, const unsigned char *exif, size_t exifSize,
+               int orientation, OutputSink *sink) {
+    // EXIF Orientation -> imir axis (-1: none, 0: top-bottom, 1: left-right, as libheif
+    // and Apple read it) applied before the anticlockwise rotation in quarter turns
+    static const signed char mirror[9] = { -1, -1, 1, -1, 0, 1, -1, 1, -1 };
+    static const unsigned char turns[9] = { 0, 0, 0, 2, 0, 1, 3, 3, 1 };
+    if (orientation < 0 || orientation > 8) orientation = 0;
+    int items = exif ? 2 : 1;
+    if (hp->size + (exif ? exifSize + 4 : 0) > 0xFFFFFFF0u) {
+        fprintf(stderr, "HEVC preview is too large for a HEIF file with 32-bit offsets\n");
+        return -1;
+    }
+    ByteBuf o;
+    memset(&o, 0, sizeof(o));
+    size_t box = heif_box_begin(&o, "ftyp");
+    bb_put(&o, "heic", 4);
+    heif_put32(&o, 0);
+    bb_put(&o, "mif1heic", 8);
+    heif_box_end(&o, box);
+
+    size_t meta = heif_box_begin(&o, "meta");
+    heif_put32(&o, 0);
+    box = heif_box_begin(&o, "hdlr");
+    // version/flags, pre_defined, handler_type, 3 reserved words, empty name
+    static const unsigned char hdlr[25] = { 0, 0, 0, 0, 0, 0, 0, 0, 'p', 'i', 'c', 't' };
+    bb_put(&o, hdlr, sizeof(hdlr));
+    heif_box_end(&o, box);
+    box = heif_box_begin(&o, "pitm");
+    heif_put32(&o, 0);
+    heif_put16(&o, 1);
+    heif_box_end(&o, box);
+
+    // iloc v0: 4-byte extent offsets and lengths, no base offset; offsets patched below
+    size_t extentOffset[2];
+    box = heif_box_begin(&o, "iloc");
+    heif_put32(&o, 0);
+    heif_put16(&o, 0x4400);
+    heif_put16(&o, (uint16_t)items);
+    for (int i = 0; i < items; i++) {
+        heif_put16(&o, (uint16_t)(i + 1));
+        heif_put16(&o, 0);
+        heif_put16(&o, 1);
+        extentOffset[i] = o.len;
+        heif_put32(&o, 0);
+        heif_put32(&o, i == 0 ? (uint32_t)hp->size : (uint32_t)(exifSize + 4));
+    }
+    heif_box_end(&o, box);
+
+    box = heif_box_begin(&o, "iinf");
+    heif_put32(&o, 0);
+    heif_put16(&o, (uint16_t)items);
+    for (int i = 0; i < items; i++) {
+        size_t infe = heif_box_begin(&o, "infe");
+        heif_put32(&o, 2u << 24);
+        heif_put16(&o, (uint16_t)(i + 1));
+        heif_put16(&o, 0);
+        bb_put(&o, i == 0 ? "hvc1" : "Exif", 5);
+        heif_box_end(&o, infe);
+    }
+    heif_box_end(&o, box);
+    if (exif) {
+        box = heif_box_begin(&o, "iref");
+        heif_put32(&o, 0);
+        size_t cdsc = heif_box_begin(&o, "cdsc");
+        heif_put16(&o, 2);
+        heif_put16(&o, 1);
+        heif_put16(&o, 1);
+        heif_box_end(&o, cdsc);
+        heif_box_end(&o, box);
+    }
+
+    // Item properties: 1 hvcC, 2 ispe, then imir and irot as the orientation needs
+    unsigned char assoc[4] = { 0x81, 0x02 };
+    int props = 2;
+    size_t iprp = heif_box_begin(&o, "iprp");
+    size_t ipco = heif_box_begin(&o, "ipco");
+    bb_put(&o, hp->hvcc, hp->hvccSize);
+    box = heif_box_begin(&o, "ispe");
+    heif_put32(&o, 0);
+    heif_put32(&o, hp->width);
+    heif_put32(&o, hp->height);
+    heif_box_end(&o, box);
+    if (mirror[orientation] >= 0) {
+        box = heif_box_begin(&o, "imir");
+        unsigned char axis = (unsigned char)mirror[orientation];
+        bb_put(&o, &axis, 1);
+        heif_box_end(&o, box);
+        assoc[props] = (unsigned char)(0x80 | (props + 1));
+        props++;
+    }
+    if (turns[orientation]) {
+        box = heif_box_begin(&o, "irot");
+        bb_put(&o, &turns[orientation], 1);
+        heif_box_end(&o, box);
+        assoc[props] = (unsigned char)(0x80 | (props + 1));
+        props++;
+    }
+    heif_box_end(&o, ipco);
+    box = heif_box_begin(&o, "ipma");
+    heif_put32(&o, 0);
+    heif_put32(&o, 1);
+    heif_put16(&o, 1);
+    unsigned char n = (unsigned char)props;
+    bb_put(&o, &n, 1);
+    bb_put(&o, assoc, props);
+    heif_box_end(&o, box);
+    heif_box_end(&o, iprp);
+    heif_box_end(&o, meta);
+
+    heif_put32(&o, (uint32_t)(8 + hp->size + (exif ? exifSize + 4 : 0)));
+    bb_put(&o, "mdat", 4);
+    if (o.failed) {
+        fprintf(stderr, "Memory allocation failed for HEIF header\n");
+        free(o.data);
+        return -1;
+    }
+    tiff_put32(o.data + extentOffset[0], (uint32_t)o.len, 1);
+    if (exif)
+        tiff_put32(o.data + extentOffset[1], (uint32_t)(o.len + hp->size), 1);
+
+    int rc = -1, unused;
+    static const unsigned char exifHeaderOffset[4] = { 0, 0, 0, 6 };
+    if (sink_write(sink, o.data, o.len) != o.len ||
+        stream_jpeg(rd, hp->offset, (size_t)hp->size, NULL, 0, sink, &unused) != 0 ||
+        (exif && (sink_write(sink, exifHeaderOffset, 4) != 4 || sink_write(sink, exif, exifSize) != exifSize))) {
+        fprintf(stderr, "Failed to write HEIF preview to %s\n", sink->to_stdout ? "stdout" : sink->path);
+    } else {
+        rc = 0;
+    }
+    free(o.data);
+    return rc;
+}
+
+// extract_heif_preview: --heif; writes the HEVC preview of an HDR PQ file as HEIF with
+// its (full or minimized) EXIF. Returns 1 without writing anything if the file has
+// no HEVC preview, so the caller can fall back to the JPEG preview.
+int extract_heif_preview(const char *cr3_path, const char *output_path, int to_stdout, int verbose) {
+    RangeReader *rd = reader_open(cr3_path, verbose);
+    if (!rd)
+        return -1;
+    HevcPreview hp;
+    uint64_t t = trace_begin();
+    int found = tiff_byte_order(rd) < 0 ? locate_hevc_preview(rd, &hp) : 0;
+    trace_end("parse container", t, NULL);
+    if (found <= 0) {
+        reader_close(rd);
+        return found < 0 ? -1 : 1;
+    }
+    size_t exifSize = 0;
+    unsigned char *exif = load_exif(rd, &exifSize, verbose);
+    // The rotation moves into irot/imir, so viewers must not apply the tag again
+    int orientation = exif_orientation(exif, exifSize, 1);
+    OutputSink sink;
+    int rc = -1;
+    if (sink_open(&sink, output_path, to_stdout) != 0) {
+        perror("Failed to open output HEIF file");
+    } else {
+        rc = write_heif(rd, &hp, exif, exifSize, orientation, &sink);
+        if (rc == 0 && verbose) {
+            if (to_stdout)
+                fprintf(stderr, "HEVC preview %ux%u (%llu bytes) streamed to stdout as HEIF\n",
+                        hp.width, hp.height, (unsigned long long)hp.size);
+            else
+                printf("HEVC preview %ux%u extracted to %s (size: %zu bytes)\n", hp.width, hp.height,
+                       output_path, sink.size);
+        }
+        rc = sink_close(&sink, rc == 0) != 0 ? -1 : rc;
+    }
+    scratch_free(exif);
+    scratch_free(hp.hvcc);
+    reader_close(rd);
+    return rc;
+}
+
+// extract_largest_jpeg: the default mode. Writes the largest preview unaltered, or
+// with --min-long-edge / --max-bytes the one select_preview picks. --render-raw
+// skips the previews and writes a render of the raw data instead; --raw-fallback
+// does so when no preview is found or the chosen one has no readable frame header.
+int extract_largest_jpeg(const char *cr3_path, const char *output_path, int to_stdout, int verbose) {
+    RangeReader *cr3_file = reader_open(cr3_path, verbose);
+    if (!cr3_file)
+        return -1;
+
+    JpegInfo *jpegs = NULL;
+    int jpeg_count = 0;
+    int largest_idx = -1;   // -1: render the raw track instead
+    if (!g_render_raw) {
+        if (locate_jpegs(cr3_file, &jpegs, &jpeg_count) != 0) {
+            fprintf(stderr, "Failed to scan for JPEG previews in CR3 file.\n");
+            reader_close(cr3_file);
+            if (jpegs) scratch_free(jpegs);
+            return -1;
+        }
+
+        if (jpeg_count == 0 && !g_raw_fallback) {
+            fprintf(stderr, "No JPEG previews found in CR3 file: %s\n", cr3_path);
+            HevcPreview hp;
+            if (!g_heif && tiff_byte_order(cr3_file) < 0 && locate_hevc_preview(cr3_file, &hp) > 0) {
+                fprintf(stderr, "%s has an HEVC (HDR PQ) preview: use '--heif' to extract it\n", cr3_path);
+                scratch_free(hp.hvcc);
+            }
+            reader_close(cr3_file);
+            if (jpegs) scratch_free(jpegs);
+            return -1;
+        }
+
+        if (jpeg_count == 0) {
+            fprintf(stderr, "%s: no JPEG preview found, rendering the raw data\n", cr3_path);
+        } else if (g_min_long_edge || g_max_bytes) {
+            largest_idx = select_preview(cr3_file, jpegs, jpeg_count, verbose);
+            if (largest_idx < 0 && !g_raw_fallback) {
+                fprintf(stderr, "No readable JPEG preview found in CR3 file: %s\n", cr3_path);
+                reader_close(cr3_file);
+                scratch_free(jpegs);
+                return -1;
+            } else if (largest_idx < 0) {
+                fprintf(stderr, "%s: no readable JPEG preview, rendering the raw data\n", cr3_path);
+            }
+        } else {
+            largest_idx = 0;
+            for (int i = 1; i < jpeg_count; i++) {
+                if (jpegs[i].size > jpegs[largest_idx].size)
+                    largest_idx = i;
+            }
+            int w, h;
+            if (g_raw_fallback && jpeg_dimensions(cr3_file, &jpegs[largest_idx], &w, &h) != 0) {
+                fprintf(stderr, "%s: the JPEG preview at %zu has no readable frame header, rendering the raw data\n",
+                        cr3_path, jpegs[largest_idx].start);
+                largest_idx = -1;
+            }
+        }
+    }
+
+    OutputSink sink;
+    if (sink_open(&sink, output_path, to_stdout) != 0) {
+        perror("Failed to open output JPEG file");
+        reader_close(cr3_file);
+        scratch_free(jpegs);
+        return -1;
+    }
+    int rc;
+    if (largest_idx < 0) {
+        rc = write_raw_render(cr3_file, &sink, verbose);
+        if (rc == 0 && verbose) {
+            if (to_stdout)
+                fprintf(stderr, "Raw render streamed to stdout (size: %zu bytes)\n", sink.size);
+            else
+                printf("Raw render written to %s (size: %zu bytes)\n", output_path, sink.size);
+        }
+    } else {
+        size_t jpeg_start_offset = jpegs[largest_idx].start;
+        size_t jpeg_size = jpegs[largest_idx].size;
+        if (verbose) {
+            if (to_stdout)
+                fprintf(stderr, "%s JPEG preview found (size: %zu bytes), streaming to stdout...\n",
+                        g_min_long_edge || g_max_bytes ? "Selected" : "Largest", jpeg_size);
+            else
+                printf("%s JPEG preview extracted to %s (size: %zu bytes)\n",
+                       g_min_long_edge || g_max_bytes ? "Selected" : "Largest", output_path, jpeg_size);
+        }
+        int with_exif;
+        rc = stream_jpeg(cr3_file, jpeg_start_offset, jpeg_size, NULL, 0, &sink, &with_exif);
+    }
+    reader_close(cr3_file);
+    scratch_free(jpegs);
+    if (rc != 0) {
+        sink_close(&sink, 0);
+        return -1;
+    }
+    return sink_close(&sink, 1);
+}
+
+// Updated extract_all_jpegs with size_t and our new heuristic
+int extract_all_jpegs(const char *cr3_path, int verbose) {
+    RangeReader *cr3_file = reader_open(cr3_path, verbose);
+    if (!cr3_file)
+        return -1;
+    JpegInfo *jpegs = NULL;
+    int jpeg_count = 0;
+    if (locate_jpegs(cr3_file, &jpegs, &jpeg_count) != 0) {
+        fprintf(stderr, "Failed to scan for JPEG previews in CR3 file.\n");
+        reader_close(cr3_file);
+        scratch_free(jpegs);
+        return -1;
+    }
+    if (jpeg_count == 0) {
+        fprintf(stderr, "No JPEG previews found in CR3 file: %s\n", cr3_path);
+        reader_close(cr3_file);
+        scratch_free(jpegs);
+        return -1;
+    }
+
+    size_t exifSize = 0;
+    unsigned char *exifSegment = load_exif(cr3_file, &exifSize, verbose);
+
+    // New heuristic: if the first JPEG segment is below 8KB and there are at least 4 segments,
+    // skip the first segment by setting starting_index to 1.
+    int starting_index = 0;
+    if (jpegs[0].source == JPEG_FROM_SCAN && jpeg_count >= 4 && jpegs[0].size < 8 * 1024) {
+        if (verbose)
+            fprintf(stderr, "First JPEG segment size %zu is below 8KB, skipping it.\n", jpegs[0].size);
+        starting_index = 1;
+    }
+    int max_extract = ((jpeg_count - starting_index) < 3) ? (jpeg_count - starting_index) : 3;
+    // --thumbs-first writes the first preview and the others in separate tasks
+    int first = g_tier == TIER_BACKGROUND ? 1 : 0;
+    if (g_tier == TIER_THUMB) max_extract = 1;
+    int result = 0;
+    for (int i = starting_index + first; i < starting_index + max_extract; i++) {
+        char *outfile = generate_output_filename_all((g_output_filename != NULL ? g_output_filename : cr3_path), i);
+        if (!outfile) {
+            fprintf(stderr, "Failed to generate output filename for JPEG %d\n", i + 1);
+            result = -1;
+            break;
+        }
+        OutputSink sink;
+        if (sink_open(&sink, outfile, 0) != 0) {
+            perror("Failed to open output file");
+            scratch_free(outfile);
+            result = -1;
+            break;
+        }
+        int with_exif;
+        if (emit_jpeg(cr3_file, &jpegs[i], exifSegment, exifSize, &sink, &with_exif, verbose) != 0) {
+            sink_close(&sink, 0);
+            scratch_free(outfile);
             result = -1;
             break;
         }
-        if (fread(jpeg_data, 1, size_jpeg, cr3_file) != size_jpeg) {
-            perror("Failed to read JPEG data");
-            free(jpeg_data);
-            result = -1;
+        size_t output_size = sink.size;
+        if (sink_close(&sink, 1) != 0) {
+            scratch_free(outfile);
+            result = -1;
+            break;
+        }
+        if (verbose)
+            fprintf(stderr, "Extracted JPEG %d to %s (size: %zu bytes) with %sEXIF\n",
+                    i + 1, outfile, output_size, (with_exif ? (g_minimize_exif ? "minimized " : "full ") : "no "));
+        scratch_free(outfile);
+    }
+    if (exifSegment) scratch_free(exifSegment);
+    scratch_free(jpegs);
+    reader_close(cr3_file);
+    return result;
+}
+
+// Updated extract_specific_jpeg with size_t and our new mapping heuristic.
+// If the first segment is invalid (below 8KB) and there are at least 4 segments,
+// we adjust the mapping so that -j 1 extracts jpegs[1], -j 2 extracts jpegs[2], and -j 3 extracts jpegs[3].
+int extract_specific_jpeg(const char *cr3_path, int jpeg_index, int to_stdout, int verbose) {
+    RangeReader *cr3_file = reader_open(cr3_path, verbose);
+    if (!cr3_file)
+        return -1;
+    JpegInfo *jpegs = NULL;
+    int jpeg_count = 0;
+    if (locate_jpegs(cr3_file, &jpegs, &jpeg_count) != 0) {
+        fprintf(stderr, "Failed to scan for JPEG previews in CR3 file.\n");
+        reader_close(cr3_file);
+        return -1;
+    }
+    int idx = 0;
+    if (jpeg_index == 0) {
+        // -j auto: --min-long-edge / --max-bytes choose the preview
+        idx = select_preview(cr3_file, jpegs, jpeg_count, verbose);
+        if (idx < 0) {
+            fprintf(stderr, "No readable JPEG preview found in CR3 file: %s\n", cr3_path);
+            reader_close(cr3_file);
+            scratch_free(jpegs);
+            return -1;
+        }
+    } else if (jpeg_count >= 4 && jpegs[0].source == JPEG_FROM_SCAN && jpegs[0].size < 8 * 1024) {
+        if (jpeg_index < 1 || jpeg_index > (jpeg_count - 1)) {
+            fprintf(stderr, "Requested JPEG index %d not available after skipping the invalid first segment. Only %d valid JPEG segments available.\n", jpeg_index, jpeg_count - 1);
+            reader_close(cr3_file);
+            scratch_free(jpegs);
+            return -1;
+        }
+        if (verbose)
+            fprintf(stderr, "First JPEG segment size %zu is below 8KB, adjusting extraction index from %d to %d.\n", jpegs[0].size, jpeg_index, jpeg_index);
+        idx = jpeg_index; // e.g., -j 1 now maps to array index 1.
+    } else {
+        if (jpeg_index < 1 || jpeg_index > jpeg_count) {
+            fprintf(stderr, "Requested JPEG index %d not available. Only %d JPEG segments found.\n", jpeg_index, jpeg_count);
+            reader_close(cr3_file);
+            scratch_free(jpegs);
+            return -1;
+        }
+        idx = jpeg_index - 1;
+    }
+    size_t exifSize = 0;
+    unsigned char *exifSegment = load_exif(cr3_file, &exifSize, verbose);
+    char *outfile = NULL;
+    if (!to_stdout) {
+        if (g_output_filename != NULL) {
+            outfile = scratch_strdup(g_output_filename);
+        } else {
+            outfile = jpeg_index == 0 ? generate_output_filename(cr3_path) : generate_output_filename_all(cr3_path, idx);
+        }
+        if (!outfile) {
+            fprintf(stderr, "Failed to generate output filename for JPEG %d\n", jpeg_index);
+            scratch_free(exifSegment);
+            reader_close(cr3_file);
+            scratch_free(jpegs);
+            return -1;
+        }
+    }
+    OutputSink sink;
+    if (sink_open(&sink, outfile, to_stdout) != 0) {
+        perror("Failed to open output file");
+        scratch_free(outfile);
+        scratch_free(exifSegment);
+        reader_close(cr3_file);
+        scratch_free(jpegs);
+        return -1;
+    }
+    int with_exif = 0;
+    int rc = emit_jpeg(cr3_file, &jpegs[idx], exifSegment, exifSize, &sink, &with_exif, verbose);
+    size_t output_size = sink.size;
+    scratch_free(exifSegment);
+    reader_close(cr3_file);
+    scratch_free(jpegs);
+    if (rc != 0 || sink_close(&sink, 1) != 0) {
+        if (rc != 0)
+            sink_close(&sink, 0);
+        scratch_free(outfile);
+        return -1;
+    }
+    if (verbose) {
+        if (to_stdout)
+            fprintf(stderr, "Extracted JPEG %d to stdout (size: %zu bytes) with %sEXIF\n",
+                    jpeg_index ? jpeg_index : idx + 1, output_size, (with_exif ? (g_minimize_exif ? "minimized " : "full ") : "no "));
+        else
+            fprintf(stderr, "Extracted JPEG %d to %s (size: %zu bytes) with %sEXIF\n",
+                    jpeg_index ? jpeg_index : idx + 1, outfile, output_size, (with_exif ? (g_minimize_exif ? "minimized " : "full ") : "no "));
+    }
+    scratch_free(outfile);
+    return 0;
+}
+
+// output_source_name: outputs for an http:// input are named after the last path
+// component of the URL, without the query or fragment, and written to the current
+// directory. Returns the length of the name, which *name points to (not terminated).
+size_t output_source_name(const char *source, const char **name) {
+    *name = source;
+    if (strncmp(source, "http://", 7) != 0) return strlen(source);
+    const char *end = source + 7 + strcspn(source + 7, "?#"), *start = end;
+    while (start > source + 7 && start[-1] != '/') start--;
+    if (start == source + 7 || start == end) {
+        *name = "download";
+        return 8;
+    }
+    *name = start;
+    return (size_t)(end - start);
+}
+
+// generate_output_filename (unchanged)
+char* generate_output_filename(const char* source) {
+    return generate_output_filename_ext(source, ".jpg");
+}
+
+// generate_output_filename_ext: source name with its extension replaced by ext
+char* generate_output_filename_ext(const char* source, const char *ext) {
+    const char *name;
+    size_t len = output_source_name(source, &name);
+    char *output = scratch_alloc(len + strlen(ext) + 1);
+    if (!output) {
+        fprintf(stderr, "Failed to allocate memory for output filename\n");
+        return NULL;
+    }
+    memcpy(output, name, len);
+    output[len] = '\0';
+    char *dot = strrchr(output, '.');
+    if (dot && dot != output && *(dot + 1) != '\0')
+        *dot = '\0';
+    strcat(output, ext);
+    return output;
+}
+
+// generate_output_filename_all (unchanged)
+char* generate_output_filename_all(const char* source, int index) {
+    const char *name;
+    size_t len = output_source_name(source, &name);
+    char *base = scratch_alloc(len + 1);
+    if (!base) return NULL;
+    memcpy(base, name, len);
+    base[len] = '\0';
+    char *dot = strrchr(base, '.');
+    if (dot) {
+        *dot = '\0';
+    }
+    int outsize = strlen(base) + 1 + 3 + 4 + 1;
+    char *outfile = scratch_alloc(outsize);
+    if (!outfile) {
+        scratch_free(base);
+        return NULL;
+    }
+    snprintf(outfile, outsize, "%s_%03d.jpg", base, index + 1);
+    scratch_free(base);
+    return outfile;
+}
+
+// file_stat_info: size and modification time (nanoseconds) of a file; -1 if it cannot be stat'ed
+int file_stat_info(const char *path, uint64_t *size, int64_t *mtime_ns) {
+    struct stat st;
+    if (stat(path, &st) != 0)
+        return -1;
+    *size = (uint64_t)st.st_size;
+#if defined(__APPLE__)
+    *mtime_ns = (int64_t)st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+#elif defined(_WIN32)
+    *mtime_ns = (int64_t)st.st_mtime * 1000000000;
+#else
+    *mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+    return 0;
+}
+
+// read_text_line: reads one line of any length without its line ending.
+// Returns NULL at end of file. *complete is cleared if the line had no '\n'
+// (e.g. a journal line torn by a crash).
+char *read_text_line(FILE *f, int *complete) {
+    size_t cap = 256, len = 0;
+    char *line = malloc(cap);
+    if (!line) return NULL;
+    *complete = 0;
+    int c;
+    while ((c = fgetc(f)) != EOF) {
+        if (c == '\n') {
+            *complete = 1;
             break;
         }
-        unsigned char *output_data = jpeg_data;
-        size_t output_size = size_jpeg;
-        if (exifSegment) {
-            if (!insertExifIntoJpeg(jpeg_data, size_jpeg, exifSegment, exifSize, &output_data, &output_size)) {
-                fprintf(stderr, "Failed to insert EXIF into JPEG %d (using original JPEG).\n", i + 1);
-                output_data = jpeg_data;
-                output_size = size_jpeg;
+        if (len + 1 >= cap) {
+            cap *= 2;
+            char *temp = realloc(line, cap);
+            if (!temp) {
+                free(line);
+                return NULL;
+            }
+            line = temp;
+        }
+        line[len++] = (char)c;
+    }
+    if (c == EOF && len == 0) {
+        free(line);
+        return NULL;
+    }
+    if (len > 0 && line[len - 1] == '\r') len--;
+    line[len] = '\0';
+    return line;
+}
+
+// Journal fields are tab separated, so tabs, newlines and backslashes in paths are escaped.
+char *journal_escape(const char *s) {
+    char *out = malloc(strlen(s) * 2 + 1);
+    if (!out) return NULL;
+    char *o = out;
+    for (; *s; s++) {
+        if (*s == '\\') { *o++ = '\\'; *o++ = '\\'; }
+        else if (*s == '\t') { *o++ = '\\'; *o++ = 't'; }
+        else if (*s == '\n') { *o++ = '\\'; *o++ = 'n'; }
+        else *o++ = *s;
+    }
+    *o = '\0';
+    return out;
+}
+
+// journal_split: splits a line in place on tabs, unescaping each field. Returns the field count.
+int journal_split(char *line, char **fields, int max_fields) {
+    int n = 0;
+    char *r = line, *w = line;
+    fields[n++] = w;
+    for (; *r; r++) {
+        if (*r == '\t') {
+            *w++ = '\0';
+            if (n == max_fields) return -1;
+            fields[n++] = w;
+        } else if (*r == '\\' && r[1]) {
+            r++;
+            *w++ = (*r == 't') ? '\t' : (*r == 'n') ? '\n' : *r;
+        } else {
+            *w++ = *r;
+        }
+    }
+    *w = '\0';
+    return n;
+}
+
+uint64_t journal_hash(const char *s) {
+    uint64_t h = 1469598103934665603ULL;
+    for (; *s; s++)
+        h = (h ^ (unsigned char)*s) * 1099511628211ULL;
+    return h;
+}
+
+void job_outputs_free(JobOutputs *job) {
+    for (int i = 0; i < job->count; i++)
+        scratch_free(job->outputs[i].path);
+    job->count = 0;
+}
+
+// journal_find: looks up a source in the open-addressing table built by journal_load
+JournalEntry *journal_find(JournalEntry *table, size_t capacity, const char *source) {
+    if (!table) return NULL;
+    size_t mask = capacity - 1;
+    for (size_t i = journal_hash(source) & mask; table[i].source; i = (i + 1) & mask) {
+        if (strcmp(table[i].source, source) == 0)
+            return &table[i];
+    }
+    return NULL;
+}
+
+// journal_insert: takes ownership of entry; a later line for the same source replaces an earlier one
+int journal_insert(JournalEntry **table, size_t *capacity, size_t *used, JournalEntry *entry) {
+    if ((*used + 1) * 2 > *capacity) {
+        size_t new_cap = *capacity ? *capacity * 2 : 1024;
+        JournalEntry *grown = calloc(new_cap, sizeof(JournalEntry));
+        if (!grown) return -1;
+        for (size_t i = 0; i < *capacity; i++) {
+            if (!(*table)[i].source) continue;
+            size_t j = journal_hash((*table)[i].source) & (new_cap - 1);
+            while (grown[j].source) j = (j + 1) & (new_cap - 1);
+            grown[j] = (*table)[i];
+        }
+        free(*table);
+        *table = grown;
+        *capacity = new_cap;
+    }
+    JournalEntry *existing = journal_find(*table, *capacity, entry->source);
+    if (existing) {
+        free(existing->source);
+        job_outputs_free(&existing->done);
+        *existing = *entry;
+        return 0;
+    }
+    size_t j = journal_hash(entry->source) & (*capacity - 1);
+    while ((*table)[j].source) j = (j + 1) & (*capacity - 1);
+    (*table)[j] = *entry;
+    (*used)++;
+    return 0;
+}
+
+// journal_load: reads a journal into a hash table (capacity returned in *count).
+// A missing journal is not an error; malformed or torn lines are ignored.
+int journal_load(const char *path, JournalEntry **entries, size_t *count) {
+    *entries = NULL;
+    *count = 0;
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        if (errno == ENOENT) return 0;
+        perror("Failed to open journal");
+        return -1;
+    }
+    size_t used = 0;
+    char *line;
+    int complete;
+    while ((line = read_text_line(f, &complete)) != NULL) {
+        char *fields[4 + 3 * MAX_JOB_OUTPUTS];
+        int n = complete ? journal_split(line, fields, 4 + 3 * MAX_JOB_OUTPUTS) : -1;
+        int outputs = n >= 4 ? atoi(fields[3]) : -1;
+        if (outputs < 0 || outputs > MAX_JOB_OUTPUTS || n != 4 + 3 * outputs) {
+            free(line);
+            continue;
+        }
+        JournalEntry entry;
+        memset(&entry, 0, sizeof(entry));
+        entry.source = strdup(fields[0]);
+        entry.size = strtoull(fields[1], NULL, 10);
+        entry.mtime_ns = strtoll(fields[2], NULL, 10);
+        for (int i = 0; i < outputs; i++) {
+            OutputRecord *rec = &entry.done.outputs[entry.done.count++];
+            rec->path = strdup(fields[4 + 3 * i]);
+            rec->size = strtoull(fields[5 + 3 * i], NULL, 10);
+            rec->crc = (uint32_t)strtoul(fields[6 + 3 * i], NULL, 16);
+        }
+        free(line);
+        if (!entry.source || journal_insert(entries, count, &used, &entry) != 0) {
+            fprintf(stderr, "Memory allocation failed while loading journal\n");
+            free(entry.source);
+            job_outputs_free(&entry.done);
+            fclose(f);
+            return -1;
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+void journal_free(JournalEntry *table, size_t capacity) {
+    for (size_t i = 0; i < capacity; i++) {
+        if (!table[i].source) continue;
+        free(table[i].source);
+        job_outputs_free(&table[i].done);
+    }
+    free(table);
+}
+
+// journal_append: writes one complete line per finished input and flushes it,
+// so a killed run loses at most the line being written.
+int journal_append(FILE *journal, const char *source, uint64_t size, int64_t mtime_ns, const JobOutputs *job) {
+    char *src = journal_escape(source);
+    if (!src) return -1;
+    fprintf(journal, "%s\t%llu\t%lld\t%d", src, (unsigned long long)size, (long long)mtime_ns, job->count);
+    scratch_free(src);
+    for (int i = 0; i < job->count; i++) {
+        char *out = journal_escape(job->outputs[i].path);
+        if (!out) return -1;
+        fprintf(journal, "\t%s\t%zu\t%08x", out, job->outputs[i].size, (unsigned)job->outputs[i].crc);
+        scratch_free(out);
+    }
+    fputc('\n', journal);
+    return (fflush(journal) == 0 && !ferror(journal)) ? 0 : -1;
+}
+
+// journal_entry_verified: the source still has the recorded size and mtime, and every
+// recorded output exists with the recorded size and CRC-32.
+int journal_entry_verified(const JournalEntry *entry, uint64_t size, int64_t mtime_ns) {
+    if (entry->size != size || entry->mtime_ns != mtime_ns || entry->done.count == 0)
+        return 0;
+    unsigned char buffer[STREAM_BUFFER_SIZE];
+    for (int i = 0; i < entry->done.count; i++) {
+        const OutputRecord *rec = &entry->done.outputs[i];
+        FILE *f = fopen(rec->path, "rb");
+        if (!f) return 0;
+        uint32_t crc = 0;
+        size_t total = 0, n;
+        while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+            crc = crc32_update(crc, buffer, n);
+            total += n;
+        }
+        int ok = !ferror(f) && total == rec->size && crc == rec->crc;
+        fclose(f);
+        if (!ok) return 0;
+    }
+    return 1;
+}
+
+int output_is_fresh(const char *path, int64_t src_mtime_ns) {
+    uint64_t size;
+    int64_t mtime_ns;
+    return path && file_stat_info(path, &size, &mtime_ns) == 0 && mtime_ns >= src_mtime_ns;
+}
+
+// outputs_up_to_date: make-style check that the outputs this mode would write already
+// exist and are at least as new as the source. The -j mappings shift by one when the
+// first segment is skipped as too small, so either set of names is accepted. With
+// --heif, files without an HEVC preview get a .jpg, so either name counts. With -o,
+// the file named there is checked instead (for -j all, the names derived from it).
+int outputs_up_to_date(const char *cr3_path, int64_t src_mtime_ns) {
+    if (!g_extract_all && g_output_filename)
+        return output_is_fresh(g_output_filename, src_mtime_ns);
+    if (!g_extract_all && g_extract_index <= 0) {
+        char *out = generate_output_filename(cr3_path);
+        int fresh = output_is_fresh(out, src_mtime_ns);
+        scratch_free(out);
+        if (!fresh && g_heif) {
+            out = generate_output_filename_ext(cr3_path, ".HIF");
+            fresh = output_is_fresh(out, src_mtime_ns);
+            scratch_free(out);
+        }
+        return fresh;
+    }
+    int first = g_extract_all ? 0 : g_extract_index - 1;
+    int n = g_extract_all ? 3 : 1;
+    for (int shift = 0; shift <= 1; shift++) {
+        int fresh = 1;
+        for (int i = 0; i < n && fresh; i++) {
+            char *out = generate_output_filename_all(g_output_filename ? g_output_filename : cr3_path,
+                                                     first + shift + i);
+            fresh = output_is_fresh(out, src_mtime_ns);
+            scratch_free(out);
+        }
+        if (fresh) return 1;
+    }
+    return 0;
+}
+
+// process_file: runs the selected mode on one input within the resource limits.
+// Returns 0 on success, RESULT_OVER_LIMIT if a limit stopped it, -1 otherwise.
+// *bytes_read receives how much of the input was read.
+int process_file(const char *cr3_path, int to_stdout, int verbose, uint64_t *bytes_read) {
+    FileBudget budget;
+    budget_begin(&budget, cr3_path);
+    int result = run_mode(cr3_path, to_stdout, verbose);
+    budget_end();
+    *bytes_read = atomic_load(&budget.read);
+    if (atomic_load(&budget.exceeded)) {
+        metrics_add(METRIC_FILES_OVER_LIMIT, 1);
+        return RESULT_OVER_LIMIT;
+    }
+    return result;
+}
+
+// run_mode: runs the selected extraction mode on one input. Returns 0 on success.
+int run_mode(const char *cr3_path, int to_stdout, int verbose) {
+    if (g_verify) {
+        return verify_file(cr3_path, verbose);
+    } else if (g_phash || g_dupes_distance >= 0) {
+        return phash_file(cr3_path, verbose);
+    } else if (g_extract_all) {
+        int result = extract_all_jpegs(cr3_path, verbose);
+        if (result == 0 && verbose) {
+            fprintf(stderr, "Extraction of first 3 JPEGs completed successfully.\n");
+        } else if (result != 0) {
+            fprintf(stderr, "Extraction failed.\n");
+        }
+        return result;
+    } else if (g_extract_index != -1) {
+        int result = extract_specific_jpeg(cr3_path, g_extract_index, to_stdout, verbose);
+        if (result == 0 && verbose && g_extract_index == 0) {
+            fprintf(stderr, "Extraction of the selected JPEG completed successfully.\n");
+        } else if (result == 0 && verbose) {
+            fprintf(stderr, "Extraction of JPEG %d completed successfully.\n", g_extract_index);
+        } else if (result != 0) {
+            fprintf(stderr, "Extraction failed.\n");
+        }
+        return result;
+    } else {
+        char *output_path = NULL;
+        int result = 1;
+        if (g_heif) {
+            if (!to_stdout) {
+                output_path = g_output_filename ? scratch_strdup(g_output_filename)
+                                                : generate_output_filename_ext(cr3_path, ".HIF");
+                if (!output_path)
+                    return -1;
+            }
+            result = extract_heif_preview(cr3_path, output_path, to_stdout, verbose);
+            if (result == 1) {
+                if (verbose)
+                    fprintf(stderr, "%s: no HEVC preview, extracting the JPEG preview\n", cr3_path);
+                if (output_path) scratch_free(output_path);
+                output_path = NULL;
+            }
+        }
+        if (result == 1 && !to_stdout) {
+            if (g_output_filename != NULL) {
+                output_path = scratch_strdup(g_output_filename);
             } else {
-                free(jpeg_data);
+                output_path = generate_output_filename(cr3_path);
             }
+            if (!output_path)
+                return -1;
         }
-        char *outfile = generate_output_filename_all((g_output_filename != NULL ? g_output_filename : cr3_path), i);
-        if (!outfile) {
-            fprintf(stderr, "Failed to generate output filename for JPEG %d\n", i + 1);
-            free(output_data);
-            result = -1;
-            break;
+        if (result == 1)
+            result = extract_largest_jpeg(cr3_path, output_path, to_stdout, verbose);
+        if (result == 0 && verbose) {
+            fprintf(stderr, "Extraction completed successfully.\n");
+        } else if (result != 0) {
+            fprintf(stderr, "Extraction failed.\n");
         }
-        FILE *outf = fopen(outfile, "wb");
-        if (!outf) {
-            perror("Failed to open output file");
-            free(outfile);
-            free(output_data);
-            result = -1;
+        if (output_path) scratch_free(output_path);
+        return result;
+    }
+}
+
+// WorkQueue: a fixed-size ring; producers block when it is full so a fast
+// directory walk or inotify burst cannot queue unbounded work.
+int queue_init(WorkQueue *q, int capacity) {
+    memset(q, 0, sizeof(*q));
+    q->items = malloc(capacity * sizeof(char *));
+    if (!q->items) return -1;
+    q->capacity = capacity;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    pthread_cond_init(&q->not_full, NULL);
+    return 0;
+}
+
+// queue_push: takes ownership of path. Returns -1 (and frees it) if the queue was closed.
+int queue_push(WorkQueue *q, char *path) {
+    pthread_mutex_lock(&q->lock);
+    while (q->count == q->capacity && !q->closed)
+        pthread_cond_wait(&q->not_full, &q->lock);
+    if (q->closed) {
+        pthread_mutex_unlock(&q->lock);
+        free(path);
+        return -1;
+    }
+    q->items[(q->head + q->count) % q->capacity] = path;
+    q->count++;
+    trace_counter("queue depth", (uint64_t)q->count);
+    metrics_queue_depth(q->count);
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+    return 0;
+}
+
+// queue_pop: blocks until work arrives; returns NULL once the queue is closed and drained
+char *queue_pop(WorkQueue *q) {
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0 && !q->closed)
+        pthread_cond_wait(&q->not_empty, &q->lock);
+    char *path = NULL;
+    if (q->count > 0) {
+        path = q->items[q->head];
+        q->head = (q->head + 1) % q->capacity;
+        q->count--;
+        trace_counter("queue depth", (uint64_t)q->count);
+        metrics_queue_depth(q->count);
+        pthread_cond_signal(&q->not_full);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return path;
+}
+
+void queue_close(WorkQueue *q) {
+    pthread_mutex_lock(&q->lock);
+    q->closed = 1;
+    pthread_cond_broadcast(&q->not_empty);
+    pthread_cond_broadcast(&q->not_full);
+    pthread_mutex_unlock(&q->lock);
+}
+
+void queue_destroy(WorkQueue *q) {
+    while (q->count > 0) {
+        free(q->items[q->head]);
+        q->head = (q->head + 1) % q->capacity;
+        q->count--;
+    }
+    free(q->items);
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->not_empty);
+    pthread_cond_destroy(&q->not_full);
+}
+
+// batch_begin: loads the journal for --resume and opens it for appending
+int batch_begin(BatchState *st, int to_stdout, int verbose) {
+    memset(st, 0, sizeof(*st));
+    st->to_stdout = to_stdout;
+    st->verbose = verbose;
+    if (g_resume && journal_load(g_journal_path, &st->journal, &st->journal_cap) != 0)
+        return -1;
+    if (g_journal_path) {
+        st->journal_out = fopen(g_journal_path, "ab");
+        if (!st->journal_out) {
+            perror("Failed to open journal for appending");
+            if (st->journal) journal_free(st->journal, st->journal_cap);
+            return -1;
+        }
+    }
+    pthread_mutex_init(&st->lock, NULL);
+    adapt_init(&st->adapt);
+    return 0;
+}
+
+void batch_end(BatchState *st) {
+    if (st->journal_out) fclose(st->journal_out);
+    if (st->journal) journal_free(st->journal, st->journal_cap);
+    pthread_mutex_destroy(&st->lock);
+    adapt_destroy(&st->adapt);
+}
+
+// batch_process_input: skips finished work when --resume or --newer is given,
+// otherwise extracts and journals the input. Safe to call from several workers.
+// With --thumbs-first, tier selects the previews written; a thumbnail tier is neither
+// counted nor journaled, but its output is kept in *thumb for the background tier.
+// Returns 0 on success, 1 if skipped, -1 on failure.
+int batch_process_input(BatchState *st, const char *cr3_path, int tier, OutputRecord *thumb) {
+    uint64_t size = 0;
+    int64_t mtime_ns = 0;
+    int have_stat = (file_stat_info(cr3_path, &size, &mtime_ns) == 0);
+    if (tier == TIER_BACKGROUND) {
+        // checked with the thumbnail tier
+    } else if (have_stat && g_resume) {
+        JournalEntry *entry = journal_find(st->journal, st->journal_cap, cr3_path);
+        if (entry && journal_entry_verified(entry, size, mtime_ns)) {
+            if (st->verbose) fprintf(stderr, "Skipping %s (journal: done and verified)\n", cr3_path);
+            pthread_mutex_lock(&st->lock);
+            st->skipped++;
+            pthread_mutex_unlock(&st->lock);
+            metrics_add(METRIC_FILES_SKIPPED, 1);
+            arena_reset();
+            return 1;
+        }
+    }
+    if (tier != TIER_BACKGROUND && have_stat && g_skip_newer && outputs_up_to_date(cr3_path, mtime_ns)) {
+        if (st->verbose) fprintf(stderr, "Skipping %s (outputs are up to date)\n", cr3_path);
+        pthread_mutex_lock(&st->lock);
+        st->skipped++;
+        pthread_mutex_unlock(&st->lock);
+        metrics_add(METRIC_FILES_SKIPPED, 1);
+        arena_reset();
+        return 1;
+    }
+
+    JobOutputs job;
+    memset(&job, 0, sizeof(job));
+    if (tier == TIER_BACKGROUND && thumb && thumb->path) {
+        job.outputs[0] = *thumb;
+        job.outputs[0].path = scratch_strdup(thumb->path);
+        job.count = job.outputs[0].path ? 1 : 0;
+    }
+    g_job_outputs = &job;
+    g_tier = tier;
+    if (tier != TIER_BACKGROUND)
+        metrics_add(METRIC_FILES_STARTED, 1);
+    uint64_t t = trace_begin();
+    int64_t started = monotonic_ms();
+    uint64_t bytes_read = 0;
+    int result = process_file(cr3_path, st->to_stdout, st->verbose, &bytes_read);
+    adapt_sample(&st->adapt, bytes_read, monotonic_ms() - started);
+    trace_end(tier == TIER_THUMB ? "thumbnail" : "file", t, cr3_path);
+    g_tier = TIER_ALL;
+    g_job_outputs = NULL;
+    if (tier == TIER_THUMB && result == 0) {
+        if (st->journal_out && job.count > 0) {
+            *thumb = job.outputs[0];
+            thumb->path = strdup(job.outputs[0].path);
+        }
+        job_outputs_free(&job);
+        arena_reset();
+        return 0;
+    }
+    metrics_add(result == 0 ? METRIC_FILES_DONE : METRIC_FILES_FAILED, 1);
+
+    t = trace_begin();
+    pthread_mutex_lock(&st->lock);
+    if (result == 0) {
+        st->done++;
+        if (st->journal_out && have_stat && journal_append(st->journal_out, cr3_path, size, mtime_ns, &job) != 0)
+            fprintf(stderr, "Failed to write journal entry for %s\n", cr3_path);
+    } else {
+        st->failed++;
+        if (result == RESULT_OVER_LIMIT) st->over_limit++;
+        if (st->multi) fprintf(stderr, "Failed: %s\n", cr3_path);
+    }
+    pthread_mutex_unlock(&st->lock);
+    trace_end("record result", t, NULL);
+    job_outputs_free(&job);
+    arena_reset();
+    return result == 0 ? 0 : -1;
+}
+
+// ----- Thumbnails first -----
+// --thumbs-first splits -j all into two tiers so a viewer can show a full grid of
+// thumbnails early: every input's first preview (the THMB thumbnail of a CR3) is
+// written before any input's larger previews. Each tier opens and indexes the file
+// itself. Paths written to the --priority file (usually a FIFO) jump the queue and
+// get both tiers next; the newest request goes first.
+
+int tier_init(TierSchedule *ts, char **inputs, int count) {
+    memset(ts, 0, sizeof(*ts));
+    ts->inputs = inputs;
+    ts->count = count;
+    ts->remaining = count;
+    ts->thumbs_left = count;
+    ts->state = calloc(count, 1);
+    ts->thumbs = calloc(count, sizeof(OutputRecord));
+    if (!ts->state || !ts->thumbs) {
+        fprintf(stderr, "Memory allocation failed for --thumbs-first\n");
+        free(ts->state);
+        free(ts->thumbs);
+        return -1;
+    }
+    ts->start_ms = monotonic_ms();
+    pthread_mutex_init(&ts->lock, NULL);
+    pthread_cond_init(&ts->cond, NULL);
+    return 0;
+}
+
+void tier_destroy(TierSchedule *ts) {
+    for (int i = 0; i < ts->count; i++)
+        free(ts->thumbs[i].path);
+    free(ts->thumbs);
+    free(ts->state);
+    free(ts->urgent);
+    pthread_mutex_destroy(&ts->lock);
+    pthread_cond_destroy(&ts->cond);
+}
+
+// tier_next: claims the next task, waiting while the only work left is background
+// tiers whose thumbnails are still being written. Returns the input index (and the
+// tier in *tier), or -1 when every task has been claimed.
+int tier_next(TierSchedule *ts, int *tier) {
+    int index = -1;
+    pthread_mutex_lock(&ts->lock);
+    for (;;) {
+        while (index < 0 && ts->urgent_count > 0) {
+            int i = ts->urgent[--ts->urgent_count];
+            if (ts->state[i] & TS_BACKGROUND_CLAIMED) continue;
+            if (!(ts->state[i] & TS_THUMB_CLAIMED)) {
+                index = i;
+                *tier = TIER_ALL;
+            } else if (ts->state[i] & TS_THUMB_DONE) {
+                index = i;
+                *tier = TIER_BACKGROUND;
+            }
+            // otherwise its thumbnail is being written; tier_finish continues with it
+        }
+        while (index < 0 && ts->next_thumb < ts->count) {
+            int i = ts->next_thumb++;
+            if (!(ts->state[i] & TS_THUMB_CLAIMED)) {
+                index = i;
+                *tier = TIER_THUMB;
+            }
+        }
+        for (int i = ts->next_background; index < 0 && i < ts->count; i++) {
+            if ((ts->state[i] & (TS_THUMB_DONE | TS_BACKGROUND_CLAIMED)) == TS_THUMB_DONE) {
+                index = i;
+                *tier = TIER_BACKGROUND;
+            }
+        }
+        if (index >= 0 || ts->remaining == 0) break;
+        pthread_cond_wait(&ts->cond, &ts->lock);
+    }
+    if (index >= 0) {
+        ts->state[index] |= *tier == TIER_THUMB ? TS_THUMB_CLAIMED
+                          : *tier == TIER_BACKGROUND ? TS_BACKGROUND_CLAIMED
+                          : TS_THUMB_CLAIMED | TS_BACKGROUND_CLAIMED;
+        if (*tier != TIER_THUMB) ts->remaining--;
+    }
+    while (ts->next_background < ts->count && (ts->state[ts->next_background] & TS_BACKGROUND_CLAIMED))
+        ts->next_background++;
+    pthread_mutex_unlock(&ts->lock);
+    return index;
+}
+
+// tier_finish: records a finished task (result from batch_process_input). Returns 1
+// if the worker should go on with the input's background tier, which was asked for
+// on --priority while its thumbnail was being written.
+int tier_finish(TierSchedule *ts, int index, int tier, int result) {
+    int next = 0;
+    pthread_mutex_lock(&ts->lock);
+    if (tier != TIER_BACKGROUND && --ts->thumbs_left == 0)
+        ts->thumbs_done_ms = monotonic_ms();
+    if (tier == TIER_THUMB) {
+        if (result != 0) {
+            ts->state[index] |= TS_BACKGROUND_CLAIMED;   // skipped or failed: nothing more to do
+            ts->remaining--;
+        } else {
+            ts->state[index] |= TS_THUMB_DONE;
+            if ((ts->state[index] & (TS_URGENT | TS_BACKGROUND_CLAIMED)) == TS_URGENT) {
+                ts->state[index] |= TS_BACKGROUND_CLAIMED;
+                ts->remaining--;
+                next = 1;
+            }
+        }
+    }
+    pthread_cond_broadcast(&ts->cond);
+    pthread_mutex_unlock(&ts->lock);
+    return next;
+}
+
+// tier_request: moves an input (named as in the input list) to the front. Returns -1
+// if it is not an input of this batch.
+int tier_request(TierSchedule *ts, const char *path, int verbose) {
+    int index = -1;
+    for (int i = 0; i < ts->count && index < 0; i++) {
+        if (strcmp(ts->inputs[i], path) == 0) index = i;
+    }
+    if (index < 0) {
+        fprintf(stderr, "Priority request for a path not in this batch: %s\n", path);
+        return -1;
+    }
+    pthread_mutex_lock(&ts->lock);
+    if (ts->urgent_count == ts->urgent_cap) {
+        int new_cap = ts->urgent_cap ? ts->urgent_cap * 2 : 16;
+        int *temp = realloc(ts->urgent, new_cap * sizeof(int));
+        if (!temp) {
+            pthread_mutex_unlock(&ts->lock);
+            return -1;
+        }
+        ts->urgent = temp;
+        ts->urgent_cap = new_cap;
+    }
+    ts->urgent[ts->urgent_count++] = index;
+    ts->state[index] |= TS_URGENT;
+    ts->requests++;
+    pthread_cond_broadcast(&ts->cond);
+    pthread_mutex_unlock(&ts->lock);
+    if (verbose) fprintf(stderr, "Priority request: %s\n", path);
+    return 0;
+}
+
+// tier_run: one worker's loop over --thumbs-first tasks
+void tier_run(BatchState *st) {
+    TierSchedule *ts = st->tiers;
+    for (;;) {
+        int tier = TIER_ALL;
+        adapt_acquire(&st->adapt);
+        int index = tier_next(ts, &tier);
+        if (index < 0) {
+            adapt_release(&st->adapt);
             break;
         }
-        size_t written = fwrite(output_data, 1, output_size, outf);
-        if (written != output_size) {
-            fprintf(stderr, "Failed to write complete JPEG data to file %s (expected %zu, wrote %zu bytes).\n",
-                    outfile, output_size, written);
-            free(outfile);
-            free(output_data);
-            fclose(outf);
-            result = -1;
+        int result = batch_process_input(st, ts->inputs[index], tier, &ts->thumbs[index]);
+        if (tier_finish(ts, index, tier, result))
+            batch_process_input(st, ts->inputs[index], TIER_BACKGROUND, &ts->thumbs[index]);
+        adapt_release(&st->adapt);
+    }
+}
+
+#ifdef __linux__
+// priority_reader: reads paths, one per line, from the --priority file until the
+// batch ends. A FIFO is reopened whenever its writer closes it.
+void *priority_reader(void *arg) {
+    TierSchedule *ts = (TierSchedule *)arg;
+    char line[4096];
+    size_t len = 0;
+    int fd = -1, fifo = 0;
+    while (!atomic_load(&ts->stop)) {
+        if (fd < 0) {
+            struct stat st;
+            fd = open(g_priority_path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+            if (fd < 0 || fstat(fd, &st) != 0) {
+                perror("Failed to open the --priority file");
+                break;
+            }
+            fifo = S_ISFIFO(st.st_mode);
+        }
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        if (poll(&pfd, 1, 200) <= 0)
+            continue;
+        char buf[4096];
+        ssize_t got = read(fd, buf, sizeof(buf));
+        if (got < 0 && (errno == EAGAIN || errno == EINTR))
+            continue;
+        if (got <= 0) {
+            close(fd);
+            fd = -1;
+            len = 0;
+            if (!fifo) break;
+            continue;
+        }
+        for (ssize_t i = 0; i < got; i++) {
+            if (buf[i] == '\n' || buf[i] == '\r') {
+                line[len] = '\0';
+                if (len) tier_request(ts, line, ts->verbose);
+                len = 0;
+            } else if (len < sizeof(line) - 1) {
+                line[len++] = buf[i];
+            }
+        }
+    }
+    if (fd >= 0) close(fd);
+    return NULL;
+}
+#endif
+
+void *batch_worker(void *arg) {
+    BatchState *st = (BatchState *)arg;
+    char *path;
+    trace_thread_begin("worker");
+    metrics_thread_begin();
+    arena_begin();
+    while (!st->tiers) {
+        uint64_t t = trace_begin();
+        adapt_acquire(&st->adapt);
+        path = queue_pop(&st->queue);
+        trace_end("wait for work", t, NULL);
+        if (!path) {
+            adapt_release(&st->adapt);
             break;
         }
-        if (verbose)
-            fprintf(stderr, "Extracted JPEG %d to %s (size: %zu bytes) with %sEXIF\n",
-                    i + 1, outfile, output_size, (exifSegment ? (g_minimize_exif ? "minimized " : "full ") : "no "));
-        fclose(outf);
-        free(outfile);
-        free(output_data);
-    }
-    if (exifSegment) free(exifSegment);
-    free(jpegs);
-    fclose(cr3_file);
-    return result;
+        batch_process_input(st, path, TIER_ALL, NULL);
+        adapt_release(&st->adapt);
+        free(path);
+    }
+    if (st->tiers)
+        tier_run(st);
+    arena_end();
+    trace_thread_end();
+    return NULL;
 }
 
-// Updated extract_specific_jpeg with size_t and our new mapping heuristic.
-// If the first segment is invalid (below 8KB) and there are at least 4 segments,
-// we adjust the mapping so that -j 1 extracts jpegs[1], -j 2 extracts jpegs[2], and -j 3 extracts jpegs[3].
-int extract_specific_jpeg(const char *cr3_path, int jpeg_index, int to_stdout, int verbose) {
-    FILE *cr3_file = fopen(cr3_path, "rb");
-    if (!cr3_file) {
-        perror("Failed to open CR3 file");
-        return -1;
+// start_workers: creates the worker pool and its bounded queue. Returns the number started.
+int start_workers(BatchState *st, pthread_t *threads, int count) {
+    if (queue_init(&st->queue, count * 2) != 0) {
+        fprintf(stderr, "Memory allocation failed for work queue\n");
+        return 0;
+    }
+    int started = 0;
+    while (started < count && pthread_create(&threads[started], NULL, batch_worker, st) == 0)
+        started++;
+    if (started == 0) {
+        fprintf(stderr, "Failed to start worker threads\n");
+        queue_destroy(&st->queue);
+    }
+    return started;
+}
+
+void stop_workers(BatchState *st, pthread_t *threads, int count) {
+    queue_close(&st->queue);
+    for (int i = 0; i < count; i++)
+        pthread_join(threads[i], NULL);
+    queue_destroy(&st->queue);
+}
+
+// run_batch: processes every input (in order when --jobs is 1). Returns 0 if no input
+// failed, EXIT_OVER_LIMIT if every failure was a resource limit, otherwise 1.
+int run_batch(char **inputs, int input_count, int to_stdout, int verbose) {
+    BatchState st;
+    if (batch_begin(&st, to_stdout, verbose) != 0)
+        return 1;
+    st.multi = (input_count > 1);
+    if (g_layout_window > 0 && input_count > 1)
+        layout_order(inputs, input_count, verbose);
+    TierSchedule tiers;
+    if (g_thumbs_first) {
+        if (tier_init(&tiers, inputs, input_count) != 0) {
+            batch_end(&st);
+            return 1;
+        }
+        tiers.verbose = verbose;
+        st.tiers = &tiers;
     }
-    fseek(cr3_file, 0, SEEK_END);
-    size_t fileSize = ftell(cr3_file);
-    rewind(cr3_file);
-    JpegInfo *jpegs = NULL;
-    int jpeg_count = 0;
-    if (find_all_jpegs(cr3_file, &jpegs, &jpeg_count) != 0) {
-        fprintf(stderr, "Failed to scan for JPEG previews in CR3 file.\n");
-        fclose(cr3_file);
-        return -1;
+
+    int workers = st.adapt.enabled ? st.adapt.max : g_jobs;
+    pthread_t *threads = NULL;
+    int started = 0;
+    if (workers > 1 && input_count > 1) {
+        threads = malloc(workers * sizeof(pthread_t));
+        started = threads ? start_workers(&st, threads, workers) : 0;
+        if (started == 0) {
+            free(threads);
+            if (st.tiers) tier_destroy(&tiers);
+            batch_end(&st);
+            return 1;
+        }
     }
-    int idx = 0;
-    // Adjust index mapping if the first JPEG segment is too small.
-    if (jpeg_count >= 4 && jpegs[0].size < 8 * 1024) {
-        if (jpeg_index < 1 || jpeg_index > (jpeg_count - 1)) {
-            fprintf(stderr, "Requested JPEG index %d not available after skipping the invalid first segment. Only %d valid JPEG segments available.\n", jpeg_index, jpeg_count - 1);
-            fclose(cr3_file);
-            free(jpegs);
-            return -1;
+#ifdef __linux__
+    pthread_t priority_thread;
+    int priority_started = g_priority_path && pthread_create(&priority_thread, NULL, priority_reader, &tiers) == 0;
+#endif
+
+    if (started == 0) {
+        arena_begin();
+        if (st.tiers) {
+            tier_run(&st);
+        } else {
+            for (int i = 0; i < input_count; i++)
+                batch_process_input(&st, inputs[i], TIER_ALL, NULL);
         }
-        if (verbose)
-            fprintf(stderr, "First JPEG segment size %zu is below 8KB, adjusting extraction index from %d to %d.\n", jpegs[0].size, jpeg_index, jpeg_index);
-        idx = jpeg_index; // e.g., -j 1 now maps to array index 1.
+        arena_end();
     } else {
-        if (jpeg_index < 1 || jpeg_index > jpeg_count) {
-            fprintf(stderr, "Requested JPEG index %d not available. Only %d JPEG segments found.\n", jpeg_index, jpeg_count);
-            fclose(cr3_file);
-            free(jpegs);
-            return -1;
+        for (int i = 0; i < input_count && !st.tiers; i++) {
+            char *path = strdup(inputs[i]);
+            if (!path || queue_push(&st.queue, path) != 0) {
+                fprintf(stderr, "Failed to queue %s\n", inputs[i]);
+                pthread_mutex_lock(&st.lock);
+                st.failed++;
+                pthread_mutex_unlock(&st.lock);
+            }
         }
-        idx = jpeg_index - 1;
+        stop_workers(&st, threads, started);
+        free(threads);
     }
-    if (fseek(cr3_file, jpegs[idx].start, SEEK_SET) != 0) {
-        perror("Failed to seek to JPEG start position in CR3 file");
-        fclose(cr3_file);
-        free(jpegs);
-        return -1;
+
+    if (verbose && input_count > 1)
+        fprintf(stderr, "Batch finished: %d %s, %d skipped, %d failed (%d over resource limits).\n", st.done,
+                g_verify ? "passed" : g_phash || g_dupes_distance >= 0 ? "hashed" : "extracted", st.skipped, st.failed,
+                st.over_limit);
+    if (verbose)
+        report_adaptive_stats(&st.adapt);
+    if (st.tiers) {
+        atomic_store(&tiers.stop, 1);
+#ifdef __linux__
+        if (priority_started)
+            pthread_join(priority_thread, NULL);
+#endif
+        if (verbose)
+            fprintf(stderr, "Thumbnails first: all thumbnails after %.1f s, every preview after %.1f s; "
+                    "%d priority requests\n", (tiers.thumbs_done_ms - tiers.start_ms) / 1000.0,
+                    (monotonic_ms() - tiers.start_ms) / 1000.0, tiers.requests);
+        tier_destroy(&tiers);
     }
-    size_t jpeg_size = jpegs[idx].size;
-    unsigned char *jpeg_data = (unsigned char *)malloc(jpeg_size);
-    if (!jpeg_data) {
-        perror("Failed to allocate memory for JPEG data");
-        fclose(cr3_file);
-        free(jpegs);
-        return -1;
+    int failed = st.failed, over_limit = st.over_limit;
+    batch_end(&st);
+    return !failed ? 0 : failed == over_limit ? EXIT_OVER_LIMIT : 1;
+}
+
+// is_raw_name: file names --watch and directory inputs pick up (.CR3, .CR2, .DNG, any case)
+int is_raw_name(const char *name) {
+    static const char *const extensions[] = { "cr3", "cr2", "dng" };
+    const char *dot = strrchr(name, '.');
+    if (!dot || name[0] == '.' || strlen(dot) != 4) return 0;
+    for (size_t i = 0; i < sizeof(extensions) / sizeof(extensions[0]); i++) {
+        int match = 1;
+        for (int k = 0; k < 3; k++)
+            match &= (dot[1 + k] | 0x20) == extensions[i][k];
+        if (match) return 1;
     }
-    if (fread(jpeg_data, 1, jpeg_size, cr3_file) != jpeg_size) {
-        perror("Failed to read JPEG data from CR3 file");
-        free(jpeg_data);
-        fclose(cr3_file);
-        free(jpegs);
-        return -1;
+    return 0;
+}
+
+#ifdef __linux__
+volatile sig_atomic_t g_watch_stop = 0;
+
+void watch_signal_handler(int sig) {
+    (void)sig;
+    g_watch_stop = 1;
+}
+
+// A file seen by inotify that is waiting out its debounce period
+typedef struct {
+    char *path;
+    int64_t due_ms;
+    uint64_t size;
+} PendingFile;
+
+// run_watch: extracts each CR3 closed-after-write or renamed into dir. A file is
+// handed to the workers only after it has had no events for --debounce ms and
+// its size has stopped changing, so copies still in progress are not read.
+int run_watch(const char *dir, int verbose) {
+    int fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (fd < 0) {
+        perror("inotify_init1 failed");
+        return 1;
     }
-    unsigned char *exifSegment = NULL;
-    size_t exifSize = 0;
-    if (!extractCr3Exif_streaming(cr3_file, fileSize, &exifSegment, &exifSize, verbose)) {
-        if (verbose)
-            fprintf(stderr, "Failed to extract EXIF from CR3 file (continuing without EXIF).\n");
-    } else if (g_minimize_exif) {
-        if (!minimizeExifData(&exifSegment, &exifSize)) {
-            fprintf(stderr, "Failed to minimize EXIF data (continuing without EXIF).\n");
-            free(exifSegment);
-            exifSegment = NULL;
-        }
-    }
-    unsigned char *output_data = jpeg_data;
-    size_t output_size = jpeg_size;
-    if (exifSegment) {
-        if (!insertExifIntoJpeg(jpeg_data, jpeg_size, exifSegment, exifSize, &output_data, &output_size)) {
-            fprintf(stderr, "Failed to insert EXIF into JPEG (using original JPEG).\n");
-            output_data = jpeg_data;
-            output_size = jpeg_size;
-        } else {
-            free(jpeg_data);
-        }
-        free(exifSegment);
+    if (inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        perror("Failed to watch directory");
+        close(fd);
+        return 1;
     }
-    FILE *outf = NULL;
-    char *outfile = NULL;
-    if (to_stdout) {
-        outf = stdout;
-#ifdef _WIN32
-        _setmode(_fileno(stdout), _O_BINARY);
-#endif
-    } else {
-        if (g_output_filename != NULL) {
-            outfile = strdup(g_output_filename);
-        } else {
-            outfile = generate_output_filename_all(cr3_path, idx);
+    BatchState st;
+    if (batch_begin(&st, 0, verbose) != 0) {
+        close(fd);
+        return 1;
+    }
+    st.multi = 1;
+    int workers = st.adapt.enabled ? st.adapt.max : g_jobs > 0 ? g_jobs : 1;
+    pthread_t *threads = malloc(workers * sizeof(pthread_t));
+    int started = threads ? start_workers(&st, threads, workers) : 0;
+    if (started == 0) {
+        free(threads);
+        batch_end(&st);
+        close(fd);
+        return 1;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = watch_signal_handler;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    if (verbose) fprintf(stderr, "Watching %s with %d worker(s)...\n", dir, started);
+
+    PendingFile *pending = NULL;
+    int pending_count = 0, pending_cap = 0;
+    char events[16 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (!g_watch_stop) {
+        int64_t now = monotonic_ms();
+        int timeout = 1000;
+        for (int i = 0; i < pending_count; i++) {
+            int64_t wait = pending[i].due_ms - now;
+            if (wait < timeout) timeout = wait > 0 ? (int)wait : 0;
         }
-        if (!outfile) {
-            fprintf(stderr, "Failed to generate output filename for JPEG %d\n", jpeg_index);
-            free(output_data);
-            fclose(cr3_file);
-            free(jpegs);
-            return -1;
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        int pr = poll(&pfd, 1, timeout);
+        if (pr < 0 && errno != EINTR) {
+            perror("poll failed");
+            break;
         }
-        outf = fopen(outfile, "wb");
-        if (!outf) {
-            perror("Failed to open output file");
-            free(outfile);
-            free(output_data);
-            fclose(cr3_file);
-            free(jpegs);
-            return -1;
+        if (pr > 0) {
+            ssize_t len;
+            while ((len = read(fd, events, sizeof(events))) > 0) {
+                for (char *p = events; p < events + len; ) {
+                    struct inotify_event *ev = (struct inotify_event *)p;
+                    p += sizeof(struct inotify_event) + ev->len;
+                    if (ev->len == 0 || (ev->mask & IN_ISDIR) || !is_raw_name(ev->name))
+                        continue;
+                    size_t plen = strlen(dir) + 1 + strlen(ev->name) + 1;
+                    char *path = malloc(plen);
+                    if (!path) continue;
+                    snprintf(path, plen, "%s/%s", dir, ev->name);
+                    int found = -1;
+                    for (int i = 0; i < pending_count; i++) {
+                        if (strcmp(pending[i].path, path) == 0) found = i;
+                    }
+                    if (found < 0) {
+                        if (pending_count == pending_cap) {
+                            int new_cap = pending_cap ? pending_cap * 2 : 16;
+                            PendingFile *temp = realloc(pending, new_cap * sizeof(PendingFile));
+                            if (!temp) {
+                                free(path);
+                                continue;
+                            }
+                            pending = temp;
+                            pending_cap = new_cap;
+                        }
+                        found = pending_count++;
+                        pending[found].path = path;
+                        int64_t mtime_ns;
+                        if (file_stat_info(path, &pending[found].size, &mtime_ns) != 0)
+                            pending[found].size = (uint64_t)-1;
+                    } else {
+                        free(path);
+                    }
+                    pending[found].due_ms = monotonic_ms() + g_debounce_ms;
+                }
+            }
         }
-    }
-    size_t written = fwrite(output_data, 1, output_size, outf);
-    if (written != output_size) {
-        fprintf(stderr, "Failed to write complete JPEG data.\n");
-        if (!to_stdout) {
-            free(outfile);
-            fclose(outf);
+        now = monotonic_ms();
+        for (int i = 0; i < pending_count; ) {
+            if (pending[i].due_ms > now) {
+                i++;
+                continue;
+            }
+            uint64_t size;
+            int64_t mtime_ns;
+            if (file_stat_info(pending[i].path, &size, &mtime_ns) != 0) {
+                free(pending[i].path);   // removed or renamed away before it settled
+            } else if (size != pending[i].size) {
+                pending[i].size = size;  // still growing: look again after another quiet period
+                pending[i].due_ms = now + g_debounce_ms;
+                i++;
+                continue;
+            } else {
+                if (verbose) fprintf(stderr, "New file ready: %s\n", pending[i].path);
+                queue_push(&st.queue, pending[i].path);
+            }
+            pending[i] = pending[--pending_count];
         }
-        free(output_data);
-        fclose(cr3_file);
-        free(jpegs);
-        return -1;
     }
-    if (verbose) {
-        if (to_stdout)
-            fprintf(stderr, "Extracted JPEG %d to stdout (size: %zu bytes) with %sEXIF\n",
-                    jpeg_index, output_size, (exifSegment ? (g_minimize_exif ? "minimized " : "full ") : "no "));
-        else
-            fprintf(stderr, "Extracted JPEG %d to %s (size: %zu bytes) with %sEXIF\n",
-                    jpeg_index, outfile, output_size, (exifSegment ? (g_minimize_exif ? "minimized " : "full ") : "no "));
+
+    if (verbose) fprintf(stderr, "Stopping watch, finishing queued files...\n");
+    for (int i = 0; i < pending_count; i++)
+        free(pending[i].path);
+    free(pending);
+    stop_workers(&st, threads, started);
+    free(threads);
+    close(fd);
+    if (verbose)
+        fprintf(stderr, "Watch finished: %d extracted, %d skipped, %d failed.\n", st.done, st.skipped, st.failed);
+    if (verbose)
+        report_adaptive_stats(&st.adapt);
+    int failed = st.failed;
+    batch_end(&st);
+    return failed ? 1 : 0;
+}
+#else
+int run_watch(const char *dir, int verbose) {
+    (void)dir;
+    (void)verbose;
+    fprintf(stderr, "'--watch' is only supported on Linux.\n");
+    return 1;
+}
+#endif
+
+// report_peak_rss: peak resident set size at exit (-v), to check the memory bound
+void report_peak_rss(void) {
+#ifndef _WIN32
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) == 0) {
+#ifdef __APPLE__
+        long kb = ru.ru_maxrss / 1024;   // bytes on macOS
+#else
+        long kb = ru.ru_maxrss;
+#endif
+        fprintf(stderr, "Peak RSS: %ld KB\n", kb);
     }
-    if (!to_stdout) {
-        fclose(outf);
-        free(outfile);
+#endif
+}
+
+// add_input: appends a copy of path to the growable input list
+int add_input(char ***inputs, int *count, int *capacity, const char *path) {
+    if (*count >= *capacity) {
+        int new_cap = *capacity ? *capacity * 2 : 16;
+        char **temp = realloc(*inputs, new_cap * sizeof(char *));
+        if (!temp) return -1;
+        *inputs = temp;
+        *capacity = new_cap;
     }
-    free(output_data);
-    fclose(cr3_file);
-    free(jpegs);
+    (*inputs)[*count] = strdup(path);
+    if (!(*inputs)[*count]) return -1;
+    (*count)++;
     return 0;
 }
 
-// generate_output_filename (unchanged)
-char* generate_output_filename(const char* source) {
-    char *output = malloc(strlen(source) + 5);
-    if (!output) {
-        fprintf(stderr, "Failed to allocate memory for output filename\n");
-        return NULL;
+// read_input_list: --files-from support, one path per line, blank lines ignored
+int read_input_list(const char *list_path, char ***inputs, int *count, int *capacity) {
+    FILE *f = (strcmp(list_path, "-") == 0) ? stdin : fopen(list_path, "r");
+    if (!f) {
+        perror("Failed to open input list");
+        return -1;
     }
-    strcpy(output, source);
-    char *dot = strrchr(output, '.');
-    if (dot && dot != output && *(dot + 1) != '\0')
-        *dot = '\0';
-    strcat(output, ".jpg");
-    return output;
+    char *line;
+    int complete, rc = 0;
+    while (rc == 0 && (line = read_text_line(f, &complete)) != NULL) {
+        if (line[0] && add_input(inputs, count, capacity, line) != 0) {
+            fprintf(stderr, "Memory allocation failed for input list\n");
+            rc = -1;
+        }
+        free(line);
+    }
+    if (f != stdin) fclose(f);
+    return rc;
 }
 
-// generate_output_filename_all (unchanged)
-char* generate_output_filename_all(const char* source, int index) {
-    char *base = malloc(strlen(source) + 1);
-    if (!base) return NULL;
-    strcpy(base, source);
-    char *dot = strrchr(base, '.');
-    if (dot) {
-        *dot = '\0';
+int compare_strings(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// add_directory_inputs: appends the CR3 files below dir, recursively and in name
+// order. Symbolic links to directories are not followed, and a directory that cannot
+// be read is skipped with a warning.
+int add_directory_inputs(const char *dir, char ***inputs, int *count, int *capacity) {
+#ifndef _WIN32
+    DIR *d = opendir(dir);
+    if (!d) {
+        fprintf(stderr, "Skipping directory %s: %s\n", dir, strerror(errno));
+        return 0;
     }
-    int outsize = strlen(base) + 1 + 3 + 4 + 1;
-    char *outfile = malloc(outsize);
-    if (!outfile) {
-        free(base);
-        return NULL;
+    char **names = NULL;
+    int n = 0, cap = 0, rc = 0;
+    struct dirent *e;
+    while (rc == 0 && (e = readdir(d)) != NULL) {
+        if (strcmp(e->d_name, ".") != 0 && strcmp(e->d_name, "..") != 0)
+            rc = add_input(&names, &n, &cap, e->d_name);
     }
-    snprintf(outfile, outsize, "%s_%03d.jpg", base, index + 1);
-    free(base);
-    return outfile;
+    closedir(d);
+    if (n > 1)
+        qsort(names, n, sizeof(char *), compare_strings);
+    size_t dlen = strlen(dir);
+    const char *sep = dlen && dir[dlen - 1] == '/' ? "" : "/";
+    for (int i = 0; rc == 0 && i < n; i++) {
+        size_t len = dlen + strlen(names[i]) + 2;
+        char *path = malloc(len);
+        struct stat st;
+        if (!path) {
+            rc = -1;
+            break;
+        }
+        snprintf(path, len, "%s%s%s", dir, sep, names[i]);
+        if (lstat(path, &st) == 0 && S_ISDIR(st.st_mode))
+            rc = add_directory_inputs(path, inputs, count, capacity);
+        else if (is_raw_name(names[i]))
+            rc = add_input(inputs, count, capacity, path);
+        free(path);
+    }
+    for (int i = 0; i < n; i++)
+        free(names[i]);
+    free(names);
+    return rc;
+#else
+    (void)inputs;
+    (void)count;
+    (void)capacity;
+    fprintf(stderr, "Skipping directory %s: directory inputs are not supported on this platform\n", dir);
+    return 0;
+#endif
+}
+
+// expand_directory_inputs: replaces every directory in the input list by the CR3
+// files below it
+int expand_directory_inputs(char ***inputs, int *count, int *capacity) {
+    char **expanded = NULL;
+    int n = 0, cap = 0, rc = 0;
+    for (int i = 0; i < *count; i++) {
+        struct stat st;
+        if (rc == 0) {
+            if (stat((*inputs)[i], &st) == 0 && S_ISDIR(st.st_mode))
+                rc = add_directory_inputs((*inputs)[i], &expanded, &n, &cap);
+            else
+                rc = add_input(&expanded, &n, &cap, (*inputs)[i]);
+        }
+        free((*inputs)[i]);
+    }
+    free(*inputs);
+    *inputs = expanded;
+    *count = n;
+    *capacity = cap;
+    return rc;
 }
 
-// main (unchanged)
 int main(int argc, char *argv[]) {
     int to_stdout = 0, verbose = 0;
-    const char *cr3_path = NULL;
-    char *output_path = NULL;
+    char **inputs = NULL;
+    int input_count = 0, input_cap = 0;
+    const char *watch_dir = NULL;
+    const char *store_manifest = NULL;
+    int result = 1;
 
+    crc32_init();
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "-h") == 0) {
             print_usage(argv[0]);
-            return 0;
+            result = 0;
+            goto done;
         } else if (strcmp(argv[i], "-") == 0) {
             to_stdout = 1;
         } else if (strcmp(argv[i], "-v") == 0) {
@@ -809,20 +8156,23 @@ int main(int argc, char *argv[]) {
                 if (strcmp(argv[i + 1], "all") == 0) {
                     g_extract_all = 1;
                     i++;
+                } else if (strcmp(argv[i + 1], "auto") == 0) {
+                    g_extract_index = 0;
+                    i++;
                 } else if (strcmp(argv[i + 1], "1") == 0 ||
                            strcmp(argv[i + 1], "2") == 0 ||
                            strcmp(argv[i + 1], "3") == 0) {
                     g_extract_index = atoi(argv[i + 1]);
                     i++;
                 } else {
-                    fprintf(stderr, "Expected 'all', '1', '2' or '3' after '-j'\n");
+                    fprintf(stderr, "Expected 'all', 'auto', '1', '2' or '3' after '-j'\n");
                     print_usage(argv[0]);
-                    return 1;
+                    goto done;
                 }
             } else {
                 fprintf(stderr, "Expected parameter after '-j'\n");
                 print_usage(argv[0]);
-                return 1;
+                goto done;
             }
         } else if (strcmp(argv[i], "-o") == 0) {
             if (i + 1 < argc) {
@@ -831,60 +8181,425 @@ int main(int argc, char *argv[]) {
             } else {
                 fprintf(stderr, "Expected filename after '-o'\n");
                 print_usage(argv[0]);
-                return 1;
+                goto done;
             }
-        } else if (!cr3_path) {
-            cr3_path = argv[i];
-        } else {
-            fprintf(stderr, "Multiple input files specified.\n");
+        } else if (strcmp(argv[i], "--box-index") == 0) {
+            g_box_index = 1;
+        } else if (strcmp(argv[i], "--follow") == 0) {
+            g_follow = 1;
+        } else if (strcmp(argv[i], "--follow-timeout") == 0) {
+            if (i + 1 >= argc || atoi(argv[i + 1]) < 1) {
+                fprintf(stderr, "Expected seconds after '--follow-timeout'\n");
+                print_usage(argv[0]);
+                goto done;
+            }
+            g_follow_timeout_ms = atoi(argv[++i]) * 1000;
+        } else if (strcmp(argv[i], "--files-from") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Expected list file after '--files-from'\n");
+                print_usage(argv[0]);
+                goto done;
+            }
+            if (read_input_list(argv[++i], &inputs, &input_count, &input_cap) != 0)
+                goto done;
+        } else if (strcmp(argv[i], "--journal") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Expected file name after '--journal'\n");
+                print_usage(argv[0]);
+                goto done;
+            }
+            g_journal_path = argv[++i];
+        } else if (strcmp(argv[i], "--resume") == 0) {
+            g_resume = 1;
+        } else if (strcmp(argv[i], "--newer") == 0) {
+            g_skip_newer = 1;
+        } else if (strcmp(argv[i], "--jobs") == 0) {
+            if (i + 1 < argc && strcmp(argv[i + 1], "auto") == 0) {
+                g_adaptive = 1;
+                i++;
+            } else if (i + 1 < argc && atoi(argv[i + 1]) >= 1) {
+                g_adaptive = 0;
+                g_jobs = atoi(argv[++i]);
+            } else {
+                fprintf(stderr, "Expected a positive number or 'auto' after '--jobs'\n");
+                print_usage(argv[0]);
+                goto done;
+            }
+        } else if (strcmp(argv[i], "--jobs-min") == 0) {
+            if (i + 1 >= argc || atoi(argv[i + 1]) < 1) {
+                fprintf(stderr, "Expected a positive number after '--jobs-min'\n");
+                print_usage(argv[0]);
+                goto done;
+            }
+            g_jobs_min = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--jobs-max") == 0) {
+            if (i + 1 >= argc || atoi(argv[i + 1]) < 1) {
+                fprintf(stderr, "Expected a positive number after '--jobs-max'\n");
+                print_usage(argv[0]);
+                goto done;
+            }
+            g_jobs_max = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--read-buffer-min") == 0) {
+            if (i + 1 >= argc || atoi(argv[i + 1]) < 4) {
+                fprintf(stderr, "Expected KB (at least 4) after '--read-buffer-min'\n");
+                print_usage(argv[0]);
+                goto done;
+            }
+            g_read_buffer_min = (size_t)atoi(argv[++i]) * 1024;
+        } else if (strcmp(argv[i], "--read-buffer-max") == 0) {
+            if (i + 1 >= argc || atoi(argv[i + 1]) < 4) {
+                fprintf(stderr, "Expected KB (at least 4) after '--read-buffer-max'\n");
+                print_usage(argv[0]);
+                goto done;
+            }
+            g_read_buffer_max = (size_t)atoi(argv[++i]) * 1024;
+        } else if (strcmp(argv[i], "--thumbs-first") == 0) {
+            g_thumbs_first = 1;
+        } else if (strcmp(argv[i], "--priority") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Expected a file name after '--priority'\n");
+                print_usage(argv[0]);
+                goto done;
+            }
+            g_priority_path = argv[++i];
+        } else if (strcmp(argv[i], "--layout-order") == 0) {
+            if (i + 1 >= argc || atoi(argv[i + 1]) < 1) {
+                fprintf(stderr, "Expected a positive number after '--layout-order'\n");
+                print_usage(argv[0]);
+                goto done;
+            }
+            g_layout_window = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--debounce") == 0) {
+            if (i + 1 >= argc || atoi(argv[i + 1]) < 0) {
+                fprintf(stderr, "Expected milliseconds after '--debounce'\n");
+                print_usage(argv[0]);
+                goto done;
+            }
+            g_debounce_ms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--arena-size") == 0) {
+            if (i + 1 >= argc || atoi(argv[i + 1]) < 0) {
+                fprintf(stderr, "Expected KB after '--arena-size'\n");
+                print_usage(argv[0]);
+                goto done;
+            }
+            g_arena_size = (size_t)atoi(argv[++i]) * 1024;
+        } else if (strcmp(argv[i], "--scan-threads") == 0) {
+            if (i + 1 >= argc || atoi(argv[i + 1]) < 1) {
+                fprintf(stderr, "Expected a positive number after '--scan-threads'\n");
+                print_usage(argv[0]);
+                goto done;
+            }
+            g_scan_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--read-buffer") == 0) {
+            if (i + 1 >= argc || atoi(argv[i + 1]) < 4) {
+                fprintf(stderr, "Expected KB (at least 4) after '--read-buffer'\n");
+                print_usage(argv[0]);
+                goto done;
+            }
+            g_read_buffer_size = (size_t)atoi(argv[++i]) * 1024;
+        } else if (strcmp(argv[i], "--read-buffers") == 0) {
+            if (i + 1 >= argc || atoi(argv[i + 1]) < 1) {
+                fprintf(stderr, "Expected a positive number after '--read-buffers'\n");
+                print_usage(argv[0]);
+                goto done;
+            }
+            g_read_buffers = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--walk") == 0) {
+            g_walk = 1;
+        } else if (strcmp(argv[i], "--bench-scan") == 0) {
+            g_bench_scan = 1;
+        } else if (strcmp(argv[i], "--bulk") == 0) {
+            g_bulk = 1;
+        } else if (strcmp(argv[i], "--direct") == 0) {
+            g_bulk = 1;
+            g_direct = 1;
+        } else if (strcmp(argv[i], "--huge-pages") == 0) {
+            g_huge_pages = 1;
+        } else if (strcmp(argv[i], "--rotate") == 0) {
+            g_rotate = 1;
+        } else if (strcmp(argv[i], "--min-long-edge") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Expected pixel count after '--min-long-edge'\n");
+                print_usage(argv[0]);
+                goto done;
+            }
+            g_min_long_edge = atoi(argv[++i]);
+            if (g_min_long_edge < 1) {
+                fprintf(stderr, "'--min-long-edge' expects a positive pixel count\n");
+                goto done;
+            }
+        } else if (strcmp(argv[i], "--max-bytes") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Expected size after '--max-bytes'\n");
+                print_usage(argv[0]);
+                goto done;
+            }
+            g_max_bytes = parse_byte_size(argv[++i]);
+            if (!g_max_bytes) {
+                fprintf(stderr, "'--max-bytes' expects a size such as 300000, 300k or 2M\n");
+                goto done;
+            }
+        } else if (strcmp(argv[i], "--render-raw") == 0) {
+            g_render_raw = 1;
+        } else if (strcmp(argv[i], "--raw-fallback") == 0) {
+            g_raw_fallback = 1;
+        } else if (strcmp(argv[i], "--bench-render") == 0) {
+            g_bench_render = 1;
+        } else if (strcmp(argv[i], "--verify") == 0) {
+            g_verify = 1;
+        } else if (strcmp(argv[i], "--heif") == 0) {
+            g_heif = 1;
+        } else if (strcmp(argv[i], "--phash") == 0) {
+            g_phash = 1;
+        } else if (strcmp(argv[i], "--dupes") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Expected distance after '--dupes'\n");
+                print_usage(argv[0]);
+                goto done;
+            }
+            g_dupes_distance = atoi(argv[++i]);
+            if (g_dupes_distance < 0 || g_dupes_distance > 64) {
+                fprintf(stderr, "'--dupes' expects a bit distance from 0 to 64\n");
+                goto done;
+            }
+        } else if (strcmp(argv[i], "--store") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Expected directory after '--store'\n");
+                print_usage(argv[0]);
+                goto done;
+            }
+            g_store_dir = argv[++i];
+        } else if (strcmp(argv[i], "--store-manifest") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Expected file name after '--store-manifest'\n");
+                print_usage(argv[0]);
+                goto done;
+            }
+            store_manifest = argv[++i];
+        } else if (strcmp(argv[i], "--max-boxes") == 0 || strcmp(argv[i], "--max-depth") == 0 ||
+                   strcmp(argv[i], "--max-previews") == 0) {
+            if (i + 1 >= argc || atoi(argv[i + 1]) <= 0) {
+                fprintf(stderr, "Expected a positive count after '%s'\n", argv[i]);
+                print_usage(argv[0]);
+                goto done;
+            }
+            int n = atoi(argv[i + 1]);
+            if (strcmp(argv[i], "--max-boxes") == 0) g_max_boxes = n;
+            else if (strcmp(argv[i], "--max-depth") == 0) g_max_depth = n;
+            else g_max_previews = n;
+            i++;
+        } else if (strcmp(argv[i], "--max-metadata") == 0 || strcmp(argv[i], "--max-read") == 0) {
+            size_t n = i + 1 < argc ? parse_byte_size(argv[i + 1]) : 0;
+            if (!n) {
+                fprintf(stderr, "'%s' expects a size such as 300000, 64M or 2G\n", argv[i]);
+                goto done;
+            }
+            if (strcmp(argv[i], "--max-metadata") == 0) g_max_metadata = n;
+            else g_max_read = n;
+            i++;
+        } else if (strcmp(argv[i], "--time-limit") == 0) {
+            double secs = i + 1 < argc ? atof(argv[i + 1]) : 0;
+            if (secs <= 0) {
+                fprintf(stderr, "Expected seconds after '--time-limit'\n");
+                print_usage(argv[0]);
+                goto done;
+            }
+            g_time_limit_ms = secs * 1000 < 1 ? 1 : (int64_t)(secs * 1000);
+            i++;
+        } else if (strcmp(argv[i], "--trace") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Expected file name after '--trace'\n");
+                print_usage(argv[0]);
+                goto done;
+            }
+            g_trace_path = argv[++i];
+        } else if (strcmp(argv[i], "--metrics") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Expected file name after '--metrics'\n");
+                print_usage(argv[0]);
+                goto done;
+            }
+            g_metrics_path = argv[++i];
+        } else if (strcmp(argv[i], "--metrics-interval") == 0) {
+            if (i + 1 >= argc || atoi(argv[i + 1]) <= 0) {
+                fprintf(stderr, "Expected seconds after '--metrics-interval'\n");
+                print_usage(argv[0]);
+                goto done;
+            }
+            g_metrics_interval = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--metrics-port") == 0) {
+            if (i + 1 >= argc || atoi(argv[i + 1]) <= 0 || atoi(argv[i + 1]) > 65535) {
+                fprintf(stderr, "Expected a port number after '--metrics-port'\n");
+                print_usage(argv[0]);
+                goto done;
+            }
+            g_metrics_port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--watch") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Expected directory after '--watch'\n");
+                print_usage(argv[0]);
+                goto done;
+            }
+            watch_dir = argv[++i];
+        } else if (strncmp(argv[i], "--", 2) == 0) {
+            fprintf(stderr, "Unknown option '%s' (an input named like this can be given as './%s')\n", argv[i], argv[i]);
             print_usage(argv[0]);
-            return 1;
+            goto done;
+        } else if (add_input(&inputs, &input_count, &input_cap, argv[i]) != 0) {
+            fprintf(stderr, "Memory allocation failed for input list\n");
+            goto done;
         }
     }
 
-    if (!cr3_path) {
-        fprintf(stderr, "No input CR3 file specified.\n");
-        print_usage(argv[0]);
-        return 1;
+    if (store_manifest && !g_store_dir) {
+        fprintf(stderr, "'--store-manifest' requires '--store DIR'.\n");
+        goto done;
     }
-
-    if (g_extract_all) {
-        if (to_stdout) {
-            fprintf(stderr, "Cannot use stdout output with '-j all' option.\n");
-            return 1;
+    if (g_store_dir && (to_stdout || g_verify || g_phash || g_dupes_distance >= 0 || g_bench_scan || g_bench_render)) {
+        fprintf(stderr, "'--store' needs an extraction mode that writes files.\n");
+        goto done;
+    }
+    if (g_store_dir) {
+#ifndef _WIN32
+        struct stat st;
+        if (mkdir(g_store_dir, 0777) != 0 && (stat(g_store_dir, &st) != 0 || !S_ISDIR(st.st_mode))) {
+            fprintf(stderr, "Cannot use '%s' as the store: %s\n", g_store_dir, strerror(errno));
+            goto done;
         }
-        int result = extract_all_jpegs(cr3_path, verbose);
-        if (result == 0 && verbose) {
-            fprintf(stderr, "Extraction of first 3 JPEGs completed successfully.\n");
-        } else if (result != 0) {
-            fprintf(stderr, "Extraction failed.\n");
+#else
+        fprintf(stderr, "'--store' is not supported on Windows.\n");
+        goto done;
+#endif
+        if (store_manifest && !(g_store_manifest = fopen(store_manifest, "a"))) {
+            perror("Failed to open the store manifest");
+            goto done;
         }
-        return (result == 0) ? 0 : 1;
-    } else if (g_extract_index != -1) {
-        int result = extract_specific_jpeg(cr3_path, g_extract_index, to_stdout, verbose);
-        if (result == 0 && verbose) {
-            fprintf(stderr, "Extraction of JPEG %d completed successfully.\n", g_extract_index);
-        } else if (result != 0) {
-            fprintf(stderr, "Extraction failed.\n");
+    }
+
+    if (g_thumbs_first && (!g_extract_all || watch_dir)) {
+        fprintf(stderr, "'--thumbs-first' applies to '-j all' over a list of inputs (not '--watch').\n");
+        goto done;
+    }
+    if (g_priority_path && !g_thumbs_first) {
+        fprintf(stderr, "'--priority' requires '--thumbs-first'.\n");
+        goto done;
+    }
+#ifndef __linux__
+    if (g_priority_path) {
+        fprintf(stderr, "'--priority' is only supported on Linux.\n");
+        goto done;
+    }
+#endif
+    if (g_adaptive && ((g_jobs_max && g_jobs_min > g_jobs_max) || g_read_buffer_min > g_read_buffer_max)) {
+        fprintf(stderr, "'--jobs-min' and '--read-buffer-min' must not exceed their '-max' counterparts.\n");
+        goto done;
+    }
+
+    trace_thread_begin("main");
+    metrics_thread_begin();
+    if ((g_metrics_path || g_metrics_port) && metrics_start() != 0)
+        goto done;
+    if (watch_dir) {
+        if (input_count > 0 || to_stdout || g_output_filename) {
+            fprintf(stderr, "'--watch' cannot be combined with input files, stdout output or '-o'.\n");
+            goto done;
         }
-        return (result == 0) ? 0 : 1;
-    } else {
-        if (!to_stdout) {
-            if (g_output_filename != NULL) {
-                output_path = strdup(g_output_filename);
-            } else {
-                output_path = generate_output_filename(cr3_path);
-            }
-            if (!output_path)
-                return 1;
+        if (g_resume && !g_journal_path) {
+            fprintf(stderr, "'--resume' requires '--journal FILE'.\n");
+            goto done;
         }
-        int result = extract_largest_jpeg(cr3_path, output_path, to_stdout, verbose);
-        if (result == 0 && verbose) {
-            fprintf(stderr, "Extraction completed successfully.\n");
-        } else if (result != 0) {
-            fprintf(stderr, "Extraction failed.\n");
+        result = run_watch(watch_dir, verbose);
+        if (verbose) {
+            report_scratch_stats();
+            report_bulk_stats();
+            report_store_stats();
+            report_peak_rss();
         }
-        if (output_path) free(output_path);
-        return (result == 0) ? 0 : 1;
+        goto done;
+    }
+    if (expand_directory_inputs(&inputs, &input_count, &input_cap) != 0) {
+        fprintf(stderr, "Memory allocation failed for input list\n");
+        goto done;
+    }
+    if (input_count == 0) {
+        fprintf(stderr, "No input CR3 file specified.\n");
+        print_usage(argv[0]);
+        goto done;
+    }
+    if (g_bench_scan) {
+        result = run_scan_benchmark(inputs, input_count);
+        goto done;
+    }
+    if (g_bench_render) {
+        result = run_render_benchmark(inputs, input_count);
+        goto done;
     }
+    if (input_count > 1 && (to_stdout || g_output_filename)) {
+        fprintf(stderr, "Cannot use stdout output or '-o' with multiple input files.\n");
+        goto done;
+    }
+    if (g_resume && !g_journal_path) {
+        fprintf(stderr, "'--resume' requires '--journal FILE'.\n");
+        goto done;
+    }
+    if (g_extract_all && to_stdout) {
+        fprintf(stderr, "Cannot use stdout output with '-j all' option.\n");
+        goto done;
+    }
+    if ((g_min_long_edge || g_max_bytes) ? (g_extract_all || g_extract_index > 0) : g_extract_index == 0) {
+        fprintf(stderr, "'--min-long-edge' and '--max-bytes' select the preview for the default mode or '-j auto'.\n");
+        goto done;
+    }
+    if ((g_render_raw || g_raw_fallback) && (g_extract_all || g_extract_index != -1 || g_phash || g_dupes_distance >= 0)) {
+        fprintf(stderr, "'--render-raw' and '--raw-fallback' apply to the default mode only.\n");
+        goto done;
+    }
+    if (g_render_raw && (g_min_long_edge || g_max_bytes)) {
+        fprintf(stderr, "'--render-raw' cannot be combined with '--min-long-edge' or '--max-bytes'.\n");
+        goto done;
+    }
+    if (g_rotate && ((!g_extract_all && g_extract_index == -1) || g_phash || g_dupes_distance >= 0)) {
+        fprintf(stderr, "'--rotate' applies to the -j modes only.\n");
+        goto done;
+    }
+    if (g_verify && (g_extract_all || g_extract_index != -1 || g_phash || g_dupes_distance >= 0 || g_render_raw ||
+                     g_raw_fallback || g_min_long_edge || g_max_bytes || g_rotate || to_stdout || g_output_filename ||
+                     g_journal_path || g_skip_newer)) {
+        fprintf(stderr, "'--verify' cannot be combined with extraction, hashing, output or journal options.\n");
+        goto done;
+    }
+    if (g_heif && (g_extract_all || g_extract_index != -1 || g_render_raw || g_raw_fallback || g_min_long_edge ||
+                   g_max_bytes || g_rotate || g_phash || g_dupes_distance >= 0 || g_verify)) {
+        fprintf(stderr, "'--heif' applies to the default mode only.\n");
+        goto done;
+    }
+    if ((g_phash || g_dupes_distance >= 0) && (g_journal_path || g_skip_newer)) {
+        fprintf(stderr, "'--phash' and '--dupes' cannot be combined with '--journal' or '--newer'.\n");
+        goto done;
+    }
+
+    result = run_batch(inputs, input_count, to_stdout, verbose);
+    if (g_dupes_distance >= 0)
+        report_duplicates();
+    if (verbose) {
+        report_scratch_stats();
+        report_bulk_stats();
+        report_store_stats();
+        report_peak_rss();
+    }
+
+done:
+    if (g_store_manifest && fclose(g_store_manifest) != 0) {
+        perror("Failed to finish the store manifest");
+        result = 1;
+    }
+    if (g_metrics_path || g_metrics_port)
+        metrics_stop();
+    trace_thread_end();
+    if (g_trace_rings && trace_write(g_trace_path, verbose) != 0)
+        result = 1;
+    for (int i = 0; i < input_count; i++)
+        free(inputs[i]);
+    free(inputs);
+    return result;
 }
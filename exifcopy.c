@@ -3,6 +3,11 @@
 #include <stdint.h>
 #include <string.h>
 #include <ctype.h>
+#include <strings.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/types.h>
 
 static int g_verbose = 0;  // Global verbose flag
 
@@ -337,20 +342,26 @@ int minimizeExifData(unsigned char **exifSegment, size_t *exifSize) {
     return 1;
 }
 
-// ----- Insert EXIF Segment into JPEG -----
-// Inserts the provided EXIF segment (with proper header) immediately after the SOI marker.
+// ----- Replace EXIF Segment in JPEG -----
+// Walks the destination's marker segments up to the first SOS and rebuilds the header:
+// SOI, the provided EXIF segment (with proper header), then every existing segment except
+// EXIF APP1 segments (and XMP APP1 segments when dropXmp is set). The image data is copied
+// unchanged, so running exifcopy again on its own output replaces the EXIF it wrote.
 int insertExifIntoJpeg(const unsigned char *jpegData, size_t jpegSize,
-                         unsigned char *exifSegment, size_t exifSize,
+                         const unsigned char *exifSegment, size_t exifSize, int dropXmp,
                          unsigned char **outputData, size_t *outputSize) {
+    static const char xmpHeader[] = "http://ns.adobe.com/xap/1.0/";
+    static const char xmpExtHeader[] = "http://ns.adobe.com/xmp/extension/";
     if (jpegSize < 2 || jpegData[0] != 0xFF || jpegData[1] != 0xD8) {
          fprintf(stderr, "Destination file is not a valid JPEG.\n");
          return 0;
     }
+    if (exifSize > 65533) {
+         fprintf(stderr, "EXIF data (%zu bytes) does not fit in an APP1 segment.\n", exifSize);
+         return 0;
+    }
     
-    ensureExifHeader(&exifSegment, &exifSize);
-    
-    *outputSize = 2 + 4 + exifSize + (jpegSize - 2);
-    *outputData = (unsigned char *)malloc(*outputSize);
+    *outputData = (unsigned char *)malloc(2 + 4 + exifSize + (jpegSize - 2));
     if (!*outputData) {
          fprintf(stderr, "Memory allocation failed for output JPEG.\n");
          return 0;
@@ -365,65 +376,357 @@ int insertExifIntoJpeg(const unsigned char *jpegData, size_t jpegSize,
     (*outputData)[pos++] = segLength & 0xFF;
     memcpy(*outputData + pos, exifSegment, exifSize);
     pos += exifSize;
-    memcpy(*outputData + pos, jpegData + 2, jpegSize - 2);
+
+    size_t in = 2;
+    int removedExif = 0, removedXmp = 0;
+    while (in + 2 <= jpegSize && jpegData[in] == 0xFF) {
+         unsigned char marker = jpegData[in + 1];
+         if (marker == 0xFF) {              // fill byte
+              in++;
+              continue;
+         }
+         if (marker == 0xDA || marker == 0xD9)
+              break;                        // the rest is image data, copied below
+         if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) {
+              memcpy(*outputData + pos, jpegData + in, 2);
+              pos += 2;
+              in += 2;
+              continue;
+         }
+         if (in + 4 > jpegSize)
+              break;
+         size_t length = ((size_t)jpegData[in + 2] << 8) | jpegData[in + 3];
+         if (length < 2 || in + 2 + length > jpegSize) {
+              fprintf(stderr, "Destination JPEG has a malformed marker segment at offset %zu.\n", in);
+              free(*outputData);
+              *outputData = NULL;
+              return 0;
+         }
+         const unsigned char *payload = jpegData + in + 4;
+         size_t payloadSize = length - 2;
+         int drop = 0;
+         if (marker == 0xE1) {
+              if (payloadSize >= 6 && memcmp(payload, "Exif\0\0", 6) == 0) {
+                   drop = 1;
+                   removedExif++;
+              } else if (dropXmp &&
+                         ((payloadSize >= sizeof(xmpHeader) && memcmp(payload, xmpHeader, sizeof(xmpHeader)) == 0) ||
+                          (payloadSize >= sizeof(xmpExtHeader) &&
+                           memcmp(payload, xmpExtHeader, sizeof(xmpExtHeader)) == 0))) {
+                   drop = 1;
+                   removedXmp++;
+              }
+         }
+         if (!drop) {
+              memcpy(*outputData + pos, jpegData + in, 2 + length);
+              pos += 2 + length;
+         }
+         in += 2 + length;
+    }
+    memcpy(*outputData + pos, jpegData + in, jpegSize - in);
+    pos += jpegSize - in;
+    *outputSize = pos;
+    if (g_verbose && (removedExif || removedXmp))
+         printf("Removed %d EXIF and %d XMP segment(s) from the destination\n", removedExif, removedXmp);
     return 1;
 }
 
-// ----- Main Application -----
-int main(int argc, char **argv) {
-    // Usage: exifcopy_noexiv2 <source_cr3> <destination_jpeg> [-v]
-    if (argc < 3 || argc > 4) {
-         fprintf(stderr, "Usage: %s <source_cr3> <destination_jpeg> [-v]\n", argv[0]);
-         return 1;
+// ----- Copy Jobs -----
+// A job pairs a source CR3 with a destination JPEG. Jobs are sorted by source so that each
+// CR3 is parsed once for all of its destinations, and sources are spread over --jobs threads.
+typedef struct {
+    char *src;
+    char *dst;
+    size_t order;   // position in the input, keeps destinations of a source in order
+} CopyJob;
+
+static CopyJob *g_jobs = NULL;
+static size_t g_jobCount = 0, g_jobCapacity = 0;
+static size_t g_nextJob = 0;        // first job of the next unclaimed source
+static int g_dropXmp = 0;
+static int g_failed = 0;
+static pthread_mutex_t g_jobLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Adds a source/destination pair, copying both strings. Returns 1 on success.
+int addJob(const char *src, const char *dst) {
+    if (g_jobCount == g_jobCapacity) {
+        size_t capacity = g_jobCapacity ? g_jobCapacity * 2 : 64;
+        CopyJob *jobs = (CopyJob *)realloc(g_jobs, capacity * sizeof(CopyJob));
+        if (!jobs) {
+            fprintf(stderr, "Memory allocation failed for job list\n");
+            return 0;
+        }
+        g_jobs = jobs;
+        g_jobCapacity = capacity;
     }
-    const char *srcPath = argv[1];
-    const char *dstPath = argv[2];
-    if (argc == 4 && strcmp(argv[3], "-v") == 0) {
-         g_verbose = 1;
+    CopyJob *job = &g_jobs[g_jobCount];
+    job->src = strdup(src);
+    job->dst = strdup(dst);
+    job->order = g_jobCount;
+    if (!job->src || !job->dst) {
+        fprintf(stderr, "Memory allocation failed for job list\n");
+        free(job->src);
+        free(job->dst);
+        return 0;
     }
-    
+    g_jobCount++;
+    return 1;
+}
+
+int compareJobs(const void *a, const void *b) {
+    const CopyJob *x = (const CopyJob *)a, *y = (const CopyJob *)b;
+    int c = strcmp(x->src, y->src);
+    if (c != 0) return c;
+    return x->order < y->order ? -1 : x->order > y->order;
+}
+
+// Reads "source<TAB>destination" lines from a manifest ('-' is stdin). Blank lines and
+// lines starting with '#' are skipped. Returns 1 on success.
+int readManifest(const char *path) {
+    FILE *f = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "Cannot open manifest %s\n", path);
+        return 0;
+    }
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t len;
+    int lineNumber = 0, ok = 1;
+    while (ok && (len = getline(&line, &capacity, f)) >= 0) {
+        lineNumber++;
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            line[--len] = '\0';
+        if (len == 0 || line[0] == '#')
+            continue;
+        char *tab = strchr(line, '\t');
+        if (!tab || tab == line || tab[1] == '\0') {
+            fprintf(stderr, "%s:%d: expected \"source<TAB>destination\"\n", path, lineNumber);
+            ok = 0;
+            break;
+        }
+        *tab = '\0';
+        ok = addJob(line, tab + 1);
+    }
+    free(line);
+    if (f != stdin) fclose(f);
+    return ok;
+}
+
+// Pairs every .jpg/.jpeg in jpegDir with the CR3 of the same name in cr3Dir. A "_NNN"
+// suffix as written by 'cr3extract -j all' is ignored when no CR3 matches the full name.
+// JPEGs without a source are skipped with a warning. Returns 1 on success.
+int readDirectoryMap(const char *cr3Dir, const char *jpegDir) {
+    DIR *dir = opendir(jpegDir);
+    if (!dir) {
+        fprintf(stderr, "Cannot open directory %s\n", jpegDir);
+        return 0;
+    }
+    struct dirent *entry;
+    int ok = 1;
+    while (ok && (entry = readdir(dir)) != NULL) {
+        const char *name = entry->d_name;
+        const char *dot = strrchr(name, '.');
+        if (!dot || dot == name || (strcasecmp(dot, ".jpg") != 0 && strcasecmp(dot, ".jpeg") != 0))
+            continue;
+        size_t stemLen = dot - name;
+        size_t pathSize = strlen(cr3Dir) + stemLen + 6;
+        char *src = (char *)malloc(pathSize);
+        char *dst = (char *)malloc(strlen(jpegDir) + strlen(name) + 2);
+        if (!src || !dst) {
+            fprintf(stderr, "Memory allocation failed for directory map\n");
+            free(src);
+            free(dst);
+            ok = 0;
+            break;
+        }
+        sprintf(dst, "%s/%s", jpegDir, name);
+        int found = 0;
+        for (int attempt = 0; attempt < 2 && !found; attempt++) {
+            size_t len = stemLen;
+            if (attempt == 1) {     // IMG_0001_002.jpg -> IMG_0001
+                if (len < 5 || name[len - 4] != '_' || !isdigit((unsigned char)name[len - 3]) ||
+                    !isdigit((unsigned char)name[len - 2]) || !isdigit((unsigned char)name[len - 1]))
+                    break;
+                len -= 4;
+            }
+            for (int upper = 1; upper >= 0 && !found; upper--) {
+                snprintf(src, pathSize, "%s/%.*s.%s", cr3Dir, (int)len, name, upper ? "CR3" : "cr3");
+                found = access(src, R_OK) == 0;
+            }
+        }
+        if (found)
+            ok = addJob(src, dst);
+        else
+            fprintf(stderr, "Warning: no CR3 in %s for %s, skipped\n", cr3Dir, dst);
+        free(src);
+        free(dst);
+    }
+    closedir(dir);
+    return ok;
+}
+
+// Extracts and minimizes the EXIF of one source and writes it into each of its
+// destinations. Returns the number of destinations that failed.
+int copyExifToDestinations(const CopyJob *jobs, size_t count) {
+    const char *srcPath = jobs[0].src;
     unsigned char *exifSegment = NULL;
     size_t exifSize = 0;
     
     // Use streaming method for CR3 source.
     if (!extractCr3Exif_streaming(srcPath, &exifSegment, &exifSize)) {
-         fprintf(stderr, "Failed to extract EXIF from CR3 source file.\n");
-         return 1;
+         fprintf(stderr, "Failed to extract EXIF from CR3 source file %s.\n", srcPath);
+         return (int)count;
     }
     
     if (!minimizeExifData(&exifSegment, &exifSize)) {
-         fprintf(stderr, "Error minimizing EXIF data.\n");
-         free(exifSegment);
-         return 1;
-    }
-    
-    size_t dstSize = 0;
-    unsigned char *dstData = readFile(dstPath, &dstSize);
-    if (!dstData) {
+         fprintf(stderr, "Error minimizing EXIF data of %s.\n", srcPath);
          free(exifSegment);
-         return 1;
+         return (int)count;
     }
+    ensureExifHeader(&exifSegment, &exifSize);
     
-    unsigned char *outputData = NULL;
-    size_t outputSize = 0;
-    if (!insertExifIntoJpeg(dstData, dstSize, exifSegment, exifSize, &outputData, &outputSize)) {
-         fprintf(stderr, "Failed to insert EXIF into destination JPEG.\n");
+    int failed = 0;
+    for (size_t i = 0; i < count; i++) {
+         const char *dstPath = jobs[i].dst;
+         size_t dstSize = 0;
+         unsigned char *dstData = readFile(dstPath, &dstSize);
+         if (!dstData) {
+              failed++;
+              continue;
+         }
+         
+         unsigned char *outputData = NULL;
+         size_t outputSize = 0;
+         if (!insertExifIntoJpeg(dstData, dstSize, exifSegment, exifSize, g_dropXmp, &outputData, &outputSize)) {
+              fprintf(stderr, "Failed to insert EXIF into destination JPEG %s.\n", dstPath);
+              free(dstData);
+              failed++;
+              continue;
+         }
          free(dstData);
-         free(exifSegment);
+         
+         if (!writeFile(dstPath, outputData, outputSize)) {
+              fprintf(stderr, "Failed to write modified JPEG to %s\n", dstPath);
+              free(outputData);
+              failed++;
+              continue;
+         }
+         if (g_verbose) {
+              printf("Successfully copied and minimized EXIF from %s to %s\n", srcPath, dstPath);
+         }
+         free(outputData);
+    }
+    free(exifSegment);
+    return failed;
+}
+
+// Worker thread: claims all jobs of the next source until none are left.
+void *copyWorker(void *arg) {
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&g_jobLock);
+        size_t first = g_nextJob, end = first;
+        while (end < g_jobCount && strcmp(g_jobs[end].src, g_jobs[first].src) == 0)
+            end++;
+        g_nextJob = end;
+        pthread_mutex_unlock(&g_jobLock);
+        if (first == end)
+            break;
+        int failed = copyExifToDestinations(g_jobs + first, end - first);
+        if (failed) {
+            pthread_mutex_lock(&g_jobLock);
+            g_failed += failed;
+            pthread_mutex_unlock(&g_jobLock);
+        }
+    }
+    return NULL;
+}
+
+void printUsage(const char *program) {
+    fprintf(stderr, "Usage: %s <source_cr3> <destination_jpeg> [-v] [-x]\n", program);
+    fprintf(stderr, "       %s --manifest LIST [--jobs N] [-v] [-x]\n", program);
+    fprintf(stderr, "       %s --map CR3_DIR JPEG_DIR [--jobs N] [-v] [-x]\n", program);
+    fprintf(stderr, "Existing EXIF APP1 segments of the destination are replaced.\n");
+    fprintf(stderr, "  -x              : Also remove XMP APP1 segments from the destination\n");
+    fprintf(stderr, "  --manifest LIST : Read \"source<TAB>destination\" lines from LIST ('-' reads stdin)\n");
+    fprintf(stderr, "  --map CR3_DIR JPEG_DIR : Update every JPEG in JPEG_DIR from the CR3 of the same name\n");
+    fprintf(stderr, "                    (IMG_0001.jpg and IMG_0001_002.jpg from IMG_0001.CR3)\n");
+    fprintf(stderr, "  --jobs N        : Process up to N source files in parallel (default 1)\n");
+}
+
+// ----- Main Application -----
+int main(int argc, char **argv) {
+    // Usage: exifcopy <source_cr3> <destination_jpeg> [-v] [-x], or a batch (see printUsage)
+    const char *positional[2] = { NULL, NULL };
+    int positionalCount = 0, batch = 0, jobs = 1, ok = 1;
+    for (int i = 1; i < argc && ok; i++) {
+         if (strcmp(argv[i], "-v") == 0) {
+              g_verbose = 1;
+         } else if (strcmp(argv[i], "-x") == 0) {
+              g_dropXmp = 1;
+         } else if (strcmp(argv[i], "--jobs") == 0) {
+              if (i + 1 >= argc || atoi(argv[i + 1]) <= 0) {
+                   fprintf(stderr, "Expected a positive number after '--jobs'\n");
+                   ok = 0;
+                   break;
+              }
+              jobs = atoi(argv[++i]);
+         } else if (strcmp(argv[i], "--manifest") == 0) {
+              if (i + 1 >= argc) {
+                   fprintf(stderr, "Expected file name after '--manifest'\n");
+                   ok = 0;
+                   break;
+              }
+              batch = 1;
+              ok = readManifest(argv[++i]);
+         } else if (strcmp(argv[i], "--map") == 0) {
+              if (i + 2 >= argc) {
+                   fprintf(stderr, "Expected CR3 and JPEG directories after '--map'\n");
+                   ok = 0;
+                   break;
+              }
+              batch = 1;
+              ok = readDirectoryMap(argv[i + 1], argv[i + 2]);
+              i += 2;
+         } else if (positionalCount < 2) {
+              positional[positionalCount++] = argv[i];
+         } else {
+              ok = 0;
+         }
+    }
+    if (ok && batch)
+         ok = positionalCount == 0;
+    else if (ok)
+         ok = positionalCount == 2 && addJob(positional[0], positional[1]);
+    if (!ok) {
+         printUsage(argv[0]);
+         for (size_t i = 0; i < g_jobCount; i++) {
+              free(g_jobs[i].src);
+              free(g_jobs[i].dst);
+         }
+         free(g_jobs);
          return 1;
     }
-    free(dstData);
     
-    if (!writeFile(dstPath, outputData, outputSize)) {
-         fprintf(stderr, "Failed to write modified JPEG to %s\n", dstPath);
-         free(outputData);
-         free(exifSegment);
-         return 1;
+    qsort(g_jobs, g_jobCount, sizeof(CopyJob), compareJobs);
+    pthread_t *threads = (pthread_t *)malloc(jobs * sizeof(pthread_t));
+    int started = 0;
+    if (threads) {
+         while (started < jobs && pthread_create(&threads[started], NULL, copyWorker, NULL) == 0)
+              started++;
     }
-    if (g_verbose) {
-         printf("Successfully copied and minimized EXIF from %s to %s\n", srcPath, dstPath);
+    if (started == 0)
+         copyWorker(NULL);
+    for (int i = 0; i < started; i++)
+         pthread_join(threads[i], NULL);
+    free(threads);
+    
+    if (batch && (g_verbose || g_failed))
+         fprintf(stderr, "Updated %zu of %zu JPEGs\n", g_jobCount - (size_t)g_failed, g_jobCount);
+    for (size_t i = 0; i < g_jobCount; i++) {
+         free(g_jobs[i].src);
+         free(g_jobs[i].dst);
     }
-    free(outputData);
-    free(exifSegment);
-    return 0;
+    free(g_jobs);
+    return g_failed ? 1 : 0;
 }
@@ -0,0 +1,196 @@
+#!/usr/bin/env python3
+"""Write a small CR3 whose CRX track codes a known picture in its LL subband.
+
+usage: gen_crx.py out.cr3 W H levels cfa [q] [nojpeg]
+
+W and H are the sensor size, levels the number of wavelet levels (0-3), cfa the
+Bayer pattern (0 RGGB, 1 GRBG, 2 GBRG, 3 BGGR) and q the quantizer. The picture
+coded in the lowest subband is also saved as out.cr3.truth.png, so the output of
+cr3extract --render-raw can be compared with it. The higher subbands are filler.
+With nojpeg, the preview track holds no JPEG, which exercises --raw-fallback.
+Needs Pillow.
+"""
+import io, os, struct, sys, random
+from PIL import Image, ImageDraw
+
+JS = [1,1,1,1,2,2,2,2,4,4,4,4,8,8,8,8,16,16,32,32,64,64,128,128,256,512,1024,2048,4096,8192,16384,32768]
+J = [0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,5,5,6,6,7,7,8,9,10,11,12,13,14,15]
+
+class BW:
+    def __init__(s): s.bits = []
+    def put(s, v, n):
+        for i in range(n - 1, -1, -1): s.bits.append((v >> i) & 1)
+    def data(s):
+        b = s.bits + [0] * (-len(s.bits) % 8)
+        return bytes(int(''.join(map(str, b[i:i+8])), 2) for i in range(0, len(b), 8))
+
+def predk(k, code, mx):
+    n = k - (code < ((1 << k) >> 1)) + ((code >> k) > 2) + ((code >> k) > 5)
+    return mx if mx and n > mx else n
+
+class Enc:
+    def __init__(s, w): s.w = w; s.k = 0; s.s = 0; s.bw = BW(); s.prev = None; s.qk = 0
+    def code(s, code, k, esc, escbits):
+        z = code >> k
+        if z >= esc:
+            s.bw.put(0, esc); s.bw.put(1, 1); s.bw.put(code, escbits)
+        else:
+            s.bw.put(0, z); s.bw.put(1, 1); s.bw.put(code & ((1 << k) - 1), k)
+    def resid(s, v, pred, ahead):
+        d = v - pred
+        code = 2 * d if d >= 0 else -2 * d - 1
+        s.code(code, s.k, 41, 21)
+        if ahead >= 0: code = (code + ahead) >> 1
+        s.k = predk(s.k, code, 15)
+    def run(s, N, L):
+        cur = 1
+        while cur + JS[s.s] <= N:
+            s.bw.put(1, 1); cur += JS[s.s]
+            if s.s < 31: s.s += 1
+            if cur == L: return
+        s.bw.put(0, 1)
+        s.bw.put(N - cur, J[s.s])
+        if s.s > 0: s.s -= 1
+    def line(s, vals):
+        w = s.w
+        cur = [0] * (w + 2)
+        x = 1
+        if s.prev is None:
+            while x <= w:
+                pred = cur[x - 1]
+                if x < w and pred == 0:
+                    n = 0
+                    while x + n <= w and vals[x + n - 1] == 0: n += 1
+                    if n:
+                        s.bw.put(1, 1); s.run(n, w - x + 1)
+                        x += n
+                        if x > w: break
+                    else:
+                        s.bw.put(0, 1)
+                cur[x] = vals[x - 1]
+                s.resid(cur[x], pred, -1)
+                x += 1
+        else:
+            prev = s.prev
+            cur[0] = prev[1]
+            def ahead(x): return abs(2 * (prev[x + 1] - prev[x])) if x < w else -1
+            while x <= w:
+                a, b, c = cur[x - 1], prev[x], prev[x - 1]
+                if x < w and a == b and a == prev[x + 1]:
+                    n = 0
+                    while x + n <= w and vals[x + n - 1] == a: n += 1
+                    if n:
+                        s.bw.put(1, 1); s.run(n, w - x + 1)
+                        for i in range(n): cur[x + i] = a
+                        x += n
+                        if x > w: break
+                    else:
+                        s.bw.put(0, 1)
+                    cur[x] = vals[x - 1]
+                    s.resid(cur[x], prev[x], ahead(x))
+                else:
+                    delta = b - c
+                    med = [a + delta, a + delta, a, b]
+                    pred = med[(((c < a) ^ (delta < 0)) << 1) + ((a < b) ^ (delta < 0))]
+                    cur[x] = vals[x - 1]
+                    s.resid(cur[x], pred, ahead(x))
+                x += 1
+        cur[w + 1] = cur[w] + 1
+        s.prev = cur
+    def qupdate(s, delta):
+        code = 2 * delta if delta >= 0 else -2 * delta - 1
+        s.code(code, s.qk, 23, 8)
+        s.qk = predk(s.qk, code, 0)
+
+def box(t, payload): return struct.pack('>I', 8 + len(payload)) + t + payload
+def fullbox(t, ver, flags, payload): return box(t, struct.pack('>I', (ver << 24) | flags) + payload)
+
+def picture(w, h, seed=3):
+    im = Image.new('RGB', (w, h))
+    d = ImageDraw.Draw(im)
+    r = random.Random(seed)
+    for i in range(30):
+        x0, y0 = r.randrange(w), r.randrange(h)
+        d.rectangle([x0, y0, x0 + r.randrange(w // 3 + 1), y0 + r.randrange(h // 3 + 1)],
+                    fill=(r.randrange(256), r.randrange(256), r.randrange(256)))
+    d.rectangle([0, 0, w // 10, h // 10], fill=(0, 0, 0))
+    d.rectangle([w - w // 10, h - h // 10, w, h], fill=(255, 255, 255))
+    return im
+
+# NOISE=n in the environment adds +-n to every coefficient, which keeps the
+# run-length path from dominating.
+NOISE = int(os.environ.get("NOISE", "0"))
+
+def main():
+    out, W, H, levels, cfa = sys.argv[1], int(sys.argv[2]), int(sys.argv[3]), int(sys.argv[4]), int(sys.argv[5])
+    q = int(sys.argv[6]) if len(sys.argv) > 6 else 28
+    nojpeg = 'nojpeg' in sys.argv
+    bits = 14
+    pw, ph = W // 2, H // 2
+    lw, lh = pw, ph
+    for _ in range(levels): lw, lh = (lw + 1) >> 1, (lh + 1) >> 1
+    pic = picture(lw, lh)
+    pic.save(out + '.truth.png')
+    px = pic.load()
+    QS = [0x28, 0x2D, 0x33, 0x39, 0x40, 0x48]
+    scale = (QS[q % 6] << (q // 6 - 6)) if q // 6 >= 6 else (QS[q % 6] >> (6 - q // 6)) if levels else 1
+    red = [0, 1, 2, 3][cfa]; blue = [3, 2, 1, 0][cfa]
+    gain = {0: 20, 1: 40, 2: 25}
+    planes = []
+    for p in range(4):
+        ch = 0 if p == red else 2 if p == blue else 1
+        rows = []
+        for y in range(lh):
+            row = []
+            for x in range(lw):
+                v = 2048 + px[x, y][ch] * gain[ch] - (1 << (bits - 1))
+                v += NOISE and random.Random(x * 7919 + y * 104729 + p).randint(-NOISE, NOISE)
+                row.append(int(round(v / scale)))
+            rows.append(row)
+        planes.append(rows)
+    nb = 3 * levels + 1
+    hdr = b''
+    tile = b''
+    comp_hdrs = []
+    for p in range(4):
+        e = Enc(lw)
+        for y in range(lh):
+            if levels: e.qupdate(0)
+            e.line(planes[p][y])
+        ll = e.bw.data()
+        pad = 3
+        bands = [ll + b'\0' * pad] + [bytes(random.Random(p * 100 + b).randrange(256) for _ in range(40)) for b in range(1, nb)]
+        bh = b''
+        for b, data in enumerate(bands):
+            bitdata = (q << 19) | (0x8000000 if levels else 0) | (pad if b == 0 else 0)
+            bh += struct.pack('>HHII', 0xFF03, 8, len(data), bitdata)
+        comp = b''.join(bands)
+        comp_hdrs.append(struct.pack('>HHIBBBB', 0xFF02, 8, len(comp), 8, 0, 0, 0) + bh)
+        tile += comp
+    hdr = struct.pack('>HHII', 0xFF01, 8, len(tile), 0) + b''.join(comp_hdrs)
+    hdr += b'\0' * (-len(hdr) % 16)
+    sample = hdr + tile
+    cmp1 = struct.pack('>IHHIIIIBBBBI', 0, 0x100, 0, W, H, W, H, bits, (4 << 4) | cfa, levels, 0, len(hdr)) + b'\0' * 28
+
+    full = io.BytesIO(); picture(640, 480, 9).save(full, 'JPEG', quality=80); full = full.getvalue()
+    if nojpeg: full = b'\0' * 100
+    def trak(width, height, child, size, off):
+        craw = b'\0' * 6 + struct.pack('>H', 1) + b'\0' * 16 + struct.pack('>HH', width, height) \
+            + struct.pack('>III', 0x00480000, 0x00480000, 0) + struct.pack('>H', 1) + b'\0' * 32 \
+            + struct.pack('>Hh', 24, -1) + child
+        stsd = fullbox(b'stsd', 0, 0, struct.pack('>I', 1) + box(b'CRAW', craw))
+        stsz = fullbox(b'stsz', 0, 0, struct.pack('>II', size, 1))
+        co64 = fullbox(b'co64', 0, 0, struct.pack('>IQ', 1, off))
+        stbl = box(b'stbl', stsd + stsz + co64)
+        return box(b'trak', fullbox(b'tkhd', 0, 0, b'\0' * 80) + box(b'mdia', fullbox(b'mdhd', 0, 0, b'\0' * 20) + box(b'minf', stbl)))
+    ftyp = box(b'ftyp', b'crx ' + struct.pack('>I', 1) + b'crx isom')
+    def build(o1, o2):
+        t1 = trak(640, 480, box(b'JPEG', b'\0\0\0\0'), len(full), o1)
+        t2 = trak(W, H, box(b'CMP1', cmp1), len(sample), o2)
+        return ftyp + box(b'moov', fullbox(b'mvhd', 0, 0, b'\0' * 96) + t1 + t2)
+    head = build(0, 0)
+    mo = len(head) + 8
+    head = build(mo, mo + len(full))
+    open(out, 'wb').write(head + box(b'mdat', full + sample))
+
+main()